@@ -0,0 +1,285 @@
+//
+// Decode benchmark: runs parse_v5(), parse_v9() and parse_ipfix() over the same data
+// datagram again and again and reports the records decoded per second. The
+// Cisco case has a generated decoder, the others run their compiled program.
+// Rows are counted instead of inserted.
+//
+// usage: cnetflow_bench [iterations]
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "../src/arena.h"
+#include "../src/collector.h"
+#include "../src/exporter.h"
+#include "../src/flow_batch.h"
+#include "../src/metrics.h"
+#include "../src/netflow_ipfix.h"
+#include "../src/netflow_v5.h"
+#include "../src/netflow_v9.h"
+
+// Records per data datagram, as a busy router packs them.
+#define BENCH_RECORDS 24
+
+extern arena_struct_t *arena_collector;
+extern arena_struct_t *arena_hashmap_nf9;
+extern arena_struct_t *arena_hashmap_ipfix;
+
+static uint64_t bench_rows = 0;
+
+// Replaces the ClickHouse batcher for the benchmark.
+int ch_insert_flows(flow_batch_t *flows) {
+  bench_rows += flows->count;
+  return 0;
+}
+
+typedef struct {
+  uint16_t type;
+  uint16_t len;
+} bench_field_t;
+
+// A typical v9 export: the stored 5-tuple, counters and routing fields, plus
+// some the collector does not keep (next hop, direction, sampler, flow id).
+static const bench_field_t v9_fields[] = {
+    {8, 4},  {12, 4}, {15, 4}, {7, 2},  {11, 2}, {4, 1},  {5, 1},  {6, 1},  {10, 4}, {14, 4}, {1, 8},
+    {2, 8},  {22, 4}, {21, 4}, {16, 4}, {17, 4}, {9, 1},  {13, 1}, {61, 1}, {48, 2}, {148, 4},
+};
+
+// The Cisco IOS IPv4 export, which has a generated decoder (src/netflow_layouts.py.h).
+static const bench_field_t cisco_fields[] = {
+    {1, 4},  {2, 4},  {4, 1}, {5, 1},  {6, 1},  {7, 2},  {8, 4},  {9, 1},  {10, 2},
+    {11, 2}, {12, 4}, {13, 1}, {14, 2}, {15, 4}, {16, 2}, {17, 2}, {21, 4}, {22, 4},
+};
+
+// A typical IPFIX export: millisecond timestamps, 2-byte interfaces and an
+// enterprise field.
+static const bench_field_t ipfix_fields[] = {
+    {8, 4},  {12, 4}, {7, 2},  {11, 2},   {4, 1},  {6, 1},  {5, 1},  {10, 2},  {14, 2},
+    {1, 8},  {2, 8},  {152, 8}, {153, 8}, {16, 4}, {17, 4}, {9, 1},  {13, 1},  {0x8001, 4},
+};
+
+static size_t put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t) (v >> 8);
+  p[1] = (uint8_t) v;
+  return 2;
+}
+
+static size_t put32(uint8_t *p, uint32_t v) {
+  put16(p, (uint16_t) (v >> 16));
+  put16(p + 2, (uint16_t) v);
+  return 4;
+}
+
+/**
+ * Writes a template record for `fields` at `p`.
+ *
+ * @return Its length.
+ */
+static size_t bench_template(uint8_t *p, const bench_field_t *fields, size_t count) {
+  size_t pos = put16(p, 256);
+  pos += put16(p + pos, (uint16_t) count);
+  for (size_t i = 0; i < count; i++) {
+    pos += put16(p + pos, fields[i].type);
+    pos += put16(p + pos, fields[i].len);
+    if (fields[i].type & 0x8000) {
+      pos += put32(p + pos, 9);
+    }
+  }
+  return pos;
+}
+
+/**
+ * Writes BENCH_RECORDS data records for `fields` at `p`, every field filled
+ * with a plausible value of its width.
+ *
+ * @return Their length.
+ */
+static size_t bench_records(uint8_t *p, const bench_field_t *fields, size_t count) {
+  size_t pos = 0;
+  for (uint32_t r = 0; r < BENCH_RECORDS; r++) {
+    for (size_t i = 0; i < count; i++) {
+      // A private source talking to a public destination, ending after it started,
+      // so that every record passes netflow_prepare_batch().
+      uint64_t value = 1000u + fields[i].type + r;
+      if (fields[i].type == 8) {
+        value = 0x0a000001u + r;
+      } else if (fields[i].type == 12) {
+        value = 0x08080800u + r;
+      } else if (fields[i].type == 21) {
+        value = 2000u + r;
+      }
+      for (uint16_t b = 0; b < fields[i].len; b++) {
+        p[pos + b] = (uint8_t) (value >> (8 * (fields[i].len - 1 - b)));
+      }
+      pos += fields[i].len;
+    }
+  }
+  return pos;
+}
+
+static size_t bench_v9_header(uint8_t *p, uint16_t count) {
+  size_t pos = put16(p, 9);
+  pos += put16(p + pos, count);
+  pos += put32(p + pos, 100000);
+  pos += put32(p + pos, 1700000000);
+  pos += put32(p + pos, 1);
+  pos += put32(p + pos, 0);
+  return pos;
+}
+
+/**
+ * Writes a v5 datagram of 30 records, as full as v5 gets.
+ *
+ * @return Its length.
+ */
+static size_t bench_v5(uint8_t *p) {
+  size_t pos = put16(p, 5);
+  pos += put16(p + pos, 30);
+  pos += put32(p + pos, 100000);
+  pos += put32(p + pos, 1700000000);
+  pos += put32(p + pos, 0);
+  pos += put32(p + pos, 1);
+  pos += put32(p + pos, 0);
+  for (uint32_t r = 0; r < 30; r++) {
+    pos += put32(p + pos, 0x0a000001u + r);
+    pos += put32(p + pos, 0x08080808u);
+    pos += put32(p + pos, 0x0a0000feu);
+    pos += put16(p + pos, 3);
+    pos += put16(p + pos, 4);
+    pos += put32(p + pos, 10 + r);
+    pos += put32(p + pos, 1500 * (10 + r));
+    pos += put32(p + pos, 90000);
+    pos += put32(p + pos, 99000);
+    pos += put16(p + pos, (uint16_t) (40000 + r));
+    pos += put16(p + pos, 443);
+    pos += put32(p + pos, 0x001b0600);
+    pos += put16(p + pos, 0);
+    pos += put16(p + pos, 15169);
+    pos += put32(p + pos, 0x00181800);
+  }
+  return pos;
+}
+
+static size_t bench_ipfix_header(uint8_t *p, uint16_t len) {
+  size_t pos = put16(p, 10);
+  pos += put16(p + pos, len);
+  pos += put32(p + pos, 1700000000);
+  pos += put32(p + pos, 1);
+  pos += put32(p + pos, 0);
+  return pos;
+}
+
+/**
+ * Parses `packet` `iterations` times with `parse`, from a fresh copy each time
+ * since the parsers swap headers in place.
+ *
+ * @return Records decoded per second.
+ */
+static double bench_run(void *(*parse)(uv_work_t *), const uint8_t *packet, size_t len, uint64_t iterations) {
+  uint8_t buf[2048];
+  parse_args_t args;
+  uv_work_t req;
+  req.data = &args;
+  bench_rows = 0;
+  uint64_t start = uv_hrtime();
+  for (uint64_t i = 0; i < iterations; i++) {
+    memcpy(buf, packet, len);
+    memset(&args, 0, sizeof(args));
+    args.data = buf;
+    args.len = len;
+    args.exporter = 0x0100007f;
+    exporter_addr_from_string("127.0.0.1", args.exporter_addr);
+    args.now = 1700000000;
+    parse(&req);
+  }
+  double seconds = (double) (uv_hrtime() - start) / 1e9;
+  return seconds > 0 ? (double) bench_rows / seconds : 0;
+}
+
+/**
+ * Teaches parse_v9() a template for `fields`, then times a data flowset of it.
+ *
+ * @return Records decoded per second.
+ */
+static double bench_v9(const bench_field_t *fields, size_t count, uint64_t iterations) {
+  uint8_t templ[512];
+  uint8_t data[2048];
+  size_t pos = bench_v9_header(templ, 1);
+  size_t set = pos;
+  pos += 4 + bench_template(templ + pos + 4, fields, count);
+  put16(templ + set, 0);
+  put16(templ + set + 2, (uint16_t) (pos - set));
+  bench_run(parse_v9, templ, pos, 1);
+
+  pos = bench_v9_header(data, BENCH_RECORDS);
+  set = pos;
+  pos += 4 + bench_records(data + pos + 4, fields, count);
+  while ((pos - set) % 4 != 0) {
+    data[pos++] = 0;
+  }
+  put16(data + set, 256);
+  put16(data + set + 2, (uint16_t) (pos - set));
+  return bench_run(parse_v9, data, pos, iterations);
+}
+
+int main(int argc, char **argv) {
+  uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+
+  arena_collector = malloc(sizeof(arena_struct_t));
+  arena_hashmap_nf9 = malloc(sizeof(arena_struct_t));
+  arena_hashmap_ipfix = malloc(sizeof(arena_struct_t));
+  arena_create(arena_collector, 1024 * 1024);
+  arena_create(arena_hashmap_nf9, 1024 * 1024);
+  arena_create(arena_hashmap_ipfix, 1024 * 1024);
+#ifdef ENABLE_METRICS
+  metrics_init();
+  metrics_local_begin();
+#endif
+  init_v9(arena_hashmap_nf9, 1024);
+  init_ipfix(arena_hashmap_ipfix, 1024);
+
+  uint8_t templ[512];
+  uint8_t data[2048];
+  size_t v9_count = sizeof(v9_fields) / sizeof(v9_fields[0]);
+  size_t ipfix_count = sizeof(ipfix_fields) / sizeof(ipfix_fields[0]);
+
+  // v9: learn each template, then time its data flowset.
+  double v9_rate = bench_v9(v9_fields, v9_count, iterations);
+  uint64_t v9_rows = bench_rows;
+  double cisco_rate = bench_v9(cisco_fields, sizeof(cisco_fields) / sizeof(cisco_fields[0]), iterations);
+  uint64_t cisco_rows = bench_rows;
+
+  // IPFIX: the same, with a template set and a data set.
+  size_t pos = 16;
+  pos += 4 + bench_template(templ + pos + 4, ipfix_fields, ipfix_count);
+  put16(templ + 16, 2);
+  put16(templ + 18, (uint16_t) (pos - 16));
+  bench_ipfix_header(templ, (uint16_t) pos);
+  bench_run(parse_ipfix, templ, pos, 1);
+
+  pos = 16;
+  pos += 4 + bench_records(data + pos + 4, ipfix_fields, ipfix_count);
+  put16(data + 16, 256);
+  put16(data + 18, (uint16_t) (pos - 16));
+  bench_ipfix_header(data, (uint16_t) pos);
+  double ipfix_rate = bench_run(parse_ipfix, data, pos, iterations);
+  uint64_t ipfix_rows = bench_rows;
+
+  // v5: the scalar decoder, then the fastest this CPU has.
+  pos = bench_v5(data);
+  init_v5("scalar");
+  double v5_scalar_rate = bench_run(parse_v5, data, pos, iterations);
+  init_v5(NULL);
+  double v5_rate = bench_run(parse_v5, data, pos, iterations);
+  uint64_t v5_rows = bench_rows;
+
+  printf("v5 scalar: %llu records, %.0f records/s\n", (unsigned long long) v5_rows, v5_scalar_rate);
+  printf("v5:    %llu records, %.0f records/s\n", (unsigned long long) v5_rows, v5_rate);
+  printf("v9:    %llu records, %.0f records/s\n", (unsigned long long) v9_rows, v9_rate);
+  printf("cisco: %llu records, %.0f records/s\n", (unsigned long long) cisco_rows, cisco_rate);
+  printf("ipfix: %llu records, %.0f records/s\n", (unsigned long long) ipfix_rows, ipfix_rate);
+  return v5_rows == 0 || v9_rows == 0 || cisco_rows == 0 || ipfix_rows == 0;
+}
@@ -1,5 +1,7 @@
+import argparse
+import json
 from enum import IntEnum
-from typing import List, Dict
+from typing import List, Dict, Tuple
 
 
 class IPFIXFieldType(IntEnum):
@@ -493,9 +495,209 @@ formatted_lines = [format_entry(entry)
 # Add terminating entry
 formatted_lines.append("    {0, 0, -1, 0, NULL, NULL}")
 
-for ftype in IPFIXFieldType:
-    print(f"#define IPFIX_FT_{ftype.name} {ftype.value}")
 
-# Wrap with array definition
-formatted_array = "ipfix_field_type_t ipfix_field_types[] = {\n" + "\n".join(formatted_lines) + "\n};"
-print(formatted_array)
+def print_fields():
+    for ftype in IPFIXFieldType:
+        print(f"#define IPFIX_FT_{ftype.name} {ftype.value}")
+
+    # Wrap with array definition
+    formatted_array = "ipfix_field_type_t ipfix_field_types[] = {\n" + "\n".join(formatted_lines) + "\n};"
+    print(formatted_array)
+
+
+# Template layouts common enough to get a generated decoder: (type, length)
+# pairs in record order, as the exporter sends them. Override with
+# --layouts-file, a JSON list of {"name", "comment", "fields": [[type, length], ...]}.
+KNOWN_LAYOUTS = [
+    {
+        "name": "cisco_v4",
+        "comment": "Cisco IOS v9 IPv4 template, the v5 record fields",
+        "fields": [
+            (IPFIXFieldType.OCTETDELTACOUNT, 4), (IPFIXFieldType.PACKETDELTACOUNT, 4),
+            (IPFIXFieldType.PROTOCOLIDENTIFIER, 1), (IPFIXFieldType.IPCLASSOFSERVICE, 1),
+            (IPFIXFieldType.TCPCONTROLBITS, 1), (IPFIXFieldType.SOURCETRANSPORTPORT, 2),
+            (IPFIXFieldType.SOURCEIPV4ADDRESS, 4), (IPFIXFieldType.SOURCEIPV4PREFIXLENGTH, 1),
+            (IPFIXFieldType.INGRESSINTERFACE, 2), (IPFIXFieldType.DESTINATIONTRANSPORTPORT, 2),
+            (IPFIXFieldType.DESTINATIONIPV4ADDRESS, 4), (IPFIXFieldType.DESTINATIONIPV4PREFIXLENGTH, 1),
+            (IPFIXFieldType.EGRESSINTERFACE, 2), (IPFIXFieldType.IPNEXTHOPIPV4ADDRESS, 4),
+            (IPFIXFieldType.BGPSOURCEASNUMBER, 2), (IPFIXFieldType.BGPDESTINATIONASNUMBER, 2),
+            (IPFIXFieldType.FLOWENDSYSUPTIME, 4), (IPFIXFieldType.FLOWSTARTSYSUPTIME, 4),
+        ],
+    },
+    {
+        "name": "softflowd_v4",
+        "comment": "softflowd -v 9 IPv4 template (docker-compose.yaml)",
+        "fields": [
+            (IPFIXFieldType.SOURCEIPV4ADDRESS, 4), (IPFIXFieldType.DESTINATIONIPV4ADDRESS, 4),
+            (IPFIXFieldType.FLOWENDSYSUPTIME, 4), (IPFIXFieldType.FLOWSTARTSYSUPTIME, 4),
+            (IPFIXFieldType.OCTETDELTACOUNT, 4), (IPFIXFieldType.PACKETDELTACOUNT, 4),
+            (IPFIXFieldType.INGRESSINTERFACE, 4), (IPFIXFieldType.EGRESSINTERFACE, 4),
+            (IPFIXFieldType.SOURCETRANSPORTPORT, 2), (IPFIXFieldType.DESTINATIONTRANSPORTPORT, 2),
+            (IPFIXFieldType.PROTOCOLIDENTIFIER, 1), (IPFIXFieldType.TCPCONTROLBITS, 1),
+            (IPFIXFieldType.IPVERSION, 1), (IPFIXFieldType.IPCLASSOFSERVICE, 1),
+        ],
+    },
+    {
+        "name": "softflowd_v6",
+        "comment": "softflowd -v 9 IPv6 template (docker-compose.yaml)",
+        "fields": [
+            (IPFIXFieldType.SOURCEIPV6ADDRESS, 16), (IPFIXFieldType.DESTINATIONIPV6ADDRESS, 16),
+            (IPFIXFieldType.FLOWENDSYSUPTIME, 4), (IPFIXFieldType.FLOWSTARTSYSUPTIME, 4),
+            (IPFIXFieldType.OCTETDELTACOUNT, 4), (IPFIXFieldType.PACKETDELTACOUNT, 4),
+            (IPFIXFieldType.INGRESSINTERFACE, 4), (IPFIXFieldType.EGRESSINTERFACE, 4),
+            (IPFIXFieldType.SOURCETRANSPORTPORT, 2), (IPFIXFieldType.DESTINATIONTRANSPORTPORT, 2),
+            (IPFIXFieldType.PROTOCOLIDENTIFIER, 1), (IPFIXFieldType.TCPCONTROLBITS, 1),
+            (IPFIXFieldType.IPVERSION, 1), (IPFIXFieldType.IPCLASSOFSERVICE, 1),
+        ],
+    },
+]
+
+# Where a flow row stores each element: (member, bytes, kind, ip_version, ipv6).
+# Must match netflow_field_dest() in src/netflow_template.c.
+FIELD_DESTS: Dict[int, Tuple[str, int, str, int, int]] = {
+    IPFIXFieldType.FLOWSTARTSYSUPTIME: ("First", 4, "seconds", 0, 0),
+    IPFIXFieldType.FLOWSTARTMILLISECONDS: ("First", 4, "seconds", 0, 0),
+    IPFIXFieldType.FLOWENDSYSUPTIME: ("Last", 4, "seconds", 0, 0),
+    IPFIXFieldType.FLOWENDMILLISECONDS: ("Last", 4, "seconds", 0, 0),
+    IPFIXFieldType.IPVERSION: ("ip_version", 1, "ip_version", 0, 0),
+    IPFIXFieldType.SOURCEIPV4ADDRESS: ("srcaddr", 16, "addr", 4, 0),
+    IPFIXFieldType.DESTINATIONIPV4ADDRESS: ("dstaddr", 16, "addr", 0, 0),
+    IPFIXFieldType.SOURCEIPV6ADDRESS: ("srcaddr", 16, "addr", 6, 1),
+    IPFIXFieldType.DESTINATIONIPV6ADDRESS: ("dstaddr", 16, "addr", 0, 1),
+    IPFIXFieldType.BGPNEXTHOPIPV4ADDRESS: ("nexthop", 16, "addr", 0, 0),
+    IPFIXFieldType.BGPNEXTHOPIPV6ADDRESS: ("nexthop", 16, "addr", 0, 1),
+    IPFIXFieldType.OCTETDELTACOUNT: ("dOctets", 8, "uint", 0, 0),
+    IPFIXFieldType.PACKETDELTACOUNT: ("dPkts", 8, "uint", 0, 0),
+    IPFIXFieldType.SOURCETRANSPORTPORT: ("srcport", 2, "uint", 0, 0),
+    IPFIXFieldType.TCPSOURCEPORT: ("srcport", 2, "uint", 0, 0),
+    IPFIXFieldType.UDPSOURCEPORT: ("srcport", 2, "uint", 0, 0),
+    IPFIXFieldType.DESTINATIONTRANSPORTPORT: ("dstport", 2, "uint", 0, 0),
+    IPFIXFieldType.TCPDESTINATIONPORT: ("dstport", 2, "uint", 0, 0),
+    IPFIXFieldType.UDPDESTINATIONPORT: ("dstport", 2, "uint", 0, 0),
+    IPFIXFieldType.PROTOCOLIDENTIFIER: ("prot", 1, "uint", 0, 0),
+    IPFIXFieldType.INGRESSINTERFACE: ("input", 2, "uint", 0, 0),
+    IPFIXFieldType.EGRESSINTERFACE: ("output", 2, "uint", 0, 0),
+    IPFIXFieldType.BGPSOURCEASNUMBER: ("src_as", 4, "uint", 0, 0),
+    IPFIXFieldType.BGPDESTINATIONASNUMBER: ("dst_as", 4, "uint", 0, 0),
+    IPFIXFieldType.TCPCONTROLBITS: ("tcp_flags", 1, "uint", 0, 0),
+    IPFIXFieldType.IPCLASSOFSERVICE: ("tos", 1, "uint", 0, 0),
+    IPFIXFieldType.SOURCEIPV4PREFIXLENGTH: ("src_mask", 1, "uint", 0, 0),
+    IPFIXFieldType.SOURCEIPV6PREFIXLENGTH: ("src_mask", 1, "uint", 0, 0),
+    IPFIXFieldType.DESTINATIONIPV4PREFIXLENGTH: ("dst_mask", 1, "uint", 0, 0),
+    IPFIXFieldType.DESTINATIONIPV6PREFIXLENGTH: ("dst_mask", 1, "uint", 0, 0),
+}
+
+C_TYPES = {1: "uint8_t", 2: "uint16_t", 4: "uint32_t", 8: "uint64_t", 16: "uint128_t"}
+
+
+def layout_load(offset: int, width: int) -> str:
+    """C expression reading the big-endian field at `offset`, or None if the width has no fixed load."""
+    src = f"src + {offset}"
+    if width == 1:
+        return f"src[{offset}]"
+    if width in (2, 4, 8):
+        return f"netflow_load{width * 8}({src})"
+    if width == 16:
+        return f"(uint128_t) netflow_load64({src}) << 64 | netflow_load64({src} + 8)"
+    return None
+
+
+def layout_statement(offset: int, width: int, dest) -> str:
+    """The unrolled C statement for one field, mirroring netflow_op_for(), or None if the field is dropped."""
+    member, size, kind, _, _ = dest
+    if kind == "seconds":
+        if width not in (4, 8):
+            return None
+        return f"out->{member} = (uint32_t) ({layout_load(offset, width)} / 1000 + diff);"
+    if kind == "ip_version":
+        if width != 1:
+            return None
+        return f"ipv6 = src[{offset}] == 6;\n  out->{member} = ipv6 ? 6 : 4;"
+    if kind == "addr" and width not in (4, 16) and not 1 <= width <= 8:
+        return None
+    if kind == "uint" and not 1 <= width <= 8:
+        return None
+    load = layout_load(offset, width)
+    if load is None:
+        # Any other width up to 8 bytes, as netflow_op_uint reads it.
+        load = " | ".join(f"(uint64_t) src[{offset + b}] << {8 * (width - 1 - b)}" for b in range(width))
+    return f"out->{member} = ({C_TYPES[size]}) ({load});"
+
+
+def layout_fingerprint(spec: bytes) -> int:
+    """FNV-1a over the field specifiers; must match netflow_layout_fingerprint()."""
+    h = 2166136261
+    for b in spec:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def print_layouts(layouts):
+    print("//")
+    print("// Generated by scripts/gen_fields.h.py --layouts; do not edit.")
+    print("//")
+    print("// Unrolled decoders for the template layouts most exporters send. Each decodes")
+    print("// one record exactly as the compiled program of the same template would.")
+    print("//")
+    print()
+    print("#ifndef CNETFLOW_NETFLOW_LAYOUTS_PY_H")
+    print("#define CNETFLOW_NETFLOW_LAYOUTS_PY_H")
+    print()
+    entries = []
+    for layout in layouts:
+        name = layout["name"]
+        fields = [(int(t), int(l)) for t, l in layout["fields"]]
+        spec = b"".join(t.to_bytes(2, "big") + l.to_bytes(2, "big") for t, l in fields)
+        body = []
+        offset = 0
+        ip_version = 0
+        ipv6 = 0
+        for t, l in fields:
+            dest = FIELD_DESTS.get(t)
+            if dest is not None:
+                statement = layout_statement(offset, l, dest)
+                if statement is not None:
+                    body.append("  " + statement)
+                ip_version = dest[3] or ip_version
+                ipv6 = ipv6 or dest[4]
+            offset += l
+        print(f"// {layout.get('comment', name)}: {len(fields)} fields, {offset} bytes.")
+        print(f"static const uint8_t netflow_layout_{name}_spec[] = {{")
+        for i in range(0, len(spec), 12):
+            print("    " + ", ".join(f"0x{b:02x}" for b in spec[i:i + 12]) + ",")
+        print("};")
+        print()
+        print(f"static int netflow_layout_{name}(const uint8_t *src, netflow_v9_record_insert_uint128_t *out, uint32_t diff) {{")
+        if not any("diff" in line for line in body):
+            print("  (void) diff;")
+        print(f"  int ipv6 = {ipv6};")
+        if ip_version:
+            print(f"  out->ip_version = {ip_version};")
+        for line in body:
+            print(line)
+        print("  return ipv6;")
+        print("}")
+        print()
+        entries.append(f"    {{{layout_fingerprint(spec):#010x}u, {len(fields)}, {offset}, "
+                       f"netflow_layout_{name}_spec, netflow_layout_{name}}},")
+    print("static const netflow_layout_t netflow_layouts[] = {")
+    for entry in entries:
+        print(entry)
+    print("};")
+    print()
+    print("#endif // CNETFLOW_NETFLOW_LAYOUTS_PY_H")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Generate src/fields.py.h, or with --layouts src/netflow_layouts.py.h")
+    parser.add_argument("--layouts", action="store_true", help="generate the known-layout decoders")
+    parser.add_argument("--layouts-file", help="JSON list of layouts to use instead of KNOWN_LAYOUTS")
+    args = parser.parse_args()
+    if args.layouts:
+        layouts = KNOWN_LAYOUTS
+        if args.layouts_file:
+            with open(args.layouts_file) as f:
+                layouts = json.load(f)
+        print_layouts(layouts)
+    else:
+        print_fields()
@@ -50,6 +50,9 @@ CREATE TABLE IF NOT EXISTS flows
     dst_mask    UInt8,
     ip_version  UInt8,
 
+    -- Collector-side 1-in-N sampling applied under overload (1 = not sampled)
+    sampling_rate UInt32 DEFAULT 1,
+
     -- Flow hash for deduplication (optional)
     flow_hash   String DEFAULT ''
 )
@@ -61,6 +64,9 @@ SETTINGS
     index_granularity = 8192,
     storage_policy = 'default';
 
+-- Tables created before the column existed
+ALTER TABLE flows ADD COLUMN IF NOT EXISTS sampling_rate UInt32 DEFAULT 1 AFTER ip_version;
+
 -- ============================================================
 -- 2. EXPORTERS TABLE
 -- ============================================================
@@ -234,6 +240,7 @@ create table netflow.flows
     src_mask    UInt8,
     dst_mask    UInt8,
     ip_version  UInt8,
+    sampling_rate UInt32 default 1,
     flow_hash   String   default ''
 )
     engine = MergeTree PARTITION BY toYYYYMMDD(first)
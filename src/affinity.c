@@ -0,0 +1,361 @@
+//
+// CPU and NUMA placement of the collector's threads by role.
+//
+// Each role gets an optional CPU list. Threads of the role pin themselves to it
+// when they start, and memory the role owns is allocated while the allocating
+// thread prefers the NUMA node those CPUs belong to, so the pages are first
+// touched there even when the allocation happens on the main thread.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "affinity.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "log.h"
+
+#define AFFINITY_MAX_NODES 64
+
+#ifdef __linux__
+typedef struct {
+  affinity_role_t role;
+  char name[24];
+  long tid;
+} affinity_thread_t;
+
+typedef struct {
+  int configured;
+  cpu_set_t cpus;
+  // NUMA node shared by all CPUs of the role, or -1.
+  int node;
+} affinity_role_config_t;
+
+static affinity_role_config_t roles[affinity_roles];
+
+static uv_once_t registry_once = UV_ONCE_INIT;
+static uv_mutex_t registry_lock;
+static affinity_thread_t registry[AFFINITY_MAX_THREADS];
+static size_t registry_len;
+
+static void registry_init(void) { uv_mutex_init(&registry_lock); }
+#endif
+
+const char *affinity_role_name(affinity_role_t role) {
+  switch (role) {
+    case affinity_role_recv:
+      return "recv";
+    case affinity_role_parse:
+      return "parse";
+    case affinity_role_metrics:
+      return "metrics";
+    default:
+      return "unknown";
+  }
+}
+
+#ifdef __linux__
+static long current_tid(void) { return (long) syscall(SYS_gettid); }
+
+/**
+ * @return The NUMA node of `cpu` from sysfs, or -1 without NUMA support.
+ */
+static int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  int node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  int any = 0;
+  while (*p != '\0') {
+    char *end;
+    errno = 0;
+    long first = strtol(p, &end, 10);
+    if (end == p || errno != 0 || first < 0 || first >= CPU_SETSIZE) {
+      return UV_EINVAL;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p || errno != 0 || last < first || last >= CPU_SETSIZE) {
+        return UV_EINVAL;
+      }
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET((int) cpu, set);
+    }
+    any = 1;
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return UV_EINVAL;
+    }
+  }
+  return any ? 0 : UV_EINVAL;
+}
+
+/**
+ * Writes `set` as a CPU list, folding consecutive CPUs into ranges.
+ */
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+  for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+    if (!CPU_ISSET(cpu, set)) {
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+      last++;
+    }
+    int n = last == cpu ? snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu)
+                        : snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+    if (n < 0) {
+      break;
+    }
+    len += (size_t) n;
+    cpu = last;
+  }
+}
+
+/**
+ * @return The CPU `tid` last ran on, field 39 of its stat file, or -1.
+ */
+static int thread_last_cpu(long tid) {
+  char path[64];
+  char line[1024];
+  snprintf(path, sizeof(path), "/proc/self/task/%ld/stat", tid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  size_t n = fread(line, 1, sizeof(line) - 1, f);
+  fclose(f);
+  line[n] = '\0';
+  // The command name in field 2 may contain spaces; count fields after its closing parenthesis.
+  char *p = strrchr(line, ')');
+  if (p == NULL) {
+    return -1;
+  }
+  int field = 2;
+  while (*p != '\0' && field < 39) {
+    if (*p++ == ' ') {
+      field++;
+    }
+  }
+  return field == 39 ? atoi(p) : -1;
+}
+#endif
+
+int affinity_configure(affinity_role_t role, const char *cpus) {
+#ifdef __linux__
+  if (role >= affinity_roles) {
+    return UV_EINVAL;
+  }
+  cpu_set_t set;
+  int rc = parse_cpu_list(cpus, &set);
+  if (rc != 0) {
+    return rc;
+  }
+  int node = -2;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &set)) {
+      continue;
+    }
+    int n = cpu_node(cpu);
+    if (node == -2) {
+      node = n;
+    } else if (node != n) {
+      node = -1;
+      break;
+    }
+  }
+  roles[role].configured = 1;
+  roles[role].cpus = set;
+  roles[role].node = node < 0 ? -1 : node;
+  if (roles[role].node < 0) {
+    LOG_INFO("%s %d %s %s CPUs %s span several NUMA nodes, memory placement left to the kernel\n", __FILE__,
+             __LINE__, __func__, affinity_role_name(role), cpus);
+  }
+  return 0;
+#else
+  (void) role;
+  (void) cpus;
+  return UV_ENOTSUP;
+#endif
+}
+
+void affinity_apply(affinity_role_t role, const char *name) {
+#ifdef __linux__
+  if (role >= affinity_roles) {
+    return;
+  }
+  if (roles[role].configured && sched_setaffinity(0, sizeof(cpu_set_t), &roles[role].cpus) != 0) {
+    LOG_ERROR("%s %d %s pinning %s thread %s failed: %s\n", __FILE__, __LINE__, __func__, affinity_role_name(role),
+              name, strerror(errno));
+  }
+  uv_once(&registry_once, registry_init);
+  long tid = current_tid();
+  uv_mutex_lock(&registry_lock);
+  size_t i;
+  for (i = 0; i < registry_len; i++) {
+    if (registry[i].tid == tid) {
+      break;
+    }
+  }
+  if (i < AFFINITY_MAX_THREADS) {
+    registry[i].role = role;
+    registry[i].tid = tid;
+    snprintf(registry[i].name, sizeof(registry[i].name), "%s", name);
+    if (i == registry_len) {
+      registry_len++;
+    }
+  }
+  uv_mutex_unlock(&registry_lock);
+#else
+  (void) role;
+  (void) name;
+#endif
+}
+
+void affinity_mem_begin(affinity_role_t role) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  if (role >= affinity_roles || roles[role].node < 0 || !roles[role].configured) {
+    return;
+  }
+  unsigned long mask[AFFINITY_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  if (roles[role].node >= AFFINITY_MAX_NODES) {
+    return;
+  }
+  mask[roles[role].node / (8 * sizeof(unsigned long))] |= 1UL << (roles[role].node % (8 * sizeof(unsigned long)));
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, AFFINITY_MAX_NODES + 1) != 0) {
+    LOG_ERROR("%s %d %s preferring node %d for %s memory failed: %s\n", __FILE__, __LINE__, __func__,
+              roles[role].node, affinity_role_name(role), strerror(errno));
+  }
+#else
+  (void) role;
+#endif
+}
+
+void affinity_mem_end(void) {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+#endif
+}
+
+static uv_barrier_t pool_barrier;
+
+static void pool_pin_work(uv_work_t *req) {
+  (void) req;
+  affinity_apply(affinity_role_parse, "threadpool");
+  // Keep this thread busy until every other pool thread has taken a task.
+  uv_barrier_wait(&pool_barrier);
+}
+
+static void pool_pin_done(uv_work_t *req, int status) {
+  (void) status;
+  (*(unsigned int *) req->data)--;
+}
+
+void affinity_pin_threadpool(uv_loop_t *loop, unsigned int threads) {
+  if (threads == 0) {
+    return;
+  }
+  uv_work_t *reqs = calloc(threads, sizeof(*reqs));
+  if (reqs == NULL || uv_barrier_init(&pool_barrier, threads) != 0) {
+    free(reqs);
+    return;
+  }
+  // uv_queue_work() only fails without a work callback, so every task runs.
+  unsigned int pending = threads;
+  for (unsigned int i = 0; i < threads; i++) {
+    reqs[i].data = &pending;
+    uv_queue_work(loop, &reqs[i], pool_pin_work, pool_pin_done);
+  }
+  while (pending > 0) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  uv_barrier_destroy(&pool_barrier);
+  free(reqs);
+}
+
+size_t affinity_append_json(char *buf, size_t size, size_t len) {
+  if (len >= size) {
+    return len;
+  }
+  int n = snprintf(buf + len, size - len, ",\n  \"placement\": [");
+  len = n < 0 ? len : len + (size_t) n;
+#ifdef __linux__
+  uv_once(&registry_once, registry_init);
+  uv_mutex_lock(&registry_lock);
+  int first = 1;
+  // Threads that do not fit are left out rather than cut mid-object.
+  for (size_t i = 0; i < registry_len && len + 200 < size; i++) {
+    cpu_set_t allowed;
+    char cpus[256];
+    // A thread that has exited has no stat file left.
+    int cpu = thread_last_cpu(registry[i].tid);
+    if (cpu < 0 || sched_getaffinity((pid_t) registry[i].tid, sizeof(allowed), &allowed) != 0) {
+      continue;
+    }
+    format_cpu_list(&allowed, cpus, sizeof(cpus));
+    n = snprintf(buf + len, size - len,
+                 "%s\n    {\"role\": \"%s\", \"thread\": \"%s\", \"tid\": %ld, \"cpus\": \"%s\", \"cpu\": %d, "
+                 "\"node\": %d}",
+                 first ? "" : ",", affinity_role_name(registry[i].role), registry[i].name, registry[i].tid, cpus, cpu,
+                 cpu_node(cpu));
+    len = n < 0 ? len : len + (size_t) n;
+    first = 0;
+  }
+  uv_mutex_unlock(&registry_lock);
+#endif
+  if (len < size) {
+    n = snprintf(buf + len, size - len, "\n  ],\n  \"placement_memory_nodes\": {");
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  for (int role = 0; role < affinity_roles && len < size; role++) {
+#ifdef __linux__
+    int node = roles[role].configured ? roles[role].node : -1;
+#else
+    int node = -1;
+#endif
+    n = snprintf(buf + len, size - len, "%s\"%s\": %d", role ? ", " : "", affinity_role_name((affinity_role_t) role),
+                 node);
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  if (len < size) {
+    n = snprintf(buf + len, size - len, "}");
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  return len < size ? len : size - 1;
+}
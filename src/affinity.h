@@ -0,0 +1,65 @@
+//
+// CPU and NUMA placement of the collector's threads by role.
+//
+
+#ifndef CNETFLOW_AFFINITY_H
+#define CNETFLOW_AFFINITY_H
+
+#include <stddef.h>
+#include <uv.h>
+
+#define AFFINITY_MAX_THREADS 256
+
+typedef enum {
+  // UDP loop and receive threads, and the buffers they receive into.
+  affinity_role_recv = 0,
+  // Parser threads (threadpool or pipeline), which also run the ClickHouse inserts, and the template arenas.
+  affinity_role_parse = 1,
+  // Metrics thread.
+  affinity_role_metrics = 2,
+  affinity_roles = 3,
+} affinity_role_t;
+
+/**
+ * Returns the role's name as used in the metrics output.
+ */
+const char *affinity_role_name(affinity_role_t role);
+
+/**
+ * Sets the CPUs threads of `role` are pinned to, as a list like "0-3,8,10-11".
+ * The role's memory is placed on the NUMA node of those CPUs when they all
+ * share one.
+ *
+ * @return 0 on success, UV_EINVAL if the list does not parse, UV_ENOTSUP off Linux.
+ */
+int affinity_configure(affinity_role_t role, const char *cpus);
+
+/**
+ * Pins the calling thread to the CPUs of `role`, if any were configured, and
+ * records it under `name` for affinity_append_json().
+ */
+void affinity_apply(affinity_role_t role, const char *name);
+
+/**
+ * Makes the calling thread's page allocations prefer the NUMA node of `role`
+ * until affinity_mem_end(). Memory first touched in between lands there.
+ */
+void affinity_mem_begin(affinity_role_t role);
+void affinity_mem_end(void);
+
+/**
+ * Runs one task on each of the `threads` libuv threadpool threads of `loop`
+ * that pins it to the parse role, then returns.
+ */
+void affinity_pin_threadpool(uv_loop_t *loop, unsigned int threads);
+
+/**
+ * Appends the recorded threads with the CPUs they may run on, the CPU they
+ * last ran on and its node, followed by each role's memory node, as JSON
+ * members starting with a comma.
+ *
+ * @return The new length of the string in `buf`.
+ */
+size_t affinity_append_json(char *buf, size_t size, size_t len);
+
+#endif // CNETFLOW_AFFINITY_H
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef _WIN32
 #include <arpa/inet.h>
 #include <sys/resource.h>
@@ -24,15 +25,25 @@
 #include <ws2tcpip.h>
 #endif
 #include <uv.h>
+#include "affinity.h"
 #include "arena.h"
 #include "dyn_array.h"
+#include "exporter.h"
+#include "handover.h"
+#include "ingest.h"
+#include "ingest_queue.h"
+#include "ingest_validate.h"
 #include "log.h"
 #include "metrics.h"
 #include "netflow_ipfix.h"
 #include "netflow_v5.h"
 #include "netflow_v9.h"
+#include "pipeline.h"
+#include "pkt_slab.h"
+#include "shard.h"
 
 extern void ch_db_cleanup_all(void);
+extern size_t ch_flush_flows(void);
 
 #define _MAX_ALLOWED_RAM 12.0
 #define true 1
@@ -43,7 +54,6 @@ extern void ch_db_cleanup_all(void);
 #define MAX_THREAD_COUNTER 7
 
 arena_struct_t *arena_collector;
-arena_struct_t *arena_udp_handle;
 arena_struct_t *arena_hashmap_nf9;
 arena_struct_t *arena_hashmap_ipfix;
 static collector_t *collector_config;
@@ -66,6 +76,114 @@ static volatile uint64_t total_processed_msgs = 0;
 int g_max_flows = 10000;
 int g_max_diff = 5;
 char *g_ch_conn_string = NULL;
+ingest_config_t g_ingest_config = {
+    .mode = ingest_mode_libuv,
+    .batch = INGEST_DEFAULT_BATCH,
+    .sockets = 1,
+    .gro = 0,
+    .iface = NULL,
+    .tpacket_blocks = INGEST_TPACKET_DEFAULT_BLOCKS,
+    .xdp_queue = 0,
+    .xdp_frames = INGEST_XDP_DEFAULT_FRAMES,
+    .xdp_native = 0,
+    .uring_buffers = INGEST_URING_DEFAULT_BUFFERS,
+    .rcvbuf = INGEST_DEFAULT_RCVBUF,
+    .rcvbuf_max = INGEST_DEFAULT_RCVBUF_MAX,
+};
+// Exporters allowed to send, NULL to accept every source.
+ingest_allowlist_t *g_exporter_allowlist = NULL;
+// Dispatch weights of exporters in the ingest queues, NULL for equal shares.
+ingest_weights_t *g_exporter_weights = NULL;
+uint32_t g_queue_limit = INGEST_QUEUE_DEFAULT_LIMIT;
+ingest_overload_t g_overload_policy = ingest_overload_drop_newest;
+// Datagrams one thread may have with the parsers before the rest wait in its
+// ingest queue. UINT32_MAX when CNETFLOW_QUEUE_LIMIT=0 disables the queue.
+static uint32_t parse_window = UINT32_MAX;
+// libuv mode: the uv_udp_t socket's buffer, polled for kernel drops by rcvbuf_timer.
+static ingest_rcvbuf_t libuv_rcvbuf;
+static uv_timer_t rcvbuf_timer;
+static int rcvbuf_timer_started = 0;
+// Adaptive parser count: reconsidered every PIPELINE_SCALE_INTERVAL_MS.
+static uv_timer_t scale_timer;
+static int scale_timer_started = 0;
+
+static uv_timer_t handover_timer;
+static int handover_timer_started = 0;
+static uint64_t handover_start_ms = 0;
+
+// Loop that owns the work requests queued by udp_handle() on this thread.
+// Receive threads started by ingest.c point it at their own loop, so that
+// after_work_cb runs on the loop the request was queued on.
+static THREAD_LOCAL uv_loop_t *dispatch_loop = NULL;
+// In pipeline mode, this thread's rings to the parser threads.
+static THREAD_LOCAL pipeline_producer_t *dispatch_producer = NULL;
+// Datagrams this thread handed to the parsers that have not completed yet.
+static THREAD_LOCAL uint32_t dispatch_inflight = 0;
+// Datagrams waiting for room in the window, created on first overload.
+static THREAD_LOCAL ingest_queue_t *dispatch_queue = NULL;
+static THREAD_LOCAL int dispatch_closing = 0;
+// Receive time stamped on the datagrams this thread dispatches, 0 to read
+// the coarse clock per datagram.
+static THREAD_LOCAL uint64_t dispatch_recv_ms = 0;
+
+void collector_set_dispatch_loop(uv_loop_t *loop) {
+  dispatch_loop = loop;
+  if (pipeline_enabled() && dispatch_producer == NULL) {
+    dispatch_producer = pipeline_producer_open(loop);
+  }
+}
+
+void collector_close_dispatch_loop(void) {
+  // The producer stays valid until pipeline_stop(): datagrams still in the
+  // ingest queue are submitted to it as earlier ones complete.
+  pipeline_producer_close(dispatch_producer);
+  dispatch_closing = 1;
+  if (dispatch_queue != NULL && dispatch_queue->count == 0) {
+    ingest_queue_report(dispatch_queue, 1);
+    ingest_queue_destroy(dispatch_queue);
+    dispatch_queue = NULL;
+  }
+}
+
+/**
+ * Wall-clock time in milliseconds from the coarse clock: read from the vDSO
+ * without a syscall, at the resolution of the kernel tick.
+ */
+uint64_t collector_clock_ms(void) {
+#ifdef CLOCK_REALTIME_COARSE
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+  }
+#endif
+  uv_timeval64_t tv;
+  if (uv_gettimeofday(&tv) != 0) {
+    return (uint64_t) time(NULL) * 1000;
+  }
+  return (uint64_t) tv.tv_sec * 1000 + (uint64_t) tv.tv_usec / 1000;
+}
+
+/**
+ * Sets the receive time of the datagrams this thread dispatches next, as
+ * taken from a kernel timestamp or once per receive batch. 0 goes back to
+ * reading collector_clock_ms() for every datagram.
+ */
+void collector_set_receive_time(uint64_t recv_ms) { dispatch_recv_ms = recv_ms; }
+
+/**
+ * Number of libuv threadpool threads, clamped the way libuv reads UV_THREADPOOL_SIZE.
+ */
+static unsigned int collector_threadpool_size(void) {
+  const char *threadpool_str = getenv("UV_THREADPOOL_SIZE");
+  if (threadpool_str == NULL) {
+    return 4;
+  }
+  unsigned int threadpool = (unsigned int) atoi(threadpool_str);
+  if (threadpool == 0) {
+    return 1;
+  }
+  return threadpool > 1024 ? 1024 : threadpool;
+}
 
 void print_rss_max_usage() {
 #ifndef _WIN32
@@ -107,6 +225,48 @@ void check_backlog_cb(uv_timer_t *handle) {
   last_processed_msgs = total_processed_msgs;
 }
 
+static void rcvbuf_timer_cb(uv_timer_t *handle) { ingest_rcvbuf_poll(&libuv_rcvbuf, uv_now(handle->loop)); }
+
+static void scale_timer_cb(uv_timer_t *handle) {
+  int backlog = active_requests;
+  pipeline_adapt(uv_now(handle->loop), backlog > 0 ? (uint64_t) backlog : 0);
+}
+
+/**
+ * Waits for the datagrams already received to be parsed, so the templates sent
+ * are the ones every flow inserted so far was decoded with, then answers the
+ * new process and leaves the loop.
+ */
+static void handover_timer_cb(uv_timer_t *handle) {
+  if (active_requests > 0 && uv_now(handle->loop) - handover_start_ms < 10000) {
+    return;
+  }
+  if (active_requests > 0) {
+    LOG_ERROR("handover: %d requests still pending, handing over anyway\n", active_requests);
+  }
+  uv_timer_stop(handle);
+  handover_send();
+  uv_stop(handle->loop);
+}
+
+/**
+ * A new process asked for the sockets: stop reading from them, the kernel keeps
+ * buffering what arrives until the new process reads from its copies.
+ */
+static void collector_handover_requested(void) {
+  ingest_stop();
+  if (udp_server_global) {
+    uv_udp_recv_stop(udp_server_global);
+    if (!uv_is_closing((uv_handle_t *) udp_server_global)) {
+      uv_close((uv_handle_t *) udp_server_global, NULL);
+    }
+  }
+  handover_start_ms = uv_now(loop_udp);
+  uv_timer_init(loop_udp, &handover_timer);
+  uv_timer_start(&handover_timer, handover_timer_cb, 0, 10);
+  handover_timer_started = 1;
+}
+
 void collector_inc_received_flows(uint64_t count) { __sync_fetch_and_add(&total_received_flows, count); }
 
 /**
@@ -175,6 +335,7 @@ void signal_handler(const int signal) {
     case SIGINT:
     case SIGABRT:
       LOG_ERROR("signal caught, stopping...\n");
+      ingest_stop();
       if (udp_server_global) {
         uv_udp_recv_stop(udp_server_global);
         if (!uv_is_closing((uv_handle_t *) udp_server_global)) {
@@ -229,44 +390,21 @@ int8_t collector_setup(collector_t *collector) {
  */
 void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
   (void) handle;
-  // buf->base = malloc(suggested_size);
-  // buf->len = suggested_size;
-  // buf->base = malloc(suggested_size);
-  // buf->len = suggested_size;
-  // return;
-  static volatile int data_counter = 1;
-  (void) data_counter;
-  suggested_size = 2000; // should be enough for most packets
-  LOG_DEBUG("%s %d %s buf->base = (char *) collector_config->alloc(arena_udp_handle, suggested_size);\n", __FILE__,
-            __LINE__, __func__);
-  buf->base = (char *) collector_config->alloc(arena_udp_handle, suggested_size);
-  buf->len = suggested_size;
-  if (buf->base == NULL) {
-#ifdef USE_ARENA_ALLOCATOR
-    size_t arena_offset = arena_udp_handle->offset;
-#else
-    size_t arena_offset = 0;
-#endif
-    (void) arena_offset;
-    LOG_ERROR("%s %d %s alloc_cb: [%d] called for handle %p size: %lu buf->base: %p buf->len: %lu arena_offset: %lu\n",
-              __FILE__, __LINE__, __func__, data_counter, (void *) handle, suggested_size, buf->base, buf->len,
-              arena_offset);
-    LOG_ERROR("%s %d %s", __FILE__, __LINE__, __func__);
-    EXIT_WITH_MSG(-1, "alloc_cb failed to allocate memory\n");
+  (void) suggested_size;
+  // libuv always suggests 64 KiB; a jumbo-sized context covers every export
+  // we have seen without tying up the 64 KiB class.
+  pkt_ctx_t *ctx = pkt_slab_alloc(PKT_SLAB_RECV_SIZE);
+  if (ctx == NULL) {
+    // libuv reports UV_ENOBUFS to udp_handle and retries on the next wakeup.
+    metrics_inc_pkt_slab_drop();
+    buf->base = NULL;
+    buf->len = 0;
+    return;
   }
-
-#ifdef USE_ARENA_ALLOCATOR
-  size_t arena_offset_debug = arena_udp_handle->offset;
-#else
-  size_t arena_offset_debug = 0;
-#endif
-  (void) arena_offset_debug;
-  LOG_DEBUG("%s %d %s alloc_cb: [%d] called for handle %p size: %lu buf->base: %p buf->len: %lu arena_offset: %lu\n",
-            __FILE__, __LINE__, __func__, data_counter, (void *) handle, suggested_size, buf->base, buf->len,
-            arena_offset_debug);
-  // memset(buffer[buffer_index].base, 0, suggested_size);
+  buf->base = pkt_ctx_data(ctx);
+  buf->len = ctx->capacity;
 }
-#ifdef HAVE_PCAP
+#ifndef _WIN32
 #include <netinet/if_ether.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -274,7 +412,9 @@ void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
 #define __FAVOR_BSD 1
 #endif
 #include <netinet/udp.h>
+#ifdef HAVE_PCAP
 #include <pcap.h>
+#endif
 #ifndef DLT_LINUX_SLL
 #define DLT_LINUX_SLL 113
 #endif
@@ -284,6 +424,51 @@ void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
 #ifndef DLT_NULL
 #define DLT_NULL 0
 #endif
+
+int collector_udp_payload(const uint8_t *frame, size_t caplen, int linktype, const uint8_t **payload,
+                          struct sockaddr_in *src) {
+  size_t offset = 0;
+  if (linktype == DLT_EN10MB) {
+    offset = 14;
+  } else if (linktype == DLT_LINUX_SLL) {
+    offset = 16;
+  } else if (linktype == DLT_NULL) {
+    offset = 4;
+  } else {
+    return -1;
+  }
+
+  if (caplen < offset + sizeof(struct ip))
+    return 0;
+
+  const struct ip *ip_hdr = (const struct ip *) (frame + offset);
+  if (ip_hdr->ip_v != 4 || ip_hdr->ip_p != IPPROTO_UDP)
+    return 0;
+
+  size_t ip_len = ip_hdr->ip_hl * 4;
+  if (ip_len < sizeof(struct ip) || caplen < offset + ip_len + sizeof(struct udphdr))
+    return 0;
+
+  const struct udphdr *udp_hdr = (const struct udphdr *) (frame + offset + ip_len);
+
+  size_t udp_len = ntohs(udp_hdr->uh_ulen);
+  if (udp_len < 8)
+    return 0;
+
+  size_t payload_len = udp_len - 8;
+  if (caplen < offset + ip_len + 8 + payload_len)
+    return 0;
+
+  *payload = frame + offset + ip_len + 8;
+  memset(src, 0, sizeof(*src));
+  src->sin_family = AF_INET;
+  src->sin_addr = ip_hdr->ip_src;
+  src->sin_port = udp_hdr->uh_sport;
+  return (int) payload_len;
+}
+#endif // _WIN32
+
+#ifdef HAVE_PCAP
 #include "dyn_array.h"
 
 uint32_t global_pcap_frame_number = 0;
@@ -305,6 +490,7 @@ int compare_pcap_lines(const void *a, const void *b) {
 }
 
 int parse_pcap_file(collector_t *collector, const char *filename) {
+  (void) collector;
   LOG_INFO("Pass 1: Parsing templates from pcap file %s...\n", filename);
   char errbuf[PCAP_ERRBUF_SIZE];
   uv_mutex_init(&pcap_output_mutex);
@@ -329,57 +515,39 @@ int parse_pcap_file(collector_t *collector, const char *filename) {
     global_pcap_frame_number = 0;
     while (pcap_next_ex(pcap, &header, &data) >= 0) {
       global_pcap_frame_number++;
-      int offset = 0;
-      if (linktype == DLT_EN10MB) {
-        offset = 14;
-      } else if (linktype == DLT_LINUX_SLL) {
-        offset = 16;
-      } else if (linktype == DLT_NULL) {
-        offset = 4;
-      } else {
+      const uint8_t *payload = NULL;
+      struct sockaddr_in addr;
+      int payload_len = collector_udp_payload(data, header->caplen, linktype, &payload, &addr);
+      if (payload_len < 0) {
         if (pass == 1)
           LOG_ERROR("Unsupported pcap datalink type: %d\n", linktype);
         break;
       }
-
-      if (header->caplen < offset + sizeof(struct ip))
-        continue;
-
-      struct ip *ip_hdr = (struct ip *) (data + offset);
-      if (ip_hdr->ip_p != IPPROTO_UDP)
-        continue;
-
-      int ip_len = ip_hdr->ip_hl * 4;
-      if (header->caplen < offset + ip_len + sizeof(struct udphdr))
+      if (payload_len == 0)
         continue;
 
-      struct udphdr *udp_hdr = (struct udphdr *) (data + offset + ip_len);
-
-      int udp_len = ntohs(udp_hdr->uh_ulen);
-      if (udp_len < 8)
-        continue;
-
-      int payload_len = udp_len - 8;
-      if (header->caplen < offset + ip_len + 8 + payload_len)
+      pkt_ctx_t *ctx = pkt_slab_alloc((size_t) payload_len);
+      while (ctx == NULL && payload_len <= PKT_SLAB_MAX_SIZE) {
+        // Offline parsing must not drop: wait for parsers to hand contexts back.
+        uv_run(loop_udp, UV_RUN_ONCE);
+        ctx = pkt_slab_alloc((size_t) payload_len);
+      }
+      if (ctx == NULL)
         continue;
-
-      const u_char *payload = data + offset + ip_len + 8;
-
       uv_buf_t buf;
-      buf.base = (char *) collector->alloc(arena_udp_handle, payload_len);
-      if (!buf.base)
-        continue;
+      buf.base = pkt_ctx_data(ctx);
       buf.len = payload_len;
       memcpy(buf.base, payload, payload_len);
 
-      struct sockaddr_in addr;
-      memset(&addr, 0, sizeof(addr));
-      addr.sin_family = AF_INET;
-      addr.sin_addr = ip_hdr->ip_src;
-      addr.sin_port = udp_hdr->uh_sport;
-
+      // Offline parsing must not shed either: keep the ingest queue empty.
+      while (dispatch_inflight >= parse_window) {
+        uv_run(loop_udp, UV_RUN_ONCE);
+      }
       active_requests++; // temporarily bump to prevent early exit if udp_handle errors before queuing
+      // Flows are rebased on the capture time, not on when the file is read.
+      collector_set_receive_time((uint64_t) header->ts.tv_sec * 1000 + (uint64_t) header->ts.tv_usec / 1000);
       udp_handle(NULL, payload_len, &buf, (struct sockaddr *) &addr, (pass == 1) ? 3 : 2);
+      collector_set_receive_time(0);
       active_requests--;
 
       while (active_requests > 1000000) {
@@ -463,9 +631,22 @@ int8_t collector_start(collector_t *collector) {
   }
 #endif
 
+  // Placement is read first: the arenas below are touched here but used by the parsers.
+  static const char *const cpus_env[affinity_roles] = {"CNETFLOW_CPUS_RECV", "CNETFLOW_CPUS_PARSE",
+                                                       "CNETFLOW_CPUS_METRICS"};
+  for (int role = 0; role < affinity_roles; role++) {
+    const char *cpus_str = getenv(cpus_env[role]);
+    if (cpus_str && affinity_configure((affinity_role_t) role, cpus_str) != 0) {
+      LOG_ERROR("%s must be a CPU list like 0-3,8, leaving %s threads unpinned\n", cpus_env[role],
+                affinity_role_name((affinity_role_t) role));
+    }
+  }
+  // This thread runs the UDP loop.
+  affinity_apply(affinity_role_recv, "collector");
+
+  affinity_mem_begin(affinity_role_parse);
   arena_collector = malloc(sizeof(arena_struct_t));
 
-  arena_udp_handle = malloc(sizeof(arena_struct_t));
   arena_hashmap_nf9 = malloc(sizeof(arena_struct_t));
   arena_hashmap_ipfix = malloc(sizeof(arena_struct_t));
 
@@ -476,11 +657,6 @@ int8_t collector_start(collector_t *collector) {
     goto error_no_arena;
   }
 
-  err = arena_create(arena_udp_handle, (size_t) 5 * 1024 * 1024 * 1024);
-  if (err != ok) {
-    LOG_ERROR("arena_create failed: %d\n", err);
-    goto error_no_arena;
-  }
   err = arena_create(arena_hashmap_nf9, (size_t) 1 * 1024 * 1024 * 1024);
   if (err != ok) {
     LOG_ERROR("arena_create failed: %d\n", err);
@@ -494,10 +670,12 @@ int8_t collector_start(collector_t *collector) {
     goto error_no_arena;
   }
 #endif
+  init_v5(getenv("CNETFLOW_V5_DECODER"));
   LOG_ERROR("%s %d %s init_v9(arena_collector, 1000000);\n", __FILE__, __LINE__, __func__);
   init_v9(arena_hashmap_nf9, 1000000);
   LOG_ERROR("%s %d %s init_ipfix(arena_collector, 1000000);\n", __FILE__, __LINE__, __func__);
   init_ipfix(arena_hashmap_ipfix, 1000000);
+  affinity_mem_end();
 
   // Initialize global metrics
   metrics_init();
@@ -509,15 +687,267 @@ int8_t collector_start(collector_t *collector) {
   const char *max_diff_str = getenv("CNETFLOW_MAX_DIFF");
   if (max_diff_str)
     g_max_diff = atoi(max_diff_str);
+  const char *max_octets_str = getenv("CNETFLOW_MAX_OCTETS_PER_SEC");
+  const char *max_packets_str = getenv("CNETFLOW_MAX_PACKETS_PER_SEC");
+  long long max_octets = max_octets_str ? strtoll(max_octets_str, NULL, 10) : 0;
+  long long max_packets = max_packets_str ? strtoll(max_packets_str, NULL, 10) : 0;
+  if (max_octets < 0 || max_octets >= UINT32_MAX) {
+    LOG_ERROR("CNETFLOW_MAX_OCTETS_PER_SEC must be between 1 and %u, using %u\n", UINT32_MAX - 1,
+              NETFLOW_MAX_OCTETS_PER_SEC);
+    max_octets = 0;
+  }
+  if (max_packets < 0 || max_packets >= UINT32_MAX) {
+    LOG_ERROR("CNETFLOW_MAX_PACKETS_PER_SEC must be between 1 and %u, using %u\n", UINT32_MAX - 1,
+              NETFLOW_MAX_PACKETS_PER_SEC);
+    max_packets = 0;
+  }
+  netflow_set_flow_limits((uint32_t) max_octets, (uint32_t) max_packets);
   const char *ch_conn_str = getenv("CH_CONN_STRING");
   if (ch_conn_str)
     g_ch_conn_string = strdup(ch_conn_str);
+  const char *recv_mode_str = getenv("CNETFLOW_RECV_MODE");
+  int recv_mode = ingest_parse_mode(recv_mode_str);
+  if (recv_mode < 0) {
+    LOG_ERROR("Unknown CNETFLOW_RECV_MODE %s, using libuv\n", recv_mode_str);
+    recv_mode = ingest_mode_libuv;
+  }
+  g_ingest_config.mode = (ingest_mode_t) recv_mode;
+  const char *recv_batch_str = getenv("CNETFLOW_RECV_BATCH");
+  if (recv_batch_str) {
+    long recv_batch = strtol(recv_batch_str, NULL, 10);
+    if (recv_batch < 1 || recv_batch > INGEST_MAX_BATCH) {
+      LOG_ERROR("CNETFLOW_RECV_BATCH must be between 1 and %d, using %d\n", INGEST_MAX_BATCH, INGEST_DEFAULT_BATCH);
+    } else {
+      g_ingest_config.batch = (unsigned int) recv_batch;
+    }
+  }
+  const char *recv_sockets_str = getenv("CNETFLOW_RECV_SOCKETS");
+  if (recv_sockets_str) {
+    long recv_sockets = strtol(recv_sockets_str, NULL, 10);
+    if (recv_sockets < 1 || recv_sockets > INGEST_MAX_SOCKETS) {
+      LOG_ERROR("CNETFLOW_RECV_SOCKETS must be between 1 and %d, using 1\n", INGEST_MAX_SOCKETS);
+    } else {
+      g_ingest_config.sockets = (unsigned int) recv_sockets;
+    }
+  }
+  const char *recv_gro_str = getenv("CNETFLOW_RECV_GRO");
+  if (recv_gro_str && strcmp(recv_gro_str, "1") == 0) {
+    g_ingest_config.gro = 1;
+    if (g_ingest_config.mode == ingest_mode_libuv) {
+      // uv_udp_t does not surface the UDP_GRO cmsg.
+      LOG_INFO("CNETFLOW_RECV_GRO requires collector-owned sockets, using recvmmsg\n");
+      g_ingest_config.mode = ingest_mode_recvmmsg;
+    }
+  }
+  if (g_ingest_config.sockets > 1 && g_ingest_config.mode == ingest_mode_libuv) {
+    // Only the collector-owned sockets can join a reuseport group.
+    LOG_INFO("CNETFLOW_RECV_SOCKETS=%u requires collector-owned sockets, using recvmmsg\n", g_ingest_config.sockets);
+    g_ingest_config.mode = ingest_mode_recvmmsg;
+  }
+  g_ingest_config.iface = getenv("CNETFLOW_TPACKET_IFACE");
+  const char *tpacket_blocks_str = getenv("CNETFLOW_TPACKET_BLOCKS");
+  if (tpacket_blocks_str) {
+    long tpacket_blocks = strtol(tpacket_blocks_str, NULL, 10);
+    if (tpacket_blocks < 1 || tpacket_blocks > INGEST_TPACKET_MAX_BLOCKS) {
+      LOG_ERROR("CNETFLOW_TPACKET_BLOCKS must be between 1 and %d, using %d\n", INGEST_TPACKET_MAX_BLOCKS,
+                INGEST_TPACKET_DEFAULT_BLOCKS);
+    } else {
+      g_ingest_config.tpacket_blocks = (unsigned int) tpacket_blocks;
+    }
+  }
+  uint32_t pkt_contexts = PKT_SLAB_DEFAULT_CONTEXTS;
+  const char *pkt_contexts_str = getenv("CNETFLOW_PKT_CONTEXTS");
+  if (pkt_contexts_str) {
+    long contexts = strtol(pkt_contexts_str, NULL, 10);
+    if (contexts < 64 || contexts > PKT_SLAB_MAX_CONTEXTS) {
+      LOG_ERROR("CNETFLOW_PKT_CONTEXTS must be between 64 and %d, using %d\n", PKT_SLAB_MAX_CONTEXTS,
+                PKT_SLAB_DEFAULT_CONTEXTS);
+    } else {
+      pkt_contexts = (uint32_t) contexts;
+    }
+  }
+  // Receive buffers are written by the receive threads.
+  affinity_mem_begin(affinity_role_recv);
+  int slab_ret = pkt_slab_init(pkt_contexts);
+  affinity_mem_end();
+  if (slab_ret != 0) {
+    goto error_destroy_arena;
+  }
+  const char *queue_limit_str = getenv("CNETFLOW_QUEUE_LIMIT");
+  if (queue_limit_str) {
+    long queue_limit = strtol(queue_limit_str, NULL, 10);
+    if (queue_limit < 0 || queue_limit > INGEST_QUEUE_MAX_LIMIT) {
+      LOG_ERROR("CNETFLOW_QUEUE_LIMIT must be between 0 and %d, using %d\n", INGEST_QUEUE_MAX_LIMIT,
+                INGEST_QUEUE_DEFAULT_LIMIT);
+    } else {
+      g_queue_limit = (uint32_t) queue_limit;
+    }
+  }
+  const char *overload_policy_str = getenv("CNETFLOW_OVERLOAD_POLICY");
+  int overload_policy = ingest_queue_parse_policy(overload_policy_str);
+  if (overload_policy < 0) {
+    LOG_ERROR("Unknown CNETFLOW_OVERLOAD_POLICY %s, using drop_newest\n", overload_policy_str);
+    overload_policy = ingest_overload_drop_newest;
+  }
+  g_overload_policy = (ingest_overload_t) overload_policy;
+  unsigned int parser_threads = 0;
+  const char *parser_threads_str = getenv("CNETFLOW_PARSER_THREADS");
+  if (parser_threads_str) {
+    long threads = strtol(parser_threads_str, NULL, 10);
+    if (threads < 0 || threads > PIPELINE_MAX_THREADS) {
+      LOG_ERROR("CNETFLOW_PARSER_THREADS must be between 0 and %d, using the libuv threadpool\n",
+                PIPELINE_MAX_THREADS);
+    } else {
+      parser_threads = (unsigned int) threads;
+    }
+  }
+  const char *shards_str = getenv("CNETFLOW_SHARDS");
+  if (shards_str) {
+    long shards = strtol(shards_str, NULL, 10);
+    if (shards < 0 || shards > SHARD_MAX) {
+      LOG_ERROR("CNETFLOW_SHARDS must be between 0 and %d, sharding disabled\n", SHARD_MAX);
+    } else if (shards > 0) {
+      // Each shard is run by one parser thread.
+      parser_threads = (unsigned int) shards;
+      shard_configure(parser_threads);
+    }
+  }
+  unsigned int parser_threads_min = 0;
+  const char *parser_threads_min_str = getenv("CNETFLOW_PARSER_THREADS_MIN");
+  if (parser_threads_min_str && parser_threads > 0) {
+    long threads = strtol(parser_threads_min_str, NULL, 10);
+    if (threads < 1 || threads > (long) parser_threads) {
+      LOG_ERROR("CNETFLOW_PARSER_THREADS_MIN must be between 1 and %u, keeping every parser active\n",
+                parser_threads);
+    } else {
+      parser_threads_min = (unsigned int) threads;
+    }
+  }
+  unsigned int pipeline_ring = PIPELINE_DEFAULT_RING;
+  const char *pipeline_ring_str = getenv("CNETFLOW_PIPELINE_RING");
+  if (pipeline_ring_str) {
+    long ring = strtol(pipeline_ring_str, NULL, 10);
+    if (ring < 64 || ring > PIPELINE_MAX_RING || (ring & (ring - 1)) != 0) {
+      LOG_ERROR("CNETFLOW_PIPELINE_RING must be a power of two between 64 and %d, using %d\n", PIPELINE_MAX_RING,
+                PIPELINE_DEFAULT_RING);
+    } else {
+      pipeline_ring = (unsigned int) ring;
+    }
+  }
+  if (g_ingest_config.mode == ingest_mode_xdp) {
+    g_ingest_config.iface = getenv("CNETFLOW_XDP_IFACE");
+  }
+  const char *xdp_queue_str = getenv("CNETFLOW_XDP_QUEUE");
+  if (xdp_queue_str) {
+    long xdp_queue = strtol(xdp_queue_str, NULL, 10);
+    if (xdp_queue < 0 || xdp_queue > 1023) {
+      LOG_ERROR("CNETFLOW_XDP_QUEUE must be between 0 and 1023, using 0\n");
+    } else {
+      g_ingest_config.xdp_queue = (unsigned int) xdp_queue;
+    }
+  }
+  const char *xdp_frames_str = getenv("CNETFLOW_XDP_FRAMES");
+  if (xdp_frames_str) {
+    long xdp_frames = strtol(xdp_frames_str, NULL, 10);
+    if (xdp_frames < 64 || xdp_frames > INGEST_XDP_MAX_FRAMES || (xdp_frames & (xdp_frames - 1)) != 0) {
+      LOG_ERROR("CNETFLOW_XDP_FRAMES must be a power of two between 64 and %d, using %d\n", INGEST_XDP_MAX_FRAMES,
+                INGEST_XDP_DEFAULT_FRAMES);
+    } else {
+      g_ingest_config.xdp_frames = (unsigned int) xdp_frames;
+    }
+  }
+  const char *xdp_attach_str = getenv("CNETFLOW_XDP_ATTACH");
+  if (xdp_attach_str && strcmp(xdp_attach_str, "drv") == 0) {
+    g_ingest_config.xdp_native = 1;
+  }
+  const char *uring_buffers_str = getenv("CNETFLOW_URING_BUFFERS");
+  if (uring_buffers_str) {
+    long uring_buffers = strtol(uring_buffers_str, NULL, 10);
+    if (uring_buffers < 16 || uring_buffers > INGEST_URING_MAX_BUFFERS || (uring_buffers & (uring_buffers - 1)) != 0) {
+      LOG_ERROR("CNETFLOW_URING_BUFFERS must be a power of two between 16 and %d, using %d\n", INGEST_URING_MAX_BUFFERS,
+                INGEST_URING_DEFAULT_BUFFERS);
+    } else {
+      g_ingest_config.uring_buffers = (unsigned int) uring_buffers;
+    }
+  }
+  const char *rcvbuf_str = getenv("CNETFLOW_RCVBUF");
+  if (rcvbuf_str) {
+    long rcvbuf = strtol(rcvbuf_str, NULL, 10);
+    if (rcvbuf < 0 || rcvbuf > (1 << 30)) {
+      LOG_ERROR("CNETFLOW_RCVBUF must be between 0 and %d, using %d\n", 1 << 30, INGEST_DEFAULT_RCVBUF);
+    } else {
+      g_ingest_config.rcvbuf = (int) rcvbuf;
+    }
+  }
+  const char *rcvbuf_max_str = getenv("CNETFLOW_RCVBUF_MAX");
+  if (rcvbuf_max_str) {
+    long rcvbuf_max = strtol(rcvbuf_max_str, NULL, 10);
+    if (rcvbuf_max < 0 || rcvbuf_max > (1 << 30)) {
+      LOG_ERROR("CNETFLOW_RCVBUF_MAX must be between 0 and %d, using %d\n", 1 << 30, INGEST_DEFAULT_RCVBUF_MAX);
+    } else {
+      g_ingest_config.rcvbuf_max = (int) rcvbuf_max;
+    }
+  }
+  const char *allowlist_str = getenv("CNETFLOW_EXPORTER_ALLOWLIST");
+  if (allowlist_str && *allowlist_str) {
+    g_exporter_allowlist = ingest_allowlist_load(allowlist_str);
+    if (g_exporter_allowlist == NULL) {
+      fprintf(stderr, "could not load CNETFLOW_EXPORTER_ALLOWLIST %s\n", allowlist_str);
+      goto error_destroy_arena;
+    }
+    LOG_INFO("accepting datagrams from %u exporters listed in %s\n", g_exporter_allowlist->count, allowlist_str);
+  }
+  const char *weights_str = getenv("CNETFLOW_EXPORTER_WEIGHTS");
+  if (weights_str && *weights_str) {
+    g_exporter_weights = ingest_weights_load(weights_str);
+    if (g_exporter_weights == NULL) {
+      fprintf(stderr, "could not load CNETFLOW_EXPORTER_WEIGHTS %s\n", weights_str);
+      goto error_destroy_arena;
+    }
+    LOG_INFO("weighing exporters by %u prefixes listed in %s\n", g_exporter_weights->count, weights_str);
+  }
 
   LOG_ERROR("%s %d %s collector_init...\n", __FILE__, __LINE__, __func__);
   loop_timer_rss = uv_default_loop();
   loop_timer_snmp = uv_default_loop();
   loop_udp = uv_default_loop();
   loop_pool = uv_default_loop();
+  if (parser_threads > 0) {
+    const char *stealing_str = getenv("CNETFLOW_WORK_STEALING");
+    pipeline_set_stealing(stealing_str && strcmp(stealing_str, "1") == 0);
+    pipeline_set_min_threads(parser_threads_min);
+    int pipeline_ret = pipeline_start(parser_threads, pipeline_ring);
+    if (pipeline_ret != 0) {
+      LOG_ERROR("could not start %u parser threads: %s\n", parser_threads, uv_strerror(pipeline_ret));
+      fprintf(stderr, "could not start %u parser threads: %s\n", parser_threads, uv_strerror(pipeline_ret));
+      goto error_destroy_arena;
+    }
+    collector_set_dispatch_loop(loop_udp);
+  } else {
+    // The threadpool threads parse and insert; pin them before the first datagram starts them.
+    affinity_pin_threadpool(loop_pool, collector_threadpool_size());
+  }
+  if (g_queue_limit > 0) {
+    if (parser_threads > 0) {
+      parse_window = parser_threads * pipeline_ring;
+    } else {
+      // Enough to keep every pool thread busy between two completions.
+      parse_window = collector_threadpool_size() * 16;
+    }
+    LOG_INFO("ingest queue: %u datagrams, %s policy, parse window %u\n", g_queue_limit,
+             ingest_queue_policy_name(g_overload_policy), parse_window);
+  }
+
+  const char *handover_path = getenv("CNETFLOW_HANDOVER_SOCKET");
+  if (handover_path && *handover_path && !collector->pcap_file) {
+    // Before any socket is bound: the running collector keeps them until it has drained.
+    int handover_ret = handover_receive(handover_path);
+    if (handover_ret >= 0) {
+      LOG_INFO("handover: took over %d sockets from %s\n", handover_ret, handover_path);
+    } else if (handover_ret != UV_ENOENT && handover_ret != UV_ECONNREFUSED) {
+      LOG_ERROR("handover: could not take over from %s: %s\n", handover_path, uv_strerror(handover_ret));
+    }
+  }
 
   // Start TCP JSON metrics listener
   metrics_tcp_start(8085);
@@ -533,6 +963,11 @@ int8_t collector_start(collector_t *collector) {
   uv_timer_start(&timer_req_rss, (void *) print_rss_max_usage, 1000, 1000);
   uv_timer_init(loop_udp, &timer_backlog);
   uv_timer_start(&timer_backlog, check_backlog_cb, 60000, 60000);
+  if (parser_threads_min > 0 && parser_threads_min < parser_threads) {
+    uv_timer_init(loop_udp, &scale_timer);
+    uv_timer_start(&scale_timer, scale_timer_cb, PIPELINE_SCALE_INTERVAL_MS, PIPELINE_SCALE_INTERVAL_MS);
+    scale_timer_started = 1;
+  }
   LOG_DEBUG("%s %d %s uv_udp_t *udp_server = collector_config->alloc(arena_collector, sizeof(uv_udp_t));\n", __FILE__,
             __LINE__, __func__);
   uv_udp_t *udp_server = collector_config->alloc(arena_collector, sizeof(uv_udp_t));
@@ -549,9 +984,10 @@ int8_t collector_start(collector_t *collector) {
 
   LOG_DEBUG(
       "%s %d %s struct sockaddr *addr = (struct sockaddr *) collector_config->alloc(arena_collector, sizeof(struct "
-      "sockaddr));\n",
+      "sockaddr_storage));\n",
       __FILE__, __LINE__, __func__);
-  struct sockaddr *addr = (struct sockaddr *) collector_config->alloc(arena_collector, sizeof(struct sockaddr));
+  // Large enough for an IPv6 bind address.
+  struct sockaddr *addr = (struct sockaddr *) collector_config->alloc(arena_collector, sizeof(struct sockaddr_storage));
   if (addr == NULL) {
     LOG_ERROR("%s %d %s could not allocate sockaddr\n", __FILE__, __LINE__, __func__);
     goto error_destroy_arena;
@@ -584,26 +1020,90 @@ int8_t collector_start(collector_t *collector) {
   }
 
   const int port = (int) strtoul(port_bind_str, NULL, 10);
+  // An IPv6 address such as "::" binds dual-stack: IPv4 exporters arrive IPv4-mapped.
   int addr_ret = uv_ip4_addr(ip_bind, port, (struct sockaddr_in *) addr);
+  if (addr_ret < 0) {
+    addr_ret = uv_ip6_addr(ip_bind, port, (struct sockaddr_in6 *) addr);
+  }
   if (addr_ret < 0) {
     LOG_ERROR("Invalid bind IP address %s: %s\n", ip_bind, uv_strerror(addr_ret));
     fprintf(stderr, "Invalid bind IP address %s: %s\n", ip_bind, uv_strerror(addr_ret));
     goto error_destroy_arena;
   }
   LOG_INFO("binding to udp port %d\n", port);
-  const int bind_ret = uv_udp_bind(udp_server, addr_const, UV_UDP_REUSEADDR);
+  const char *tcp_port_str = getenv("CNETFLOW_TCP_PORT");
+  if (tcp_port_str && *tcp_port_str) {
+    long tcp_port = strtol(tcp_port_str, NULL, 10);
+    if (tcp_port < 1 || tcp_port > 65535) {
+      LOG_ERROR("CNETFLOW_TCP_PORT must be between 1 and 65535, IPFIX over TCP disabled\n");
+    } else {
+      struct sockaddr_storage tcp_addr;
+      memcpy(&tcp_addr, addr, sizeof(tcp_addr));
+      // Same address as the UDP socket, other port.
+      if (addr->sa_family == AF_INET6) {
+        ((struct sockaddr_in6 *) &tcp_addr)->sin6_port = htons((uint16_t) tcp_port);
+      } else {
+        ((struct sockaddr_in *) &tcp_addr)->sin_port = htons((uint16_t) tcp_port);
+      }
+      int tcp_ret = ingest_tcp_start(loop_udp, (const struct sockaddr *) &tcp_addr);
+      if (tcp_ret != 0) {
+        LOG_ERROR("IPFIX over TCP failed to start on port %ld: %s\n", tcp_port, uv_strerror(tcp_ret));
+        fprintf(stderr, "IPFIX over TCP failed to start on port %ld: %s\n", tcp_port, uv_strerror(tcp_ret));
+        goto error_destroy_arena;
+      }
+      LOG_INFO("listening for IPFIX on tcp port %ld\n", tcp_port);
+    }
+  }
+  if (g_ingest_config.mode != ingest_mode_libuv) {
+    affinity_mem_begin(affinity_role_recv);
+    int ingest_ret = ingest_start(loop_udp, addr_const, &g_ingest_config);
+    affinity_mem_end();
+    if (ingest_ret == 0) {
+      goto run_loop;
+    }
+    if (ingest_ret != UV_ENOSYS) {
+      LOG_ERROR("%s receive mode failed to start: %s\n", ingest_mode_name(g_ingest_config.mode), uv_strerror(ingest_ret));
+      fprintf(stderr, "%s receive mode failed to start: %s\n", ingest_mode_name(g_ingest_config.mode), uv_strerror(ingest_ret));
+      goto error_destroy_arena;
+    }
+    LOG_ERROR("%s receive mode is not supported on this platform, falling back to libuv\n",
+              ingest_mode_name(g_ingest_config.mode));
+    g_ingest_config.mode = ingest_mode_libuv;
+  }
+  const int inherited_fd = handover_take_socket(SOCK_DGRAM, addr_const, 0);
+  const int bind_ret = inherited_fd >= 0 ? uv_udp_open(udp_server, inherited_fd)
+                                         : uv_udp_bind(udp_server, addr_const, UV_UDP_REUSEADDR);
   if (bind_ret < 0) {
     LOG_ERROR("bind failed: %s\n", uv_strerror(bind_ret));
     fprintf(stderr, "bind failed: %s\n", uv_strerror(bind_ret));
     goto error_destroy_arena;
   }
 
+#ifndef _WIN32
+  uv_os_fd_t udp_fd;
+  if (uv_fileno((uv_handle_t *) udp_server, &udp_fd) == 0) {
+    handover_offer_socket(udp_fd);
+    ingest_rcvbuf_init(&libuv_rcvbuf, udp_fd, &g_ingest_config);
+    uv_timer_init(loop_udp, &rcvbuf_timer);
+    uv_timer_start(&rcvbuf_timer, rcvbuf_timer_cb, 1000, 1000);
+    rcvbuf_timer_started = 1;
+  }
+#endif
+
   const int listen = uv_udp_recv_start(udp_server, (uv_alloc_cb) alloc_cb, udp_handle);
   if (listen < 0) {
     LOG_ERROR("listen failed: %s\n", uv_strerror(listen));
     goto error_destroy_arena;
   }
 
+run_loop:
+  handover_release_unused();
+  if (handover_path && *handover_path) {
+    int handover_ret = handover_listen(loop_udp, handover_path, collector_handover_requested);
+    if (handover_ret != 0) {
+      LOG_ERROR("handover: could not listen on %s: %s\n", handover_path, uv_strerror(handover_ret));
+    }
+  }
   uv_run(loop_udp, UV_RUN_DEFAULT);
 
   // Wait for all pending work requests to finish before cleanup
@@ -623,15 +1123,35 @@ ok:
   close_redis();
 #endif
 
+  ingest_stop();
+  ingest_join();
+  collector_close_dispatch_loop();
+  handover_close();
+  if (handover_timer_started) {
+    uv_close((uv_handle_t *) &handover_timer, NULL);
+    handover_timer_started = 0;
+  }
   if (udp_server_global && !uv_is_closing((uv_handle_t *) udp_server_global)) {
     uv_close((uv_handle_t *) udp_server_global, NULL);
   }
   uv_close((uv_handle_t *) &timer_req_rss, NULL);
   uv_close((uv_handle_t *) &timer_backlog, NULL);
+  if (rcvbuf_timer_started) {
+    uv_close((uv_handle_t *) &rcvbuf_timer, NULL);
+    rcvbuf_timer_started = 0;
+  }
+  if (scale_timer_started) {
+    uv_close((uv_handle_t *) &scale_timer, NULL);
+    scale_timer_started = 0;
+  }
   uv_run(loop_udp, UV_RUN_ONCE);
   uv_run(loop_timer_rss, UV_RUN_ONCE);
+  pipeline_stop();
+  shard_destroy();
 
 #ifdef USE_CLICKHOUSE
+  // Flows short of a full batch would otherwise be lost with the process.
+  ch_flush_flows();
   ch_db_cleanup_all();
 #endif
 
@@ -639,8 +1159,11 @@ ok:
   free(arena_hashmap_ipfix);
   arena_destroy(arena_hashmap_nf9);
   free(arena_hashmap_nf9);
-  arena_destroy(arena_udp_handle);
-  free(arena_udp_handle);
+  pkt_slab_destroy();
+  ingest_allowlist_destroy(g_exporter_allowlist);
+  g_exporter_allowlist = NULL;
+  ingest_weights_destroy(g_exporter_weights);
+  g_exporter_weights = NULL;
   arena_destroy(arena_collector);
   free(arena_collector);
 
@@ -656,19 +1179,97 @@ ok:
   return 0;
 
 error_destroy_arena:
+  collector_close_dispatch_loop();
+  pipeline_stop();
+  shard_destroy();
   arena_destroy(arena_hashmap_ipfix);
   free(arena_hashmap_ipfix);
   arena_destroy(arena_hashmap_nf9);
   free(arena_hashmap_nf9);
-  arena_destroy(arena_udp_handle);
-  free(arena_udp_handle);
+  pkt_slab_destroy();
+  ingest_allowlist_destroy(g_exporter_allowlist);
+  g_exporter_allowlist = NULL;
+  ingest_weights_destroy(g_exporter_weights);
+  g_exporter_weights = NULL;
   arena_destroy(arena_collector);
   free(arena_collector);
 error_no_arena:
+  affinity_mem_end();
   LOG_ERROR("%s %d %s: exit collector_thread\n", __FILE__, __LINE__, __func__);
   return -1;
 }
 
+/**
+ * Returns a datagram and its context: the buffer goes back to the receive
+ * path's release hook when one was given, and the context to the slab.
+ */
+static void collector_release(pkt_ctx_t *ctx, collector_release_cb release, void *release_ctx, void *data) {
+  if (release != NULL && data != NULL) {
+    release(release_ctx, data);
+  }
+  pkt_slab_free(ctx);
+}
+
+/**
+ * Hands a prepared context to the parsers: the pipeline rings when this
+ * thread has a producer, the libuv threadpool otherwise.
+ */
+static int collector_submit(pkt_ctx_t *ctx) {
+  int rc;
+  if (dispatch_producer != NULL) {
+    rc = pipeline_submit(dispatch_producer, ctx, ctx->args.exporter);
+  } else {
+    rc = uv_queue_work(dispatch_loop ? dispatch_loop : loop_pool, &ctx->work, ctx->work.work_cb,
+                       ctx->work.after_work_cb);
+  }
+  if (rc == 0) {
+    dispatch_inflight++;
+    __sync_fetch_and_add(&total_received_msgs, 1);
+  }
+  return rc;
+}
+
+/**
+ * Drops a context that was counted in active_requests but never completed.
+ */
+static void collector_shed(pkt_ctx_t *ctx, metrics_drop_reason_t reason) {
+  metrics_inc_overload_drop(ctx->args.exporter, reason);
+  active_requests--;
+  collector_release(ctx, ctx->args.release, ctx->args.release_ctx, ctx->args.data);
+}
+
+/**
+ * Moves queued datagrams to the parsers while the window has room, in the
+ * queue's weighted round-robin order across exporters.
+ */
+static void collector_flush_queue(void) {
+  if (dispatch_queue == NULL) {
+    return;
+  }
+  while (dispatch_inflight < parse_window) {
+    pkt_ctx_t *ctx = ingest_queue_pop(dispatch_queue);
+    if (ctx == NULL) {
+      break;
+    }
+    int rc = collector_submit(ctx);
+    if (rc == UV_ENOBUFS) {
+      // That parser's ring is full; retry on the next completion.
+      ingest_queue_unpop(dispatch_queue, ctx);
+      break;
+    }
+    if (rc != 0) {
+      LOG_ERROR("uv_queue_work failed: %s\n", uv_strerror(rc));
+      active_requests--;
+      collector_release(ctx, ctx->args.release, ctx->args.release_ctx, ctx->args.data);
+    }
+  }
+  ingest_queue_report(dispatch_queue, dispatch_queue->count == 0);
+  if (dispatch_closing && dispatch_queue->count == 0) {
+    ingest_queue_destroy(dispatch_queue);
+    dispatch_queue = NULL;
+  }
+}
+
 void after_work_cb(uv_work_t *req, int status) {
   (void) status;
   if (req == NULL) {
@@ -676,33 +1277,18 @@ void after_work_cb(uv_work_t *req, int status) {
     return;
   }
 
-  parse_args_t *func_args = (parse_args_t *) req->data;
-  if (func_args == NULL) {
-    LOG_ERROR("%s %d %s: func_args is NULL\n", __FILE__, __LINE__, __func__);
-    // Still try to free req safely
-    (void) arena_free(arena_collector, req);
-    return;
-  }
-  // Capture everything needed before any free
-  uint64_t processed = func_args->processed_flows;
-  void *data_ptr = func_args->data;
+  pkt_ctx_t *ctx = pkt_ctx_from_work(req);
+  parse_args_t *func_args = &ctx->args;
+  __sync_fetch_and_add(&total_processed_flows, func_args->processed_flows);
+  __sync_fetch_and_add(&total_processed_msgs, 1);
 
-  // Break the back-reference from req to the (soon to be) freed args
-  req->data = NULL;
-
-  // Update counters first (does not depend on freed memory)
-  total_processed_flows += processed;
-  total_processed_msgs++;
-
-  // Now free buffers in the safest order
-  if (data_ptr != NULL) {
-    (void) arena_free(arena_udp_handle, data_ptr);
-  }
-  (void) arena_free(arena_collector, func_args);
-  (void) arena_free(arena_collector, req);
+  // Buffer, args and request are released together.
+  collector_release(ctx, func_args->release, func_args->release_ctx, func_args->data);
 
   // Decrement backlog after all work is done
   active_requests--;
+  dispatch_inflight--;
+  collector_flush_queue();
 }
 /**
  * Handles incoming UDP packets, parses the data, and processes it according
@@ -718,6 +1304,92 @@ void after_work_cb(uv_work_t *req, int status) {
 void udp_handle(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
   LOG_DEBUG("%s %d %s got udp packet! handle: %p flags: %d bytes: %ld\n", __FILE__, __LINE__, __func__, (void *) handle,
             flags, nread);
+  if (buf->base == NULL) {
+    if (nread < 1) {
+      return;
+    }
+    LOG_ERROR("%s %d %s: got buf->base == NULL\n", __FILE__, __LINE__, __func__);
+    EXIT_WITH_MSG(-1, "udp_handle: got buf->base == NULL\n");
+  }
+  if (handle != NULL) {
+    // Datagram larger than the context buffer.
+    if (flags & UV_UDP_PARTIAL) {
+      LOG_ERROR("%s %d %s truncated datagram dropped\n", __FILE__, __LINE__, __func__);
+      nread = 0;
+    }
+    // libuv flags are not collector flags.
+    flags = 0;
+  }
+  collector_dispatch(buf->base, nread, addr, flags, NULL, NULL);
+}
+
+static void collector_segment_release(void *ctx, void *data) {
+  (void) data;
+  pkt_ctx_t *buffer_ctx = (pkt_ctx_t *) ctx;
+  if (__sync_sub_and_fetch(&buffer_ctx->refs, 1) == 0) {
+    pkt_slab_free(buffer_ctx);
+  }
+}
+
+/**
+ * Handles a UDP_GRO receive: `nread` bytes coalesced by the kernel from
+ * datagrams of `segment_size` bytes each, the last one possibly shorter.
+ * Every segment is one NetFlow/IPFIX message and is dispatched on its own,
+ * parsed in place; the buffer's context goes back to the slab once the last
+ * segment has been released.
+ *
+ * @param buffer Buffer of a pkt_slab context.
+ * @param nread Payload length in bytes.
+ * @param segment_size The UDP_GRO cmsg value, or 0 if the receive was not coalesced.
+ * @param addr Source address of the exporter.
+ * @param flags Collector flags stored in parse_args_t.
+ */
+void udp_handle_segments(char *buffer, ssize_t nread, size_t segment_size, const struct sockaddr *addr,
+                         unsigned flags) {
+  pkt_ctx_t *buffer_ctx = pkt_ctx_from_data(buffer);
+  if (nread < 1) {
+    pkt_slab_free(buffer_ctx);
+    return;
+  }
+  if (segment_size == 0 || (size_t) nread < segment_size) {
+    segment_size = (size_t) nread;
+  }
+  size_t segments = ((size_t) nread + segment_size - 1) / segment_size;
+  // One reference per segment plus ours, so early releases cannot free the
+  // buffer while later segments are still being dispatched.
+  buffer_ctx->refs = (int) segments + 1;
+  if (segments > 1) {
+    metrics_inc_gro(segments);
+  }
+  for (size_t offset = 0; offset < (size_t) nread; offset += segment_size) {
+    size_t len = (size_t) nread - offset;
+    if (len > segment_size) {
+      len = segment_size;
+    }
+    collector_dispatch(buffer + offset, (ssize_t) len, addr, flags, collector_segment_release, buffer_ctx);
+  }
+  collector_segment_release(buffer_ctx, NULL);
+}
+
+/**
+ * Queues one datagram for parsing on the libuv threadpool.
+ *
+ * The datagram is parsed in place: `data` must stay valid until `release` is
+ * called, either from after_work_cb once the parser is done, or right away
+ * when the datagram is rejected.
+ *
+ * @param data Datagram payload. Ownership passes to the collector.
+ * @param nread Payload length in bytes; values below 1 are dropped.
+ * @param addr Source address of the exporter, or NULL if unknown.
+ * @param flags Collector flags stored in parse_args_t (pcap passes, etc).
+ * @param release Called with (`release_ctx`, `data`) to hand the buffer back.
+ *                NULL means `data` is the buffer of a pkt_slab context.
+ * @param release_ctx Opaque pointer passed to `release`.
+ */
+void collector_dispatch(char *data, ssize_t nread, const struct sockaddr *addr, unsigned flags,
+                        collector_release_cb release, void *release_ctx) {
+  // Datagrams from a receive ring only borrow a buffer-less context below.
+  pkt_ctx_t *ctx = release == NULL ? pkt_ctx_from_data(data) : NULL;
   if (nread > 65536 || nread < 1) {
     if (nread == 0) {
       LOG_DEBUG("%s %d %s nread == 0\n", __FILE__, __LINE__, __func__);
@@ -726,31 +1398,18 @@ void udp_handle(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const stru
     } else if (nread < 0) {
       LOG_DEBUG("%s %d %s nread < 0\n", __FILE__, __LINE__, __func__);
     }
-    LOG_INFO("%s %d %s relase: %p\n", __FILE__, __LINE__, __func__, buf->base);
-    arena_free(arena_udp_handle, buf->base);
-
-    return;
-    goto udp_handle_free_and_return;
-  }
-  if (buf->base == NULL) {
-    LOG_ERROR("%s %d %s: got buf->base == NULL\n", __FILE__, __LINE__, __func__);
-    EXIT_WITH_MSG(-1, "udp_handle: got buf->base == NULL\n");
+    LOG_INFO("%s %d %s relase: %p\n", __FILE__, __LINE__, __func__, data);
+    goto dispatch_release_and_return;
   }
 
   if (addr == NULL) {
-    LOG_DEBUG("%s %d %s got udp packet! handle: %p ip: NULL flags: %d\n", __FILE__, __LINE__, __func__, (void *) handle,
-              flags);
-    goto udp_handle_free_and_return;
+    LOG_DEBUG("%s %d %s got udp packet! ip: NULL flags: %d\n", __FILE__, __LINE__, __func__, flags);
+    goto dispatch_release_and_return;
   }
-  char address_str[INET6_ADDRSTRLEN + 8]; // Enough space for IPv6 + port
-  get_ip_str(addr, address_str, sizeof(address_str));
-  // printf("Address: %s\n", address_str);
-  LOG_DEBUG("%s %d %s got udp packet! handle: %p ip: %s flags: %d bytes: %ld\n", __FILE__, __LINE__, __func__,
-            (void *) handle, address_str, flags, nread);
 
   if (nread < 2) {
     LOG_DEBUG("%s %d %s packet too short for version detection: %ld bytes\n", __FILE__, __LINE__, __func__, nread);
-    goto udp_handle_free_and_return;
+    goto dispatch_release_and_return;
   }
 
 #ifdef ENABLE_METRICS
@@ -760,64 +1419,76 @@ void udp_handle(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const stru
   // Track total bytes received for rates
   metrics_inc_bytes(nread);
 
-  NETFLOW_VERSION nf_version = collector_config->detect_version(buf->base);
+  // Unknown sources and malformed headers are dropped here, before a context
+  // is borrowed or any work is queued.
+  if (g_exporter_allowlist != NULL && !ingest_allowlist_contains(g_exporter_allowlist, addr)) {
+    metrics_inc_exporter_denied();
+    goto dispatch_release_and_return;
+  }
+  ingest_invalid_t invalid = ingest_validate_header((const uint8_t *) data, (size_t) nread);
+  if (invalid != ingest_valid) {
+    LOG_DEBUG("%s %d %s invalid header (%s), %ld bytes\n", __FILE__, __LINE__, __func__, ingest_invalid_name(invalid),
+              nread);
+    metrics_inc_invalid_header();
+    goto dispatch_release_and_return;
+  }
+
+  char address_str[INET6_ADDRSTRLEN + 8]; // Enough space for IPv6 + port
+  get_ip_str(addr, address_str, sizeof(address_str));
+  // printf("Address: %s\n", address_str);
+  LOG_DEBUG("%s %d %s got udp packet! ip: %s flags: %d bytes: %ld\n", __FILE__, __LINE__, __func__, address_str,
+            flags, nread);
+
+  NETFLOW_VERSION nf_version = collector_config->detect_version(data);
   switch (nf_version) {
     case NETFLOW_V5:
     case NETFLOW_V9:
     case NETFLOW_IPFIX:
       break;
     default:
-      goto udp_handle_free_and_return;
+      goto dispatch_release_and_return;
   }
 
-  parse_args_t *func_args = NULL;
-  LOG_ERROR("%s %d %s func_args = collector_config->alloc(arena_collector, sizeof(parse_args_t));\n", __FILE__,
-            __LINE__, __func__);
-
-  func_args = collector_config->alloc(arena_collector, sizeof(parse_args_t));
-  if (func_args == NULL) {
-    LOG_ERROR("%s %d %s: Failed to allocate func_args\n", __FILE__, __LINE__, __func__);
-    goto udp_handle_free_and_return;
+  if (ctx == NULL) {
+    ctx = pkt_slab_alloc(0);
+    if (ctx == NULL) {
+      metrics_inc_pkt_slab_drop();
+      goto dispatch_release_and_return;
+    }
   }
-  // func_args = malloc(sizeof(parse_args_t));
+  parse_args_t *func_args = &ctx->args;
+  uv_work_t *work_req = &ctx->work;
   func_args->exporter = 0;
   func_args->len = 0;
   func_args->data = NULL;
   func_args->status = collector_data_status_init;
+  func_args->processed_flows = 0;
+  func_args->sampling_rate = 1;
   func_args->frame_number = global_pcap_frame_number;
+  func_args->release = release;
+  func_args->release_ctx = release_ctx;
 
-  LOG_ERROR("%s %d %s work_req = collector_config->alloc(arena_collector, sizeof(uv_work_t));\n", __FILE__, __LINE__,
-            __func__);
-  uv_work_t *work_req = collector_config->alloc(arena_collector, sizeof(uv_work_t));
-  if (work_req == NULL) {
-    LOG_ERROR("%s %d %s: Failed to allocate work_req\n", __FILE__, __LINE__, __func__);
-    arena_free(arena_collector, func_args);
-    goto udp_handle_free_and_return;
-  }
-  // work_req = malloc(sizeof(uv_work_t));
   uv_work_cb work_cb;
   static size_t data_counter = 1;
-  if (addr->sa_family == AF_INET) {
-    struct sockaddr_in *addr4 = (struct sockaddr_in *) addr;
-    func_args->exporter = addr4->sin_addr.s_addr;
-  } else if (addr->sa_family == AF_INET6) {
-    // For IPv6, we'll use the first 32 bits of the address as a simple identifier for now,
-    // or we might need to expand func_args to support IPv6 exporter addresses properly.
-    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) addr;
-    memcpy(&func_args->exporter, &addr6->sin6_addr, sizeof(uint32_t));
+  // IPv4 exporters reaching a dual-stack socket show up IPv4-mapped and get
+  // the same identity as over an IPv4 socket.
+  if (exporter_addr_from_sockaddr(addr, func_args->exporter_addr) == 0) {
+    func_args->exporter = exporter_addr_fold(func_args->exporter_addr);
   } else {
+    memset(func_args->exporter_addr, 0, sizeof(func_args->exporter_addr));
     func_args->exporter = 0;
   }
 
-  func_args->data = buf->base;
+  func_args->data = data;
   func_args->len = nread;
   func_args->status = collector_data_status_init;
-  func_args->index = data_counter;
-  func_args->now = (uint32_t) time(NULL);
+  func_args->index = __sync_fetch_and_add(&data_counter, 1);
+  func_args->recv_ms = dispatch_recv_ms ? dispatch_recv_ms : collector_clock_ms();
+  func_args->now = (uint32_t) (func_args->recv_ms / 1000);
   func_args->flags = flags;
   work_req->data = (parse_args_t *) func_args;
   LOG_ERROR("%s %d %s [%d] work_req addr: %p   work_req->data addr: %p\n", __FILE__, __LINE__, __func__, (int)data_counter,
-            work_req, buf->base);
+            work_req, data);
   switch (nf_version) {
     case NETFLOW_V5:
       work_cb = (void *) collector_config->parse_v5;
@@ -840,23 +1511,45 @@ void udp_handle(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const stru
   if (work_cb) {
 
     active_requests++;
-    int rc = uv_queue_work(loop_pool, work_req, work_cb, (uv_after_work_cb) after_work_cb);
-    if (rc != 0) {
-      LOG_ERROR("uv_queue_work failed: %s\n", uv_strerror(rc));
-      active_requests--;
-      arena_free(arena_udp_handle, func_args->data);
-      arena_free(arena_collector, func_args);
-      arena_free(arena_collector, work_req);
-    } else {
-      total_received_msgs++;
-      data_counter++;
+    work_req->work_cb = work_cb;
+    work_req->after_work_cb = (uv_after_work_cb) after_work_cb;
+    if ((dispatch_queue == NULL || dispatch_queue->count == 0) && dispatch_inflight < parse_window) {
+      int rc = collector_submit(ctx);
+      if (rc == 0) {
+        return;
+      }
+      if (rc != UV_ENOBUFS) {
+        LOG_ERROR("uv_queue_work failed: %s\n", uv_strerror(rc));
+        active_requests--;
+        collector_release(ctx, release, release_ctx, data);
+        return;
+      }
+      if (g_queue_limit == 0) {
+        metrics_inc_pipeline_drop();
+        active_requests--;
+        collector_release(ctx, release, release_ctx, data);
+        return;
+      }
+    }
+    // The parsers already have a full window from this thread.
+    if (dispatch_queue == NULL) {
+      dispatch_queue = ingest_queue_create(g_queue_limit, g_overload_policy);
+      if (dispatch_queue == NULL) {
+        collector_shed(ctx, metrics_drop_queue_full);
+        return;
+      }
+      ingest_queue_set_weights(dispatch_queue, g_exporter_weights);
+    }
+    metrics_drop_reason_t reason;
+    pkt_ctx_t *victim = ingest_queue_offer(dispatch_queue, ctx, &reason);
+    if (victim != NULL) {
+      collector_shed(victim, reason);
     }
+    ingest_queue_report(dispatch_queue, 0);
     return;
   }
   // after_work_cb will release all mmemory chunks
 
-// memset((void *) buf->base, 0, nread);
-// memset((void *) buf, 0, sizeof(uv_buf_t));
-udp_handle_free_and_return:
-  arena_free(arena_udp_handle, buf->base);
+dispatch_release_and_return:
+  collector_release(ctx, release, release_ctx, data);
 }
@@ -13,17 +13,35 @@ typedef enum {
   collector_data_status_done = 2,
 } collector_data_status;
 
+/**
+ * Hands a datagram buffer back to the receive path that provided it.
+ * Called exactly once per dispatched datagram.
+ */
+typedef void (*collector_release_cb)(void *ctx, void *data);
+
 typedef struct {
   size_t len;
   // uv_mutex_t *mutex;
+  // IPv4 address of the exporter in network order, or its IPv6 address folded
+  // to 32 bits: what the queues, metrics and database rows know it by.
   uint32_t exporter;
+  // Full exporter address, IPv4 as IPv4-mapped; with the v9 source id or IPFIX
+  // observation domain it identifies the exporter's templates.
+  uint8_t exporter_addr[16];
   collector_data_status status;
   size_t index;
   void *data;
   uint64_t processed_flows;
+  // Receive time of the datagram, milliseconds since the epoch.
+  uint64_t recv_ms;
+  // recv_ms in seconds, the reference the parsers rebase flow times on.
   uint32_t now;
   uint32_t flags;
   uint32_t frame_number;
+  // 1-in-N rate the ingest queue sampled this datagram's exporter at, 1 if not sampled.
+  uint32_t sampling_rate;
+  collector_release_cb release;
+  void *release_ctx;
 } parse_args_t;
 
 typedef struct {
@@ -43,7 +61,20 @@ int8_t collector_setup(collector_t *);
 int8_t collector_start(collector_t *);
 char *get_ip_str(const struct sockaddr *sa, char *s, size_t maxlen);
 void collector_inc_received_flows(uint64_t count);
+void collector_set_dispatch_loop(uv_loop_t *loop);
+void collector_close_dispatch_loop(void);
+uint64_t collector_clock_ms(void);
+void collector_set_receive_time(uint64_t recv_ms);
+void collector_dispatch(char *data, ssize_t nread, const struct sockaddr *addr, unsigned flags,
+                        collector_release_cb release, void *release_ctx);
+#ifndef _WIN32
+struct sockaddr_in;
+int collector_udp_payload(const uint8_t *frame, size_t caplen, int linktype, const uint8_t **payload,
+                          struct sockaddr_in *src);
+#endif
 void udp_handle(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
+void udp_handle_segments(char *buffer, ssize_t nread, size_t segment_size, const struct sockaddr *addr,
+                         unsigned flags);
 void print_rss_max_usage(void);
 void after_work_cb(uv_work_t *req, int status);
 int parse_pcap_file(collector_t *collector, const char *filename);
@@ -4,6 +4,7 @@
 #ifndef DB_H
 #define DB_H
 
+#include "flow_batch.h"
 #include "netflow.h"
 #include "log.h"
 
@@ -13,7 +14,7 @@ typedef struct ch_conn_t* db_conn_t;
 // Backend declarations (from db_clickhouse.h)
 void ch_db_connect(db_conn_t *conn);
 void ch_disconnect(db_conn_t conn);
-int ch_insert_flows(uint32_t exporter, netflow_v9_uint128_flowset_t *flows);
+int ch_insert_flows(flow_batch_t *flows);
 int ch_insert_dump(uint32_t exporter, char *template_key, const uint8_t *dump, const size_t dump_size);
 int ch_insert_template(uint32_t exporter, char *template_key, const uint8_t *dump, const size_t dump_size);
 int ch_create_flows_table(db_conn_t conn);
@@ -22,7 +23,7 @@ char *ch_ip_uint128_to_string(uint128_t value, uint8_t ip_version);
 // Function aliases for unified API
 #define db_connect(conn) ch_db_connect(conn)
 #define db_disconnect(conn) do { if(*(conn)) ch_disconnect(*(conn)); *(conn) = NULL; } while(0)
-#define insert_flows(exporter, flows) ch_insert_flows(exporter, flows)
+#define insert_flows(flows) ch_insert_flows(flows)
 #define insert_dump(exporter, template_key, dump, dump_size) ch_insert_dump(exporter, template_key, dump, dump_size)
 #define insert_template(exporter, template_key, dump, dump_size) ch_insert_template(exporter, template_key, dump, dump_size)
 #define db_create_flows_table(conn) ch_create_flows_table(*(conn))
@@ -46,8 +47,8 @@ static inline void db_init_connection(db_conn_t *conn) {
 /**
  * Insert NetFlow records into the database
  */
-static inline int db_insert_flows(uint32_t exporter, netflow_v9_uint128_flowset_t *flows) {
-    return ch_insert_flows(exporter, flows);
+static inline int db_insert_flows(flow_batch_t *flows) {
+    return ch_insert_flows(flows);
 }
 
 /**
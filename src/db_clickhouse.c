@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <uv.h>
 #include "arena.h"
+#include "exporter.h"
+#include "flow_batch.h"
 #include "log.h"
 #include "netflow.h"
 
@@ -65,6 +67,22 @@ static char ***ch_queries_ptrs = NULL;
 static int ch_queries_count = 0;
 static int ch_queries_capacity = 0;
 
+// One parser thread's flows waiting to be sent, gathered by ch_insert_flows()
+// and sent once they are many or old enough, or by ch_flush_flows() on
+// shutdown. The INSERT text is only built when the batch is sent.
+typedef struct ch_flow_batch_s {
+  uv_mutex_t mutex;
+  flow_batch_t flows;
+  char *query;
+  int offset;
+  int query_size;
+  uint32_t last;
+  struct ch_flow_batch_s *next;
+} ch_flow_batch_t;
+
+// Every thread's batch, guarded by cleanup_mutex.
+static ch_flow_batch_t *ch_batches = NULL;
+
 void register_ch_cleanup(ch_conn_t **conn_ptr, char **query_ptr) {
   uv_once(&cleanup_mutex_once, init_cleanup_mutex);
   uv_mutex_lock(&cleanup_mutex);
@@ -120,6 +138,14 @@ void ch_db_cleanup_all(void) {
   ch_queries_ptrs = NULL;
   ch_queries_count = 0;
   ch_queries_capacity = 0;
+  // Batch queries were freed above through their registered pointers.
+  while (ch_batches != NULL) {
+    ch_flow_batch_t *batch = ch_batches;
+    ch_batches = batch->next;
+    uv_mutex_destroy(&batch->mutex);
+    flow_batch_free(&batch->flows);
+    free(batch);
+  }
   uv_mutex_unlock(&cleanup_mutex);
 }
 
@@ -367,6 +393,7 @@ int ch_create_flows_table(ch_conn_t *conn) {
                                    "    src_mask UInt8,"
                                    "    dst_mask UInt8,"
                                    "    ip_version UInt8,"
+                                   "    sampling_rate UInt32 DEFAULT 1,"
                                    "    flow_hash String DEFAULT ''"
                                    ") ENGINE = MergeTree()"
                                    " PARTITION BY toYYYYMMDD(first)"
@@ -531,138 +558,186 @@ WEAK int ch_insert_dump(uint32_t exporter, char *template_key, const uint8_t *du
 extern int g_max_flows;
 extern int g_max_diff;
 
-WEAK int ch_insert_flows(uint32_t exporter, netflow_v9_uint128_flowset_t *flows) {
-  static THREAD_LOCAL ch_conn_t *conn = NULL;
-  static THREAD_LOCAL char *query = NULL;
-  static THREAD_LOCAL int offset = 0;
-  static THREAD_LOCAL int query_size = 0;
-  static THREAD_LOCAL size_t inserted = 0;
-  static THREAD_LOCAL uint32_t last = 0;
-  static THREAD_LOCAL char exporter_str[INET_ADDRSTRLEN] = {0};
-  static THREAD_LOCAL uint32_t last_exporter = 0;
-
-  if (unlikely(last == 0)) {
-    last = (uint32_t) time(NULL);
+/**
+ * Writes the batch's flows as one TSV INSERT into batch->query.
+ * @return 0 on success, -1 if the query buffer could not grow
+ */
+static int ch_encode_batch(ch_flow_batch_t *batch) {
+  const flow_batch_t *flows = &batch->flows;
+  if (unlikely(batch->query_size == 0)) {
+    batch->query_size = 1024 * 1024; // Start with 1MB for TSV
   }
-  uint32_t now = (uint32_t) time(NULL);
-
-  ch_db_connect(&conn);
-  if (unlikely(!conn || !conn->connected)) {
-    CH_LOG_ERROR("%s %d %s: Failed to connect\n", __FILE__, __LINE__, __func__);
-    return -1;
+  if (unlikely(batch->query == NULL)) {
+    batch->query = calloc(batch->query_size, 1);
   }
-
-  if (unlikely(!flows || flows->header.count == 0)) {
-    return 0;
-  }
-
-  // Cache exporter IP string
-  if (unlikely(exporter != last_exporter || exporter_str[0] == '\0')) {
-    struct in_addr addr;
-    addr.s_addr = htonl(exporter);
-    if (inet_ntop(AF_INET, &addr, exporter_str, sizeof(exporter_str)) == NULL) {
-      snprintf(exporter_str, sizeof(exporter_str), "unknown");
-    }
-    last_exporter = exporter;
-  }
-
-  // Build bulk insert query for better performance
-  if (unlikely(query_size == 0)) {
-    query_size = 1024 * 1024; // Start with 1MB for TSV
-  }
-  if (unlikely(query == NULL)) {
-    query = calloc(query_size, 1);
-    static THREAD_LOCAL bool query_registered = false;
-    if (!query_registered) {
-      register_ch_cleanup(NULL, &query);
-      query_registered = true;
-    }
-  }
-  if (unlikely(!query)) {
+  if (unlikely(!batch->query)) {
     CH_LOG_ERROR("%s %d %s: Failed to allocate query buffer\n", __FILE__, __LINE__, __func__);
     return -1;
   }
 
-  if (offset == 0) {
-    offset = snprintf(query, query_size,
-                      "INSERT INTO flows (exporter,srcaddr,dstaddr,srcport,dstport,"
-                      "protocol,input,output,dpkts,doctets,first,last,"
-                      "tcp_flags,tos,src_as,dst_as,src_mask,dst_mask,ip_version) FORMAT TabSeparated\n");
-  }
-
-  for (int i = 0; i < flows->header.count; i++) {
-    if (flows->records[i].dOctets == 0 || flows->records[i].dPkts == 0 ||
-        flows->records[i].First > flows->records[i].Last || flows->records[i].First == 0 ||
-        flows->records[i].Last == 0 ||
-        (flows->records[i].prot == 6 && flows->records[i].srcport == 0 && flows->records[i].dstport == 0) ||
-        (flows->records[i].prot == 17 && flows->records[i].srcport == 0 && flows->records[i].dstport == 0)
-    ) {
-      continue;
-    }
-
-    uint32_t dur = flows->records[i].Last - flows->records[i].First;
-    if (dur > 0 && (flows->records[i].dOctets / dur > _MAX_OCTETS_TO_CONSIDER_WRONG ||
-                    flows->records[i].dPkts / dur > _MAX_PACKETS_TO_CONSIDER_WRONG)) {
-      continue;
-    }
-    if (dur == 0 && (flows->records[i].dOctets > _MAX_OCTETS_TO_CONSIDER_WRONG ||
-                     flows->records[i].dPkts > _MAX_PACKETS_TO_CONSIDER_WRONG)) {
-      continue;
-    }
-
-    if (unlikely(flows->records[i].srcaddr < 16777216 || flows->records[i].dstaddr < 16777216)) {
-      continue;
+  batch->offset = snprintf(batch->query, batch->query_size,
+                           "INSERT INTO flows (exporter,srcaddr,dstaddr,srcport,dstport,"
+                           "protocol,input,output,dpkts,doctets,first,last,"
+                           "tcp_flags,tos,src_as,dst_as,src_mask,dst_mask,ip_version,sampling_rate) FORMAT TabSeparated\n");
+
+  // Rows come in runs from one exporter, so its string is only rebuilt when it changes.
+  char exporter_str[INET6_ADDRSTRLEN] = {0};
+  uint32_t last_exporter = 0;
+  uint32_t v6 = 0;
+  for (uint32_t i = 0; i < flows->count; i++) {
+    if (unlikely(flows->exporter[i] != last_exporter || exporter_str[0] == '\0')) {
+      uint8_t addr[16];
+      uint32_t domain;
+      if (exporter_lookup(flows->exporter[i], addr, &domain) == 0) {
+        exporter_addr_to_string(addr, exporter_str, sizeof(exporter_str));
+      } else {
+        snprintf(exporter_str, sizeof(exporter_str), "unknown");
+      }
+      last_exporter = flows->exporter[i];
     }
-
-    char *srcaddr = ch_ip_uint128_to_string(flows->records[i].srcaddr, flows->records[i].ip_version);
+    uint128_t src;
+    uint128_t dst;
+    flow_batch_addrs(flows, i, &v6, &src, &dst);
+    char *srcaddr = ch_ip_uint128_to_string(src, flows->ip_version[i]);
     // Note: ch_ip_uint128_to_string uses a ring of 4 buffers, so we can call it again for dstaddr safely
-    char *dstaddr = ch_ip_uint128_to_string(flows->records[i].dstaddr, flows->records[i].ip_version);
+    char *dstaddr = ch_ip_uint128_to_string(dst, flows->ip_version[i]);
 
     char value_str[1024];
     int written =
         snprintf(value_str, sizeof(value_str),
-                 "%s\t%s\t%s\t%u\t%u\t%u\t%u\t%u\t%llu\t%llu\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\n",
-                 exporter_str, srcaddr, dstaddr, flows->records[i].srcport,
-                 flows->records[i].dstport, flows->records[i].prot, flows->records[i].input, flows->records[i].output,
-                 (unsigned long long) flows->records[i].dPkts, (unsigned long long) flows->records[i].dOctets,
-                 flows->records[i].First, flows->records[i].Last,
-                 flows->records[i].tcp_flags, flows->records[i].tos, flows->records[i].src_as, flows->records[i].dst_as,
-                 flows->records[i].src_mask, flows->records[i].dst_mask, flows->records[i].ip_version);
-
-    if (unlikely(offset + written + 1 >= query_size)) {
-      size_t new_query_size = query_size * 2;
-      char *new_query = realloc(query, new_query_size);
+                 "%s\t%s\t%s\t%u\t%u\t%u\t%u\t%u\t%llu\t%llu\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\n",
+                 exporter_str, srcaddr, dstaddr, flows->srcport[i], flows->dstport[i], flows->prot[i],
+                 flows->input[i], flows->output[i], (unsigned long long) flows->dPkts[i],
+                 (unsigned long long) flows->dOctets[i], flows->First[i], flows->Last[i], flows->tcp_flags[i],
+                 flows->tos[i], flows->src_as[i], flows->dst_as[i], flows->src_mask[i], flows->dst_mask[i],
+                 flows->ip_version[i], flows->sampling_rate[i]);
+
+    if (unlikely(batch->offset + written + 1 >= batch->query_size)) {
+      size_t new_query_size = batch->query_size * 2;
+      char *new_query = realloc(batch->query, new_query_size);
       if (!new_query) {
         CH_LOG_ERROR("%s %d %s: Failed to reallocate query buffer\n", __FILE__, __LINE__, __func__);
         return -1;
       }
-      query = new_query;
-      query_size = (int) new_query_size;
+      batch->query = new_query;
+      batch->query_size = (int) new_query_size;
     }
 
-    memcpy(query + offset, value_str, written);
-    offset += written;
-    inserted++;
+    memcpy(batch->query + batch->offset, value_str, written);
+    batch->offset += written;
   }
+  return 0;
+}
 
-  if (inserted > 0 && (inserted >= (size_t) g_max_flows || (now - last) > (uint32_t) g_max_diff)) {
-    last = now;
-    int result = ch_execute(conn, query, (size_t) offset);
+/**
+ * Sends the batch's flows and starts a new batch. Called with batch->mutex held.
+ */
+static void ch_send_batch(ch_conn_t *conn, ch_flow_batch_t *batch) {
+  int result = ch_encode_batch(batch);
+  if (likely(result == 0)) {
+    result = ch_execute(conn, batch->query, (size_t) batch->offset);
+  }
 
-    if (unlikely(result < 0)) {
-      CH_LOG_ERROR("%s %d %s: Failed to insert %zu flows\n", __FILE__, __LINE__, __func__, inserted);
-    } else {
-      CH_LOG_INFO("%s %d %s: Successfully inserted %zu flows\n", __FILE__, __LINE__, __func__, inserted);
-    }
+  if (unlikely(result < 0)) {
+    CH_LOG_ERROR("%s %d %s: Failed to insert %u flows\n", __FILE__, __LINE__, __func__, batch->flows.count);
+  } else {
+    CH_LOG_INFO("%s %d %s: Successfully inserted %u flows\n", __FILE__, __LINE__, __func__,
+                batch->flows.count);
+  }
+
+  flow_batch_truncate(&batch->flows, 0);
+  batch->offset = 0;
+  // We don't free the columns or query here, we keep them for reuse in next batch
+}
 
-    inserted = 0;
-    offset = 0;
-    // We don't free query here, we keep it for reuse in next batch
+/**
+ * Returns the calling thread's batch, registering it on first use.
+ */
+static ch_flow_batch_t *ch_thread_batch(void) {
+  static THREAD_LOCAL ch_flow_batch_t *batch = NULL;
+  if (likely(batch != NULL)) {
+    return batch;
   }
+  batch = calloc(1, sizeof(ch_flow_batch_t));
+  if (batch == NULL) {
+    return NULL;
+  }
+  uv_mutex_init(&batch->mutex);
+  register_ch_cleanup(NULL, &batch->query);
+  uv_mutex_lock(&cleanup_mutex);
+  batch->next = ch_batches;
+  ch_batches = batch;
+  uv_mutex_unlock(&cleanup_mutex);
+  return batch;
+}
+
+WEAK int ch_insert_flows(flow_batch_t *flows) {
+  static THREAD_LOCAL ch_conn_t *conn = NULL;
+
+  ch_flow_batch_t *batch = ch_thread_batch();
+  if (unlikely(batch == NULL)) {
+    CH_LOG_ERROR("%s %d %s: Failed to allocate batch\n", __FILE__, __LINE__, __func__);
+    return -1;
+  }
+
+  // The flush interval follows the receive time of the flows, so there is
+  // no clock read per datagram.
+  uint32_t now = flows && flows->received ? flows->received : (uint32_t) time(NULL);
+  if (unlikely(batch->last == 0)) {
+    batch->last = now;
+  }
+
+  ch_db_connect(&conn);
+  if (unlikely(!conn || !conn->connected)) {
+    CH_LOG_ERROR("%s %d %s: Failed to connect\n", __FILE__, __LINE__, __func__);
+    return -1;
+  }
+
+  if (unlikely(!flows || flows->count == 0)) {
+    return 0;
+  }
+
+  // Only ch_flush_flows() from the shutdown path ever contends for this.
+  uv_mutex_lock(&batch->mutex);
+  // The parsers' netflow_prepare_batch() pass has already dropped the flows not worth storing.
+  if (unlikely(flow_batch_append(&batch->flows, flows) != 0)) {
+    CH_LOG_ERROR("%s %d %s: Failed to grow batch\n", __FILE__, __LINE__, __func__);
+    uv_mutex_unlock(&batch->mutex);
+    return -1;
+  }
+
+  if (batch->flows.count >= (uint32_t) g_max_flows || (int32_t) (now - batch->last) > g_max_diff) {
+    batch->last = now;
+    ch_send_batch(conn, batch);
+  }
+  uv_mutex_unlock(&batch->mutex);
   return 0;
 }
 
+size_t ch_flush_flows(void) {
+  static THREAD_LOCAL ch_conn_t *conn = NULL;
+  size_t flushed = 0;
+
+  uv_once(&cleanup_mutex_once, init_cleanup_mutex);
+  uv_mutex_lock(&cleanup_mutex);
+  ch_flow_batch_t *batches = ch_batches;
+  uv_mutex_unlock(&cleanup_mutex);
+  // Batches are only ever prepended, so the list from here on is stable.
+  for (ch_flow_batch_t *batch = batches; batch != NULL; batch = batch->next) {
+    uv_mutex_lock(&batch->mutex);
+    if (batch->flows.count > 0) {
+      if (conn == NULL) {
+        ch_db_connect(&conn);
+      }
+      flushed += batch->flows.count;
+      ch_send_batch(conn, batch);
+    }
+    uv_mutex_unlock(&batch->mutex);
+  }
+  return flushed;
+}
+
 
-int ch_insert_flows2(uint32_t exporter, netflow_v9_uint128_flowset_t *flows) {
-  return ch_insert_flows(exporter, flows);
+int ch_insert_flows2(flow_batch_t *flows) {
+  return ch_insert_flows(flows);
 }
@@ -4,10 +4,8 @@
 
 #ifndef DB_CLICKHOUSE_H
 #define DB_CLICKHOUSE_H
-#define _MAX_OCTETS_TO_CONSIDER_WRONG 900000000
-                                    //482053188
-#define _MAX_PACKETS_TO_CONSIDER_WRONG 9000000
 #include <curl/curl.h>
+#include "flow_batch.h"
 #include "netflow.h"
 #include <stdint.h>
 #include <time.h>
@@ -68,12 +66,20 @@ int ch_execute(ch_conn_t *conn, const char *query, size_t query_len);
 int ch_create_flows_table(ch_conn_t *conn);
 
 /**
- * Inserts NetFlow records into ClickHouse using HTTP interface
- * @param exporter Exporter IP address
- * @param flows NetFlow v9 flowset to insert
+ * Queues a datagram's flows for ClickHouse using HTTP interface. They are
+ * copied into the calling thread's batch, which is sent once it holds
+ * g_max_flows rows or is older than g_max_diff seconds.
+ * @param flows Decoded flows, each row carrying its exporter
  * @return 0 on success, -1 on failure
  */
-int ch_insert_flows(uint32_t exporter, netflow_v9_uint128_flowset_t *flows);
+int ch_insert_flows(flow_batch_t *flows);
+
+/**
+ * Sends every thread's partially filled batch of flows, from any thread.
+ * Meant for shutdown, once the parsers are idle.
+ * @return Number of flows sent
+ */
+size_t ch_flush_flows(void);
 
 /**
  * Converts IP address to string representation
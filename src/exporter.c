@@ -0,0 +1,215 @@
+//
+// Exporter identity interning.
+//
+// Templates are only unique per exporter address and v9 source id or IPFIX
+// observation domain. Rather than hashing that 20-byte identity on every
+// template lookup, each datagram's identity is turned into a 32-bit id once,
+// and the template tables keep their 8-byte (id, template id) keys: a template
+// lookup is still one probe.
+//
+// Ids index an append-only array of identities. The open-addressing slot table
+// pointing into it is read without a lock: an id is published with a release
+// store after its identity is written, and never moved or removed. Inserts are
+// serialised by a mutex. Each thread also remembers the last identity it
+// interned, which is all a burst of datagrams from one exporter needs.
+//
+// Ids are never reused, since the template tables are keyed by them. The
+// insert path instead caps the domains of each address, counted in a second
+// table only the insert path touches, so a single source cannot use up the
+// ids with forged source ids or observation domains.
+//
+
+#include "exporter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#endif
+
+#define EXPORTER_SLOTS (EXPORTER_MAX_DOMAINS * 2)
+
+typedef struct {
+  uint8_t addr[16];
+  uint32_t domain;
+} exporter_identity_t;
+
+typedef struct {
+  uint8_t addr[16];
+  uint32_t domains;
+} exporter_address_t;
+
+// Index 0 is unused so that 0 can mean "no id".
+static exporter_identity_t identities[EXPORTER_MAX_DOMAINS + 1];
+static uint32_t slots[EXPORTER_SLOTS];
+static uint32_t count = 0;
+// Addresses of the interned identities; insert path only, like address_slots,
+// which holds an index into it plus one.
+static exporter_address_t addresses[EXPORTER_MAX_DOMAINS];
+static uint32_t address_slots[EXPORTER_SLOTS];
+static uint32_t address_count = 0;
+static uv_mutex_t insert_mutex;
+static uv_once_t insert_once = UV_ONCE_INIT;
+
+static THREAD_LOCAL exporter_identity_t last_identity;
+static THREAD_LOCAL uint32_t last_id = 0;
+
+static void insert_init(void) { uv_mutex_init(&insert_mutex); }
+
+int exporter_addr_is_v4(const uint8_t addr[16]) {
+  static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+  return memcmp(addr, prefix, sizeof(prefix)) == 0;
+}
+
+int exporter_addr_from_sockaddr(const struct sockaddr *addr, uint8_t out[16]) {
+  if (addr->sa_family == AF_INET) {
+    memset(out, 0, 10);
+    out[10] = 0xff;
+    out[11] = 0xff;
+    memcpy(out + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    return 0;
+  }
+  if (addr->sa_family == AF_INET6) {
+    memcpy(out, &((const struct sockaddr_in6 *) addr)->sin6_addr, 16);
+    return 0;
+  }
+  return -1;
+}
+
+int exporter_addr_from_string(const char *str, uint8_t out[16]) {
+  struct sockaddr_in addr4;
+  struct sockaddr_in6 addr6;
+  if (uv_ip4_addr(str, 0, &addr4) == 0) {
+    return exporter_addr_from_sockaddr((const struct sockaddr *) &addr4, out);
+  }
+  if (uv_ip6_addr(str, 0, &addr6) == 0) {
+    return exporter_addr_from_sockaddr((const struct sockaddr *) &addr6, out);
+  }
+  return -1;
+}
+
+void exporter_addr_to_string(const uint8_t addr[16], char *out, size_t len) {
+  int err = exporter_addr_is_v4(addr) ? uv_inet_ntop(AF_INET, addr + 12, out, len)
+                                      : uv_inet_ntop(AF_INET6, addr, out, len);
+  if (err != 0 && len > 0) {
+    snprintf(out, len, "unknown");
+  }
+}
+
+uint32_t exporter_addr_fold(const uint8_t addr[16]) {
+  uint32_t words[4];
+  memcpy(words, addr, sizeof(words));
+  if (exporter_addr_is_v4(addr)) {
+    return words[3];
+  }
+  return words[0] ^ words[1] ^ words[2] ^ words[3];
+}
+
+static uint32_t exporter_hash(const uint8_t addr[16], uint32_t domain) {
+  uint32_t words[4];
+  memcpy(words, addr, sizeof(words));
+  uint32_t h = words[0] * 2654435761u;
+  h = (h ^ words[1]) * 2654435761u;
+  h = (h ^ words[2]) * 2654435761u;
+  h = (h ^ words[3]) * 2654435761u;
+  h = (h ^ domain) * 2654435761u;
+  return h ^ (h >> 16);
+}
+
+/**
+ * @return The id of the identity, 0 if absent. `*slot_out` is set to the slot
+ *         it is or would be stored in.
+ */
+static uint32_t exporter_find(const uint8_t addr[16], uint32_t domain, uint32_t *slot_out) {
+  uint32_t slot = exporter_hash(addr, domain) & (EXPORTER_SLOTS - 1);
+  for (;;) {
+    uint32_t id = __atomic_load_n(&slots[slot], __ATOMIC_ACQUIRE);
+    if (id == 0) {
+      break;
+    }
+    if (identities[id].domain == domain && memcmp(identities[id].addr, addr, 16) == 0) {
+      *slot_out = slot;
+      return id;
+    }
+    slot = (slot + 1) & (EXPORTER_SLOTS - 1);
+  }
+  *slot_out = slot;
+  return 0;
+}
+
+/**
+ * @return The entry of `addr` in the address table, added with no domains if
+ *         absent. Insert path only; there is always room for the address of
+ *         an identity that fits in the identity table.
+ */
+static exporter_address_t *exporter_address(const uint8_t addr[16]) {
+  uint32_t slot = exporter_hash(addr, 0) & (EXPORTER_SLOTS - 1);
+  while (address_slots[slot] != 0) {
+    exporter_address_t *address = &addresses[address_slots[slot] - 1];
+    if (memcmp(address->addr, addr, 16) == 0) {
+      return address;
+    }
+    slot = (slot + 1) & (EXPORTER_SLOTS - 1);
+  }
+  exporter_address_t *address = &addresses[address_count++];
+  memcpy(address->addr, addr, 16);
+  address->domains = 0;
+  address_slots[slot] = address_count;
+  return address;
+}
+
+uint32_t exporter_intern(const uint8_t addr[16], uint32_t domain) {
+  if (last_id != 0 && last_identity.domain == domain && memcmp(last_identity.addr, addr, 16) == 0) {
+    return last_id;
+  }
+  uint32_t slot;
+  uint32_t id = exporter_find(addr, domain, &slot);
+  if (id == 0) {
+    uv_once(&insert_once, insert_init);
+    uv_mutex_lock(&insert_mutex);
+    // Another thread may have inserted it since the lookup.
+    id = exporter_find(addr, domain, &slot);
+    int capped = 0;
+    if (id == 0 && count < EXPORTER_MAX_DOMAINS) {
+      exporter_address_t *address = exporter_address(addr);
+      if (address->domains < EXPORTER_MAX_DOMAINS_PER_ADDR) {
+        address->domains++;
+        id = count + 1;
+        memcpy(identities[id].addr, addr, 16);
+        identities[id].domain = domain;
+        __atomic_store_n(&count, id, __ATOMIC_RELEASE);
+        __atomic_store_n(&slots[slot], id, __ATOMIC_RELEASE);
+      } else {
+        capped = 1;
+      }
+    }
+    uv_mutex_unlock(&insert_mutex);
+    if (id == 0) {
+      if (capped) {
+        LOG_ERROR("%s %d %s exporter has %u domains already\n", __FILE__, __LINE__, __func__,
+                  EXPORTER_MAX_DOMAINS_PER_ADDR);
+      } else {
+        LOG_ERROR("%s %d %s exporter table full (%u identities)\n", __FILE__, __LINE__, __func__,
+                  EXPORTER_MAX_DOMAINS);
+      }
+      return 0;
+    }
+  }
+  memcpy(last_identity.addr, addr, 16);
+  last_identity.domain = domain;
+  last_id = id;
+  return id;
+}
+
+int exporter_lookup(uint32_t id, uint8_t addr[16], uint32_t *domain) {
+  if (id == 0 || id > __atomic_load_n(&count, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  memcpy(addr, identities[id].addr, 16);
+  *domain = identities[id].domain;
+  return 0;
+}
+
+uint32_t exporter_count(void) { return __atomic_load_n(&count, __ATOMIC_ACQUIRE); }
@@ -0,0 +1,81 @@
+//
+// Exporter identities: the full address of an exporter together with its v9
+// source id or IPFIX observation domain, interned into a compact id that keys
+// the template tables.
+//
+
+#ifndef CNETFLOW_EXPORTER_H
+#define CNETFLOW_EXPORTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// Distinct (address, domain) pairs the process can tell apart.
+#define EXPORTER_MAX_DOMAINS 65536
+// Domains one address may intern, so that datagrams from a single source with
+// made-up source ids or observation domains cannot fill the table.
+#define EXPORTER_MAX_DOMAINS_PER_ADDR 256
+
+/**
+ * Writes the 16-byte identity of `addr`: IPv6 as is, IPv4 (and IPv4 received
+ * on a dual-stack socket) as an IPv4-mapped address.
+ *
+ * @return 0 on success, -1 for another address family.
+ */
+int exporter_addr_from_sockaddr(const struct sockaddr *addr, uint8_t out[16]);
+
+/**
+ * Parses an IPv4 or IPv6 address into its 16-byte identity.
+ *
+ * @return 0 on success, -1 if `str` is neither.
+ */
+int exporter_addr_from_string(const char *str, uint8_t out[16]);
+
+/**
+ * @return 1 if `addr` is an IPv4-mapped IPv4 address, 0 otherwise.
+ */
+int exporter_addr_is_v4(const uint8_t addr[16]);
+
+/**
+ * Formats an identity address, IPv4-mapped ones in dotted form. `len` should
+ * be at least INET6_ADDRSTRLEN.
+ */
+void exporter_addr_to_string(const uint8_t addr[16], char *out, size_t len);
+
+/**
+ * @return The IPv4 address in network order if `addr` is IPv4-mapped,
+ *         otherwise the four 32-bit words of the IPv6 address folded together.
+ */
+uint32_t exporter_addr_fold(const uint8_t addr[16]);
+
+/**
+ * Interns an exporter address and its source id (v9) or observation domain
+ * (IPFIX). The same pair always yields the same id for the life of the
+ * process. Safe to call from any thread; a hit takes no lock.
+ *
+ * @return An id in 1..EXPORTER_MAX_DOMAINS, or 0 when the table is full or
+ *         `addr` already has EXPORTER_MAX_DOMAINS_PER_ADDR domains.
+ */
+uint32_t exporter_intern(const uint8_t addr[16], uint32_t domain);
+
+/**
+ * Reads back the address and domain an id was interned for.
+ *
+ * @return 0 on success, -1 for an unknown id.
+ */
+int exporter_lookup(uint32_t id, uint8_t addr[16], uint32_t *domain);
+
+/**
+ * @return The number of interned ids.
+ */
+uint32_t exporter_count(void);
+
+/**
+ * @return The key of template `template_id` of the exporter interned as `id`.
+ */
+static inline uint64_t exporter_template_key(uint32_t id, uint16_t template_id) {
+  return ((uint64_t) id << 32) | template_id;
+}
+
+#endif // CNETFLOW_EXPORTER_H
@@ -0,0 +1,233 @@
+//
+// Growable column-oriented batch of decoded flows.
+//
+// Every per-row column is listed once in flow_batch_columns, so growing,
+// appending and compacting walk the same table instead of naming each field.
+//
+
+#include "flow_batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  size_t offset;
+  size_t size;
+  // Carries rows, as opposed to working space.
+  int data;
+} flow_batch_column_t;
+
+#define FLOW_BATCH_COLUMN(name, data)                                                                                  \
+  { offsetof(flow_batch_t, name), sizeof(*((flow_batch_t *) 0)->name), data }
+
+static const flow_batch_column_t flow_batch_columns[] = {
+    FLOW_BATCH_COLUMN(exporter, 1),   FLOW_BATCH_COLUMN(sampling_rate, 1), FLOW_BATCH_COLUMN(srcaddr, 1),
+    FLOW_BATCH_COLUMN(dstaddr, 1),    FLOW_BATCH_COLUMN(nexthop, 1),       FLOW_BATCH_COLUMN(dPkts, 1),
+    FLOW_BATCH_COLUMN(dOctets, 1),    FLOW_BATCH_COLUMN(First, 1),         FLOW_BATCH_COLUMN(Last, 1),
+    FLOW_BATCH_COLUMN(src_as, 1),     FLOW_BATCH_COLUMN(dst_as, 1),        FLOW_BATCH_COLUMN(input, 1),
+    FLOW_BATCH_COLUMN(output, 1),     FLOW_BATCH_COLUMN(srcport, 1),       FLOW_BATCH_COLUMN(dstport, 1),
+    FLOW_BATCH_COLUMN(tcp_flags, 1),  FLOW_BATCH_COLUMN(prot, 1),          FLOW_BATCH_COLUMN(tos, 1),
+    FLOW_BATCH_COLUMN(src_mask, 1),   FLOW_BATCH_COLUMN(dst_mask, 1),      FLOW_BATCH_COLUMN(ip_version, 1),
+    FLOW_BATCH_COLUMN(scratch, 0),
+};
+
+#define FLOW_BATCH_COLUMN_COUNT (sizeof(flow_batch_columns) / sizeof(flow_batch_columns[0]))
+
+static inline void **flow_batch_column(flow_batch_t *batch, size_t column) {
+  return (void **) ((char *) batch + flow_batch_columns[column].offset);
+}
+
+static inline const void *flow_batch_column_const(const flow_batch_t *batch, size_t column) {
+  return *(void *const *) ((const char *) batch + flow_batch_columns[column].offset);
+}
+
+int flow_batch_reserve(flow_batch_t *batch, uint32_t rows) {
+  if (rows <= batch->capacity - batch->count) {
+    return 0;
+  }
+  if (rows > UINT32_MAX / 2 - batch->count) {
+    return -1;
+  }
+  uint32_t capacity = batch->capacity ? batch->capacity : FLOW_BATCH_INITIAL_ROWS;
+  while (capacity < batch->count + rows) {
+    capacity *= 2;
+  }
+  // A column that grew before a later one failed keeps its rows, so the batch
+  // stays usable at its old capacity.
+  for (size_t c = 0; c < FLOW_BATCH_COLUMN_COUNT; c++) {
+    void **column = flow_batch_column(batch, c);
+    void *grown = realloc(*column, (size_t) capacity * flow_batch_columns[c].size);
+    if (grown == NULL) {
+      LOG_ERROR("%s %d %s: Failed to grow flow batch to %u rows\n", __FILE__, __LINE__, __func__, capacity);
+      return -1;
+    }
+    *column = grown;
+  }
+  batch->capacity = capacity;
+  return 0;
+}
+
+static int flow_batch_reserve_v6(flow_batch_t *batch, uint32_t entries) {
+  if (entries <= batch->v6_capacity - batch->v6_count) {
+    return 0;
+  }
+  if (entries > UINT32_MAX / 2 - batch->v6_count) {
+    return -1;
+  }
+  uint32_t capacity = batch->v6_capacity ? batch->v6_capacity : 16;
+  while (capacity < batch->v6_count + entries) {
+    capacity *= 2;
+  }
+  uint32_t *rows = realloc(batch->v6_row, (size_t) capacity * sizeof(*rows));
+  if (rows != NULL) {
+    batch->v6_row = rows;
+  }
+  uint128_t *srcaddr = realloc(batch->v6_srcaddr, (size_t) capacity * sizeof(*srcaddr));
+  if (srcaddr != NULL) {
+    batch->v6_srcaddr = srcaddr;
+  }
+  uint128_t *dstaddr = realloc(batch->v6_dstaddr, (size_t) capacity * sizeof(*dstaddr));
+  if (dstaddr != NULL) {
+    batch->v6_dstaddr = dstaddr;
+  }
+  uint128_t *nexthop = realloc(batch->v6_nexthop, (size_t) capacity * sizeof(*nexthop));
+  if (nexthop != NULL) {
+    batch->v6_nexthop = nexthop;
+  }
+  if (rows == NULL || srcaddr == NULL || dstaddr == NULL || nexthop == NULL) {
+    LOG_ERROR("%s %d %s: Failed to grow IPv6 side column to %u rows\n", __FILE__, __LINE__, __func__, capacity);
+    return -1;
+  }
+  batch->v6_capacity = capacity;
+  return 0;
+}
+
+int flow_batch_add_v6(flow_batch_t *batch, uint32_t row, const netflow_v9_record_insert_uint128_t *record) {
+  if (unlikely(batch->v6_count == batch->v6_capacity) && flow_batch_reserve_v6(batch, 1) != 0) {
+    return -1;
+  }
+  batch->v6_row[batch->v6_count] = row;
+  batch->v6_srcaddr[batch->v6_count] = record->srcaddr;
+  batch->v6_dstaddr[batch->v6_count] = record->dstaddr;
+  batch->v6_nexthop[batch->v6_count] = record->nexthop;
+  batch->v6_count++;
+  return 0;
+}
+
+int flow_batch_append(flow_batch_t *dst, const flow_batch_t *src) {
+  if (src->count == 0) {
+    return 0;
+  }
+  if (flow_batch_reserve(dst, src->count) != 0 || flow_batch_reserve_v6(dst, src->v6_count) != 0) {
+    return -1;
+  }
+  for (size_t c = 0; c < FLOW_BATCH_COLUMN_COUNT; c++) {
+    if (flow_batch_columns[c].data) {
+      const size_t size = flow_batch_columns[c].size;
+      memcpy((char *) *flow_batch_column(dst, c) + (size_t) dst->count * size, flow_batch_column_const(src, c),
+             (size_t) src->count * size);
+    }
+  }
+  for (uint32_t v6 = 0; v6 < src->v6_count; v6++) {
+    dst->v6_row[dst->v6_count] = dst->count + src->v6_row[v6];
+    dst->v6_srcaddr[dst->v6_count] = src->v6_srcaddr[v6];
+    dst->v6_dstaddr[dst->v6_count] = src->v6_dstaddr[v6];
+    dst->v6_nexthop[dst->v6_count] = src->v6_nexthop[v6];
+    dst->v6_count++;
+  }
+  dst->count += src->count;
+  dst->received = src->received;
+  return 0;
+}
+
+void flow_batch_truncate(flow_batch_t *batch, uint32_t count) {
+  if (count >= batch->count) {
+    return;
+  }
+  batch->count = count;
+  while (batch->v6_count > 0 && batch->v6_row[batch->v6_count - 1] >= count) {
+    batch->v6_count--;
+  }
+}
+
+#define FLOW_BATCH_COMPACT_COLUMN(type)                                                                                \
+  do {                                                                                                                 \
+    type *values = *column;                                                                                            \
+    uint32_t out = start;                                                                                              \
+    for (uint32_t i = start; i < count; i++) {                                                                         \
+      values[out] = values[i];                                                                                         \
+      out += keep[i] != 0;                                                                                             \
+    }                                                                                                                  \
+  } while (0)
+
+uint32_t flow_batch_compact(flow_batch_t *batch, uint32_t start, const uint32_t *keep) {
+  const uint32_t count = batch->count;
+
+  // The side column first, while its rows still have their old numbers.
+  uint32_t v6 = batch->v6_count;
+  while (v6 > 0 && batch->v6_row[v6 - 1] >= start) {
+    v6--;
+  }
+  uint32_t v6_kept = v6;
+  uint32_t kept = start;
+  for (uint32_t i = start; i < count && v6 < batch->v6_count; i++) {
+    if (batch->v6_row[v6] == i) {
+      if (keep[i] != 0) {
+        batch->v6_row[v6_kept] = kept;
+        batch->v6_srcaddr[v6_kept] = batch->v6_srcaddr[v6];
+        batch->v6_dstaddr[v6_kept] = batch->v6_dstaddr[v6];
+        batch->v6_nexthop[v6_kept] = batch->v6_nexthop[v6];
+        v6_kept++;
+      }
+      v6++;
+    }
+    kept += keep[i] != 0;
+  }
+  batch->v6_count = v6_kept;
+
+  for (size_t c = 0; c < FLOW_BATCH_COLUMN_COUNT; c++) {
+    if (!flow_batch_columns[c].data) {
+      continue;
+    }
+    void **column = flow_batch_column(batch, c);
+    switch (flow_batch_columns[c].size) {
+      case 1:
+        FLOW_BATCH_COMPACT_COLUMN(uint8_t);
+        break;
+      case 2:
+        FLOW_BATCH_COMPACT_COLUMN(uint16_t);
+        break;
+      case 4:
+        FLOW_BATCH_COMPACT_COLUMN(uint32_t);
+        break;
+      default:
+        FLOW_BATCH_COMPACT_COLUMN(uint64_t);
+        break;
+    }
+  }
+
+  kept = start;
+  for (uint32_t i = start; i < count; i++) {
+    kept += keep[i] != 0;
+  }
+  batch->count = kept;
+  return kept;
+}
+
+void flow_batch_free(flow_batch_t *batch) {
+  for (size_t c = 0; c < FLOW_BATCH_COLUMN_COUNT; c++) {
+    free(*flow_batch_column(batch, c));
+  }
+  free(batch->v6_row);
+  free(batch->v6_srcaddr);
+  free(batch->v6_dstaddr);
+  free(batch->v6_nexthop);
+  memset(batch, 0, sizeof(*batch));
+}
+
+flow_batch_t *flow_batch_thread(void) {
+  static THREAD_LOCAL flow_batch_t batch;
+  flow_batch_truncate(&batch, 0);
+  batch.received = 0;
+  return &batch;
+}
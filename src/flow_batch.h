@@ -0,0 +1,172 @@
+//
+// Growable column-oriented batch of decoded flows.
+//
+
+#ifndef CNETFLOW_FLOW_BATCH_H
+#define CNETFLOW_FLOW_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "log.h"
+#include "netflow.h"
+
+// Rows a batch starts with; it doubles from there.
+#define FLOW_BATCH_INITIAL_ROWS 256
+
+/**
+ * Decoded flows, one array per field, as every decoder emits them and every
+ * sink reads them. A batch is reused: clearing it keeps its columns, so a
+ * parser thread allocates only while its batches grow.
+ *
+ * Addresses are 32-bit columns. IPv6 rows hold 0 there and keep their
+ * addresses in the v6 side column, which lists them in row order.
+ */
+typedef struct flow_batch_s {
+  uint32_t count;
+  uint32_t capacity;
+  // Receive time of the newest rows, seconds since the epoch.
+  uint32_t received;
+
+  // Exporter of each row, as interned by exporter_intern().
+  uint32_t *exporter;
+  // Collector-side 1-in-N sampling each row's datagram went through.
+  uint32_t *sampling_rate;
+  uint32_t *srcaddr;
+  uint32_t *dstaddr;
+  uint32_t *nexthop;
+  uint64_t *dPkts;
+  uint64_t *dOctets;
+  uint32_t *First;
+  uint32_t *Last;
+  uint32_t *src_as;
+  uint32_t *dst_as;
+  uint16_t *input;
+  uint16_t *output;
+  uint16_t *srcport;
+  uint16_t *dstport;
+  uint8_t *tcp_flags;
+  uint8_t *prot;
+  uint8_t *tos;
+  uint8_t *src_mask;
+  uint8_t *dst_mask;
+  uint8_t *ip_version;
+  // Working space of netflow_prepare_batch(), one word per row.
+  uint32_t *scratch;
+
+  uint32_t v6_count;
+  uint32_t v6_capacity;
+  // Row of each IPv6 entry, ascending.
+  uint32_t *v6_row;
+  uint128_t *v6_srcaddr;
+  uint128_t *v6_dstaddr;
+  uint128_t *v6_nexthop;
+} flow_batch_t;
+
+/**
+ * Makes room for `rows` more rows.
+ *
+ * @return 0 on success, -1 if the columns could not grow.
+ */
+int flow_batch_reserve(flow_batch_t *batch, uint32_t rows);
+
+/**
+ * Appends an IPv6 row's addresses to the side column. Called by
+ * flow_batch_add().
+ *
+ * @return 0 on success, -1 if the side column could not grow.
+ */
+int flow_batch_add_v6(flow_batch_t *batch, uint32_t row, const netflow_v9_record_insert_uint128_t *record);
+
+/**
+ * Appends one decoded record as a row.
+ *
+ * @return 0 on success, -1 if the batch could not grow.
+ */
+static inline int flow_batch_add(flow_batch_t *batch, const netflow_v9_record_insert_uint128_t *record,
+                                 uint32_t exporter, uint32_t sampling_rate) {
+  if (unlikely(batch->count == batch->capacity) && flow_batch_reserve(batch, 1) != 0) {
+    return -1;
+  }
+  const uint32_t i = batch->count;
+  if (unlikely(record->ip_version == 6)) {
+    if (flow_batch_add_v6(batch, i, record) != 0) {
+      return -1;
+    }
+    batch->srcaddr[i] = 0;
+    batch->dstaddr[i] = 0;
+    batch->nexthop[i] = 0;
+  } else {
+    batch->srcaddr[i] = (uint32_t) record->srcaddr;
+    batch->dstaddr[i] = (uint32_t) record->dstaddr;
+    batch->nexthop[i] = (uint32_t) record->nexthop;
+  }
+  batch->exporter[i] = exporter;
+  batch->sampling_rate[i] = sampling_rate;
+  batch->dPkts[i] = record->dPkts;
+  batch->dOctets[i] = record->dOctets;
+  batch->First[i] = record->First;
+  batch->Last[i] = record->Last;
+  batch->src_as[i] = record->src_as;
+  batch->dst_as[i] = record->dst_as;
+  batch->input[i] = record->input;
+  batch->output[i] = record->output;
+  batch->srcport[i] = record->srcport;
+  batch->dstport[i] = record->dstport;
+  batch->tcp_flags[i] = record->tcp_flags;
+  batch->prot[i] = record->prot;
+  batch->tos[i] = record->tos;
+  batch->src_mask[i] = record->src_mask;
+  batch->dst_mask[i] = record->dst_mask;
+  batch->ip_version[i] = record->ip_version;
+  batch->count = i + 1;
+  return 0;
+}
+
+/**
+ * Appends every row of `src` to `dst` and takes on its receive time.
+ *
+ * @return 0 on success, -1 if `dst` could not grow; it is left unchanged then.
+ */
+int flow_batch_append(flow_batch_t *dst, const flow_batch_t *src);
+
+/**
+ * Drops the rows from `count` on, keeping the columns.
+ */
+void flow_batch_truncate(flow_batch_t *batch, uint32_t count);
+
+/**
+ * Of the rows from `start` on, keeps those whose keep[row] is not 0, packed
+ * in order after the rows before `start`, and drops the rest.
+ *
+ * @return The rows left.
+ */
+uint32_t flow_batch_compact(flow_batch_t *batch, uint32_t start, const uint32_t *keep);
+
+/**
+ * The row's addresses, widened back to the 128 bits of the decoded record.
+ * `v6` is a cursor into the side column: start it at 0 (or at the first
+ * entry at or after the first row read) and pass it for every row in order.
+ */
+static inline void flow_batch_addrs(const flow_batch_t *batch, uint32_t row, uint32_t *v6, uint128_t *srcaddr,
+                                    uint128_t *dstaddr) {
+  if (batch->ip_version[row] == 6 && *v6 < batch->v6_count && batch->v6_row[*v6] == row) {
+    *srcaddr = batch->v6_srcaddr[*v6];
+    *dstaddr = batch->v6_dstaddr[*v6];
+    (*v6)++;
+  } else {
+    *srcaddr = batch->srcaddr[row];
+    *dstaddr = batch->dstaddr[row];
+  }
+}
+
+/**
+ * Releases the columns; the batch is empty and can be reused.
+ */
+void flow_batch_free(flow_batch_t *batch);
+
+/**
+ * The calling parser thread's batch, emptied for a new datagram.
+ */
+flow_batch_t *flow_batch_thread(void);
+
+#endif // CNETFLOW_FLOW_BATCH_H
@@ -0,0 +1,547 @@
+//
+// Socket and template handover between an old and a new collector process.
+//
+// The running collector listens on CNETFLOW_HANDOVER_SOCKET. A new collector
+// started with the same setting connects to it before binding anything and
+// sends a request. The old collector then stops reading, waits for the
+// datagrams it already read to be parsed, and answers with one message that
+// carries a copy of every socket it was serving (SCM_RIGHTS) followed by the
+// v9 and IPFIX templates it holds. Datagrams arriving in between wait in the
+// socket buffers, which now belong to the new process as well, so nothing is
+// lost. The old collector then flushes its ClickHouse batches and exits.
+//
+
+#include "handover.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "exporter.h"
+#include "log.h"
+#include "netflow_ipfix.h"
+#include "netflow_v9.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+#define HANDOVER_MAGIC 0x434e4648u // "CNFH"
+#define HANDOVER_VERSION 2
+// Larger template blobs are refused rather than allocated.
+#define HANDOVER_MAX_TEMPLATE_BYTES ((uint64_t) 256 << 20)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} handover_request_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sockets;
+  uint32_t templates;
+  uint64_t template_bytes;
+} handover_reply_t;
+
+// Followed by `len` bytes of template record. Exporter ids are local to a
+// process, so templates travel with the exporter identity they belong to.
+typedef struct {
+  uint8_t exporter[16];
+  uint32_t domain;
+  uint16_t template_id;
+  uint16_t len;
+  uint16_t version;
+  uint16_t reserved;
+} handover_template_t;
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+  uint32_t count;
+  int failed;
+} handover_blob_t;
+
+// Both socket lists are guarded by sockets_mutex: the metrics thread takes
+// and offers its listener too.
+static uv_mutex_t sockets_mutex;
+static uv_once_t sockets_once = UV_ONCE_INIT;
+// Sockets served by this process.
+static int offered[HANDOVER_MAX_SOCKETS];
+static unsigned int offered_count = 0;
+// Sockets received from the previous process and not taken yet.
+static int inherited[HANDOVER_MAX_SOCKETS];
+static unsigned int inherited_count = 0;
+
+static struct {
+  uv_pipe_t server;
+  int listening;
+  handover_request_cb on_request;
+  // The connection of the process taking over, NULL while none is pending.
+  uv_pipe_t *client;
+  handover_request_t request;
+  size_t received;
+  // Copies of the offered sockets, taken when the request arrived.
+  int sockets[HANDOVER_MAX_SOCKETS];
+  unsigned int socket_count;
+} handover;
+
+static void sockets_init(void) { uv_mutex_init(&sockets_mutex); }
+
+void handover_offer_socket(int fd) {
+  uv_once(&sockets_once, sockets_init);
+  uv_mutex_lock(&sockets_mutex);
+  if (offered_count < HANDOVER_MAX_SOCKETS) {
+    offered[offered_count++] = fd;
+  }
+  uv_mutex_unlock(&sockets_mutex);
+}
+
+void handover_withdraw_socket(int fd) {
+  uv_once(&sockets_once, sockets_init);
+  uv_mutex_lock(&sockets_mutex);
+  for (unsigned int i = 0; i < offered_count; i++) {
+    if (offered[i] == fd) {
+      offered[i] = offered[--offered_count];
+      break;
+    }
+  }
+  uv_mutex_unlock(&sockets_mutex);
+}
+
+static int handover_same_address(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) {
+    return 0;
+  }
+  if (a->sa_family == AF_INET) {
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *) a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *) b;
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+  if (a->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *) b;
+    return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+  }
+  return 0;
+}
+
+int handover_take_socket(int type, const struct sockaddr *addr, int reuseport) {
+  int taken = -1;
+  uv_once(&sockets_once, sockets_init);
+  uv_mutex_lock(&sockets_mutex);
+  for (unsigned int i = 0; i < inherited_count; i++) {
+    int fd = inherited[i];
+    int sock_type = 0;
+    int sock_reuseport = 0;
+    socklen_t opt_len = sizeof(sock_type);
+    struct sockaddr_storage bound;
+    socklen_t bound_len = sizeof(bound);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &opt_len) != 0 || sock_type != type ||
+        getsockname(fd, (struct sockaddr *) &bound, &bound_len) != 0 ||
+        !handover_same_address((const struct sockaddr *) &bound, addr)) {
+      continue;
+    }
+#ifdef SO_REUSEPORT
+    opt_len = sizeof(sock_reuseport);
+    getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &sock_reuseport, &opt_len);
+#endif
+    if ((sock_reuseport != 0) != (reuseport != 0)) {
+      continue;
+    }
+    inherited[i] = inherited[--inherited_count];
+    taken = fd;
+    break;
+  }
+  uv_mutex_unlock(&sockets_mutex);
+  return taken;
+}
+
+void handover_release_unused(void) {
+  uv_once(&sockets_once, sockets_init);
+  uv_mutex_lock(&sockets_mutex);
+  for (unsigned int i = 0; i < inherited_count; i++) {
+    LOG_INFO("closing handed over socket %d, it is not used by this configuration\n", inherited[i]);
+    close(inherited[i]);
+  }
+  inherited_count = 0;
+  uv_mutex_unlock(&sockets_mutex);
+}
+
+static int handover_read_full(int fd, void *buf, size_t len) {
+  uint8_t *p = (uint8_t *) buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 ? UV_EOF : -errno;
+    }
+    p += n;
+    len -= (size_t) n;
+  }
+  return 0;
+}
+
+static int handover_write_full(int fd, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *) buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -errno;
+    }
+    p += n;
+    len -= (size_t) n;
+  }
+  return 0;
+}
+
+static void handover_restore_templates(const uint8_t *data, size_t len, uint32_t count) {
+  size_t offset = 0;
+  uint32_t restored = 0;
+  for (uint32_t i = 0; i < count && offset + sizeof(handover_template_t) <= len; i++) {
+    handover_template_t entry;
+    memcpy(&entry, data + offset, sizeof(entry));
+    offset += sizeof(entry);
+    if (entry.len > len - offset) {
+      break;
+    }
+    uint64_t key = exporter_template_key(exporter_intern(entry.exporter, entry.domain), entry.template_id);
+    int ret = entry.version == 9 ? v9_template_restore(key, data + offset, entry.len)
+                                 : ipfix_template_restore(key, data + offset, entry.len);
+    if (ret == 0) {
+      restored++;
+    }
+    offset += entry.len;
+  }
+  LOG_INFO("handover: restored %u of %u templates\n", restored, count);
+}
+
+int handover_receive(const char *path) {
+  struct sockaddr_un sun;
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    return UV_ENAMETOOLONG;
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  // The old process answers once its parsers have drained.
+  struct timeval timeout = {.tv_sec = HANDOVER_TIMEOUT_MS / 1000, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  handover_request_t request = {.magic = HANDOVER_MAGIC, .version = HANDOVER_VERSION};
+  int err = handover_write_full(fd, &request, sizeof(request));
+  if (err != 0) {
+    close(fd);
+    return err;
+  }
+
+  handover_reply_t reply;
+  char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_SOCKETS)];
+  struct iovec iov = {.iov_base = &reply, .iov_len = sizeof(reply)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  do {
+    n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n != (ssize_t) sizeof(reply)) {
+    err = n < 0 ? -errno : UV_EPROTO;
+    close(fd);
+    return err;
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    uv_once(&sockets_once, sockets_init);
+    uv_mutex_lock(&sockets_mutex);
+    for (size_t i = 0; i < fds; i++) {
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (inherited_count < HANDOVER_MAX_SOCKETS) {
+        inherited[inherited_count++] = received;
+      } else {
+        close(received);
+      }
+    }
+    uv_mutex_unlock(&sockets_mutex);
+  }
+  if (reply.magic != HANDOVER_MAGIC || reply.version != HANDOVER_VERSION ||
+      reply.template_bytes > HANDOVER_MAX_TEMPLATE_BYTES) {
+    close(fd);
+    handover_release_unused();
+    return UV_EPROTO;
+  }
+
+  if (reply.template_bytes > 0) {
+    uint8_t *templates = malloc((size_t) reply.template_bytes);
+    if (templates == NULL) {
+      err = UV_ENOMEM;
+    } else {
+      err = handover_read_full(fd, templates, (size_t) reply.template_bytes);
+      if (err == 0) {
+        handover_restore_templates(templates, (size_t) reply.template_bytes, reply.templates);
+      }
+      free(templates);
+    }
+    if (err != 0) {
+      // The sockets are still good; only the templates have to be learned again.
+      LOG_ERROR("handover: could not read the templates: %s\n", uv_strerror(err));
+    }
+  }
+  close(fd);
+  LOG_INFO("handover: received %u sockets\n", inherited_count);
+  return (int) inherited_count;
+}
+
+static void handover_blob_add(uint16_t version, uint64_t key, const void *record, size_t len, void *ctx) {
+  handover_blob_t *blob = (handover_blob_t *) ctx;
+  size_t need = sizeof(handover_template_t) + len;
+  handover_template_t entry = {.template_id = (uint16_t) key, .len = (uint16_t) len, .version = version};
+  if (blob->failed || len > UINT16_MAX || exporter_lookup((uint32_t) (key >> 32), entry.exporter, &entry.domain) != 0) {
+    return;
+  }
+  if (blob->len + need > blob->cap) {
+    size_t cap = blob->cap ? blob->cap * 2 : 64 * 1024;
+    while (cap < blob->len + need) {
+      cap *= 2;
+    }
+    uint8_t *data = realloc(blob->data, cap);
+    if (data == NULL) {
+      blob->failed = 1;
+      return;
+    }
+    blob->data = data;
+    blob->cap = cap;
+  }
+  memcpy(blob->data + blob->len, &entry, sizeof(entry));
+  memcpy(blob->data + blob->len + sizeof(entry), record, len);
+  blob->len += need;
+  blob->count++;
+}
+
+static void handover_close_sockets(void) {
+  for (unsigned int i = 0; i < handover.socket_count; i++) {
+    close(handover.sockets[i]);
+  }
+  handover.socket_count = 0;
+}
+
+int handover_send(void) {
+  if (handover.client == NULL) {
+    return UV_EINVAL;
+  }
+  uv_os_fd_t fd;
+  int err = uv_fileno((uv_handle_t *) handover.client, &fd);
+  handover_blob_t blob;
+  memset(&blob, 0, sizeof(blob));
+  if (err == 0) {
+    v9_templates_foreach(handover_blob_add, &blob);
+    ipfix_templates_foreach(handover_blob_add, &blob);
+    if (blob.failed) {
+      LOG_ERROR("handover: out of memory while copying templates, sending none\n");
+      blob.len = 0;
+      blob.count = 0;
+    }
+    // Written in one go: the new process reads everything before it starts.
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval timeout = {.tv_sec = HANDOVER_TIMEOUT_MS / 1000, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    handover_reply_t reply = {.magic = HANDOVER_MAGIC,
+                              .version = HANDOVER_VERSION,
+                              .sockets = handover.socket_count,
+                              .templates = blob.count,
+                              .template_bytes = blob.len};
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_SOCKETS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &reply, .iov_len = sizeof(reply)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (handover.socket_count > 0) {
+      msg.msg_control = control;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * handover.socket_count);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handover.socket_count);
+      memcpy(CMSG_DATA(cmsg), handover.sockets, sizeof(int) * handover.socket_count);
+    }
+    ssize_t n;
+    do {
+      n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) sizeof(reply)) {
+      err = n < 0 ? -errno : UV_EPROTO;
+    } else if (blob.len > 0) {
+      err = handover_write_full(fd, blob.data, blob.len);
+    }
+  }
+  free(blob.data);
+  if (err != 0) {
+    LOG_ERROR("handover: could not answer the new process: %s\n", uv_strerror(err));
+  } else {
+    LOG_INFO("handover: sent %u sockets and %u templates\n", handover.socket_count, blob.count);
+  }
+  handover_close_sockets();
+  uv_close((uv_handle_t *) handover.client, (uv_close_cb) free);
+  handover.client = NULL;
+  return err != 0 ? err : (int) blob.count;
+}
+
+static void handover_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  (void) handle;
+  (void) suggested_size;
+  buf->base = (char *) &handover.request + handover.received;
+  buf->len = sizeof(handover.request) - handover.received;
+}
+
+static void handover_drop_client(void) {
+  uv_close((uv_handle_t *) handover.client, (uv_close_cb) free);
+  handover.client = NULL;
+}
+
+static void handover_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  (void) buf;
+  if (nread == 0) {
+    return;
+  }
+  if (nread < 0) {
+    handover_drop_client();
+    return;
+  }
+  handover.received += (size_t) nread;
+  if (handover.received < sizeof(handover.request)) {
+    return;
+  }
+  uv_read_stop(stream);
+  if (handover.request.magic != HANDOVER_MAGIC || handover.request.version != HANDOVER_VERSION) {
+    LOG_ERROR("handover: ignoring a request of an unknown version\n");
+    handover_drop_client();
+    return;
+  }
+  // Copies taken now stay valid while the receivers close their own.
+  uv_mutex_lock(&sockets_mutex);
+  handover.socket_count = 0;
+  for (unsigned int i = 0; i < offered_count; i++) {
+    int copy = fcntl(offered[i], F_DUPFD_CLOEXEC, 0);
+    if (copy >= 0) {
+      handover.sockets[handover.socket_count++] = copy;
+    }
+  }
+  uv_mutex_unlock(&sockets_mutex);
+  LOG_INFO("handover: a new process is taking over %u sockets\n", handover.socket_count);
+  handover_close();
+  handover.on_request();
+}
+
+static void handover_on_connection(uv_stream_t *server, int status) {
+  if (status < 0) {
+    return;
+  }
+  uv_pipe_t *client = malloc(sizeof(uv_pipe_t));
+  if (client == NULL) {
+    return;
+  }
+  uv_pipe_init(server->loop, client, 0);
+  if (uv_accept(server, (uv_stream_t *) client) != 0 || handover.client != NULL) {
+    // One handover at a time.
+    uv_close((uv_handle_t *) client, (uv_close_cb) free);
+    return;
+  }
+  handover.client = client;
+  handover.received = 0;
+  uv_read_start((uv_stream_t *) client, handover_alloc, handover_on_read);
+}
+
+int handover_listen(uv_loop_t *loop, const char *path, handover_request_cb on_request) {
+  uv_once(&sockets_once, sockets_init);
+  // A previous process that handed over has stopped listening; its path is stale.
+  unlink(path);
+  int err = uv_pipe_init(loop, &handover.server, 0);
+  if (err != 0) {
+    return err;
+  }
+  err = uv_pipe_bind(&handover.server, path);
+  if (err == 0) {
+    err = uv_listen((uv_stream_t *) &handover.server, 1, handover_on_connection);
+  }
+  if (err != 0) {
+    uv_close((uv_handle_t *) &handover.server, NULL);
+    return err;
+  }
+  handover.on_request = on_request;
+  handover.listening = 1;
+  return 0;
+}
+
+void handover_close(void) {
+  if (!handover.listening) {
+    return;
+  }
+  handover.listening = 0;
+  // The path now belongs to the new process; only the handle is closed.
+  uv_close((uv_handle_t *) &handover.server, NULL);
+}
+
+#else // _WIN32
+
+int handover_receive(const char *path) {
+  (void) path;
+  return UV_ENOSYS;
+}
+
+int handover_take_socket(int type, const struct sockaddr *addr, int reuseport) {
+  (void) type;
+  (void) addr;
+  (void) reuseport;
+  return -1;
+}
+
+void handover_release_unused(void) {}
+
+void handover_offer_socket(int fd) { (void) fd; }
+
+void handover_withdraw_socket(int fd) { (void) fd; }
+
+int handover_listen(uv_loop_t *loop, const char *path, handover_request_cb on_request) {
+  (void) loop;
+  (void) path;
+  (void) on_request;
+  return UV_ENOSYS;
+}
+
+int handover_send(void) { return UV_ENOSYS; }
+
+void handover_close(void) {}
+
+#endif // _WIN32
@@ -0,0 +1,74 @@
+//
+// Zero-loss restarts: a new collector takes the bound sockets and the
+// templates over from the running one through a Unix socket.
+//
+
+#ifndef CNETFLOW_HANDOVER_H
+#define CNETFLOW_HANDOVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+#define HANDOVER_MAX_SOCKETS 128
+// How long the new process waits for the old one to drain and answer.
+#define HANDOVER_TIMEOUT_MS 30000
+
+/**
+ * Called on the listening loop when a new process asks for the sockets. The
+ * collector stops reading, lets its parsers drain, then calls handover_send().
+ */
+typedef void (*handover_request_cb)(void);
+
+/**
+ * Takes the sockets and templates over from the collector listening on
+ * `path`. Blocks until that collector has drained its parsers and answered.
+ * The sockets received are kept for handover_take_socket(), the templates
+ * are stored in the v9 and IPFIX template tables.
+ *
+ * @return The number of sockets received, or a negative libuv error code;
+ *         UV_ENOENT or UV_ECONNREFUSED when no collector is listening.
+ */
+int handover_receive(const char *path);
+
+/**
+ * @return A received socket of `type` (SOCK_DGRAM or SOCK_STREAM) bound to
+ *         `addr`, with SO_REUSEPORT set if and only if `reuseport` is, or -1.
+ *         The caller owns the returned fd.
+ */
+int handover_take_socket(int type, const struct sockaddr *addr, int reuseport);
+
+/**
+ * Closes the received sockets nobody took, e.g. after a change of receive mode.
+ */
+void handover_release_unused(void);
+
+/**
+ * Registers a bound socket the collector serves, to be passed on to the next
+ * process. handover_withdraw_socket() must be called before it is closed.
+ */
+void handover_offer_socket(int fd);
+void handover_withdraw_socket(int fd);
+
+/**
+ * Listens on `path` for a new process asking to take over. The path is
+ * replaced if it exists.
+ *
+ * @return 0 on success, or a negative libuv error code.
+ */
+int handover_listen(uv_loop_t *loop, const char *path, handover_request_cb on_request);
+
+/**
+ * Answers the pending request with a copy of every offered socket, taken
+ * when the request arrived, and every template the collector holds.
+ *
+ * @return The number of templates sent, or a negative libuv error code.
+ */
+int handover_send(void);
+
+/**
+ * Stops listening for requests.
+ */
+void handover_close(void);
+
+#endif // CNETFLOW_HANDOVER_H
@@ -339,6 +339,33 @@ hashmap_delete_error:
   return -1;
 }
 
+/**
+ * Calls `cb` with every key-value pair in the hashmap, in bucket order.
+ *
+ * The hashmap is read-locked for the whole walk, so `cb` must not modify it.
+ *
+ * @param hashmap The hashmap to walk.
+ * @param cb Called with the key, its length, the value and `ctx`.
+ * @param ctx Opaque pointer passed to `cb`.
+ * @return The number of pairs visited.
+ */
+size_t hashmap_foreach(hashmap_t *hashmap, hashmap_foreach_cb cb, void *ctx) {
+  if (hashmap == NULL || hashmap->buckets == NULL || cb == NULL) {
+    return 0;
+  }
+  size_t visited = 0;
+  uv_rwlock_rdlock(hashmap->rwlock);
+  bucket_t *buckets = (bucket_t *) hashmap->buckets;
+  for (size_t i = 0; i < hashmap->bucket_count; i++) {
+    if (buckets[i].occupied && !buckets[i].deleted && buckets[i].key != NULL) {
+      cb(buckets[i].key, buckets[i].key_len, buckets[i].value, ctx);
+      visited++;
+    }
+  }
+  uv_rwlock_rdunlock(hashmap->rwlock);
+  return visited;
+}
+
 void hashmap_destroy(hashmap_t *hashmap) {
   if (hashmap == NULL) return;
   uv_rwlock_destroy(hashmap->rwlock);
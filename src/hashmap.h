@@ -31,11 +31,13 @@ typedef struct {
   arena_struct_t *arena;
 } hashmap_t;
 
+typedef void (*hashmap_foreach_cb)(const void *key, size_t key_len, void *value, void *ctx);
 hashmap_t *hashmap_create(arena_struct_t *arena, size_t bucket_count);
 size_t hashmap_hash(hashmap_t *hashmap, void *key, size_t len);
 int hashmap_set(hashmap_t *hashmap, arena_struct_t *arena, void *key, size_t key_len, void *value);
 void *hashmap_get(hashmap_t *hashmap, void *key, size_t key_len);
 int hashmap_delete(hashmap_t *hashmap, void *key, size_t key_len);
+size_t hashmap_foreach(hashmap_t *hashmap, hashmap_foreach_cb cb, void *ctx);
 void hashmap_destroy(hashmap_t *hashmap);
 
 #endif // HASHMAP_H
@@ -0,0 +1,672 @@
+//
+// Batched datagram receive paths that bypass uv_udp_recv_start.
+//
+// In recvmmsg mode the collector owns the UDP sockets itself and registers
+// them with a loop through a uv_poll_t. Each readable event drains the socket
+// with recvmmsg() into a ring of packet slab buffers; every received
+// datagram is handed to udp_handle() (which takes ownership of the buffer)
+// and only the consumed slots are refilled before the next syscall.
+//
+// With more than one socket, every socket is bound with SO_REUSEPORT and
+// served by its own thread and loop. Receiver 0 stays on the caller's loop.
+// A classic BPF program attached to the reuseport group hashes the exporter
+// source address, so one exporter always lands on the same receiver and its
+// templates and data flowsets follow the same path.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ingest.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#endif
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#include "affinity.h"
+#include "collector.h"
+#include "handover.h"
+#include "log.h"
+#include "metrics.h"
+#include "pkt_slab.h"
+
+// Upper bound on recvmmsg() calls per readable event, so that one busy socket
+// cannot starve the timers and the metrics listener on the same loop.
+#define INGEST_MAX_DRAIN_PER_WAKE 16
+
+int ingest_parse_mode(const char *mode) {
+  if (mode == NULL || *mode == '\0' || strcmp(mode, "libuv") == 0) {
+    return ingest_mode_libuv;
+  }
+  if (strcmp(mode, "recvmmsg") == 0) {
+    return ingest_mode_recvmmsg;
+  }
+  if (strcmp(mode, "tpacket") == 0) {
+    return ingest_mode_tpacket;
+  }
+  if (strcmp(mode, "xdp") == 0) {
+    return ingest_mode_xdp;
+  }
+  if (strcmp(mode, "io_uring") == 0) {
+    return ingest_mode_io_uring;
+  }
+  return -1;
+}
+
+const char *ingest_mode_name(ingest_mode_t mode) {
+  switch (mode) {
+    case ingest_mode_recvmmsg:
+      return "recvmmsg";
+    case ingest_mode_tpacket:
+      return "tpacket";
+    case ingest_mode_xdp:
+      return "xdp";
+    case ingest_mode_io_uring:
+      return "io_uring";
+    case ingest_mode_libuv:
+    default:
+      return "libuv";
+  }
+}
+
+#if defined(__linux__)
+
+typedef struct {
+  unsigned int index;
+  uv_loop_t *loop;
+  uv_thread_t thread;
+  int owns_loop;
+  // Set on the receive thread once it dispatches from its own loop.
+  int dispatching;
+  uv_poll_t poll;
+  uv_async_t stop_async;
+  int fd;
+  unsigned int batch;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_storage *addrs;
+  char **bufs;
+  // Per-slot control buffers for UDP_GRO and SO_RXQ_OVFL
+  char *ctrls;
+  int gro;
+  ingest_rcvbuf_t rcvbuf;
+  size_t buf_size;
+  int closing;
+  int pending_closes;
+} ingest_receiver_t;
+
+static ingest_receiver_t *receivers[INGEST_MAX_SOCKETS];
+static unsigned int receiver_count = 0;
+static volatile int stop_requested = 0;
+
+/**
+ * Refills every empty slot of the receive ring from the packet slab.
+ *
+ * @return The number of slots that hold a usable buffer.
+ */
+static unsigned int ingest_refill(ingest_receiver_t *r) {
+  unsigned int ready = 0;
+  for (unsigned int i = 0; i < r->batch; i++) {
+    if (r->bufs[i] == NULL) {
+      pkt_ctx_t *ctx = pkt_slab_alloc(r->buf_size);
+      r->bufs[i] = ctx ? pkt_ctx_data(ctx) : NULL;
+      if (r->bufs[i] == NULL) {
+        // Keep the slots contiguous so recvmmsg() only sees valid buffers.
+        break;
+      }
+    }
+    memset(&r->msgs[i].msg_hdr, 0, sizeof(r->msgs[i].msg_hdr));
+    r->iovs[i].iov_base = r->bufs[i];
+    r->iovs[i].iov_len = r->buf_size;
+    r->msgs[i].msg_hdr.msg_control = r->ctrls + (size_t) i * INGEST_CMSG_SPACE;
+    r->msgs[i].msg_hdr.msg_controllen = INGEST_CMSG_SPACE;
+    r->msgs[i].msg_hdr.msg_iov = &r->iovs[i];
+    r->msgs[i].msg_hdr.msg_iovlen = 1;
+    r->msgs[i].msg_hdr.msg_name = &r->addrs[i];
+    r->msgs[i].msg_hdr.msg_namelen = sizeof(r->addrs[i]);
+    r->msgs[i].msg_len = 0;
+    ready++;
+  }
+  return ready;
+}
+
+/**
+ * Reads the control messages of a receive: returns the UDP_GRO segment size,
+ * or 0 when the kernel did not coalesce it, sets `recv_ms` from the kernel
+ * timestamp if there is one, and feeds the SO_RXQ_OVFL drop counter to the
+ * receiver's buffer sizing.
+ */
+static size_t ingest_read_cmsgs(ingest_receiver_t *r, struct msghdr *msg, uint64_t *recv_ms) {
+  size_t segment_size = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    uint32_t drops;
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int size;
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      segment_size = size > 0 ? (size_t) size : 0;
+    } else if (ingest_rcvbuf_cmsg_drops(cmsg, &drops)) {
+      ingest_rcvbuf_update(&r->rcvbuf, drops, uv_now(r->loop));
+    } else {
+      ingest_cmsg_timestamp(cmsg, recv_ms);
+    }
+  }
+  return segment_size;
+}
+
+static void ingest_on_readable(uv_poll_t *handle, int status, int events) {
+  ingest_receiver_t *r = (ingest_receiver_t *) handle->data;
+  (void) events;
+  if (status < 0) {
+    LOG_ERROR("%s %d %s poll error: %s\n", __FILE__, __LINE__, __func__, uv_strerror(status));
+    return;
+  }
+
+  for (int round = 0; round < INGEST_MAX_DRAIN_PER_WAKE && !r->closing; round++) {
+    unsigned int ready = ingest_refill(r);
+    if (ready == 0) {
+      LOG_ERROR("%s %d %s packet contexts exhausted, deferring receive\n", __FILE__, __LINE__, __func__);
+      metrics_inc_pkt_slab_drop();
+      return;
+    }
+
+    int n = recvmmsg(r->fd, r->msgs, ready, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_ERROR("%s %d %s recvmmsg failed: %s\n", __FILE__, __LINE__, __func__, strerror(errno));
+      }
+      return;
+    }
+    if (n == 0) {
+      return;
+    }
+
+    metrics_inc_recv_batch((uint64_t) n);
+    // Without a kernel timestamp every datagram of the batch shares one clock read.
+    uint64_t batch_ms = 0;
+    for (int i = 0; i < n; i++) {
+      ssize_t nread = (ssize_t) r->msgs[i].msg_len;
+      if (r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        LOG_DEBUG("%s %d %s truncated datagram dropped\n", __FILE__, __LINE__, __func__);
+        nread = 0;
+      }
+      const struct sockaddr *addr = (const struct sockaddr *) &r->addrs[i];
+      uint64_t recv_ms = 0;
+      size_t segment_size = ingest_read_cmsgs(r, &r->msgs[i].msg_hdr, &recv_ms);
+      if (recv_ms == 0) {
+        if (batch_ms == 0) {
+          batch_ms = collector_clock_ms();
+        }
+        recv_ms = batch_ms;
+      }
+      collector_set_receive_time(recv_ms);
+      if (r->gro) {
+        if (nread > 0 && (segment_size == 0 || (size_t) nread <= segment_size)) {
+          // Not coalesced: keep the 64 KiB slot buffer for the next receive
+          // and hand the parsers a right-sized copy.
+          pkt_ctx_t *copy = pkt_slab_alloc((size_t) nread);
+          if (copy == NULL) {
+            metrics_inc_pkt_slab_drop();
+            continue;
+          }
+          memcpy(pkt_ctx_data(copy), r->bufs[i], (size_t) nread);
+          uv_buf_t buf = uv_buf_init(pkt_ctx_data(copy), copy->capacity);
+          udp_handle(NULL, nread, &buf, addr, 0);
+          continue;
+        }
+        char *base = r->bufs[i];
+        r->bufs[i] = NULL;
+        udp_handle_segments(base, nread, segment_size, addr, 0);
+        continue;
+      }
+      uv_buf_t buf = uv_buf_init(r->bufs[i], (unsigned int) r->buf_size);
+      // udp_handle owns the buffer from here on, including on error paths.
+      r->bufs[i] = NULL;
+      udp_handle(NULL, nread, &buf, addr, 0);
+    }
+    collector_set_receive_time(0);
+
+    // A short batch means the socket queue is empty.
+    if ((unsigned int) n < ready) {
+      return;
+    }
+  }
+}
+
+static void ingest_receiver_free(ingest_receiver_t *r) {
+  for (unsigned int i = 0; i < r->batch; i++) {
+    if (r->bufs && r->bufs[i] != NULL) {
+      pkt_slab_free(pkt_ctx_from_data(r->bufs[i]));
+    }
+  }
+  if (r->fd >= 0) {
+    handover_withdraw_socket(r->fd);
+    close(r->fd);
+  }
+  free(r->msgs);
+  free(r->iovs);
+  free(r->addrs);
+  free(r->bufs);
+  free(r->ctrls);
+}
+
+static void ingest_on_close(uv_handle_t *handle) {
+  ingest_receiver_t *r = (ingest_receiver_t *) handle->data;
+  if (--r->pending_closes > 0) {
+    return;
+  }
+  ingest_receiver_free(r);
+  // Threaded receivers are released by ingest_join() after their loop exits.
+  if (!r->owns_loop) {
+    free(r);
+  }
+}
+
+static void ingest_on_stop(uv_async_t *handle) {
+  ingest_receiver_t *r = (ingest_receiver_t *) handle->data;
+  if (r->closing) {
+    return;
+  }
+  r->closing = 1;
+  uv_poll_stop(&r->poll);
+  uv_close((uv_handle_t *) &r->poll, ingest_on_close);
+  uv_close((uv_handle_t *) &r->stop_async, ingest_on_close);
+  if (r->dispatching) {
+    // Keeps the loop running until the parser threads hand everything back.
+    collector_close_dispatch_loop();
+  }
+}
+
+static void ingest_thread(void *arg) {
+  ingest_receiver_t *r = (ingest_receiver_t *) arg;
+  char name[24];
+  snprintf(name, sizeof(name), "recv-%u", r->index);
+  affinity_apply(affinity_role_recv, name);
+  // Work queued from this thread must complete on this loop.
+  collector_set_dispatch_loop(r->loop);
+  r->dispatching = 1;
+  // Runs until the socket is closed and every queued parse has completed.
+  uv_run(r->loop, UV_RUN_DEFAULT);
+}
+
+int ingest_open_socket(const struct sockaddr *addr, int reuseport) {
+  // A socket handed over by the previous collector already has its options
+  // and datagrams that arrived during the restart.
+  int fd = handover_take_socket(SOCK_DGRAM, addr, reuseport);
+  if (fd >= 0) {
+    handover_offer_socket(fd);
+    return fd;
+  }
+  fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) {
+    LOG_ERROR("%s %d %s SO_REUSEADDR failed: %s\n", __FILE__, __LINE__, __func__, strerror(errno));
+  }
+  if (addr->sa_family == AF_INET6) {
+    // Dual-stack whatever net.ipv6.bindv6only says: IPv4 exporters arrive IPv4-mapped.
+    int zero = 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) != 0) {
+      LOG_ERROR("%s %d %s IPV6_V6ONLY failed: %s\n", __FILE__, __LINE__, __func__, strerror(errno));
+    }
+  }
+#ifdef SO_TIMESTAMPNS
+  // Stamps arrival in the kernel, before any time spent in the socket queue.
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) != 0) {
+    LOG_ERROR("%s %d %s SO_TIMESTAMPNS failed: %s\n", __FILE__, __LINE__, __func__, strerror(errno));
+  }
+#endif
+  if (reuseport) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+      int err = -errno;
+      close(fd);
+      return err;
+    }
+#else
+    close(fd);
+    return UV_ENOTSUP;
+#endif
+  }
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  socklen_t addr_len = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  if (bind(fd, addr, addr_len) != 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  handover_offer_socket(fd);
+  return fd;
+}
+
+int ingest_cmsg_timestamp(const struct cmsghdr *cmsg, uint64_t *recv_ms) {
+#ifdef SCM_TIMESTAMPNS
+  if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+    struct timespec ts;
+    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+    *recv_ms = (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+    return 1;
+  }
+#else
+  (void) cmsg;
+  (void) recv_ms;
+#endif
+  return 0;
+}
+
+/**
+ * Attaches the exporter-affinity steering program to the reuseport group of `fd`.
+ *
+ * The program loads the source address from the network header, folds it to
+ * a small hash and returns hash % sockets, i.e. the index of the socket in the
+ * group. Sockets join the group in bind order, so index i is receiver i.
+ *
+ * The network header's own version picks the address: a dual-stack socket
+ * gets IPv4 exporters as IPv4 packets, whose bytes past ip->saddr change with
+ * every datagram.
+ */
+static int ingest_attach_steering(int fd, unsigned int sockets) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+  struct sock_filter filter[] = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, (uint32_t) SKF_NET_OFF), // A = version << 4 | ihl
+      BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 2),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) SKF_NET_OFF + 12), // A = ip->saddr
+      BPF_STMT(BPF_JMP | BPF_JA, 10),
+      // Fold the four words of ip6->saddr into A.
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) SKF_NET_OFF + 8),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) SKF_NET_OFF + 12),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) SKF_NET_OFF + 16),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) SKF_NET_OFF + 20),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      // Fold A to a hash.
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 8),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, sockets),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(filter) / sizeof(filter[0]);
+  prog.filter = filter;
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+    return -errno;
+  }
+  return 0;
+#else
+  (void) fd;
+  (void) sockets;
+  return UV_ENOTSUP;
+#endif
+}
+
+static ingest_receiver_t *ingest_receiver_create(unsigned int index, const struct sockaddr *addr, unsigned int batch,
+                                                 int reuseport, const ingest_config_t *config, int *err) {
+  ingest_receiver_t *r = calloc(1, sizeof(ingest_receiver_t));
+  if (r == NULL) {
+    *err = UV_ENOMEM;
+    return NULL;
+  }
+  r->index = index;
+  r->fd = -1;
+  r->batch = batch;
+  r->msgs = calloc(batch, sizeof(struct mmsghdr));
+  r->iovs = calloc(batch, sizeof(struct iovec));
+  r->addrs = calloc(batch, sizeof(struct sockaddr_storage));
+  r->bufs = calloc(batch, sizeof(char *));
+  r->ctrls = calloc(batch, INGEST_CMSG_SPACE);
+  r->gro = config->gro;
+  r->buf_size = r->gro ? INGEST_GRO_BUFFER_SIZE : PKT_SLAB_RECV_SIZE;
+  if (!r->msgs || !r->iovs || !r->addrs || !r->bufs || !r->ctrls) {
+    ingest_receiver_free(r);
+    free(r);
+    *err = UV_ENOMEM;
+    return NULL;
+  }
+  r->fd = ingest_open_socket(addr, reuseport);
+  if (r->fd < 0) {
+    *err = r->fd;
+    r->fd = -1;
+    ingest_receiver_free(r);
+    free(r);
+    return NULL;
+  }
+  ingest_rcvbuf_init(&r->rcvbuf, r->fd, config);
+  if (r->gro) {
+    int one = 1;
+    if (setsockopt(r->fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) != 0) {
+      // Pre-5.0 kernels: plain datagrams still work through the same path.
+      LOG_ERROR("%s %d %s UDP_GRO unavailable: %s\n", __FILE__, __LINE__, __func__, strerror(errno));
+    }
+  }
+  return r;
+}
+
+/**
+ * Registers the receiver's socket and stop handle with `loop`. On failure the
+ * receiver is released once its handles have closed.
+ */
+static int ingest_receiver_attach(ingest_receiver_t *r, uv_loop_t *loop) {
+  r->loop = loop;
+  int rc = uv_async_init(loop, &r->stop_async, ingest_on_stop);
+  if (rc != 0) {
+    return rc;
+  }
+  r->stop_async.data = r;
+  r->pending_closes = 1;
+  rc = uv_poll_init(loop, &r->poll, r->fd);
+  if (rc != 0) {
+    uv_close((uv_handle_t *) &r->stop_async, ingest_on_close);
+    return rc;
+  }
+  r->poll.data = r;
+  r->pending_closes = 2;
+  rc = uv_poll_start(&r->poll, UV_READABLE, ingest_on_readable);
+  if (rc != 0) {
+    r->closing = 1;
+    uv_close((uv_handle_t *) &r->poll, ingest_on_close);
+    uv_close((uv_handle_t *) &r->stop_async, ingest_on_close);
+    return rc;
+  }
+  return 0;
+}
+
+int ingest_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  if (config->mode == ingest_mode_tpacket) {
+    return ingest_tpacket_start(loop, addr, config);
+  }
+  if (config->mode == ingest_mode_io_uring) {
+    return ingest_uring_start(loop, addr, config);
+  }
+  if (config->mode != ingest_mode_recvmmsg && config->mode != ingest_mode_xdp) {
+    return UV_EINVAL;
+  }
+  if (receiver_count != 0) {
+    return UV_EBUSY;
+  }
+  unsigned int batch = config->batch;
+  unsigned int sockets = config->sockets;
+  if (config->mode == ingest_mode_xdp) {
+    int rc = ingest_xdp_start(loop, addr, config);
+    if (rc != 0) {
+      return rc;
+    }
+    // Datagrams from other queues, or that the program passes on, still
+    // reach the stack: one socket keeps the port bound and receives them.
+    sockets = 1;
+  }
+  if (batch == 0) {
+    batch = INGEST_DEFAULT_BATCH;
+  }
+  if (batch > INGEST_MAX_BATCH) {
+    batch = INGEST_MAX_BATCH;
+  }
+  if (sockets == 0) {
+    sockets = 1;
+  }
+  if (sockets > INGEST_MAX_SOCKETS) {
+    sockets = INGEST_MAX_SOCKETS;
+  }
+  stop_requested = 0;
+
+  // Bind every socket before any of them starts receiving, so the reuseport
+  // group is complete when the steering program starts returning indexes.
+  int err = 0;
+  int reuseport = sockets > 1;
+  for (unsigned int i = 0; i < sockets; i++) {
+    receivers[i] = ingest_receiver_create(i, addr, batch, reuseport, config, &err);
+    if (receivers[i] == NULL) {
+      LOG_ERROR("%s %d %s receive socket %u: %s\n", __FILE__, __LINE__, __func__, i, uv_strerror(err));
+      for (unsigned int j = 0; j < i; j++) {
+        ingest_receiver_free(receivers[j]);
+        free(receivers[j]);
+        receivers[j] = NULL;
+      }
+      ingest_xdp_stop();
+      return err;
+    }
+  }
+  if (reuseport) {
+    int steer = ingest_attach_steering(receivers[0]->fd, sockets);
+    if (steer != 0) {
+      LOG_ERROR("%s %d %s exporter steering unavailable (%s), using the kernel reuseport hash\n", __FILE__, __LINE__,
+                __func__, uv_strerror(steer));
+    }
+  }
+
+  for (unsigned int i = 0; i < sockets; i++) {
+    ingest_receiver_t *r = receivers[i];
+    uv_loop_t *target = loop;
+    if (i > 0) {
+      target = malloc(sizeof(uv_loop_t));
+      if (target == NULL || uv_loop_init(target) != 0) {
+        free(target);
+        err = UV_ENOMEM;
+        goto fail;
+      }
+      r->owns_loop = 1;
+    }
+    err = ingest_receiver_attach(r, target);
+    if (err == 0 && r->owns_loop) {
+      err = uv_thread_create(&r->thread, ingest_thread, r);
+      if (err != 0) {
+        ingest_on_stop(&r->stop_async);
+      }
+    }
+    if (err != 0) {
+      if (r->pending_closes == 0) {
+        ingest_receiver_free(r);
+        if (!r->owns_loop) {
+          free(r);
+        }
+      }
+      if (r->owns_loop) {
+        // Let the handles that did get registered finish closing.
+        uv_run(target, UV_RUN_DEFAULT);
+        uv_loop_close(target);
+        free(target);
+        free(r);
+      }
+      receivers[i] = NULL;
+      // Sockets that never got a loop still hold their fd and buffers.
+      for (unsigned int j = i + 1; j < sockets; j++) {
+        ingest_receiver_free(receivers[j]);
+        free(receivers[j]);
+        receivers[j] = NULL;
+      }
+      goto fail;
+    }
+    receiver_count = i + 1;
+  }
+
+  LOG_INFO("%s %d %s receiving with recvmmsg on %u socket(s), batch size %u\n", __FILE__, __LINE__, __func__, sockets,
+           batch);
+  metrics_set_recv_sockets(sockets);
+  metrics_set_recv_batch_size(batch);
+  return 0;
+
+fail:
+  LOG_ERROR("%s %d %s failed to start receivers: %s\n", __FILE__, __LINE__, __func__, uv_strerror(err));
+  ingest_stop();
+  ingest_join();
+  return err;
+}
+
+void ingest_stop(void) {
+  // Only uv_async_send() here: this runs from the signal handler and must
+  // be safe to call for receivers living on other threads.
+  ingest_tpacket_stop();
+  ingest_xdp_stop();
+  ingest_uring_stop();
+  ingest_tcp_stop();
+  if (stop_requested) {
+    return;
+  }
+  stop_requested = 1;
+  for (unsigned int i = 0; i < receiver_count; i++) {
+    if (receivers[i] != NULL) {
+      uv_async_send(&receivers[i]->stop_async);
+    }
+  }
+}
+
+void ingest_join(void) {
+  for (unsigned int i = 0; i < receiver_count; i++) {
+    ingest_receiver_t *r = receivers[i];
+    if (r == NULL) {
+      continue;
+    }
+    receivers[i] = NULL;
+    if (r->owns_loop) {
+      uv_thread_join(&r->thread);
+      uv_loop_close(r->loop);
+      free(r->loop);
+      free(r);
+    }
+    // Receiver 0 is released by its close callback on the caller's loop.
+  }
+  receiver_count = 0;
+}
+
+#else // !__linux__
+
+int ingest_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  (void) loop;
+  (void) addr;
+  (void) config;
+  return UV_ENOSYS;
+}
+
+void ingest_stop(void) { ingest_tcp_stop(); }
+
+void ingest_join(void) {}
+
+#endif // __linux__
@@ -0,0 +1,217 @@
+//
+// Batched datagram receive paths that bypass uv_udp_recv_start.
+//
+
+#ifndef CNETFLOW_INGEST_H
+#define CNETFLOW_INGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+#define INGEST_DEFAULT_BATCH 32
+#define INGEST_MAX_BATCH 1024
+// Largest UDP_GRO receive: one coalesced IP datagram.
+#define INGEST_GRO_BUFFER_SIZE 65535
+// Per-receive control buffer: room for the UDP_GRO, SO_RXQ_OVFL and SO_TIMESTAMPNS messages.
+#define INGEST_CMSG_SPACE 128
+#define INGEST_MAX_SOCKETS 64
+#define INGEST_TPACKET_BLOCK_SIZE (1 << 20)
+#define INGEST_TPACKET_DEFAULT_BLOCKS 64
+#define INGEST_TPACKET_MAX_BLOCKS 4096
+#define INGEST_XDP_DEFAULT_FRAMES 4096
+#define INGEST_XDP_MAX_FRAMES (1 << 18)
+#define INGEST_URING_DEFAULT_BUFFERS 4096
+#define INGEST_URING_MAX_BUFFERS 32768
+#define INGEST_DEFAULT_RCVBUF (4 << 20)
+#define INGEST_DEFAULT_RCVBUF_MAX (64 << 20)
+// IPFIX over TCP: per-connection receive ring, a multiple of the page size
+// with room for a few messages of the largest size.
+#define INGEST_TCP_RING_SIZE (256 << 10)
+#define INGEST_TCP_MAX_MESSAGE 65535
+// Messages of one connection being parsed at once.
+#define INGEST_TCP_MAX_INFLIGHT 128
+#define INGEST_TCP_MAX_CONNECTIONS 256
+
+typedef enum {
+  ingest_mode_libuv = 0,
+  ingest_mode_recvmmsg = 1,
+  ingest_mode_tpacket = 2,
+  ingest_mode_xdp = 3,
+  ingest_mode_io_uring = 4,
+} ingest_mode_t;
+
+typedef struct {
+  ingest_mode_t mode;
+  // recvmmsg: datagrams per syscall
+  unsigned int batch;
+  // recvmmsg: sockets in the SO_REUSEPORT group
+  unsigned int sockets;
+  // recvmmsg: enable UDP_GRO and split coalesced receives into datagrams
+  int gro;
+  // tpacket, xdp: interface to capture on
+  const char *iface;
+  // tpacket: number of INGEST_TPACKET_BLOCK_SIZE blocks in the ring
+  unsigned int tpacket_blocks;
+  // xdp: receive queue the AF_XDP socket is bound to
+  unsigned int xdp_queue;
+  // xdp: number of 2 KiB UMEM frames, a power of two
+  unsigned int xdp_frames;
+  // xdp: attach in driver mode instead of generic (skb) mode
+  int xdp_native;
+  // io_uring: number of provided buffers, a power of two
+  unsigned int uring_buffers;
+  // SO_RCVBUF to request for every UDP socket, 0 keeps the kernel default
+  int rcvbuf;
+  // Cap for automatic SO_RCVBUF growth on kernel drops, 0 disables growth
+  int rcvbuf_max;
+} ingest_config_t;
+
+// Receive buffer state of one UDP socket.
+typedef struct {
+  int fd;
+  // Last size passed to SO_RCVBUF, 0 while the kernel default is in use
+  int requested;
+  int max;
+  // Last cumulative kernel drop counter seen
+  uint32_t drops;
+  uint64_t last_grow_ms;
+} ingest_rcvbuf_t;
+
+/**
+ * Parses a CNETFLOW_RECV_MODE value.
+ *
+ * @param mode The mode string ("libuv", "recvmmsg", "tpacket", "xdp" or "io_uring"). NULL selects libuv.
+ * @return The matching ingest_mode_t, or -1 if the string is not recognised.
+ */
+int ingest_parse_mode(const char *mode);
+
+/**
+ * Returns a printable name for an ingest mode.
+ */
+const char *ingest_mode_name(ingest_mode_t mode);
+
+/**
+ * Starts the receive path selected by `config->mode` for datagrams sent to `addr`.
+ *
+ * recvmmsg: opens `config->sockets` UDP sockets bound to `addr` and drains
+ * them in batches of up to `config->batch` datagrams per syscall. The first
+ * socket is served by `loop`; every additional one gets its own loop and
+ * thread, joins the SO_REUSEPORT group and is selected by a steering program
+ * that hashes the exporter source address. With `config->gro` the sockets
+ * enable UDP_GRO and every coalesced receive is split back into datagrams by
+ * udp_handle_segments().
+ *
+ * tpacket: captures on `config->iface` through a TPACKET_V3 ring and hands
+ * payloads to the parsers straight from the ring blocks.
+ *
+ * xdp: redirects the collector's datagrams on `config->iface` into an AF_XDP
+ * socket and parses them in place from its UMEM frames. A single recvmmsg
+ * socket stays bound to `addr` for datagrams the XDP program passes on.
+ *
+ * io_uring: keeps one multishot recvmsg armed on a socket bound to `addr`,
+ * receiving into a registered ring of `config->uring_buffers` provided
+ * buffers that are recycled once the datagram has been parsed.
+ *
+ * @return 0 on success, or a negative libuv error code (UV_ENOSYS when the
+ *         mode is not available on this platform or build).
+ */
+int ingest_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config);
+
+/**
+ * Asks every receiver to stop and close its socket. Async-signal-safe and
+ * idempotent; receivers finish their queued work before their loop exits.
+ */
+void ingest_stop(void);
+
+/**
+ * Waits for the receive threads started by ingest_start() to exit and
+ * releases them. Call from the thread that called ingest_start().
+ */
+void ingest_join(void);
+
+// Receive backends, selected by ingest_start().
+int ingest_tpacket_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config);
+void ingest_tpacket_stop(void);
+int ingest_xdp_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config);
+void ingest_xdp_stop(void);
+int ingest_uring_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config);
+void ingest_uring_stop(void);
+
+/**
+ * Opens a non-blocking UDP socket bound to `addr`, optionally joining its
+ * SO_REUSEPORT group, with SO_TIMESTAMPNS enabled. Shared by the backends
+ * that own their socket.
+ *
+ * @return The socket fd, or a negative errno value.
+ */
+int ingest_open_socket(const struct sockaddr *addr, int reuseport);
+
+/**
+ * @return Non-zero if `cmsg` is an SO_TIMESTAMPNS message, with the receive
+ *         time in milliseconds since the epoch in `recv_ms`.
+ */
+int ingest_cmsg_timestamp(const struct cmsghdr *cmsg, uint64_t *recv_ms);
+
+/**
+ * Applies `config->rcvbuf` to `fd` and enables SO_RXQ_OVFL, so that receives
+ * carry the socket's kernel drop counter.
+ */
+void ingest_rcvbuf_init(ingest_rcvbuf_t *b, int fd, const ingest_config_t *config);
+
+/**
+ * Sets SO_RCVBUF on `fd`, through SO_RCVBUFFORCE when the process may exceed
+ * net.core.rmem_max.
+ *
+ * @return The size the kernel reports afterwards, or a negative errno value.
+ */
+int ingest_rcvbuf_resize(int fd, int bytes);
+
+/**
+ * @return Non-zero if `cmsg` is an SO_RXQ_OVFL message, with its counter in `drops`.
+ */
+int ingest_rcvbuf_cmsg_drops(const struct cmsghdr *cmsg, uint32_t *drops);
+
+/**
+ * Records the socket's cumulative kernel drop counter: new drops are counted
+ * in the metrics and grow the buffer towards `rcvbuf_max`.
+ */
+void ingest_rcvbuf_update(ingest_rcvbuf_t *b, uint32_t drops, uint64_t now_ms);
+
+/**
+ * Reads the drop counter with SO_MEMINFO and passes it to
+ * ingest_rcvbuf_update(), for sockets whose receives bypass control messages.
+ */
+void ingest_rcvbuf_poll(ingest_rcvbuf_t *b, uint64_t now_ms);
+
+/**
+ * Listens for IPFIX exporters on TCP `addr` on `loop`, which must be the loop
+ * that dispatches to the parsers. Works alongside any UDP receive mode.
+ *
+ * @return 0 on success, or a negative libuv error code (UV_ENOSYS off Linux).
+ */
+int ingest_tcp_start(uv_loop_t *loop, const struct sockaddr *addr);
+
+/**
+ * Closes the listener and every connection. Async-signal-safe; called by
+ * ingest_stop().
+ */
+void ingest_tcp_stop(void);
+
+/**
+ * Finds the end of the IPFIX message at the start of a TCP byte stream.
+ *
+ * @return The message length once `avail` bytes hold all of it, 0 while more
+ *         bytes are needed, or -1 if `data` is not an IPFIX message header.
+ */
+int ingest_tcp_frame(const uint8_t *data, size_t avail);
+
+/**
+ * Appends the "ipfix_tcp" listener and per-connection counters to the
+ * metrics JSON in `buf` at `len`, nothing if the listener never started.
+ *
+ * @return The new length of the JSON in `buf`.
+ */
+size_t ingest_tcp_append_json(char *buf, size_t size, size_t len);
+
+#endif // CNETFLOW_INGEST_H
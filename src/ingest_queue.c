@@ -0,0 +1,513 @@
+//
+// Bounded queue between receive and parse, with load-shedding policies and
+// weighted fair dispatch across exporters.
+//
+// One queue per dispatching thread, so none of this is locked. Datagrams
+// only wait here while the parsers already have a full window of work from
+// that thread; otherwise they go straight through.
+//
+// Each exporter has its own FIFO, linked through the shared slots, and they
+// are served by deficit round-robin: on its turn an exporter earns its
+// weight times INGEST_QUEUE_QUANTUM bytes and dispatches datagrams while it
+// can pay for them, so an exporter flooding the queue only delays itself.
+// When the queue is full, an exporter under its weighted share of the slots
+// takes one from the exporter furthest over its share, so a noisy exporter
+// also loses only its own datagrams. Otherwise the overload policy applies
+// to the arriving exporter's own queue.
+//
+
+#include "ingest_queue.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#endif
+#include "exporter.h"
+#include "log.h"
+
+#define INGEST_QUEUE_NIL UINT32_MAX
+// Queue operations between two reports to the metrics.
+#define INGEST_QUEUE_REPORT_OPS 64
+
+static const char *policy_names[] = {"drop_newest", "drop_oldest", "keep_templates", "sample"};
+
+int ingest_queue_parse_policy(const char *policy) {
+  if (policy == NULL) {
+    return ingest_overload_drop_newest;
+  }
+  for (int i = 0; i < (int) (sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+    if (strcmp(policy, policy_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *ingest_queue_policy_name(ingest_overload_t policy) {
+  if ((unsigned int) policy >= sizeof(policy_names) / sizeof(policy_names[0])) {
+    return "unknown";
+  }
+  return policy_names[policy];
+}
+
+ingest_queue_t *ingest_queue_create(uint32_t capacity, ingest_overload_t policy) {
+  if (capacity == 0) {
+    return NULL;
+  }
+  ingest_queue_t *q = calloc(1, sizeof(*q));
+  if (q == NULL) {
+    return NULL;
+  }
+  q->slots = calloc(capacity, sizeof(*q->slots));
+  q->templates = calloc(capacity, sizeof(*q->templates));
+  q->owner = calloc(capacity, sizeof(*q->owner));
+  q->next = calloc(capacity, sizeof(*q->next));
+  q->prev = calloc(capacity, sizeof(*q->prev));
+  if (q->slots == NULL || q->templates == NULL || q->owner == NULL || q->next == NULL || q->prev == NULL) {
+    free(q->slots);
+    free(q->templates);
+    free(q->owner);
+    free(q->next);
+    free(q->prev);
+    free(q);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < capacity; i++) {
+    q->next[i] = i + 1 < capacity ? i + 1 : INGEST_QUEUE_NIL;
+  }
+  q->free_slot = 0;
+  q->capacity = capacity;
+  q->policy = policy;
+  q->rng = 0x9e3779b97f4a7c15ULL ^ (uint64_t) (uintptr_t) q;
+  return q;
+}
+
+void ingest_queue_destroy(ingest_queue_t *q) {
+  if (q == NULL) {
+    return;
+  }
+  if (q->count != 0) {
+    LOG_ERROR("%s %d %s destroying a queue with %u datagrams\n", __FILE__, __LINE__, __func__, q->count);
+  }
+  free(q->slots);
+  free(q->templates);
+  free(q->owner);
+  free(q->next);
+  free(q->prev);
+  free(q);
+}
+
+void ingest_queue_set_weights(ingest_queue_t *q, const ingest_weights_t *weights) { q->weights = weights; }
+
+int ingest_queue_has_templates(const uint8_t *data, size_t len) {
+  if (data == NULL || len < 4) {
+    return 0;
+  }
+  uint16_t version = (uint16_t) (data[0] << 8 | data[1]);
+  size_t offset;
+  if (version == 9) {
+    offset = 20;
+  } else if (version == 10) {
+    offset = 16;
+  } else {
+    return 0;
+  }
+  while (offset + 4 <= len) {
+    uint16_t id = (uint16_t) (data[offset] << 8 | data[offset + 1]);
+    uint16_t set_len = (uint16_t) (data[offset + 2] << 8 | data[offset + 3]);
+    // v9: 0 template, 1 options template. IPFIX: 2 template, 3 options template.
+    if ((version == 9 && id <= 1) || (version == 10 && (id == 2 || id == 3))) {
+      return 1;
+    }
+    if (set_len < 4) {
+      break;
+    }
+    offset += set_len;
+  }
+  return 0;
+}
+
+static uint16_t queue_exporter(ingest_queue_t *q, const parse_args_t *args) {
+  const uint32_t exporter = args->exporter;
+  uint32_t slot = (exporter * 2654435761u) & (INGEST_QUEUE_EXPORTERS - 1);
+  for (uint32_t probe = 0; probe < INGEST_QUEUE_EXPORTERS; probe++) {
+    uint16_t index = (uint16_t) ((slot + probe) & (INGEST_QUEUE_EXPORTERS - 1));
+    ingest_queue_exporter_t *e = &q->exporters[index];
+    if (!e->used) {
+      e->used = 1;
+      e->exporter = exporter;
+      // Weights are IPv4 prefixes; a folded IPv6 address is no IPv4 address.
+      e->weight = exporter_addr_is_v4(args->exporter_addr) ? ingest_weights_lookup(q->weights, exporter) : 1;
+      e->first = e->last = INGEST_QUEUE_NIL;
+      return index;
+    }
+    if (e->exporter == exporter) {
+      return index;
+    }
+  }
+  ingest_queue_exporter_t *overflow = &q->exporters[INGEST_QUEUE_EXPORTERS];
+  if (!overflow->used) {
+    overflow->used = 1;
+    overflow->weight = 1;
+    overflow->first = overflow->last = INGEST_QUEUE_NIL;
+  }
+  return INGEST_QUEUE_EXPORTERS;
+}
+
+static void queue_mark(ingest_queue_t *q, uint16_t index) {
+  ingest_queue_exporter_t *e = &q->exporters[index];
+  if (!e->dirty) {
+    e->dirty = 1;
+    q->dirty[q->dirty_count++] = index;
+  }
+  q->unreported++;
+}
+
+static inline uint32_t queue_cost(const ingest_queue_t *q, uint32_t slot) {
+  return (uint32_t) q->slots[slot]->args.len;
+}
+
+/**
+ * Puts an exporter that just got its first datagram into the round, at the
+ * back with a fresh quantum, or at the front when a pop is being undone.
+ */
+static void queue_activate(ingest_queue_t *q, uint16_t index, int front, uint32_t deficit) {
+  ingest_queue_exporter_t *e = &q->exporters[index];
+  uint32_t size = INGEST_QUEUE_EXPORTERS + 1;
+  if (front) {
+    q->active_head = (q->active_head + size - 1) % size;
+    q->active[q->active_head] = index;
+  } else {
+    q->active[(q->active_head + q->active_exporters) % size] = index;
+  }
+  q->active_exporters++;
+  q->active_weight += e->weight;
+  e->deficit = deficit;
+}
+
+static void queue_deactivate(ingest_queue_t *q, uint16_t index) {
+  uint32_t size = INGEST_QUEUE_EXPORTERS + 1;
+  uint32_t i = 0;
+  while (i < q->active_exporters && q->active[(q->active_head + i) % size] != index) {
+    i++;
+  }
+  if (i == q->active_exporters) {
+    return;
+  }
+  // Close the gap, keeping the round order of the others.
+  for (; i + 1 < q->active_exporters; i++) {
+    q->active[(q->active_head + i) % size] = q->active[(q->active_head + i + 1) % size];
+  }
+  q->active_exporters--;
+  q->active_weight -= q->exporters[index].weight;
+  q->exporters[index].deficit = 0;
+}
+
+static void queue_link(ingest_queue_t *q, pkt_ctx_t *ctx, uint8_t templates, int front) {
+  uint16_t index = queue_exporter(q, &ctx->args);
+  ingest_queue_exporter_t *e = &q->exporters[index];
+  uint32_t slot = q->free_slot;
+  q->free_slot = q->next[slot];
+  q->slots[slot] = ctx;
+  q->templates[slot] = templates;
+  q->owner[slot] = index;
+  if (front) {
+    q->prev[slot] = INGEST_QUEUE_NIL;
+    q->next[slot] = e->first;
+    if (e->first != INGEST_QUEUE_NIL) {
+      q->prev[e->first] = slot;
+    } else {
+      e->last = slot;
+    }
+    e->first = slot;
+  } else {
+    q->next[slot] = INGEST_QUEUE_NIL;
+    q->prev[slot] = e->last;
+    if (e->last != INGEST_QUEUE_NIL) {
+      q->next[e->last] = slot;
+    } else {
+      e->first = slot;
+    }
+    e->last = slot;
+  }
+  q->count++;
+  if (e->queued++ == 0) {
+    queue_activate(q, index, front, front ? queue_cost(q, slot) : e->weight * INGEST_QUEUE_QUANTUM);
+  } else if (front) {
+    e->deficit += queue_cost(q, slot);
+  }
+  queue_mark(q, index);
+}
+
+static pkt_ctx_t *queue_unlink(ingest_queue_t *q, uint32_t slot) {
+  uint16_t index = q->owner[slot];
+  ingest_queue_exporter_t *e = &q->exporters[index];
+  pkt_ctx_t *ctx = q->slots[slot];
+  if (q->prev[slot] != INGEST_QUEUE_NIL) {
+    q->next[q->prev[slot]] = q->next[slot];
+  } else {
+    e->first = q->next[slot];
+  }
+  if (q->next[slot] != INGEST_QUEUE_NIL) {
+    q->prev[q->next[slot]] = q->prev[slot];
+  } else {
+    e->last = q->prev[slot];
+  }
+  q->slots[slot] = NULL;
+  q->next[slot] = q->free_slot;
+  q->free_slot = slot;
+  q->count--;
+  if (--e->queued == 0) {
+    queue_deactivate(q, index);
+  }
+  queue_mark(q, index);
+  return ctx;
+}
+
+static inline uint32_t queue_random(ingest_queue_t *q) {
+  // xorshift64*
+  q->rng ^= q->rng >> 12;
+  q->rng ^= q->rng << 25;
+  q->rng ^= q->rng >> 27;
+  return (uint32_t) ((q->rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/**
+ * @return The oldest data-only datagram of exporter `index`, or INGEST_QUEUE_NIL.
+ */
+static uint32_t queue_oldest_data(const ingest_queue_t *q, uint16_t index) {
+  for (uint32_t slot = q->exporters[index].first; slot != INGEST_QUEUE_NIL; slot = q->next[slot]) {
+    if (!q->templates[slot]) {
+      return slot;
+    }
+  }
+  return INGEST_QUEUE_NIL;
+}
+
+/**
+ * @return The queued exporter holding the most slots for its weight.
+ */
+static uint16_t queue_heaviest(const ingest_queue_t *q) {
+  uint32_t size = INGEST_QUEUE_EXPORTERS + 1;
+  uint16_t heaviest = q->active[q->active_head];
+  for (uint32_t i = 1; i < q->active_exporters; i++) {
+    uint16_t index = q->active[(q->active_head + i) % size];
+    const ingest_queue_exporter_t *e = &q->exporters[index];
+    const ingest_queue_exporter_t *h = &q->exporters[heaviest];
+    if ((uint64_t) e->queued * h->weight > (uint64_t) h->queued * e->weight) {
+      heaviest = index;
+    }
+  }
+  return heaviest;
+}
+
+/**
+ * 1-in-N rate for a datagram from `args->exporter`: 1 below half full, then
+ * doubling every eighth of the queue. Exporters holding less than their
+ * weighted share of the queue are never sampled.
+ */
+static uint32_t queue_sampling_rate(ingest_queue_t *q, const parse_args_t *args) {
+  uint32_t half = q->capacity / 2;
+  if (q->count < half) {
+    return 1;
+  }
+  uint32_t rate = 2u << ((uint64_t) (q->count - half) * 8 / q->capacity);
+  if (rate > INGEST_QUEUE_MAX_SAMPLING) {
+    rate = INGEST_QUEUE_MAX_SAMPLING;
+  }
+  const ingest_queue_exporter_t *e = &q->exporters[queue_exporter(q, args)];
+  if (q->active_weight > 0 && (uint64_t) e->queued * q->active_weight < (uint64_t) q->count * e->weight) {
+    return 1;
+  }
+  return rate;
+}
+
+pkt_ctx_t *ingest_queue_offer(ingest_queue_t *q, pkt_ctx_t *ctx, metrics_drop_reason_t *reason) {
+  uint8_t templates = (uint8_t) ingest_queue_has_templates((const uint8_t *) ctx->args.data, ctx->args.len);
+  ctx->args.sampling_rate = 1;
+  if (q->policy == ingest_overload_sample && !templates) {
+    // Templates are never sampled: losing one costs every data flowset after it.
+    uint32_t rate = queue_sampling_rate(q, &ctx->args);
+    if (rate > 1 && queue_random(q) % rate != 0) {
+      *reason = metrics_drop_sampled;
+      return ctx;
+    }
+    ctx->args.sampling_rate = rate;
+  }
+  if (q->count < q->capacity) {
+    queue_link(q, ctx, templates, 0);
+    return NULL;
+  }
+  uint16_t index = queue_exporter(q, &ctx->args);
+  const ingest_queue_exporter_t *e = &q->exporters[index];
+  uint16_t heaviest = queue_heaviest(q);
+  const ingest_queue_exporter_t *h = &q->exporters[heaviest];
+  uint32_t slot = INGEST_QUEUE_NIL;
+  *reason = metrics_drop_evicted;
+  if (heaviest != index && (uint64_t) h->queued * e->weight > (uint64_t) (e->queued + 1) * h->weight) {
+    // Another exporter is over its share: it gives up its oldest datagram, a template last.
+    slot = queue_oldest_data(q, heaviest);
+    if (slot == INGEST_QUEUE_NIL && q->policy != ingest_overload_keep_templates) {
+      slot = h->first;
+    }
+  }
+  if (slot == INGEST_QUEUE_NIL && e->queued > 0) {
+    // Otherwise the policy applies to the arriving exporter's own queue.
+    if (q->policy == ingest_overload_drop_oldest) {
+      slot = e->first;
+    } else if (q->policy == ingest_overload_keep_templates && templates) {
+      // Nothing but templates queued from this exporter: the template is dropped.
+      slot = queue_oldest_data(q, index);
+    }
+  }
+  if (slot == INGEST_QUEUE_NIL) {
+    *reason = metrics_drop_queue_full;
+    return ctx;
+  }
+  pkt_ctx_t *victim = queue_unlink(q, slot);
+  queue_link(q, ctx, templates, 0);
+  return victim;
+}
+
+pkt_ctx_t *ingest_queue_pop(ingest_queue_t *q) {
+  if (q->count == 0) {
+    return NULL;
+  }
+  uint32_t size = INGEST_QUEUE_EXPORTERS + 1;
+  for (;;) {
+    uint16_t index = q->active[q->active_head];
+    ingest_queue_exporter_t *e = &q->exporters[index];
+    uint32_t cost = queue_cost(q, e->first);
+    if (e->deficit >= cost) {
+      e->deficit -= cost;
+      e->served++;
+      // An exporter that still has datagrams stays at the front for its next pop.
+      return queue_unlink(q, e->first);
+    }
+    // Its turn is over: the next exporter goes, and this one earns its next quantum.
+    e->deficit += e->weight * INGEST_QUEUE_QUANTUM;
+    q->active_head = (q->active_head + 1) % size;
+    q->active[(q->active_head + q->active_exporters - 1) % size] = index;
+  }
+}
+
+void ingest_queue_unpop(ingest_queue_t *q, pkt_ctx_t *ctx) {
+  queue_link(q, ctx, (uint8_t) ingest_queue_has_templates((const uint8_t *) ctx->args.data, ctx->args.len), 1);
+  q->exporters[queue_exporter(q, &ctx->args)].served--;
+}
+
+void ingest_queue_report(ingest_queue_t *q, int force) {
+  if (q->dirty_count == 0 || (!force && q->unreported < INGEST_QUEUE_REPORT_OPS)) {
+    return;
+  }
+  for (uint32_t i = 0; i < q->dirty_count; i++) {
+    ingest_queue_exporter_t *e = &q->exporters[q->dirty[i]];
+    metrics_add_exporter_queue(e->exporter, e->weight, (int64_t) e->queued - (int64_t) e->queued_reported,
+                               e->served - e->served_reported);
+    e->queued_reported = e->queued;
+    e->served_reported = e->served;
+    e->dirty = 0;
+  }
+  q->dirty_count = 0;
+  q->unreported = 0;
+}
+
+static int weight_rule_order(const void *a, const void *b) {
+  const ingest_weight_rule_t *x = a;
+  const ingest_weight_rule_t *y = b;
+  // Longer prefixes, i.e. larger masks, first.
+  return x->mask < y->mask ? 1 : x->mask > y->mask ? -1 : 0;
+}
+
+ingest_weights_t *ingest_weights_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    LOG_ERROR("%s %d %s cannot open exporter weights %s: %s\n", __FILE__, __LINE__, __func__, path, strerror(errno));
+    return NULL;
+  }
+  uint32_t lines = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lines++;
+  }
+  ingest_weights_t *weights = calloc(1, sizeof(*weights));
+  if (weights == NULL || (weights->rules = calloc(lines ? lines : 1, sizeof(*weights->rules))) == NULL) {
+    ingest_weights_destroy(weights);
+    fclose(f);
+    return NULL;
+  }
+
+  rewind(f);
+  uint32_t line_no = 0;
+  while (fgets(line, sizeof(line), f) != NULL && weights->count < lines) {
+    line_no++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char prefix[64];
+    char extra[2];
+    long weight;
+    int fields = sscanf(line, "%63s %ld %1s", prefix, &weight, extra);
+    if (fields <= 0) {
+      continue;
+    }
+    if (fields != 2 || weight < 1 || weight > INGEST_QUEUE_MAX_WEIGHT) {
+      LOG_ERROR("%s %d %s %s:%u: expected an IPv4 prefix and a weight from 1 to %d\n", __FILE__, __LINE__, __func__,
+                path, line_no, INGEST_QUEUE_MAX_WEIGHT);
+      continue;
+    }
+    long bits = 32;
+    char *slash = strchr(prefix, '/');
+    if (slash != NULL) {
+      char *end;
+      *slash = '\0';
+      bits = strtol(slash + 1, &end, 10);
+      if (end == slash + 1 || *end != '\0' || bits < 0 || bits > 32) {
+        LOG_ERROR("%s %d %s %s:%u: bad prefix length /%s\n", __FILE__, __LINE__, __func__, path, line_no, slash + 1);
+        continue;
+      }
+    }
+    struct in_addr addr;
+    if (uv_inet_pton(AF_INET, prefix, &addr) != 0) {
+      LOG_ERROR("%s %d %s %s:%u: not an IPv4 address: %s\n", __FILE__, __LINE__, __func__, path, line_no, prefix);
+      continue;
+    }
+    ingest_weight_rule_t *rule = &weights->rules[weights->count++];
+    rule->mask = bits == 0 ? 0 : UINT32_MAX << (32 - bits);
+    rule->network = ntohl(addr.s_addr) & rule->mask;
+    rule->weight = (uint32_t) weight;
+  }
+  fclose(f);
+  if (weights->count == 0) {
+    LOG_ERROR("%s %d %s exporter weights %s list no prefix\n", __FILE__, __LINE__, __func__, path);
+    ingest_weights_destroy(weights);
+    return NULL;
+  }
+  qsort(weights->rules, weights->count, sizeof(*weights->rules), weight_rule_order);
+  return weights;
+}
+
+uint32_t ingest_weights_lookup(const ingest_weights_t *weights, uint32_t exporter) {
+  if (weights == NULL) {
+    return 1;
+  }
+  uint32_t host = ntohl(exporter);
+  for (uint32_t i = 0; i < weights->count; i++) {
+    if ((host & weights->rules[i].mask) == weights->rules[i].network) {
+      return weights->rules[i].weight;
+    }
+  }
+  return 1;
+}
+
+void ingest_weights_destroy(ingest_weights_t *weights) {
+  if (weights == NULL) {
+    return;
+  }
+  free(weights->rules);
+  free(weights);
+}
@@ -0,0 +1,173 @@
+//
+// Bounded queue between receive and parse, with load-shedding policies and
+// weighted fair dispatch across exporters.
+//
+
+#ifndef CNETFLOW_INGEST_QUEUE_H
+#define CNETFLOW_INGEST_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+#include "pkt_slab.h"
+
+#define INGEST_QUEUE_DEFAULT_LIMIT 4096
+#define INGEST_QUEUE_MAX_LIMIT (1 << 20)
+// Exporters tracked per queue; any beyond share one extra queue.
+#define INGEST_QUEUE_EXPORTERS 1024
+// Bytes an exporter of weight 1 may dispatch per deficit round-robin round.
+#define INGEST_QUEUE_QUANTUM 1500
+#define INGEST_QUEUE_MAX_WEIGHT 1000
+// Largest 1-in-N rate the sample policy applies before it drops outright.
+#define INGEST_QUEUE_MAX_SAMPLING 16
+
+typedef enum {
+  // Full queue: the arriving datagram is dropped.
+  ingest_overload_drop_newest = 0,
+  // Full queue: the oldest queued datagram is dropped to make room.
+  ingest_overload_drop_oldest = 1,
+  // Full queue: datagrams carrying template flowsets evict the oldest data-only one.
+  ingest_overload_keep_templates = 2,
+  // Past half full: exporters above their fair share are sampled 1-in-N.
+  ingest_overload_sample = 3,
+} ingest_overload_t;
+
+// Dispatch weight of the exporters in one IPv4 prefix.
+typedef struct {
+  // Host byte order
+  uint32_t network;
+  uint32_t mask;
+  uint32_t weight;
+} ingest_weight_rule_t;
+
+// Exporter weights, longest prefix first. Read-only once loaded.
+typedef struct {
+  ingest_weight_rule_t *rules;
+  uint32_t count;
+} ingest_weights_t;
+
+typedef struct {
+  uint32_t exporter;
+  uint32_t queued;
+  int used;
+  uint32_t weight;
+  // Bytes it may still dispatch in its current round.
+  uint32_t deficit;
+  // Its queued datagrams, oldest first, linked through the slots.
+  uint32_t first;
+  uint32_t last;
+  // Datagrams dispatched, and the depth and count last reported to the metrics.
+  uint64_t served;
+  uint64_t served_reported;
+  uint32_t queued_reported;
+  int dirty;
+} ingest_queue_exporter_t;
+
+typedef struct {
+  pkt_ctx_t **slots;
+  // Per slot: non-zero if the datagram carries template flowsets.
+  uint8_t *templates;
+  // Per slot: the exporter queue it is on, and its neighbours there.
+  uint16_t *owner;
+  uint32_t *next;
+  uint32_t *prev;
+  uint32_t free_slot;
+  uint32_t capacity;
+  uint32_t count;
+  ingest_overload_t policy;
+  uint64_t rng;
+  const ingest_weights_t *weights;
+  // Exporters with at least one datagram queued, in round-robin order, and their total weight.
+  uint32_t active_exporters;
+  uint32_t active_head;
+  uint32_t active_weight;
+  uint16_t active[INGEST_QUEUE_EXPORTERS + 1];
+  // Exporters whose counters changed since they were last reported.
+  uint32_t dirty_count;
+  uint32_t unreported;
+  uint16_t dirty[INGEST_QUEUE_EXPORTERS + 1];
+  // The last entry holds every exporter that found the table full.
+  ingest_queue_exporter_t exporters[INGEST_QUEUE_EXPORTERS + 1];
+} ingest_queue_t;
+
+/**
+ * Parses a CNETFLOW_OVERLOAD_POLICY value.
+ *
+ * @param policy "drop_newest", "drop_oldest", "keep_templates" or "sample". NULL selects drop_newest.
+ * @return The matching ingest_overload_t, or -1 if the string is not recognised.
+ */
+int ingest_queue_parse_policy(const char *policy);
+
+/**
+ * Returns a printable name for an overload policy.
+ */
+const char *ingest_queue_policy_name(ingest_overload_t policy);
+
+/**
+ * @return A queue holding up to `capacity` datagrams, or NULL if out of memory.
+ */
+ingest_queue_t *ingest_queue_create(uint32_t capacity, ingest_overload_t policy);
+
+/**
+ * Frees the queue. It must be empty.
+ */
+void ingest_queue_destroy(ingest_queue_t *q);
+
+/**
+ * Weighs exporters by `weights` from now on; exporters already seen keep
+ * their weight. NULL gives every exporter weight 1.
+ */
+void ingest_queue_set_weights(ingest_queue_t *q, const ingest_weights_t *weights);
+
+/**
+ * Queues `ctx`, whose args describe the datagram, applying the overload
+ * policy. Admitted datagrams get args.sampling_rate set to the 1-in-N rate
+ * they were sampled at.
+ *
+ * @param reason Set to why the returned context was dropped.
+ * @return NULL if `ctx` was queued with nothing dropped, otherwise the context
+ *         the caller must release and count: `ctx` itself or an evicted one.
+ */
+pkt_ctx_t *ingest_queue_offer(ingest_queue_t *q, pkt_ctx_t *ctx, metrics_drop_reason_t *reason);
+
+/**
+ * @return The next context by deficit round-robin across exporters, each
+ *         exporter's own in arrival order, or NULL if the queue is empty.
+ */
+pkt_ctx_t *ingest_queue_pop(ingest_queue_t *q);
+
+/**
+ * Puts a context just popped by ingest_queue_pop() back at the head.
+ */
+void ingest_queue_unpop(ingest_queue_t *q, pkt_ctx_t *ctx);
+
+/**
+ * @return Non-zero if the NetFlow v9 or IPFIX datagram carries a template or
+ *         options template flowset.
+ */
+int ingest_queue_has_templates(const uint8_t *data, size_t len);
+
+/**
+ * Sends the per-exporter depth and dispatch counts that changed to the
+ * metrics, at most every few dozen operations unless `force` is set.
+ */
+void ingest_queue_report(ingest_queue_t *q, int force);
+
+/**
+ * Loads exporter weights, one IPv4 address or prefix and a weight from 1 to
+ * INGEST_QUEUE_MAX_WEIGHT per line, e.g. "192.0.2.0/24 4". Blank lines and
+ * text after '#' are ignored; malformed lines are logged and skipped.
+ *
+ * @return The weights, or NULL if the file cannot be read or has no rule.
+ */
+ingest_weights_t *ingest_weights_load(const char *path);
+
+/**
+ * @return The weight of the longest prefix containing `exporter`, in network
+ *         byte order, or 1 if none does.
+ */
+uint32_t ingest_weights_lookup(const ingest_weights_t *weights, uint32_t exporter);
+
+void ingest_weights_destroy(ingest_weights_t *weights);
+
+#endif // CNETFLOW_INGEST_QUEUE_H
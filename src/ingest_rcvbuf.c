@@ -0,0 +1,151 @@
+//
+// Receive buffer sizing and kernel drop accounting for the UDP sockets.
+//
+// Datagrams the kernel drops because a socket's receive queue is full never
+// reach udp_handle(), so none of the collector's own counters see them. Every
+// socket enables SO_RXQ_OVFL: the kernel then attaches its cumulative drop
+// counter to each receive as a control message. The libuv receive path cannot
+// see control messages, so there the same counter is polled with SO_MEMINFO.
+//
+// Whenever the counter moves, the socket's buffer is doubled, at most once a
+// second and never past the configured cap.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ingest.h"
+
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#endif
+#include "log.h"
+#include "metrics.h"
+
+// Minimum time between two automatic increases of the same socket's buffer.
+#define INGEST_RCVBUF_GROW_INTERVAL_MS 1000
+
+int ingest_rcvbuf_resize(int fd, int bytes) {
+#ifndef _WIN32
+#ifdef SO_RCVBUFFORCE
+  // Needs CAP_NET_ADMIN but is not capped by net.core.rmem_max.
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) != 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) != 0) {
+    return -errno;
+  }
+#else
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) != 0) {
+    return -errno;
+  }
+#endif
+  int effective = 0;
+  socklen_t len = sizeof(effective);
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &effective, &len) != 0) {
+    return -errno;
+  }
+  return effective;
+#else
+  (void) fd;
+  (void) bytes;
+  return UV_ENOTSUP;
+#endif
+}
+
+void ingest_rcvbuf_init(ingest_rcvbuf_t *b, int fd, const ingest_config_t *config) {
+  memset(b, 0, sizeof(*b));
+  b->fd = fd;
+  b->max = config->rcvbuf_max;
+  if (config->rcvbuf > 0) {
+    int effective = ingest_rcvbuf_resize(fd, config->rcvbuf);
+    if (effective < 0) {
+      LOG_ERROR("%s %d %s SO_RCVBUF %d failed: %s\n", __FILE__, __LINE__, __func__, config->rcvbuf,
+                uv_strerror(effective));
+    } else {
+      b->requested = config->rcvbuf;
+      // Linux doubles the request for bookkeeping; anything less means rmem_max capped it.
+      if (effective < config->rcvbuf) {
+        LOG_ERROR("%s %d %s receive buffer capped at %d bytes (requested %d), raise net.core.rmem_max or grant "
+                  "CAP_NET_ADMIN\n",
+                  __FILE__, __LINE__, __func__, effective, config->rcvbuf);
+      }
+      metrics_set_recv_buffer(effective);
+    }
+  }
+#ifdef SO_RXQ_OVFL
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0) {
+    LOG_ERROR("%s %d %s SO_RXQ_OVFL unavailable: %s\n", __FILE__, __LINE__, __func__, strerror(errno));
+  }
+#endif
+}
+
+int ingest_rcvbuf_cmsg_drops(const struct cmsghdr *cmsg, uint32_t *drops) {
+#ifdef SO_RXQ_OVFL
+  if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+    memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+    return 1;
+  }
+#else
+  (void) cmsg;
+  (void) drops;
+#endif
+  return 0;
+}
+
+void ingest_rcvbuf_update(ingest_rcvbuf_t *b, uint32_t drops, uint64_t now_ms) {
+  // The counter is cumulative and wraps at 2^32.
+  uint32_t delta = drops - b->drops;
+  if (delta == 0 || delta > UINT32_MAX / 2) {
+    // Unchanged, or an older value from earlier in the same batch.
+    return;
+  }
+  b->drops = drops;
+  metrics_inc_kernel_drops(delta);
+  if (b->max <= 0 || now_ms - b->last_grow_ms < INGEST_RCVBUF_GROW_INTERVAL_MS) {
+    return;
+  }
+  if (b->requested == 0) {
+    int current = 0;
+    socklen_t len = sizeof(current);
+    if (getsockopt(b->fd, SOL_SOCKET, SO_RCVBUF, &current, &len) != 0) {
+      return;
+    }
+    // getsockopt() reports the doubled value.
+    b->requested = current / 2;
+  }
+  if (b->requested >= b->max) {
+    return;
+  }
+  int next = b->requested > b->max / 2 ? b->max : b->requested * 2;
+  int effective = ingest_rcvbuf_resize(b->fd, next);
+  b->last_grow_ms = now_ms;
+  if (effective < 0) {
+    LOG_ERROR("%s %d %s growing receive buffer to %d failed: %s\n", __FILE__, __LINE__, __func__, next,
+              uv_strerror(effective));
+    return;
+  }
+  b->requested = next;
+  LOG_INFO("%s %d %s %u kernel drops on fd %d, receive buffer raised to %d bytes\n", __FILE__, __LINE__, __func__, delta,
+           b->fd, effective);
+  metrics_set_recv_buffer(effective);
+}
+
+void ingest_rcvbuf_poll(ingest_rcvbuf_t *b, uint64_t now_ms) {
+#if defined(__linux__) && defined(SO_MEMINFO)
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+  if (getsockopt(b->fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) != 0 || len <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+    return;
+  }
+  ingest_rcvbuf_update(b, meminfo[SK_MEMINFO_DROPS], now_ms);
+#else
+  (void) b;
+  (void) now_ms;
+#endif
+}
@@ -0,0 +1,412 @@
+//
+// AF_PACKET TPACKET_V3 ingest mode.
+//
+// The kernel writes matching frames into a memory-mapped ring of blocks that
+// is shared with the collector. A classic BPF filter on the packet socket only
+// lets IPv4/UDP datagrams for the configured port (and address) through. When
+// a block is handed to user space, every datagram in it is dispatched to the
+// parsers with its payload pointing straight into the block: no per-packet
+// copy and no per-packet allocation. Each block carries a reference count of
+// the datagrams still being parsed and goes back to the kernel when the last
+// one is released from after_work_cb.
+//
+// A regular UDP socket stays bound to the collector port with a drop-all
+// filter, so exporters do not get ICMP port unreachable replies and the
+// kernel does not queue a second copy of every datagram.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ingest.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collector.h"
+#include "log.h"
+#include "metrics.h"
+
+#if defined(HAVE_TPACKET) && defined(__linux__)
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_TPACKET) && defined(__linux__) && defined(TPACKET3_HDRLEN)
+
+#define TPACKET_FRAME_SIZE 2048
+// Maximum time the kernel keeps a partially filled block before handing it
+// over, so that low-rate exporters are not delayed behind a 1 MiB block.
+#define TPACKET_BLOCK_TIMEOUT_MS 10
+// Link-layer type of frames captured on an Ethernet (or loopback) interface.
+#define TPACKET_LINKTYPE_EN10MB 1
+
+typedef struct ingest_tpacket_s ingest_tpacket_t;
+
+typedef struct {
+  struct tpacket_block_desc *desc;
+  ingest_tpacket_t *owner;
+  // Datagrams from this block that are still being parsed, plus one while
+  // the block is being walked.
+  volatile int refs;
+} tpacket_block_t;
+
+struct ingest_tpacket_s {
+  uv_poll_t poll;
+  uv_async_t stop_async;
+  int fd;
+  int sink_fd;
+  uint8_t *map;
+  size_t map_len;
+  unsigned int block_count;
+  unsigned int next_block;
+  tpacket_block_t *blocks;
+  volatile int blocks_in_use;
+  int closing;
+  int pending_closes;
+};
+
+static ingest_tpacket_t *tpacket = NULL;
+
+static void tpacket_unmap(ingest_tpacket_t *t) {
+  if (t->map != NULL) {
+    munmap(t->map, t->map_len);
+    t->map = NULL;
+  }
+  if (t->fd >= 0) {
+    close(t->fd);
+    t->fd = -1;
+  }
+  free(t->blocks);
+  free(t);
+}
+
+/**
+ * Drops one reference on a ring block. The last reference hands the block
+ * back to the kernel. Used as the collector_release_cb of every datagram
+ * dispatched from the ring.
+ */
+static void tpacket_release(void *ctx, void *data) {
+  tpacket_block_t *block = (tpacket_block_t *) ctx;
+  (void) data;
+  if (__sync_sub_and_fetch(&block->refs, 1) != 0) {
+    return;
+  }
+  ingest_tpacket_t *owner = block->owner;
+  // Parsers are done with the block's contents before the kernel may reuse it.
+  __sync_synchronize();
+  block->desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+  if (__sync_sub_and_fetch(&owner->blocks_in_use, 1) == 0 && owner->closing && owner->pending_closes == 0) {
+    tpacket_unmap(owner);
+  }
+}
+
+static void tpacket_walk_block(ingest_tpacket_t *t, tpacket_block_t *block) {
+  struct tpacket_block_desc *desc = block->desc;
+  uint32_t num_pkts = desc->hdr.bh1.num_pkts;
+  uint8_t *ptr = (uint8_t *) desc + desc->hdr.bh1.offset_to_first_pkt;
+  uint64_t dispatched = 0;
+
+  block->refs = 1;
+  __sync_fetch_and_add(&t->blocks_in_use, 1);
+  for (uint32_t i = 0; i < num_pkts; i++) {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) ptr;
+    struct sockaddr_ll *sll = (struct sockaddr_ll *) (ptr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    ptr += hdr->tp_next_offset;
+    // Frames we transmit ourselves show up on loopback as well.
+    if (sll->sll_pkttype == PACKET_OUTGOING) {
+      continue;
+    }
+    const uint8_t *payload = NULL;
+    struct sockaddr_in src;
+    int len = collector_udp_payload((uint8_t *) hdr + hdr->tp_mac, hdr->tp_snaplen, TPACKET_LINKTYPE_EN10MB,
+                                    &payload, &src);
+    if (len <= 0) {
+      continue;
+    }
+    __sync_fetch_and_add(&block->refs, 1);
+    // The ring stamps every frame on arrival.
+    collector_set_receive_time((uint64_t) hdr->tp_sec * 1000 + hdr->tp_nsec / 1000000);
+    // Parsers byte-swap in place; the block is ours until it is released.
+    collector_dispatch((char *) payload, len, (const struct sockaddr *) &src, 0, tpacket_release, block);
+    dispatched++;
+  }
+  collector_set_receive_time(0);
+  if (dispatched) {
+    metrics_inc_recv_batch(dispatched);
+  }
+  // Drop the walker's reference.
+  tpacket_release(block, NULL);
+}
+
+static void tpacket_on_readable(uv_poll_t *handle, int status, int events) {
+  ingest_tpacket_t *t = (ingest_tpacket_t *) handle->data;
+  (void) events;
+  if (status < 0) {
+    LOG_ERROR("%s %d %s poll error: %s\n", __FILE__, __LINE__, __func__, uv_strerror(status));
+    return;
+  }
+  // Blocks are filled in ring order; stop at the first one the kernel still owns.
+  for (unsigned int n = 0; n < t->block_count && !t->closing; n++) {
+    tpacket_block_t *block = &t->blocks[t->next_block];
+    if (block->refs != 0 || (block->desc->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+      break;
+    }
+    __sync_synchronize();
+    tpacket_walk_block(t, block);
+    t->next_block = (t->next_block + 1) % t->block_count;
+  }
+}
+
+static void tpacket_on_close(uv_handle_t *handle) {
+  ingest_tpacket_t *t = (ingest_tpacket_t *) handle->data;
+  if (--t->pending_closes > 0) {
+    return;
+  }
+  if (t->sink_fd >= 0) {
+    close(t->sink_fd);
+    t->sink_fd = -1;
+  }
+  // Blocks still referenced by parsers keep the mapping alive; the last
+  // tpacket_release() unmaps it.
+  if (t->blocks_in_use == 0) {
+    tpacket_unmap(t);
+  }
+}
+
+static void tpacket_on_stop(uv_async_t *handle) {
+  ingest_tpacket_t *t = (ingest_tpacket_t *) handle->data;
+  if (t->closing) {
+    return;
+  }
+  t->closing = 1;
+  uv_poll_stop(&t->poll);
+  uv_close((uv_handle_t *) &t->poll, tpacket_on_close);
+  uv_close((uv_handle_t *) &t->stop_async, tpacket_on_close);
+}
+
+/**
+ * Attaches a filter that accepts unfragmented IPv4/UDP frames sent to the
+ * bind port, and to the bind address unless it is INADDR_ANY.
+ */
+static int tpacket_attach_filter(int fd, const struct sockaddr_in *addr) {
+  struct sock_filter code[16];
+  unsigned int n = 0;
+  unsigned int drop_jumps[8];
+  unsigned int drops = 0;
+
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12); // ethertype
+  drop_jumps[drops++] = n;
+  code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 0);
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23); // ip->protocol
+  drop_jumps[drops++] = n;
+  code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 0);
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20); // ip->frag_off
+  // Fragments carry no (or a partial) UDP header: jump straight to drop.
+  unsigned int frag_jump = n;
+  code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 0, 0);
+  if (addr->sin_addr.s_addr != htonl(INADDR_ANY)) {
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 30); // ip->daddr
+    drop_jumps[drops++] = n;
+    code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(addr->sin_addr.s_addr), 0, 0);
+  }
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14); // X = ip header length
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16); // udp->dest
+  drop_jumps[drops++] = n;
+  code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(addr->sin_port), 0, 0);
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffff);
+  unsigned int drop = n;
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+
+  for (unsigned int i = 0; i < drops; i++) {
+    code[drop_jumps[i]].jf = (uint8_t) (drop - drop_jumps[i] - 1);
+  }
+  code[frag_jump].jt = (uint8_t) (drop - frag_jump - 1);
+
+  struct sock_fprog prog = {.len = (unsigned short) n, .filter = code};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+/**
+ * Binds a UDP socket to the collector address that never queues anything, so
+ * the port is reported as open while the ring does the actual receiving.
+ */
+static int tpacket_open_sink(const struct sockaddr_in *addr) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  struct sock_filter drop_all[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+  struct sock_fprog prog = {.len = 1, .filter = drop_all};
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0 ||
+      bind(fd, (const struct sockaddr *) addr, sizeof(*addr)) != 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  return fd;
+}
+
+int ingest_tpacket_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  if (tpacket != NULL) {
+    return UV_EBUSY;
+  }
+  if (addr->sa_family != AF_INET) {
+    LOG_ERROR("%s %d %s tpacket mode only supports IPv4 bind addresses\n", __FILE__, __LINE__, __func__);
+    return UV_EAFNOSUPPORT;
+  }
+  if (config->iface == NULL || *config->iface == '\0') {
+    LOG_ERROR("%s %d %s tpacket mode requires CNETFLOW_TPACKET_IFACE\n", __FILE__, __LINE__, __func__);
+    return UV_EINVAL;
+  }
+  unsigned int ifindex = if_nametoindex(config->iface);
+  if (ifindex == 0) {
+    LOG_ERROR("%s %d %s unknown interface %s\n", __FILE__, __LINE__, __func__, config->iface);
+    return UV_ENODEV;
+  }
+  const struct sockaddr_in *addr4 = (const struct sockaddr_in *) addr;
+  unsigned int block_count = config->tpacket_blocks ? config->tpacket_blocks : INGEST_TPACKET_DEFAULT_BLOCKS;
+
+  ingest_tpacket_t *t = calloc(1, sizeof(ingest_tpacket_t));
+  if (t == NULL) {
+    return UV_ENOMEM;
+  }
+  t->fd = -1;
+  t->sink_fd = -1;
+  t->block_count = block_count;
+  t->blocks = calloc(block_count, sizeof(tpacket_block_t));
+  if (t->blocks == NULL) {
+    tpacket_unmap(t);
+    return UV_ENOMEM;
+  }
+
+  int err;
+  t->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, htons(ETH_P_IP));
+  if (t->fd < 0) {
+    err = -errno;
+    goto fail;
+  }
+  // Filter before the ring exists, so it never sees unrelated traffic.
+  err = tpacket_attach_filter(t->fd, addr4);
+  if (err != 0) {
+    goto fail;
+  }
+  int version = TPACKET_V3;
+  if (setsockopt(t->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+    err = -errno;
+    goto fail;
+  }
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = INGEST_TPACKET_BLOCK_SIZE;
+  req.tp_block_nr = block_count;
+  req.tp_frame_size = TPACKET_FRAME_SIZE;
+  req.tp_frame_nr = (INGEST_TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE) * block_count;
+  req.tp_retire_blk_tov = TPACKET_BLOCK_TIMEOUT_MS;
+  if (setsockopt(t->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+    err = -errno;
+    goto fail;
+  }
+  t->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+  t->map = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, t->fd, 0);
+  if (t->map == MAP_FAILED) {
+    // MAP_LOCKED needs RLIMIT_MEMLOCK headroom; the ring works without it.
+    t->map = mmap(NULL, t->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, t->fd, 0);
+  }
+  if (t->map == MAP_FAILED) {
+    t->map = NULL;
+    err = -errno;
+    goto fail;
+  }
+  for (unsigned int i = 0; i < block_count; i++) {
+    t->blocks[i].desc = (struct tpacket_block_desc *) (t->map + (size_t) i * req.tp_block_size);
+    t->blocks[i].owner = t;
+  }
+
+  struct sockaddr_ll ll;
+  memset(&ll, 0, sizeof(ll));
+  ll.sll_family = AF_PACKET;
+  ll.sll_protocol = htons(ETH_P_IP);
+  ll.sll_ifindex = (int) ifindex;
+  if (bind(t->fd, (struct sockaddr *) &ll, sizeof(ll)) != 0) {
+    err = -errno;
+    goto fail;
+  }
+
+  t->sink_fd = tpacket_open_sink(addr4);
+  if (t->sink_fd < 0) {
+    LOG_ERROR("%s %d %s could not reserve udp port %d: %s\n", __FILE__, __LINE__, __func__, ntohs(addr4->sin_port),
+              uv_strerror(t->sink_fd));
+    t->sink_fd = -1;
+  }
+
+  err = uv_async_init(loop, &t->stop_async, tpacket_on_stop);
+  if (err != 0) {
+    goto fail;
+  }
+  t->stop_async.data = t;
+  t->pending_closes = 1;
+  err = uv_poll_init(loop, &t->poll, t->fd);
+  if (err != 0) {
+    // Only the async handle exists; its close callback releases the ring.
+    t->closing = 1;
+    uv_close((uv_handle_t *) &t->stop_async, tpacket_on_close);
+    return err;
+  }
+  t->poll.data = t;
+  t->pending_closes = 2;
+  err = uv_poll_start(&t->poll, UV_READABLE, tpacket_on_readable);
+  if (err != 0) {
+    tpacket_on_stop(&t->stop_async);
+    return err;
+  }
+
+  tpacket = t;
+  LOG_INFO("%s %d %s receiving with TPACKET_V3 on %s, %u blocks of %d bytes\n", __FILE__, __LINE__, __func__,
+           config->iface, block_count, INGEST_TPACKET_BLOCK_SIZE);
+  return 0;
+
+fail:
+  LOG_ERROR("%s %d %s %s\n", __FILE__, __LINE__, __func__, uv_strerror(err));
+  if (t->sink_fd >= 0) {
+    close(t->sink_fd);
+  }
+  tpacket_unmap(t);
+  return err;
+}
+
+void ingest_tpacket_stop(void) {
+  ingest_tpacket_t *t = tpacket;
+  if (t == NULL) {
+    return;
+  }
+  tpacket = NULL;
+  uv_async_send(&t->stop_async);
+}
+
+#else // !HAVE_TPACKET
+
+int ingest_tpacket_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  (void) loop;
+  (void) addr;
+  (void) config;
+  LOG_ERROR("cnetflow was built without TPACKET_V3 support.\n");
+  return UV_ENOSYS;
+}
+
+void ingest_tpacket_stop(void) {}
+
+#endif // HAVE_TPACKET
@@ -0,0 +1,465 @@
+//
+// io_uring ingest mode.
+//
+// A single multishot IORING_OP_RECVMSG stays armed on the collector socket
+// and picks its buffers from a provided-buffer ring registered with the
+// kernel. The buffers come from one fixed pool allocated at startup: every
+// completion names the buffer the datagram landed in, the parsers decode it
+// in place and the buffer goes straight back to the ring when after_work_cb
+// releases it. There is no syscall per datagram, no arena allocation and no
+// allocator lock on the receive path.
+//
+// The ring fd is watched with uv_poll, so completions are reaped on the
+// collector loop like every other receive path. The ring is driven with raw
+// io_uring_setup/io_uring_enter/io_uring_register calls (no liburing).
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ingest.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collector.h"
+#include "handover.h"
+#include "log.h"
+#include "metrics.h"
+#include "pkt_slab.h"
+
+#if defined(HAVE_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Each pool buffer holds the io_uring_recvmsg_out header, the source
+// address and a jumbo-sized payload.
+#define URING_BUF_SIZE (PKT_SLAB_JUMBO_SIZE + 1024)
+#define URING_BUF_GROUP 0
+#define URING_SQ_ENTRIES 8
+#define URING_TAG_RECV 1
+
+typedef struct {
+  uv_poll_t poll;
+  uv_async_t stop_async;
+  int ring_fd;
+  int sock_fd;
+  // SQ and CQ rings
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  // Provided-buffer ring and the pool behind it
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  uint32_t buf_mask;
+  uint8_t *pool;
+  size_t pool_len;
+  unsigned int buffers;
+  struct msghdr msg;
+  ingest_rcvbuf_t rcvbuf;
+  int armed;
+  int buffers_in_flight;
+  int closing;
+  int pending_closes;
+} ingest_uring_t;
+
+static ingest_uring_t *uring = NULL;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(ingest_uring_t *u) {
+  if (u->ring_fd >= 0) {
+    close(u->ring_fd);
+  }
+  if (u->sock_fd >= 0) {
+    handover_withdraw_socket(u->sock_fd);
+    close(u->sock_fd);
+  }
+  if (u->sqes) {
+    munmap(u->sqes, u->sqes_len);
+  }
+  if (u->cq_map && u->cq_map != u->sq_map) {
+    munmap(u->cq_map, u->cq_map_len);
+  }
+  if (u->sq_map) {
+    munmap(u->sq_map, u->sq_map_len);
+  }
+  if (u->buf_ring) {
+    munmap(u->buf_ring, u->buf_ring_len);
+  }
+  if (u->pool) {
+    munmap(u->pool, u->pool_len);
+  }
+  free(u);
+}
+
+/**
+ * Queues the multishot recvmsg. It stays armed until the kernel runs out of
+ * provided buffers or hits an error, which the completion reports by
+ * clearing IORING_CQE_F_MORE.
+ */
+static int uring_arm(ingest_uring_t *u) {
+  uint32_t tail = *u->sq_tail;
+  uint32_t index = tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = u->sock_fd;
+  sqe->addr = (uint64_t) (uintptr_t) &u->msg;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = URING_TAG_RECV;
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  if (uring_enter(u->ring_fd, 1) < 0) {
+    return -errno;
+  }
+  u->armed = 1;
+  return 0;
+}
+
+static void uring_buf_push(ingest_uring_t *u, uint16_t bid) {
+  uint16_t tail = u->buf_ring->tail;
+  struct io_uring_buf *buf = &u->buf_ring->bufs[tail & u->buf_mask];
+  buf->addr = (uint64_t) (uintptr_t) (u->pool + (size_t) bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  // Publish the entry before the new tail.
+  __atomic_store_n(&u->buf_ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Hands the buffer holding `data` back to the provided-buffer ring. Used as
+ * the collector_release_cb of every datagram dispatched from the ring; it
+ * always runs on the collector loop, so the ring needs no lock.
+ */
+static void uring_release(void *ctx, void *data) {
+  ingest_uring_t *u = (ingest_uring_t *) ctx;
+  uint16_t bid = (uint16_t) (((uint8_t *) data - u->pool) / URING_BUF_SIZE);
+  u->buffers_in_flight--;
+  if (u->closing) {
+    if (u->buffers_in_flight == 0 && u->pending_closes == 0) {
+      uring_free(u);
+    }
+    return;
+  }
+  uring_buf_push(u, bid);
+  // The receive stopped with ENOBUFS; there is a buffer again.
+  if (!u->armed) {
+    int rc = uring_arm(u);
+    if (rc != 0) {
+      LOG_ERROR("%s %d %s re-arming recvmsg failed: %s\n", __FILE__, __LINE__, __func__, uv_strerror(rc));
+    }
+  }
+}
+
+static void uring_on_readable(uv_poll_t *handle, int status, int events) {
+  ingest_uring_t *u = (ingest_uring_t *) handle->data;
+  (void) events;
+  if (status < 0) {
+    LOG_ERROR("%s %d %s poll error: %s\n", __FILE__, __LINE__, __func__, uv_strerror(status));
+    return;
+  }
+  uint32_t head = *u->cq_head;
+  uint32_t tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  uint64_t received = 0;
+  // Without a kernel timestamp every completion of the batch shares one clock read.
+  uint64_t batch_ms = 0;
+  int rearm = 0;
+  for (; head != tail; head++) {
+    const struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    if (cqe->user_data != URING_TAG_RECV) {
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      // Multishot ended: re-arm now unless it ran out of buffers, in which
+      // case the next uring_release() does it.
+      u->armed = 0;
+      rearm = cqe->res != -ENOBUFS;
+    }
+    if (cqe->res < 0) {
+      if (cqe->res != -ENOBUFS) {
+        LOG_ERROR("%s %d %s recvmsg: %s\n", __FILE__, __LINE__, __func__, strerror(-cqe->res));
+      }
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+      continue;
+    }
+    uint16_t bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    uint8_t *buf = u->pool + (size_t) bid * URING_BUF_SIZE;
+    const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *) buf;
+    uint8_t *payload = buf + sizeof(*out) + u->msg.msg_namelen + u->msg.msg_controllen;
+    u->buffers_in_flight++;
+    uint64_t recv_ms = 0;
+    if (out->controllen > 0) {
+      struct msghdr ctrl;
+      memset(&ctrl, 0, sizeof(ctrl));
+      ctrl.msg_control = buf + sizeof(*out) + u->msg.msg_namelen;
+      ctrl.msg_controllen = out->controllen;
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&ctrl); cmsg != NULL; cmsg = CMSG_NXTHDR(&ctrl, cmsg)) {
+        uint32_t drops;
+        if (ingest_rcvbuf_cmsg_drops(cmsg, &drops)) {
+          ingest_rcvbuf_update(&u->rcvbuf, drops, uv_now(handle->loop));
+        } else {
+          ingest_cmsg_timestamp(cmsg, &recv_ms);
+        }
+      }
+    }
+    if (u->closing || (out->flags & MSG_TRUNC) || out->payloadlen == 0) {
+      uring_release(u, payload);
+      continue;
+    }
+    const struct sockaddr *src = (const struct sockaddr *) (buf + sizeof(*out));
+    if (recv_ms == 0) {
+      if (batch_ms == 0) {
+        batch_ms = collector_clock_ms();
+      }
+      recv_ms = batch_ms;
+    }
+    collector_set_receive_time(recv_ms);
+    // Parsers byte-swap in place; the buffer is ours until it is released.
+    collector_dispatch((char *) payload, (ssize_t) out->payloadlen, src, 0, uring_release, u);
+    received++;
+  }
+  collector_set_receive_time(0);
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  if (received) {
+    metrics_inc_recv_batch(received);
+  }
+  if (rearm && !u->armed && !u->closing) {
+    int rc = uring_arm(u);
+    if (rc != 0) {
+      LOG_ERROR("%s %d %s re-arming recvmsg failed: %s\n", __FILE__, __LINE__, __func__, uv_strerror(rc));
+    }
+  }
+}
+
+static void uring_on_close(uv_handle_t *handle) {
+  ingest_uring_t *u = (ingest_uring_t *) handle->data;
+  if (--u->pending_closes > 0) {
+    return;
+  }
+  // Closing the socket ends the multishot receive.
+  handover_withdraw_socket(u->sock_fd);
+  close(u->sock_fd);
+  u->sock_fd = -1;
+  // Buffers still being parsed keep the pool alive; the last uring_release() frees it.
+  if (u->buffers_in_flight == 0) {
+    uring_free(u);
+  }
+}
+
+static void uring_on_stop(uv_async_t *handle) {
+  ingest_uring_t *u = (ingest_uring_t *) handle->data;
+  if (u->closing) {
+    return;
+  }
+  u->closing = 1;
+  uv_poll_stop(&u->poll);
+  uv_close((uv_handle_t *) &u->poll, uring_on_close);
+  uv_close((uv_handle_t *) &u->stop_async, uring_on_close);
+}
+
+static int uring_map_rings(ingest_uring_t *u, const struct io_uring_params *p) {
+  u->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+  u->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_map_len > u->sq_map_len) {
+      u->sq_map_len = u->cq_map_len;
+    }
+    u->cq_map_len = u->sq_map_len;
+  }
+  u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                   IORING_OFF_SQ_RING);
+  if (u->sq_map == MAP_FAILED) {
+    u->sq_map = NULL;
+    return -errno;
+  }
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_map = u->sq_map;
+  } else {
+    u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                     IORING_OFF_CQ_RING);
+    if (u->cq_map == MAP_FAILED) {
+      u->cq_map = NULL;
+      return -errno;
+    }
+  }
+  u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    return -errno;
+  }
+  uint8_t *sq = u->sq_map;
+  uint8_t *cq = u->cq_map;
+  u->sq_head = (uint32_t *) (sq + p->sq_off.head);
+  u->sq_tail = (uint32_t *) (sq + p->sq_off.tail);
+  u->sq_mask = *(uint32_t *) (sq + p->sq_off.ring_mask);
+  u->sq_array = (uint32_t *) (sq + p->sq_off.array);
+  u->cq_head = (uint32_t *) (cq + p->cq_off.head);
+  u->cq_tail = (uint32_t *) (cq + p->cq_off.tail);
+  u->cq_mask = *(uint32_t *) (cq + p->cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+  return 0;
+}
+
+static int uring_register_buffers(ingest_uring_t *u) {
+  u->pool_len = (size_t) u->buffers * URING_BUF_SIZE;
+  u->pool = mmap(NULL, u->pool_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (u->pool == MAP_FAILED) {
+    u->pool = NULL;
+    return -errno;
+  }
+  u->buf_ring_len = u->buffers * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->buf_ring == MAP_FAILED) {
+    u->buf_ring = NULL;
+    return -errno;
+  }
+  u->buf_mask = u->buffers - 1;
+  u->buf_ring->tail = 0;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+  reg.ring_entries = u->buffers;
+  reg.bgid = URING_BUF_GROUP;
+  if (uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    return -errno;
+  }
+  for (unsigned int i = 0; i < u->buffers; i++) {
+    uring_buf_push(u, (uint16_t) i);
+  }
+  return 0;
+}
+
+int ingest_uring_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  if (uring != NULL) {
+    return UV_EBUSY;
+  }
+  unsigned int buffers = config->uring_buffers ? config->uring_buffers : INGEST_URING_DEFAULT_BUFFERS;
+  if ((buffers & (buffers - 1)) || buffers > INGEST_URING_MAX_BUFFERS) {
+    LOG_ERROR("%s %d %s CNETFLOW_URING_BUFFERS must be a power of two up to %d\n", __FILE__, __LINE__, __func__,
+              INGEST_URING_MAX_BUFFERS);
+    return UV_EINVAL;
+  }
+
+  ingest_uring_t *u = calloc(1, sizeof(ingest_uring_t));
+  if (u == NULL) {
+    return UV_ENOMEM;
+  }
+  u->ring_fd = -1;
+  u->buffers = buffers;
+  int err;
+
+  u->sock_fd = ingest_open_socket(addr, 0);
+  if (u->sock_fd < 0) {
+    err = u->sock_fd;
+    goto fail;
+  }
+  ingest_rcvbuf_init(&u->rcvbuf, u->sock_fd, config);
+  // Every datagram completes on its own CQE; size the CQ so a full pool of
+  // completions never overflows it.
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = buffers * 2;
+  u->ring_fd = uring_setup(URING_SQ_ENTRIES, &params);
+  if (u->ring_fd < 0) {
+    err = -errno;
+    goto fail;
+  }
+  if ((err = uring_map_rings(u, &params)) != 0 || (err = uring_register_buffers(u)) != 0) {
+    goto fail;
+  }
+  // Only the lengths matter: with IOSQE_BUFFER_SELECT the kernel lays the
+  // source address, the SO_RXQ_OVFL and SO_TIMESTAMPNS control messages and
+  // the payload out in the selected buffer.
+  u->msg.msg_namelen = sizeof(struct sockaddr_in6);
+  u->msg.msg_controllen = CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec));
+
+  err = uv_async_init(loop, &u->stop_async, uring_on_stop);
+  if (err != 0) {
+    goto fail;
+  }
+  u->stop_async.data = u;
+  u->pending_closes = 1;
+  err = uv_poll_init(loop, &u->poll, u->ring_fd);
+  if (err != 0) {
+    u->closing = 1;
+    uv_close((uv_handle_t *) &u->stop_async, uring_on_close);
+    return err;
+  }
+  u->poll.data = u;
+  u->pending_closes = 2;
+  err = uv_poll_start(&u->poll, UV_READABLE, uring_on_readable);
+  if (err == 0) {
+    err = uring_arm(u);
+  }
+  if (err != 0) {
+    uring_on_stop(&u->stop_async);
+    return err;
+  }
+
+  uring = u;
+  LOG_INFO("%s %d %s receiving with io_uring multishot recvmsg, %u provided buffers\n", __FILE__, __LINE__, __func__,
+           buffers);
+  metrics_set_recv_sockets(1);
+  return 0;
+
+fail:
+  LOG_ERROR("%s %d %s %s\n", __FILE__, __LINE__, __func__, uv_strerror(err));
+  uring_free(u);
+  return err;
+}
+
+void ingest_uring_stop(void) {
+  ingest_uring_t *u = uring;
+  if (u == NULL) {
+    return;
+  }
+  uring = NULL;
+  uv_async_send(&u->stop_async);
+}
+
+#else // !HAVE_IO_URING
+
+int ingest_uring_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  (void) loop;
+  (void) addr;
+  (void) config;
+  LOG_ERROR("cnetflow was built without io_uring support.\n");
+  return UV_ENOSYS;
+}
+
+void ingest_uring_stop(void) {}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,235 @@
+//
+// Checks run on the receive thread before a datagram is handed to the parsers.
+//
+// Both checks only read the datagram: a spoofed source or a malformed header
+// is dropped before a packet context is borrowed or any work is queued.
+//
+
+#include "ingest_validate.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+#include "log.h"
+
+static inline uint16_t read_u16(const uint8_t *p) { return (uint16_t) (p[0] << 8 | p[1]); }
+
+static ingest_invalid_t validate_v5(const uint8_t *data, size_t len) {
+  if (len < INGEST_V5_HEADER_SIZE) {
+    return ingest_invalid_length;
+  }
+  uint16_t count = read_u16(data + 2);
+  if (count == 0 || count > INGEST_V5_MAX_RECORDS) {
+    return ingest_invalid_count;
+  }
+  if (len < INGEST_V5_HEADER_SIZE + (size_t) count * INGEST_V5_RECORD_SIZE) {
+    return ingest_invalid_count;
+  }
+  return ingest_valid;
+}
+
+static ingest_invalid_t validate_v9(const uint8_t *data, size_t len) {
+  if (len < INGEST_V9_HEADER_SIZE + 4) {
+    return ingest_invalid_length;
+  }
+  size_t offset = INGEST_V9_HEADER_SIZE;
+  // Exporters may pad the datagram after the last flowset.
+  while (offset + 4 <= len) {
+    uint16_t id = read_u16(data + offset);
+    uint16_t set_len = read_u16(data + offset + 2);
+    // 0 template, 1 options template, 2-255 reserved, 256 and up data.
+    if ((id > 1 && id < 256) || set_len < 4 || offset + set_len > len) {
+      return ingest_invalid_set;
+    }
+    offset += set_len;
+  }
+  return ingest_valid;
+}
+
+static ingest_invalid_t validate_ipfix(const uint8_t *data, size_t len) {
+  if (len < INGEST_IPFIX_HEADER_SIZE + 4 || read_u16(data + 2) != len) {
+    return ingest_invalid_length;
+  }
+  size_t offset = INGEST_IPFIX_HEADER_SIZE;
+  // Sets fill the message exactly; padding lives inside them.
+  while (offset < len) {
+    if (offset + 4 > len) {
+      return ingest_invalid_set;
+    }
+    uint16_t id = read_u16(data + offset);
+    uint16_t set_len = read_u16(data + offset + 2);
+    // 2 template, 3 options template, 256 and up data; 0, 1 and 4-255 are reserved.
+    if ((id < 2 || (id > 3 && id < 256)) || set_len < 4 || offset + set_len > len) {
+      return ingest_invalid_set;
+    }
+    offset += set_len;
+  }
+  return ingest_valid;
+}
+
+ingest_invalid_t ingest_validate_header(const uint8_t *data, size_t len) {
+  if (data == NULL || len < 2) {
+    return ingest_invalid_length;
+  }
+  switch (read_u16(data)) {
+    case 5:
+      return validate_v5(data, len);
+    case 9:
+      return validate_v9(data, len);
+    case 10:
+      return validate_ipfix(data, len);
+    default:
+      return ingest_invalid_version;
+  }
+}
+
+const char *ingest_invalid_name(ingest_invalid_t reason) {
+  switch (reason) {
+    case ingest_valid:
+      return "valid";
+    case ingest_invalid_version:
+      return "version";
+    case ingest_invalid_length:
+      return "length";
+    case ingest_invalid_count:
+      return "count";
+    case ingest_invalid_set:
+      return "set";
+    default:
+      return "unknown";
+  }
+}
+
+static uint32_t allowlist_hash(const uint8_t key[16]) {
+  uint32_t words[4];
+  memcpy(words, key, sizeof(words));
+  uint32_t h = words[0] * 2654435761u;
+  h = (h ^ words[1]) * 2654435761u;
+  h = (h ^ words[2]) * 2654435761u;
+  h = (h ^ words[3]) * 2654435761u;
+  return h ^ (h >> 16);
+}
+
+/**
+ * Writes the 16-byte key of `addr`: IPv6 as is, IPv4 as an IPv4-mapped address.
+ */
+static int allowlist_key(const struct sockaddr *addr, uint8_t key[16]) {
+  if (addr->sa_family == AF_INET) {
+    memset(key, 0, 10);
+    key[10] = 0xff;
+    key[11] = 0xff;
+    memcpy(key + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    return 0;
+  }
+  if (addr->sa_family == AF_INET6) {
+    memcpy(key, &((const struct sockaddr_in6 *) addr)->sin6_addr, 16);
+    return 0;
+  }
+  return -1;
+}
+
+static void allowlist_insert(ingest_allowlist_t *list, const uint8_t key[16]) {
+  uint32_t slot = allowlist_hash(key) & list->mask;
+  while (list->used[slot]) {
+    if (memcmp(list->keys[slot], key, 16) == 0) {
+      return;
+    }
+    slot = (slot + 1) & list->mask;
+  }
+  memcpy(list->keys[slot], key, 16);
+  list->used[slot] = 1;
+  list->count++;
+}
+
+ingest_allowlist_t *ingest_allowlist_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    LOG_ERROR("%s %d %s cannot open exporter allowlist %s: %s\n", __FILE__, __LINE__, __func__, path, strerror(errno));
+    return NULL;
+  }
+  // Two passes: count the lines to size the table at most half full.
+  uint32_t lines = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lines++;
+  }
+  uint32_t capacity = 16;
+  while (capacity < lines * 2) {
+    capacity <<= 1;
+  }
+  ingest_allowlist_t *list = calloc(1, sizeof(*list));
+  if (list == NULL || (list->keys = calloc(capacity, 16)) == NULL || (list->used = calloc(capacity, 1)) == NULL) {
+    ingest_allowlist_destroy(list);
+    fclose(f);
+    return NULL;
+  }
+  list->mask = capacity - 1;
+
+  rewind(f);
+  uint32_t line_no = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line_no++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char *start = line + strspn(line, " \t\r\n");
+    size_t n = strcspn(start, " \t\r\n");
+    if (n == 0) {
+      continue;
+    }
+    start[n] = '\0';
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    uint8_t key[16];
+    memset(&addr6, 0, sizeof(addr6));
+    memset(&addr4, 0, sizeof(addr4));
+    if (uv_inet_pton(AF_INET, start, &addr4.sin_addr) == 0) {
+      addr4.sin_family = AF_INET;
+      allowlist_key((const struct sockaddr *) &addr4, key);
+    } else if (uv_inet_pton(AF_INET6, start, &addr6.sin6_addr) == 0) {
+      addr6.sin6_family = AF_INET6;
+      allowlist_key((const struct sockaddr *) &addr6, key);
+    } else {
+      LOG_ERROR("%s %d %s %s:%u: not an IP address: %s\n", __FILE__, __LINE__, __func__, path, line_no, start);
+      continue;
+    }
+    allowlist_insert(list, key);
+  }
+  fclose(f);
+  if (list->count == 0) {
+    LOG_ERROR("%s %d %s exporter allowlist %s lists no address\n", __FILE__, __LINE__, __func__, path);
+    ingest_allowlist_destroy(list);
+    return NULL;
+  }
+  return list;
+}
+
+int ingest_allowlist_contains(const ingest_allowlist_t *list, const struct sockaddr *addr) {
+  uint8_t key[16];
+  if (addr == NULL || allowlist_key(addr, key) != 0) {
+    return 0;
+  }
+  uint32_t slot = allowlist_hash(key) & list->mask;
+  while (list->used[slot]) {
+    if (memcmp(list->keys[slot], key, 16) == 0) {
+      return 1;
+    }
+    slot = (slot + 1) & list->mask;
+  }
+  return 0;
+}
+
+void ingest_allowlist_destroy(ingest_allowlist_t *list) {
+  if (list == NULL) {
+    return;
+  }
+  free(list->keys);
+  free(list->used);
+  free(list);
+}
@@ -0,0 +1,70 @@
+//
+// Checks run on the receive thread before a datagram is handed to the parsers.
+//
+
+#ifndef CNETFLOW_INGEST_VALIDATE_H
+#define CNETFLOW_INGEST_VALIDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// NetFlow v5 exporters send at most 30 records per datagram.
+#define INGEST_V5_MAX_RECORDS 30
+#define INGEST_V5_HEADER_SIZE 24
+#define INGEST_V5_RECORD_SIZE 48
+#define INGEST_V9_HEADER_SIZE 20
+#define INGEST_IPFIX_HEADER_SIZE 16
+
+// Why a datagram failed header validation.
+typedef enum {
+  ingest_valid = 0,
+  // Not NetFlow v5, v9 or IPFIX.
+  ingest_invalid_version = 1,
+  // Shorter than its header, or not the length the header declares.
+  ingest_invalid_length = 2,
+  // v5 record count out of range or past the end of the datagram.
+  ingest_invalid_count = 3,
+  // v9 flowset or IPFIX set with a reserved id or a length that overruns the datagram.
+  ingest_invalid_set = 4,
+} ingest_invalid_t;
+
+// Exporter addresses allowed to send, as an open-addressing set of IPv6 or
+// IPv4-mapped addresses. Read-only once loaded, so lookups take no lock.
+typedef struct {
+  uint8_t (*keys)[16];
+  uint8_t *used;
+  uint32_t mask;
+  uint32_t count;
+} ingest_allowlist_t;
+
+/**
+ * Checks the header of a NetFlow v5, v9 or IPFIX datagram against its length:
+ * the v5 record count, every v9 flowset and IPFIX set header, and the IPFIX
+ * message length. Record contents are left to the parsers.
+ *
+ * @return ingest_valid, or why the datagram must be dropped.
+ */
+ingest_invalid_t ingest_validate_header(const uint8_t *data, size_t len);
+
+/**
+ * Returns a printable name for a validation result.
+ */
+const char *ingest_invalid_name(ingest_invalid_t reason);
+
+/**
+ * Loads an allowlist with one IPv4 or IPv6 address per line. Blank lines and
+ * text after '#' are ignored; malformed lines are logged and skipped.
+ *
+ * @return The allowlist, or NULL if the file cannot be read or lists no address.
+ */
+ingest_allowlist_t *ingest_allowlist_load(const char *path);
+
+/**
+ * @return Non-zero if the source address of `addr` is on the list.
+ */
+int ingest_allowlist_contains(const ingest_allowlist_t *list, const struct sockaddr *addr);
+
+void ingest_allowlist_destroy(ingest_allowlist_t *list);
+
+#endif // CNETFLOW_INGEST_VALIDATE_H
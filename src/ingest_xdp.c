@@ -0,0 +1,482 @@
+//
+// AF_XDP ingest mode.
+//
+// A small XDP program, assembled here and loaded with the bpf() syscall,
+// redirects unfragmented IPv4/UDP frames for the collector port (and address)
+// into an AF_XDP socket through an XSKMAP; everything else continues up the
+// stack. The socket receives into a UMEM region owned by the collector, and
+// the parsers decode every datagram in place from its UMEM frame. The frame
+// goes back to the fill ring when after_work_cb releases it, so the receive
+// path does no allocation and no copy in user space.
+//
+// The program is attached in generic (skb) mode by default, which works on
+// any interface including veth pairs and loopback. Frames arriving on other
+// queues than CNETFLOW_XDP_QUEUE are passed to the stack and picked up by the
+// fallback socket that ingest.c keeps open.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "ingest.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collector.h"
+#include "log.h"
+#include "metrics.h"
+
+#if defined(HAVE_XDP) && defined(__linux__)
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_FRAME_SIZE 2048
+// Frames are handed to the stack when the socket is missing from the map.
+#define XDP_ACTION_PASS 2
+// Link-layer type of frames on an Ethernet, veth or loopback interface.
+#define XDP_LINKTYPE_EN10MB 1
+
+typedef struct {
+  volatile uint32_t *producer;
+  volatile uint32_t *consumer;
+  void *ring;
+  uint32_t mask;
+  void *map;
+  size_t map_len;
+} xdp_ring_t;
+
+typedef struct {
+  uv_poll_t poll;
+  uv_async_t stop_async;
+  int xsk_fd;
+  int map_fd;
+  int prog_fd;
+  int link_fd;
+  uint8_t *umem;
+  size_t umem_len;
+  unsigned int frames;
+  xdp_ring_t rx;
+  xdp_ring_t fill;
+  xdp_ring_t comp;
+  // Serialises fill ring producers: frames come back from after_work_cb and
+  // from the drop paths of collector_dispatch().
+  uv_mutex_t fill_mutex;
+  volatile int frames_in_flight;
+  int closing;
+  int pending_closes;
+} ingest_xdp_t;
+
+static ingest_xdp_t *xdp = NULL;
+
+static long xdp_bpf(int cmd, union bpf_attr *attr) { return syscall(__NR_bpf, cmd, attr, sizeof(*attr)); }
+
+#define XDP_INSN(c, d, s, o, i)                                                                                        \
+  ((struct bpf_insn) {.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+
+/**
+ * Assembles and loads the redirect program.
+ *
+ * Frames that are IPv4 without options, UDP, unfragmented and addressed to
+ * the bind port (and address unless INADDR_ANY) are redirected to the XSKMAP
+ * slot of their receive queue; anything else returns XDP_PASS.
+ */
+static int xdp_load_program(int map_fd, const struct sockaddr_in *addr) {
+  struct bpf_insn prog[40];
+  int pass_jumps[10];
+  int n = 0;
+  int jumps = 0;
+
+  prog[n++] = XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 0, 0); // data
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, 4, 0); // data_end
+  prog[n++] = XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+  prog[n++] = XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 14 + 20 + 8);
+  pass_jumps[jumps++] = n;
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0); // ethertype
+  pass_jumps[jumps++] = n;
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(0x0800));
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14, 0); // version/ihl
+  pass_jumps[jumps++] = n;
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45);
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 23, 0); // protocol
+  pass_jumps[jumps++] = n;
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_UDP);
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 20, 0); // frag_off
+  pass_jumps[jumps++] = n;
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 36, 0); // udp dest
+  pass_jumps[jumps++] = n;
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, addr->sin_port);
+  if (addr->sin_addr.s_addr != htonl(INADDR_ANY)) {
+    prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, 30, 0); // daddr
+    // 64-bit immediate with a zero upper half, so addresses with the top bit set compare correctly.
+    prog[n++] = XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_4, 0, 0, (int32_t) addr->sin_addr.s_addr);
+    prog[n++] = XDP_INSN(0, 0, 0, 0, 0);
+    pass_jumps[jumps++] = n;
+    prog[n++] = XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 0, 0);
+  }
+  prog[n++] = XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 16, 0); // rx_queue_index
+  prog[n++] = XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+  prog[n++] = XDP_INSN(0, 0, 0, 0, 0);
+  prog[n++] = XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_ACTION_PASS);
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  int pass = n;
+  prog[n++] = XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_ACTION_PASS);
+  prog[n++] = XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  for (int i = 0; i < jumps; i++) {
+    prog[pass_jumps[i]].off = (int16_t) (pass - pass_jumps[i] - 1);
+  }
+
+  static char log_buf[4096];
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insn_cnt = (uint32_t) n;
+  attr.insns = (uint64_t) (uintptr_t) prog;
+  attr.license = (uint64_t) (uintptr_t) "GPL";
+  attr.log_buf = (uint64_t) (uintptr_t) log_buf;
+  attr.log_size = sizeof(log_buf);
+  attr.log_level = 1;
+  log_buf[0] = '\0';
+  int fd = (int) xdp_bpf(BPF_PROG_LOAD, &attr);
+  if (fd < 0) {
+    int err = -errno;
+    LOG_ERROR("%s %d %s BPF_PROG_LOAD failed: %s\n%s\n", __FILE__, __LINE__, __func__, strerror(errno), log_buf);
+    return err;
+  }
+  return fd;
+}
+
+static int xdp_map_ring(int fd, xdp_ring_t *ring, const struct xdp_ring_offset *off, uint32_t entries,
+                        size_t entry_size, uint64_t pgoff) {
+  ring->map_len = off->desc + entries * entry_size;
+  ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, (off_t) pgoff);
+  if (ring->map == MAP_FAILED) {
+    ring->map = NULL;
+    return -errno;
+  }
+  ring->producer = (volatile uint32_t *) ((uint8_t *) ring->map + off->producer);
+  ring->consumer = (volatile uint32_t *) ((uint8_t *) ring->map + off->consumer);
+  ring->ring = (uint8_t *) ring->map + off->desc;
+  ring->mask = entries - 1;
+  return 0;
+}
+
+static void xdp_fill_push(ingest_xdp_t *x, uint64_t addr) {
+  uv_mutex_lock(&x->fill_mutex);
+  uint32_t prod = *x->fill.producer;
+  ((uint64_t *) x->fill.ring)[prod & x->fill.mask] = addr;
+  // Publish the descriptor before the new producer index.
+  __atomic_store_n(x->fill.producer, prod + 1, __ATOMIC_RELEASE);
+  uv_mutex_unlock(&x->fill_mutex);
+}
+
+static void xdp_free(ingest_xdp_t *x) {
+  if (x->link_fd >= 0) {
+    close(x->link_fd);
+  }
+  if (x->prog_fd >= 0) {
+    close(x->prog_fd);
+  }
+  if (x->map_fd >= 0) {
+    close(x->map_fd);
+  }
+  if (x->rx.map) {
+    munmap(x->rx.map, x->rx.map_len);
+  }
+  if (x->fill.map) {
+    munmap(x->fill.map, x->fill.map_len);
+  }
+  if (x->comp.map) {
+    munmap(x->comp.map, x->comp.map_len);
+  }
+  if (x->xsk_fd >= 0) {
+    close(x->xsk_fd);
+  }
+  if (x->umem) {
+    munmap(x->umem, x->umem_len);
+  }
+  uv_mutex_destroy(&x->fill_mutex);
+  free(x);
+}
+
+/**
+ * Returns the UMEM frame holding `data` to the fill ring. Used as the
+ * collector_release_cb of every datagram dispatched from the socket.
+ */
+static void xdp_release(void *ctx, void *data) {
+  ingest_xdp_t *x = (ingest_xdp_t *) ctx;
+  uint64_t frame = (uint64_t) ((uint8_t *) data - x->umem) & ~((uint64_t) XDP_FRAME_SIZE - 1);
+  if (x->closing) {
+    if (__sync_sub_and_fetch(&x->frames_in_flight, 1) == 0 && x->pending_closes == 0) {
+      xdp_free(x);
+    }
+    return;
+  }
+  xdp_fill_push(x, frame);
+  __sync_sub_and_fetch(&x->frames_in_flight, 1);
+}
+
+static void xdp_on_readable(uv_poll_t *handle, int status, int events) {
+  ingest_xdp_t *x = (ingest_xdp_t *) handle->data;
+  (void) events;
+  if (status < 0) {
+    LOG_ERROR("%s %d %s poll error: %s\n", __FILE__, __LINE__, __func__, uv_strerror(status));
+    return;
+  }
+  uint32_t cons = *x->rx.consumer;
+  uint32_t prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+  if (cons == prod) {
+    return;
+  }
+  uint64_t received = 0;
+  // AF_XDP frames carry no timestamp: the whole batch shares one clock read.
+  collector_set_receive_time(collector_clock_ms());
+  for (; cons != prod && !x->closing; cons++) {
+    const struct xdp_desc *desc = &((struct xdp_desc *) x->rx.ring)[cons & x->rx.mask];
+    uint8_t *frame = x->umem + desc->addr;
+    const uint8_t *payload = NULL;
+    struct sockaddr_in src;
+    __sync_fetch_and_add(&x->frames_in_flight, 1);
+    int len = collector_udp_payload(frame, desc->len, XDP_LINKTYPE_EN10MB, &payload, &src);
+    if (len <= 0) {
+      xdp_release(x, frame);
+      continue;
+    }
+    // Parsers byte-swap in place; the frame is ours until it is released.
+    collector_dispatch((char *) payload, len, (const struct sockaddr *) &src, 0, xdp_release, x);
+    received++;
+  }
+  collector_set_receive_time(0);
+  // Descriptors are consumed; their frames stay ours until xdp_release().
+  __atomic_store_n(x->rx.consumer, cons, __ATOMIC_RELEASE);
+  if (received) {
+    metrics_inc_recv_batch(received);
+  }
+}
+
+static void xdp_on_close(uv_handle_t *handle) {
+  ingest_xdp_t *x = (ingest_xdp_t *) handle->data;
+  if (--x->pending_closes > 0) {
+    return;
+  }
+  // Detach first so the interface stops redirecting into a dead socket.
+  if (x->link_fd >= 0) {
+    close(x->link_fd);
+    x->link_fd = -1;
+  }
+  // Frames still being parsed keep the UMEM alive; the last xdp_release() frees it.
+  if (x->frames_in_flight == 0) {
+    xdp_free(x);
+  }
+}
+
+static void xdp_on_stop(uv_async_t *handle) {
+  ingest_xdp_t *x = (ingest_xdp_t *) handle->data;
+  if (x->closing) {
+    return;
+  }
+  x->closing = 1;
+  uv_poll_stop(&x->poll);
+  uv_close((uv_handle_t *) &x->poll, xdp_on_close);
+  uv_close((uv_handle_t *) &x->stop_async, xdp_on_close);
+}
+
+int ingest_xdp_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  if (xdp != NULL) {
+    return UV_EBUSY;
+  }
+  if (addr->sa_family != AF_INET) {
+    LOG_ERROR("%s %d %s xdp mode only supports IPv4 bind addresses\n", __FILE__, __LINE__, __func__);
+    return UV_EAFNOSUPPORT;
+  }
+  if (config->iface == NULL || *config->iface == '\0') {
+    LOG_ERROR("%s %d %s xdp mode requires CNETFLOW_XDP_IFACE\n", __FILE__, __LINE__, __func__);
+    return UV_EINVAL;
+  }
+  unsigned int ifindex = if_nametoindex(config->iface);
+  if (ifindex == 0) {
+    LOG_ERROR("%s %d %s unknown interface %s\n", __FILE__, __LINE__, __func__, config->iface);
+    return UV_ENODEV;
+  }
+  unsigned int frames = config->xdp_frames ? config->xdp_frames : INGEST_XDP_DEFAULT_FRAMES;
+  if (frames & (frames - 1)) {
+    LOG_ERROR("%s %d %s CNETFLOW_XDP_FRAMES must be a power of two\n", __FILE__, __LINE__, __func__);
+    return UV_EINVAL;
+  }
+
+  ingest_xdp_t *x = calloc(1, sizeof(ingest_xdp_t));
+  if (x == NULL) {
+    return UV_ENOMEM;
+  }
+  x->xsk_fd = x->map_fd = x->prog_fd = x->link_fd = -1;
+  x->frames = frames;
+  uv_mutex_init(&x->fill_mutex);
+  int err;
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = config->xdp_queue + 1;
+  x->map_fd = (int) xdp_bpf(BPF_MAP_CREATE, &attr);
+  if (x->map_fd < 0) {
+    err = -errno;
+    goto fail;
+  }
+  x->prog_fd = xdp_load_program(x->map_fd, (const struct sockaddr_in *) addr);
+  if (x->prog_fd < 0) {
+    err = x->prog_fd;
+    goto fail;
+  }
+
+  x->umem_len = (size_t) frames * XDP_FRAME_SIZE;
+  x->umem = mmap(NULL, x->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (x->umem == MAP_FAILED) {
+    x->umem = NULL;
+    err = -errno;
+    goto fail;
+  }
+  x->xsk_fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (x->xsk_fd < 0) {
+    err = -errno;
+    goto fail;
+  }
+  struct xdp_umem_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.addr = (uint64_t) (uintptr_t) x->umem;
+  reg.len = x->umem_len;
+  reg.chunk_size = XDP_FRAME_SIZE;
+  reg.headroom = 0;
+  uint32_t ring_size = frames;
+  if (setsockopt(x->xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0 ||
+      setsockopt(x->xsk_fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) != 0 ||
+      setsockopt(x->xsk_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) != 0 ||
+      setsockopt(x->xsk_fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) != 0) {
+    err = -errno;
+    goto fail;
+  }
+  struct xdp_mmap_offsets off;
+  socklen_t off_len = sizeof(off);
+  if (getsockopt(x->xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) != 0) {
+    err = -errno;
+    goto fail;
+  }
+  if ((err = xdp_map_ring(x->xsk_fd, &x->rx, &off.rx, ring_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)) != 0 ||
+      (err = xdp_map_ring(x->xsk_fd, &x->fill, &off.fr, ring_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING)) !=
+          0 ||
+      (err = xdp_map_ring(x->xsk_fd, &x->comp, &off.cr, ring_size, sizeof(uint64_t),
+                          XDP_UMEM_PGOFF_COMPLETION_RING)) != 0) {
+    goto fail;
+  }
+  // Hand every frame to the kernel up front.
+  for (unsigned int i = 0; i < frames; i++) {
+    xdp_fill_push(x, (uint64_t) i * XDP_FRAME_SIZE);
+  }
+
+  struct sockaddr_xdp sxdp;
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = config->xdp_queue;
+  sxdp.sxdp_flags = config->xdp_native ? 0 : XDP_COPY;
+  if (bind(x->xsk_fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) != 0) {
+    err = -errno;
+    goto fail;
+  }
+  uint32_t key = config->xdp_queue;
+  uint32_t value = (uint32_t) x->xsk_fd;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = (uint32_t) x->map_fd;
+  attr.key = (uint64_t) (uintptr_t) &key;
+  attr.value = (uint64_t) (uintptr_t) &value;
+  if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+    err = -errno;
+    goto fail;
+  }
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = (uint32_t) x->prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = config->xdp_native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+  x->link_fd = (int) xdp_bpf(BPF_LINK_CREATE, &attr);
+  if (x->link_fd < 0) {
+    err = -errno;
+    goto fail;
+  }
+
+  err = uv_async_init(loop, &x->stop_async, xdp_on_stop);
+  if (err != 0) {
+    goto fail;
+  }
+  x->stop_async.data = x;
+  x->pending_closes = 1;
+  err = uv_poll_init(loop, &x->poll, x->xsk_fd);
+  if (err != 0) {
+    x->closing = 1;
+    uv_close((uv_handle_t *) &x->stop_async, xdp_on_close);
+    return err;
+  }
+  x->poll.data = x;
+  x->pending_closes = 2;
+  err = uv_poll_start(&x->poll, UV_READABLE, xdp_on_readable);
+  if (err != 0) {
+    xdp_on_stop(&x->stop_async);
+    return err;
+  }
+
+  xdp = x;
+  LOG_INFO("%s %d %s receiving with AF_XDP on %s queue %u (%s mode), %u frames\n", __FILE__, __LINE__, __func__,
+           config->iface, config->xdp_queue, config->xdp_native ? "driver" : "generic", frames);
+  return 0;
+
+fail:
+  LOG_ERROR("%s %d %s %s\n", __FILE__, __LINE__, __func__, uv_strerror(err));
+  xdp_free(x);
+  return err;
+}
+
+void ingest_xdp_stop(void) {
+  ingest_xdp_t *x = xdp;
+  if (x == NULL) {
+    return;
+  }
+  xdp = NULL;
+  uv_async_send(&x->stop_async);
+}
+
+#else // !HAVE_XDP
+
+int ingest_xdp_start(uv_loop_t *loop, const struct sockaddr *addr, const ingest_config_t *config) {
+  (void) loop;
+  (void) addr;
+  (void) config;
+  LOG_ERROR("cnetflow was built without AF_XDP support.\n");
+  return UV_ENOSYS;
+}
+
+void ingest_xdp_stop(void) {}
+
+#endif // HAVE_XDP
@@ -1,6 +1,8 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "collector.h"
+#include "ingest.h"
 #include "log.h"
 #include <string.h>
 
@@ -32,6 +34,18 @@ void print_compile_options(void) {
     printf("  Metrics: OFF\n");
 #endif
 
+    printf("  Receive modes: libuv recvmmsg");
+#ifdef HAVE_TPACKET
+    printf(" tpacket");
+#endif
+#ifdef HAVE_XDP
+    printf(" xdp");
+#endif
+#ifdef HAVE_IO_URING
+    printf(" io_uring");
+#endif
+    printf("\n");
+
 #ifdef BUILD_STATIC
     printf("  Build type: STATIC\n");
 #else
@@ -66,6 +80,14 @@ int main(int argc, char *argv[]) {
     if (strcmp(argv[i], "--options") == 0 || strcmp(argv[i], "-o") == 0) {
       print_compile_options();
       return 0;
+    } else if (strcmp(argv[i], "--recv-mode") == 0 && i + 1 < argc) {
+      const char *recv_mode = argv[++i];
+      if (ingest_parse_mode(recv_mode) < 0) {
+        printf("Usage: %s [--options|-o] [--recv-mode libuv|recvmmsg|tpacket|xdp|io_uring]\n", argv[0]);
+        return 1;
+      }
+      // collector_start() reads the receive configuration from the environment.
+      setenv("CNETFLOW_RECV_MODE", recv_mode, 1);
     }   /*else if (strcmp(argv[i], "--pcap") == 0 && i + 1 < argc) {
       pcap_file = argv[++i];
       if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
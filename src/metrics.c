@@ -5,7 +5,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "affinity.h"
+#include "handover.h"
+#include "ingest.h"
 #include "log.h"
+#include "pipeline.h"
+#include "shard.h"
 
 #ifdef USE_REDIS
 #include "redis_handler.h"
@@ -40,11 +45,37 @@ static uint32_t *exporters_array = NULL;
 static size_t exporters_count = 0;
 static size_t exporters_capacity = 0;
 
+// Ingest queue drops per exporter, by metrics_drop_reason_t
+typedef struct {
+  uint32_t exporter_ip;
+  uint64_t drops[metrics_drop_reasons];
+} overload_exporter_t;
+static overload_exporter_t *overload_array = NULL;
+static size_t overload_count = 0;
+static size_t overload_capacity = 0;
+// Ingest queue depth and datagrams dispatched from it, per exporter.
+typedef struct {
+  uint32_t exporter_ip;
+  uint32_t weight;
+  int64_t queued;
+  uint64_t served;
+} queue_exporter_t;
+static queue_exporter_t *queue_array = NULL;
+static size_t queue_count = 0;
+static size_t queue_capacity = 0;
+static uint64_t queue_served = 0;
+static const char *drop_reason_names[metrics_drop_reasons] = {"queue_full", "evicted", "sampled"};
+static const char *reject_reason_names[netflow_reject_reasons] = {"counters", "time", "ports", "rate", "address"};
+
 // Store combined exporter IP (32 bits) and interface ID (16 bits)
 static uint64_t *interfaces_array = NULL;
 static size_t interfaces_count = 0;
 static size_t interfaces_capacity = 0;
 
+#define METRICS_JSON_BUF_SIZE 40960
+// Kept free by the per-exporter drops for the shards, parser scaling and thread placement that follow them.
+#define METRICS_PLACEMENT_JSON_SIZE 16384
+
 static uv_tcp_t *g_metrics_server = NULL;
 static uv_timer_t *g_metrics_timer = NULL;
 
@@ -63,17 +94,37 @@ typedef enum {
   METRIC_IPFIX_RECORD_DROPPED,
   METRIC_ADD_BYTES,
   METRIC_ADD_FLOWSETS,
+  METRIC_RECV_BATCH,
+  METRIC_SET_RECV_BATCH_SIZE,
+  METRIC_SET_RECV_SOCKETS,
+  METRIC_KERNEL_DROPS,
+  METRIC_SET_RECV_BUFFER,
+  METRIC_GRO,
+  METRIC_PKT_SLAB_DROP,
+  METRIC_EXPORTER_DENIED,
+  METRIC_INVALID_HEADER,
+  METRIC_PIPELINE_DROP,
+  METRIC_PIPELINE_STEAL,
+  METRIC_EXPORTER_REJECTED,
+  METRIC_OVERLOAD_DROP,
+  // One type per netflow_reject_reason_t, so each adds up locally.
+  METRIC_FLOWS_REJECTED,
+  METRIC_FLOWS_REJECTED_LAST = METRIC_FLOWS_REJECTED + netflow_reject_reasons - 1,
+  METRIC_EXPORTER_QUEUE,
   METRIC_TRACK_EXPORTER,
   METRIC_TRACK_INTERFACE,
   METRIC_START_TCP,
   METRIC_START_TIMER
 } metric_type_t;
 
+#define METRIC_TYPES (METRIC_START_TIMER + 1)
+
 typedef struct {
   metric_type_t type;
   uint64_t value;
   uint32_t ip;
   uint16_t id;
+  int32_t delta;
 } metric_update_t;
 
 #define METRICS_RING_SIZE 65536
@@ -83,11 +134,42 @@ static size_t ring_tail = 0;
 static uv_mutex_t ring_mutex;
 
 static uv_thread_t metrics_thread;
+// Metrics listener handed over by the previous collector, -1 if none.
+static int metrics_listen_fd = -1;
 static uv_loop_t metrics_loop;
 static uv_async_t metrics_async;
 static uv_sem_t metrics_ready_sem;
 
+// Counters a shard thread adds up locally and pushes with metrics_local_flush().
+static THREAD_LOCAL int local_enabled = 0;
+static THREAD_LOCAL uint64_t local_counts[METRIC_TYPES];
+
+static inline int metric_is_local(metric_type_t type) {
+  switch (type) {
+    case METRIC_V5_PARSED:
+    case METRIC_V5_DROPPED:
+    case METRIC_V9_TEMPLATE_RECEIVED:
+    case METRIC_V9_TEMPLATE_DROPPED:
+    case METRIC_V9_RECORD_RECEIVED:
+    case METRIC_V9_RECORD_DROPPED:
+    case METRIC_IPFIX_TEMPLATE_RECEIVED:
+    case METRIC_IPFIX_TEMPLATE_DROPPED:
+    case METRIC_IPFIX_RECORD_RECEIVED:
+    case METRIC_IPFIX_RECORD_DROPPED:
+    case METRIC_ADD_FLOWSETS:
+    case METRIC_PIPELINE_STEAL:
+    case METRIC_EXPORTER_REJECTED:
+      return 1;
+    default:
+      return type >= METRIC_FLOWS_REJECTED && type <= METRIC_FLOWS_REJECTED_LAST;
+  }
+}
+
 static void push_update(metric_update_t *update) {
+  if (local_enabled && metric_is_local(update->type)) {
+    local_counts[update->type] += update->value;
+    return;
+  }
   uv_mutex_lock(&ring_mutex);
   size_t next_head = (ring_head + 1) % METRICS_RING_SIZE;
   if (next_head != ring_tail) {
@@ -259,6 +341,121 @@ static void process_track_interface(uint32_t exporter_ip, uint16_t interface_id)
 #endif
 }
 
+static void process_overload_drop(uint32_t exporter_ip, uint16_t reason) {
+  if (reason >= metrics_drop_reasons) {
+    return;
+  }
+  uv_mutex_lock(&g_metrics.mutex);
+  g_metrics.overload_drops[reason]++;
+  uv_mutex_unlock(&g_metrics.mutex);
+  for (size_t i = 0; i < overload_count; i++) {
+    if (overload_array[i].exporter_ip == exporter_ip) {
+      overload_array[i].drops[reason]++;
+      return;
+    }
+  }
+  if (overload_count == overload_capacity) {
+    size_t new_cap = overload_capacity == 0 ? 16 : overload_capacity * 2;
+    void *new_ptr = realloc(overload_array, new_cap * sizeof(overload_exporter_t));
+    if (!new_ptr) {
+      return;
+    }
+    overload_array = (overload_exporter_t *) new_ptr;
+    overload_capacity = new_cap;
+  }
+  memset(&overload_array[overload_count], 0, sizeof(overload_exporter_t));
+  overload_array[overload_count].exporter_ip = exporter_ip;
+  overload_array[overload_count].drops[reason] = 1;
+  overload_count++;
+}
+
+static void process_exporter_queue(uint32_t exporter_ip, uint16_t weight, int32_t queued, uint64_t served) {
+  queue_served += served;
+  for (size_t i = 0; i < queue_count; i++) {
+    if (queue_array[i].exporter_ip == exporter_ip) {
+      queue_array[i].weight = weight;
+      queue_array[i].queued += queued;
+      queue_array[i].served += served;
+      return;
+    }
+  }
+  if (queue_count == queue_capacity) {
+    size_t new_cap = queue_capacity == 0 ? 16 : queue_capacity * 2;
+    void *new_ptr = realloc(queue_array, new_cap * sizeof(queue_exporter_t));
+    if (!new_ptr) {
+      return;
+    }
+    queue_array = (queue_exporter_t *) new_ptr;
+    queue_capacity = new_cap;
+  }
+  queue_array[queue_count].exporter_ip = exporter_ip;
+  queue_array[queue_count].weight = weight;
+  queue_array[queue_count].queued = queued;
+  queue_array[queue_count].served = served;
+  queue_count++;
+}
+
+/**
+ * Appends the decoded flows dropped before insertion to the metrics JSON, per
+ * reason.
+ */
+static size_t append_rejected_json(char *buf, size_t size, size_t len) {
+  len += (size_t) snprintf(buf + len, size - len, ",\n  \"flows_rejected\": {");
+  for (int r = 0; r < netflow_reject_reasons && len < size; r++) {
+    len += (size_t) snprintf(buf + len, size - len, "%s\"%s\": %lu", r ? ", " : "", reject_reason_names[r],
+                             g_metrics.flows_rejected[r]);
+  }
+  if (len < size) {
+    len += (size_t) snprintf(buf + len, size - len, "}");
+  }
+  return len;
+}
+
+/**
+ * Appends the ingest queue drops to the metrics JSON, per reason and per
+ * exporter, then each exporter's queue depth and share of the datagrams
+ * dispatched from the queues. Exporters that do not fit in the buffer are
+ * left out.
+ */
+static size_t append_overload_json(char *buf, size_t size, size_t len) {
+  len += (size_t) snprintf(buf + len, size - len, ",\n  \"overload_drops\": {");
+  for (int r = 0; r < metrics_drop_reasons && len < size; r++) {
+    len += (size_t) snprintf(buf + len, size - len, "%s\"%s\": %lu", r ? ", " : "", drop_reason_names[r],
+                             g_metrics.overload_drops[r]);
+  }
+  if (len < size) {
+    len += (size_t) snprintf(buf + len, size - len, "},\n  \"overload_drops_by_exporter\": [");
+  }
+  for (size_t i = 0; i < overload_count && len + 160 < size; i++) {
+    // exporter_ip is in network byte order
+    uint8_t ip[4];
+    memcpy(ip, &overload_array[i].exporter_ip, sizeof(ip));
+    len += (size_t) snprintf(buf + len, size - len,
+                             "%s\n    {\"exporter\": \"%u.%u.%u.%u\", \"queue_full\": %lu, \"evicted\": %lu, "
+                             "\"sampled\": %lu}",
+                             i ? "," : "", ip[0], ip[1], ip[2], ip[3], overload_array[i].drops[metrics_drop_queue_full],
+                             overload_array[i].drops[metrics_drop_evicted],
+                             overload_array[i].drops[metrics_drop_sampled]);
+  }
+  if (len < size) {
+    len += (size_t) snprintf(buf + len, size - len, "],\n  \"queue_by_exporter\": [");
+  }
+  for (size_t i = 0; i < queue_count && len + 160 < size; i++) {
+    uint8_t ip[4];
+    memcpy(ip, &queue_array[i].exporter_ip, sizeof(ip));
+    len += (size_t) snprintf(buf + len, size - len,
+                             "%s\n    {\"exporter\": \"%u.%u.%u.%u\", \"weight\": %u, \"queued\": %ld, "
+                             "\"served\": %lu, \"share\": %.4f}",
+                             i ? "," : "", ip[0], ip[1], ip[2], ip[3], queue_array[i].weight,
+                             (long) queue_array[i].queued, queue_array[i].served,
+                             queue_served ? (double) queue_array[i].served / (double) queue_served : 0.0);
+  }
+  if (len < size) {
+    len += (size_t) snprintf(buf + len, size - len, "]");
+  }
+  return len < size ? len : size - 1;
+}
+
 static void process_update(metric_update_t *update) {
   switch (update->type) {
     case METRIC_PACKET_RECEIVED:
@@ -266,44 +463,44 @@ static void process_update(metric_update_t *update) {
       redis_packets_delta++;
       break;
     case METRIC_V5_PARSED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.netflow_v5_parsed++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_v5_parsed_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.netflow_v5_parsed += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_v5_parsed_delta += update->value;
       break;
     case METRIC_V5_DROPPED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.netflow_v5_dropped++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_v5_dropped_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.netflow_v5_dropped += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_v5_dropped_delta += update->value;
       break;
     case METRIC_V9_TEMPLATE_RECEIVED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_templates_received++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_v9_templates_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_templates_received += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_v9_templates_delta += update->value;
       break;
     case METRIC_V9_TEMPLATE_DROPPED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_templates_dropped++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_v9_templates_dropped_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_templates_dropped += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_v9_templates_dropped_delta += update->value;
       break;
     case METRIC_V9_RECORD_RECEIVED:
       uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_records_received += update->value; uv_mutex_unlock(&g_metrics.mutex);
       redis_v9_records_delta += update->value;
       break;
     case METRIC_V9_RECORD_DROPPED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_records_dropped++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_v9_records_dropped_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.v9_records_dropped += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_v9_records_dropped_delta += update->value;
       break;
     case METRIC_IPFIX_TEMPLATE_RECEIVED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_templates_received++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_ipfix_templates_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_templates_received += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_ipfix_templates_delta += update->value;
       break;
     case METRIC_IPFIX_TEMPLATE_DROPPED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_templates_dropped++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_ipfix_templates_dropped_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_templates_dropped += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_ipfix_templates_dropped_delta += update->value;
       break;
     case METRIC_IPFIX_RECORD_RECEIVED:
       uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_records_received += update->value; uv_mutex_unlock(&g_metrics.mutex);
       redis_ipfix_records_delta += update->value;
       break;
     case METRIC_IPFIX_RECORD_DROPPED:
-      uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_records_dropped++; uv_mutex_unlock(&g_metrics.mutex);
-      redis_ipfix_records_dropped_delta++;
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.ipfix_records_dropped += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      redis_ipfix_records_dropped_delta += update->value;
       break;
     case METRIC_ADD_BYTES:
       total_bytes_accum += update->value;
@@ -312,9 +509,68 @@ static void process_update(metric_update_t *update) {
     case METRIC_ADD_FLOWSETS:
       total_flowsets_accum += update->value;
       break;
+    case METRIC_RECV_BATCH:
+      uv_mutex_lock(&g_metrics.mutex);
+      g_metrics.recv_batches++;
+      g_metrics.recv_batch_msgs += update->value;
+      uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_SET_RECV_BATCH_SIZE:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.recv_batch_size = update->value; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_SET_RECV_SOCKETS:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.recv_sockets = update->value; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_KERNEL_DROPS:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.kernel_drops += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_SET_RECV_BUFFER:
+      uv_mutex_lock(&g_metrics.mutex);
+      if (update->value > g_metrics.recv_buffer_bytes) {
+        g_metrics.recv_buffer_bytes = update->value;
+      }
+      uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_GRO:
+      uv_mutex_lock(&g_metrics.mutex);
+      g_metrics.gro_receives++;
+      g_metrics.gro_segments += update->value;
+      uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_PKT_SLAB_DROP:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.pkt_slab_drops++; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_EXPORTER_DENIED:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.exporters_denied++; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_INVALID_HEADER:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.invalid_headers++; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_PIPELINE_DROP:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.pipeline_drops++; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_PIPELINE_STEAL:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.pipeline_steals += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_EXPORTER_REJECTED:
+      uv_mutex_lock(&g_metrics.mutex); g_metrics.exporters_rejected += update->value; uv_mutex_unlock(&g_metrics.mutex);
+      break;
+    case METRIC_OVERLOAD_DROP:
+      process_overload_drop(update->ip, update->id);
+      break;
+    case METRIC_EXPORTER_QUEUE:
+      process_exporter_queue(update->ip, update->id, update->delta, update->value);
+      break;
     case METRIC_TRACK_EXPORTER:
       process_track_exporter(update->ip);
       break;
+    default:
+      if (update->type >= METRIC_FLOWS_REJECTED && update->type <= METRIC_FLOWS_REJECTED_LAST) {
+        uv_mutex_lock(&g_metrics.mutex);
+        g_metrics.flows_rejected[update->type - METRIC_FLOWS_REJECTED] += update->value;
+        uv_mutex_unlock(&g_metrics.mutex);
+      }
+      break;
     case METRIC_TRACK_INTERFACE:
       process_track_interface(update->ip, update->id);
       break;
@@ -363,6 +619,7 @@ static void on_metrics_timer(uv_timer_t *handle) {
 
 static void metrics_worker_thread(void *arg) {
   (void)arg;
+  affinity_apply(affinity_role_metrics, "metrics");
   uv_loop_init(&metrics_loop);
   uv_async_init(&metrics_loop, &metrics_async, on_metrics_async);
   uv_sem_post(&metrics_ready_sem);
@@ -405,20 +662,25 @@ static void on_metrics_connection(uv_stream_t *server, int status) {
   uv_tcp_init(server->loop, client);
 
   if (uv_accept(server, (uv_stream_t *) client) == 0) {
-    char *json_buf = malloc(2048);
+    char *json_buf = malloc(METRICS_JSON_BUF_SIZE);
     if (!json_buf) {
       uv_close((uv_handle_t *) client, (uv_close_cb) free);
       return;
     }
 
     uv_mutex_lock(&g_metrics.mutex);
-    snprintf(json_buf, 2048,
+    double recv_batch_fill_avg =
+        g_metrics.recv_batches ? (double) g_metrics.recv_batch_msgs / (double) g_metrics.recv_batches : 0.0;
+    double gro_segments_avg =
+        g_metrics.gro_receives ? (double) g_metrics.gro_segments / (double) g_metrics.gro_receives : 0.0;
+    snprintf(json_buf, METRICS_JSON_BUF_SIZE,
              "HTTP/1.1 200 OK\r\n"
              "Content-Type: application/json\r\n"
              "Connection: close\r\n"
              "\r\n"
              "{\n"
              "  \"packets_received\": %lu,\n"
+             "  \"kernel_drops\": %lu,\n"
              "  \"netflow_v5_parsed\": %lu,\n"
              "  \"netflow_v5_dropped\": %lu,\n"
              "  \"v9_templates_received\": %lu,\n"
@@ -433,15 +695,41 @@ static void on_metrics_connection(uv_stream_t *server, int status) {
              "  \"interfaces_detected\": %lu,\n"
              "  \"bytes_per_sec\": %lu,\n"
              "  \"pkts_per_sec\": %lu,\n"
-             "  \"flowsets_per_sec\": %lu\n"
-             "}\n",
-             g_metrics.packets_received, g_metrics.netflow_v5_parsed, g_metrics.netflow_v5_dropped,
+             "  \"flowsets_per_sec\": %lu,\n"
+             "  \"recv_sockets\": %lu,\n"
+             "  \"recv_batch_size\": %lu,\n"
+             "  \"recv_batches\": %lu,\n"
+             "  \"recv_batch_msgs\": %lu,\n"
+             "  \"recv_batch_fill_avg\": %.2f,\n"
+             "  \"recv_buffer_bytes\": %lu,\n"
+             "  \"gro_receives\": %lu,\n"
+             "  \"gro_segments\": %lu,\n"
+             "  \"gro_segments_avg\": %.2f,\n"
+             "  \"pkt_slab_drops\": %lu,\n"
+             "  \"exporters_denied\": %lu,\n"
+             "  \"invalid_headers\": %lu,\n"
+             "  \"pipeline_drops\": %lu,\n"
+             "  \"pipeline_steals\": %lu,\n"
+             "  \"exporters_rejected\": %lu",
+             g_metrics.packets_received, g_metrics.kernel_drops, g_metrics.netflow_v5_parsed, g_metrics.netflow_v5_dropped,
              g_metrics.v9_templates_received, g_metrics.v9_templates_dropped, g_metrics.v9_records_received,
              g_metrics.v9_records_dropped, g_metrics.ipfix_templates_received, g_metrics.ipfix_templates_dropped,
              g_metrics.ipfix_records_received, g_metrics.ipfix_records_dropped, g_metrics.collectors_detected,
              g_metrics.interfaces_detected, g_metrics.bytes_per_sec, g_metrics.pkts_per_sec,
-             g_metrics.flowsets_per_sec);
+             g_metrics.flowsets_per_sec, g_metrics.recv_sockets, g_metrics.recv_batch_size, g_metrics.recv_batches,
+             g_metrics.recv_batch_msgs, recv_batch_fill_avg, g_metrics.recv_buffer_bytes, g_metrics.gro_receives, g_metrics.gro_segments,
+             gro_segments_avg, g_metrics.pkt_slab_drops, g_metrics.exporters_denied,
+             g_metrics.invalid_headers, g_metrics.pipeline_drops, g_metrics.pipeline_steals,
+             g_metrics.exporters_rejected);
+    size_t json_len = append_rejected_json(json_buf, METRICS_JSON_BUF_SIZE, strlen(json_buf));
+    json_len = append_overload_json(json_buf, METRICS_JSON_BUF_SIZE - METRICS_PLACEMENT_JSON_SIZE, json_len);
     uv_mutex_unlock(&g_metrics.mutex);
+    json_len = shard_append_json(json_buf, METRICS_JSON_BUF_SIZE - 4, json_len);
+    json_len = pipeline_append_json(json_buf, METRICS_JSON_BUF_SIZE - 4, json_len);
+    json_len = ingest_tcp_append_json(json_buf, METRICS_JSON_BUF_SIZE - 4, json_len);
+    // Placement is read from /proc, outside the metrics lock.
+    json_len = affinity_append_json(json_buf, METRICS_JSON_BUF_SIZE - 4, json_len);
+    snprintf(json_buf + json_len, METRICS_JSON_BUF_SIZE - json_len, "\n}\n");
 
     uv_write_t *req = (uv_write_t *) malloc(sizeof(uv_write_t));
     if (!req) {
@@ -466,8 +754,14 @@ static void on_metrics_connection(uv_stream_t *server, int status) {
 }
 
 void metrics_tcp_start(int port) {
+  struct sockaddr_in addr;
+  uv_ip4_addr("0.0.0.0", port, &addr);
+
   uv_thread_t self = uv_thread_self();
   if (!uv_thread_equal(&self, &metrics_thread)) {
+    // Taken on the caller's thread, before the collector closes the handed
+    // over sockets that nothing claimed.
+    metrics_listen_fd = handover_take_socket(SOCK_STREAM, (const struct sockaddr *) &addr, 0);
     metric_update_t update = { .type = METRIC_START_TCP, .value = (uint64_t)port };
     push_update(&update);
     return;
@@ -477,10 +771,9 @@ void metrics_tcp_start(int port) {
   g_metrics_server = server;
   uv_tcp_init(&metrics_loop, server);
 
-  struct sockaddr_in addr;
-  uv_ip4_addr("0.0.0.0", port, &addr);
-
-  int r = uv_tcp_bind(server, (const struct sockaddr *) &addr, 0);
+  int r = metrics_listen_fd >= 0 ? uv_tcp_open(server, metrics_listen_fd)
+                                 : uv_tcp_bind(server, (const struct sockaddr *) &addr, 0);
+  metrics_listen_fd = -1;
   if (r) {
     LOG_ERROR("Metrics TCP Bind error %s\n", uv_strerror(r));
     free(server);
@@ -493,6 +786,10 @@ void metrics_tcp_start(int port) {
     free(server);
     return;
   }
+  uv_os_fd_t fd;
+  if (uv_fileno((uv_handle_t *) server, &fd) == 0) {
+    handover_offer_socket(fd);
+  }
 
   LOG_INFO("Metrics TCP API listening on 0.0.0.0:%d\n", port);
 }
@@ -510,28 +807,66 @@ void metrics_timer_start(void) {
   uv_timer_start(timer, on_metrics_timer, 1000, 1000);
 }
 
+void metrics_local_begin(void) {
+  memset(local_counts, 0, sizeof(local_counts));
+  local_enabled = 1;
+}
+
+void metrics_local_flush(void) {
+  if (!local_enabled) {
+    return;
+  }
+  metric_update_t updates[METRIC_TYPES];
+  size_t count = 0;
+  for (int type = 0; type < METRIC_TYPES; type++) {
+    if (local_counts[type] != 0) {
+      updates[count].type = (metric_type_t) type;
+      updates[count].value = local_counts[type];
+      updates[count].ip = 0;
+      updates[count].id = 0;
+      count++;
+      local_counts[type] = 0;
+    }
+  }
+  if (count == 0) {
+    return;
+  }
+  // One lock and one wakeup for the whole batch.
+  uv_mutex_lock(&ring_mutex);
+  for (size_t i = 0; i < count; i++) {
+    size_t next_head = (ring_head + 1) % METRICS_RING_SIZE;
+    if (next_head == ring_tail) {
+      break;
+    }
+    metrics_ring[ring_head] = updates[i];
+    ring_head = next_head;
+  }
+  uv_mutex_unlock(&ring_mutex);
+  uv_async_send(&metrics_async);
+}
+
 void metrics_inc_packets(void) {
   metric_update_t update = { .type = METRIC_PACKET_RECEIVED };
   push_update(&update);
 }
 
 void metrics_inc_v5_parsed(void) {
-  metric_update_t update = { .type = METRIC_V5_PARSED };
+  metric_update_t update = { .type = METRIC_V5_PARSED, .value = 1 };
   push_update(&update);
 }
 
 void metrics_inc_v5_dropped(void) {
-  metric_update_t update = { .type = METRIC_V5_DROPPED };
+  metric_update_t update = { .type = METRIC_V5_DROPPED, .value = 1 };
   push_update(&update);
 }
 
 void metrics_inc_v9_templates_received(void) {
-  metric_update_t update = { .type = METRIC_V9_TEMPLATE_RECEIVED };
+  metric_update_t update = { .type = METRIC_V9_TEMPLATE_RECEIVED, .value = 1 };
   push_update(&update);
 }
 
 void metrics_inc_v9_templates_dropped(void) {
-  metric_update_t update = { .type = METRIC_V9_TEMPLATE_DROPPED };
+  metric_update_t update = { .type = METRIC_V9_TEMPLATE_DROPPED, .value = 1 };
   push_update(&update);
 }
 
@@ -546,17 +881,17 @@ void metrics_inc_v9_records_received_batch(uint64_t count) {
 }
 
 void metrics_inc_v9_records_dropped(void) {
-  metric_update_t update = { .type = METRIC_V9_RECORD_DROPPED };
+  metric_update_t update = { .type = METRIC_V9_RECORD_DROPPED, .value = 1 };
   push_update(&update);
 }
 
 void metrics_inc_ipfix_templates_received(void) {
-  metric_update_t update = { .type = METRIC_IPFIX_TEMPLATE_RECEIVED };
+  metric_update_t update = { .type = METRIC_IPFIX_TEMPLATE_RECEIVED, .value = 1 };
   push_update(&update);
 }
 
 void metrics_inc_ipfix_templates_dropped(void) {
-  metric_update_t update = { .type = METRIC_IPFIX_TEMPLATE_DROPPED };
+  metric_update_t update = { .type = METRIC_IPFIX_TEMPLATE_DROPPED, .value = 1 };
   push_update(&update);
 }
 
@@ -571,7 +906,7 @@ void metrics_inc_ipfix_records_received_batch(uint64_t count) {
 }
 
 void metrics_inc_ipfix_records_dropped(void) {
-  metric_update_t update = { .type = METRIC_IPFIX_RECORD_DROPPED };
+  metric_update_t update = { .type = METRIC_IPFIX_RECORD_DROPPED, .value = 1 };
   push_update(&update);
 }
 
@@ -585,6 +920,86 @@ void metrics_inc_flowsets(uint64_t flowsets) {
   push_update(&update);
 }
 
+void metrics_inc_recv_batch(uint64_t msgs) {
+  metric_update_t update = { .type = METRIC_RECV_BATCH, .value = msgs };
+  push_update(&update);
+}
+
+void metrics_set_recv_batch_size(uint64_t size) {
+  metric_update_t update = { .type = METRIC_SET_RECV_BATCH_SIZE, .value = size };
+  push_update(&update);
+}
+
+void metrics_set_recv_sockets(uint64_t sockets) {
+  metric_update_t update = { .type = METRIC_SET_RECV_SOCKETS, .value = sockets };
+  push_update(&update);
+}
+
+void metrics_inc_kernel_drops(uint64_t drops) {
+  metric_update_t update = { .type = METRIC_KERNEL_DROPS, .value = drops };
+  push_update(&update);
+}
+
+void metrics_set_recv_buffer(uint64_t bytes) {
+  metric_update_t update = { .type = METRIC_SET_RECV_BUFFER, .value = bytes };
+  push_update(&update);
+}
+
+void metrics_inc_gro(uint64_t segments) {
+  metric_update_t update = { .type = METRIC_GRO, .value = segments };
+  push_update(&update);
+}
+
+void metrics_inc_pkt_slab_drop(void) {
+  metric_update_t update = { .type = METRIC_PKT_SLAB_DROP, .value = 1 };
+  push_update(&update);
+}
+
+void metrics_inc_exporter_denied(void) {
+  metric_update_t update = { .type = METRIC_EXPORTER_DENIED, .value = 1 };
+  push_update(&update);
+}
+
+void metrics_inc_invalid_header(void) {
+  metric_update_t update = { .type = METRIC_INVALID_HEADER, .value = 1 };
+  push_update(&update);
+}
+
+void metrics_inc_pipeline_drop(void) {
+  metric_update_t update = { .type = METRIC_PIPELINE_DROP, .value = 1 };
+  push_update(&update);
+}
+
+void metrics_inc_pipeline_steal(void) {
+  metric_update_t update = { .type = METRIC_PIPELINE_STEAL, .value = 1 };
+  push_update(&update);
+}
+
+void metrics_inc_exporter_rejected(void) {
+  metric_update_t update = { .type = METRIC_EXPORTER_REJECTED, .value = 1 };
+  push_update(&update);
+}
+
+void metrics_inc_overload_drop(uint32_t exporter_ip, metrics_drop_reason_t reason) {
+  metric_update_t update = { .type = METRIC_OVERLOAD_DROP, .value = 1, .ip = exporter_ip, .id = (uint16_t) reason };
+  push_update(&update);
+}
+
+void metrics_inc_flows_rejected(const uint32_t *rejected) {
+  for (int reason = 0; reason < netflow_reject_reasons; reason++) {
+    if (rejected[reason] != 0) {
+      metric_update_t update = {.type = (metric_type_t) (METRIC_FLOWS_REJECTED + reason), .value = rejected[reason]};
+      push_update(&update);
+    }
+  }
+}
+
+void metrics_add_exporter_queue(uint32_t exporter_ip, uint32_t weight, int64_t queued, uint64_t served) {
+  metric_update_t update = {
+      .type = METRIC_EXPORTER_QUEUE, .value = served, .ip = exporter_ip, .id = (uint16_t) weight, .delta = (int32_t) queued};
+  push_update(&update);
+}
+
 void metrics_track_exporter(uint32_t exporter_ip) {
   static THREAD_LOCAL uint32_t last_exporter = 0;
   if (unlikely(exporter_ip == last_exporter)) return;
@@ -611,6 +1026,19 @@ void metrics_cleanup(void) {
     exporters_count = 0;
     exporters_capacity = 0;
   }
+  if (overload_array) {
+    free(overload_array);
+    overload_array = NULL;
+    overload_count = 0;
+    overload_capacity = 0;
+  }
+  if (queue_array) {
+    free(queue_array);
+    queue_array = NULL;
+    queue_count = 0;
+    queue_capacity = 0;
+    queue_served = 0;
+  }
   if (interfaces_array) {
     free(interfaces_array);
     interfaces_array = NULL;
@@ -3,6 +3,18 @@
 
 #include <stdint.h>
 #include <uv.h>
+#include "netflow.h"
+
+// Why the ingest queue shed a datagram.
+typedef enum {
+  // The queue was full and the arriving datagram was dropped.
+  metrics_drop_queue_full = 0,
+  // A queued datagram was dropped to make room for a newer one.
+  metrics_drop_evicted = 1,
+  // The sample policy skipped the datagram.
+  metrics_drop_sampled = 2,
+  metrics_drop_reasons = 3,
+} metrics_drop_reason_t;
 
 #ifdef ENABLE_METRICS
 
@@ -13,6 +25,8 @@
 typedef struct {
   // Basic network stats
   uint64_t packets_received;
+  // Datagrams the kernel dropped because a socket receive queue was full
+  uint64_t kernel_drops;
 
   // NetFlow v5
   uint64_t netflow_v5_parsed;
@@ -39,6 +53,38 @@ typedef struct {
   uint64_t pkts_per_sec;
   uint64_t flowsets_per_sec;
 
+  // Batched receive (recvmmsg mode)
+  uint64_t recv_sockets;
+  uint64_t recv_batch_size;
+  uint64_t recv_batches;
+  uint64_t recv_batch_msgs;
+  // Largest SO_RCVBUF the kernel reports for a receive socket
+  uint64_t recv_buffer_bytes;
+
+  // UDP_GRO: receives that returned a coalesced buffer, and the datagrams in them
+  uint64_t gro_receives;
+  uint64_t gro_segments;
+
+  // Datagrams dropped because no packet context was free
+  uint64_t pkt_slab_drops;
+
+  // Datagrams dropped before dispatch: source not on the allowlist, malformed header
+  uint64_t exporters_denied;
+  uint64_t invalid_headers;
+
+  // Datagrams dropped because their parser thread was a full ring behind
+  uint64_t pipeline_drops;
+  // Datagrams parsed by a parser thread other than their exporter's own
+  uint64_t pipeline_steals;
+  // Datagrams dropped because their exporter could not be given an id
+  uint64_t exporters_rejected;
+
+  // Datagrams shed by the ingest queue, by metrics_drop_reason_t
+  uint64_t overload_drops[metrics_drop_reasons];
+
+  // Decoded flows netflow_prepare_batch() dropped, by netflow_reject_reason_t
+  uint64_t flows_rejected[netflow_reject_reasons];
+
   // Mutex to protect global reads/writes
   uv_mutex_t mutex;
 } cnetflow_metrics_t;
@@ -95,6 +141,83 @@ void metrics_inc_bytes(uint64_t bytes);
  */
 void metrics_inc_flowsets(uint64_t flowsets);
 
+/**
+ * @brief Records one batched receive call that returned `msgs` datagrams.
+ */
+void metrics_inc_recv_batch(uint64_t msgs);
+
+/**
+ * @brief Publishes the configured receive batch size, used to report batch fill.
+ */
+void metrics_set_recv_batch_size(uint64_t size);
+
+/**
+ * @brief Publishes the number of receive sockets in the reuseport group.
+ */
+void metrics_set_recv_sockets(uint64_t sockets);
+
+/**
+ * @brief Counts datagrams the kernel dropped before they could be received.
+ */
+void metrics_inc_kernel_drops(uint64_t drops);
+
+/**
+ * @brief Publishes a receive socket's buffer size, as reported by SO_RCVBUF.
+ */
+void metrics_set_recv_buffer(uint64_t bytes);
+
+/**
+ * @brief Records one UDP_GRO receive that coalesced `segments` datagrams.
+ */
+void metrics_inc_gro(uint64_t segments);
+
+/**
+ * @brief Counts a datagram dropped because the packet slab was exhausted.
+ */
+void metrics_inc_pkt_slab_drop(void);
+
+/**
+ * @brief Counts a datagram dropped because its source is not on the exporter allowlist.
+ */
+void metrics_inc_exporter_denied(void);
+
+/**
+ * @brief Counts a datagram dropped because its header failed validation.
+ */
+void metrics_inc_invalid_header(void);
+
+/**
+ * @brief Counts a datagram dropped because its parser thread's ring was full.
+ */
+void metrics_inc_pipeline_drop(void);
+
+/**
+ * @brief Counts a datagram taken by an idle parser thread from a busy one.
+ */
+void metrics_inc_pipeline_steal(void);
+
+/**
+ * @brief Counts a datagram dropped because its exporter identity could not be interned.
+ */
+void metrics_inc_exporter_rejected(void);
+
+/**
+ * @brief Counts a datagram from `exporter_ip` shed by the ingest queue.
+ */
+void metrics_inc_overload_drop(uint32_t exporter_ip, metrics_drop_reason_t reason);
+
+/**
+ * @brief Counts the flows netflow_prepare_batch() dropped from one flowset,
+ * `rejected` being indexed by netflow_reject_reason_t.
+ */
+void metrics_inc_flows_rejected(const uint32_t *rejected);
+
+/**
+ * @brief Adds to an exporter's ingest queue depth and to the datagrams the
+ * queue dispatched for it, reported with the exporter's weight.
+ */
+void metrics_add_exporter_queue(uint32_t exporter_ip, uint32_t weight, int64_t queued, uint64_t served);
+
 /**
  * @brief Tracks unique exporter IPs.
  */
@@ -105,6 +228,17 @@ void metrics_track_exporter(uint32_t exporter_ip);
  */
 void metrics_track_interface(uint32_t exporter_ip, uint16_t interface_id);
 
+/**
+ * @brief Makes the calling thread add up its parse counters locally instead of
+ * pushing every increment to the metrics thread.
+ */
+void metrics_local_begin(void);
+
+/**
+ * @brief Pushes the counters added up since the last flush.
+ */
+void metrics_local_flush(void);
+
 #else // ENABLE_METRICS
 
 #define metrics_init() do {} while(0)
@@ -126,8 +260,26 @@ void metrics_track_interface(uint32_t exporter_ip, uint16_t interface_id);
 #define metrics_inc_ipfix_records_received_batch(count) do {} while(0)
 #define metrics_inc_bytes(bytes) do {} while(0)
 #define metrics_inc_flowsets(flowsets) do {} while(0)
+#define metrics_inc_recv_batch(msgs) do {} while(0)
+#define metrics_set_recv_batch_size(size) do {} while(0)
+#define metrics_set_recv_sockets(sockets) do {} while(0)
+#define metrics_inc_kernel_drops(drops) do { (void) (drops); } while(0)
+#define metrics_set_recv_buffer(bytes) do { (void) (bytes); } while(0)
+#define metrics_inc_gro(segments) do {} while(0)
+#define metrics_inc_pkt_slab_drop() do {} while(0)
+#define metrics_inc_exporter_denied() do {} while(0)
+#define metrics_inc_invalid_header() do {} while(0)
+#define metrics_inc_pipeline_drop() do {} while(0)
+#define metrics_inc_pipeline_steal() do {} while(0)
+#define metrics_inc_exporter_rejected() do {} while(0)
+#define metrics_inc_overload_drop(ip, reason) do { (void) (ip); (void) (reason); } while(0)
+#define metrics_inc_flows_rejected(rejected) do { (void) (rejected); } while(0)
+#define metrics_add_exporter_queue(ip, weight, queued, served) \
+  do { (void) (ip); (void) (weight); (void) (queued); (void) (served); } while(0)
 #define metrics_track_exporter(ip) do {} while(0)
 #define metrics_track_interface(ip, id) do {} while(0)
+#define metrics_local_begin() do {} while(0)
+#define metrics_local_flush() do {} while(0)
 
 #endif // ENABLE_METRICS
 
@@ -29,6 +29,7 @@ extern int is_pcap_pass_2;
 #include <string.h>
 #include "log.h"
 #include "netflow_v5.h"
+#include "flow_batch.h"
 
 endianness_e endianness = 0;
 
@@ -412,15 +413,15 @@ void printf_v5(FILE *file, netflow_v5_flowset_t *netflow_packet, int i) {
   fprintf(file, "%s:%u -> %s:%u prot: %u\n", ip_src_str, tmp_src_port, ip_dst_str,
           tmp_dst_port, netflow_packet->records[i].prot);
 }
-void printf_v9(FILE *file, netflow_v9_uint128_flowset_t *netflow_packet, size_t i, uint32_t frame_number, uint16_t template_id, uint16_t flowset_id) {
+void printf_v9(FILE *file, const flow_batch_t *flows, uint32_t row, size_t i, uint32_t frame_number, uint16_t template_id, uint16_t flowset_id) {
   char ip_src_str[50] = {0};
   char ip_dst_str[50] = {0};
 
   char *tmp;
   // srcaddr/dstaddr are already in host byte order after parse_v9 applied swap_endianness.
   // ip_int_to_str expects network byte order (s_addr), so we swap once for display.
-  uint32_t srcaddr = netflow_packet->records[i].srcaddr;
-  uint32_t dstaddr = netflow_packet->records[i].dstaddr;
+  uint32_t srcaddr = flows->srcaddr[row];
+  uint32_t dstaddr = flows->dstaddr[row];
   tmp = ip_int_to_str(htonl(srcaddr));
   strncpy(ip_src_str, tmp, strlen(tmp));
   tmp = ip_int_to_str(htonl(dstaddr));
@@ -432,9 +433,9 @@ void printf_v9(FILE *file, netflow_v9_uint128_flowset_t *netflow_packet, size_t
       line.frame_number = frame_number;
       snprintf(line.text, sizeof(line.text), "frame %u template %u flowset %u flow %zu %s:%u -> %s:%u prot: %u",
                frame_number, template_id, flowset_id, i,
-               ip_src_str, netflow_packet->records[i].srcport,
-               ip_dst_str, netflow_packet->records[i].dstport,
-               netflow_packet->records[i].prot);
+               ip_src_str, flows->srcport[row],
+               ip_dst_str, flows->dstport[row],
+               flows->prot[row]);
       uv_mutex_lock(&pcap_output_mutex);
       dyn_array_push(pcap_output_lines, &line);
       uv_mutex_unlock(&pcap_output_mutex);
@@ -445,8 +446,8 @@ void printf_v9(FILE *file, netflow_v9_uint128_flowset_t *netflow_packet, size_t
     }
     // Ports are already in host byte order after parsing.
     fprintf(file, "%s:%u -> %s:%u prot: %u\n", ip_src_str,
-            netflow_packet->records[i].srcport, ip_dst_str,
-            netflow_packet->records[i].dstport, netflow_packet->records[i].prot);
+            flows->srcport[row], ip_dst_str,
+            flows->dstport[row], flows->prot[row]);
   }
 }
 void printf_v10(FILE *file, netflow_v9_record_insert_uint128_t *record) {
@@ -470,3 +471,105 @@ void printf_v10(FILE *file, netflow_v9_record_insert_uint128_t *record) {
   fprintf(file, "%s:%u -> %s:%u prot: %u\n", ip_src_str, tmp_src_port, ip_dst_str,
           tmp_dst_port, record->prot);
 }
+
+static uint32_t netflow_max_octets_per_sec = NETFLOW_MAX_OCTETS_PER_SEC;
+static uint32_t netflow_max_packets_per_sec = NETFLOW_MAX_PACKETS_PER_SEC;
+
+void netflow_set_flow_limits(uint32_t max_octets_per_sec, uint32_t max_packets_per_sec) {
+  if (max_octets_per_sec != 0) {
+    netflow_max_octets_per_sec = max_octets_per_sec;
+  }
+  if (max_packets_per_sec != 0) {
+    netflow_max_packets_per_sec = max_packets_per_sec;
+  }
+}
+
+// 1 if `addr` is in 10/8, 172.16/12 or 192.168/16, as three unsigned range
+// compares instead of is_ipv4_private's chain of branches.
+static inline uint32_t netflow_private_bit(uint32_t addr) {
+  return (addr - 0x0a000000u < 0x01000000u) | (addr - 0xac100000u < 0x00100000u) |
+         (addr - 0xc0a80000u < 0x00010000u);
+}
+
+// Swaps a[i] and b[i] where mask[i] is all ones, for one pair of columns.
+#define NETFLOW_SWAP_COLUMNS(bits)                                                                                     \
+  static void netflow_swap_columns##bits(uint##bits##_t *restrict a, uint##bits##_t *restrict b,                       \
+                                         const uint32_t *restrict mask, uint32_t start, uint32_t count) {              \
+    for (uint32_t i = start; i < count; i++) {                                                                         \
+      uint##bits##_t t = (uint##bits##_t) ((a[i] ^ b[i]) & mask[i]);                                                   \
+      a[i] ^= t;                                                                                                       \
+      b[i] ^= t;                                                                                                       \
+    }                                                                                                                  \
+  }
+NETFLOW_SWAP_COLUMNS(8)
+NETFLOW_SWAP_COLUMNS(16)
+NETFLOW_SWAP_COLUMNS(32)
+
+uint32_t netflow_prepare_batch(flow_batch_t *flows, uint32_t start, uint32_t *rejected) {
+  const uint32_t count = flows->count;
+  const uint32_t *restrict srcaddr = flows->srcaddr;
+  const uint32_t *restrict dstaddr = flows->dstaddr;
+  const uint16_t *restrict srcport = flows->srcport;
+  const uint16_t *restrict dstport = flows->dstport;
+  const uint8_t *restrict ip_version = flows->ip_version;
+  uint32_t *restrict mask = flows->scratch;
+
+  // Swap unless src is private and dst is not, or both are and src has the higher port.
+  for (uint32_t i = start; i < count; i++) {
+    mask[i] = -((uint32_t) (ip_version[i] == 4) &
+                ((netflow_private_bit(srcaddr[i]) ^ 1) |
+                 (netflow_private_bit(dstaddr[i]) & (uint32_t) (dstport[i] > srcport[i]))));
+  }
+  netflow_swap_columns32(flows->srcaddr, flows->dstaddr, mask, start, count);
+  netflow_swap_columns16(flows->srcport, flows->dstport, mask, start, count);
+  netflow_swap_columns16(flows->input, flows->output, mask, start, count);
+  netflow_swap_columns8(flows->src_mask, flows->dst_mask, mask, start, count);
+  netflow_swap_columns32(flows->src_as, flows->dst_as, mask, start, count);
+  if (rejected == NULL) {
+    return count;
+  }
+
+  // The checks each row fails, one bit per netflow_reject_reason_t.
+  const uint64_t octets_limit = (uint64_t) netflow_max_octets_per_sec + 1;
+  const uint64_t packets_limit = (uint64_t) netflow_max_packets_per_sec + 1;
+  const uint64_t *restrict octets = flows->dOctets;
+  const uint64_t *restrict packets = flows->dPkts;
+  const uint32_t *restrict first = flows->First;
+  const uint32_t *restrict last = flows->Last;
+  const uint8_t *restrict prot = flows->prot;
+  for (uint32_t i = start; i < count; i++) {
+    // octets / duration > limit without dividing: octets >= (limit + 1) * max(duration, 1).
+    uint64_t duration = (uint32_t) (last[i] - first[i]);
+    duration += duration == 0;
+    mask[i] = ((uint32_t) ((octets[i] == 0) | (packets[i] == 0)) << netflow_reject_counters) |
+              ((uint32_t) ((first[i] == 0) | (last[i] == 0) | (first[i] > last[i])) << netflow_reject_time) |
+              ((uint32_t) (((prot[i] == 6) | (prot[i] == 17)) & (srcport[i] == 0) & (dstport[i] == 0))
+               << netflow_reject_ports) |
+              ((uint32_t) ((octets[i] >= octets_limit * duration) | (packets[i] >= packets_limit * duration))
+               << netflow_reject_rate) |
+              ((uint32_t) (((srcaddr[i] >> 24) == 0) | ((dstaddr[i] >> 24) == 0)) & (ip_version[i] != 6))
+                  << netflow_reject_address;
+  }
+  // IPv6 rows take the address check on their side column entries.
+  for (uint32_t v6 = flows->v6_count; v6 > 0 && flows->v6_row[v6 - 1] >= start; v6--) {
+    mask[flows->v6_row[v6 - 1]] |= (uint32_t) (((flows->v6_srcaddr[v6 - 1] >> 24) == 0) |
+                                               ((flows->v6_dstaddr[v6 - 1] >> 24) == 0))
+                                   << netflow_reject_address;
+  }
+
+  // Indexed by the first failed check; the last slot counts the rows kept.
+  uint32_t outcome[netflow_reject_reasons + 1] = {0};
+  for (uint32_t i = start; i < count; i++) {
+    outcome[__builtin_ctz(mask[i] | 1u << netflow_reject_reasons)]++;
+  }
+  if (outcome[netflow_reject_reasons] == count - start) {
+    return count;
+  }
+  for (int reason = 0; reason < netflow_reject_reasons; reason++) {
+    rejected[reason] += outcome[reason];
+  }
+  for (uint32_t i = start; i < count; i++) {
+    mask[i] = mask[i] == 0;
+  }
+  return flow_batch_compact(flows, start, mask);
+}
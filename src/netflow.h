@@ -42,6 +42,10 @@ typedef struct {
   uint8_t engine_type;
   uint8_t engine_id;
   uint16_t sampling_interval;
+  // Collector-side 1-in-N sampling applied under overload, 1 when every datagram was parsed.
+  uint32_t sampling_rate;
+  // Receive time of the datagram, seconds since the epoch.
+  uint32_t received;
 } netflow_v9_header_insert_t;
 typedef struct {
   uint32_t srcaddr;
@@ -190,7 +194,51 @@ void printf_v5(FILE *, netflow_v5_flowset_t *, int);
 void swap_src_dst_v5_ipv4(netflow_v5_record_t *record);
 void swap_src_dst_v9_ipv4(netflow_v9_record_insert_uint128_t *record);
 void swap_src_dst_ipfix_ipv4(netflow_v9_record_insert_uint128_t *record);
-void printf_v9(FILE *file, netflow_v9_uint128_flowset_t *netflow_packet, size_t i, uint32_t frame_number, uint16_t template_id, uint16_t flowset_id);
+struct flow_batch_s;
+// Prints row `row` of a batch, the flowset's flow `i`.
+void printf_v9(FILE *file, const struct flow_batch_s *flows, uint32_t row, size_t i, uint32_t frame_number, uint16_t template_id, uint16_t flowset_id);
 int is_ipv4_private(uint32_t);
+
+// Default limits above which a flow's rate is taken for a decoding error.
+#define NETFLOW_MAX_OCTETS_PER_SEC 900000000u
+#define NETFLOW_MAX_PACKETS_PER_SEC 9000000u
+
+// Why netflow_prepare_batch() dropped a row, in the order the checks apply.
+typedef enum {
+  // No octets or no packets.
+  netflow_reject_counters = 0,
+  // First or Last missing, or First after Last.
+  netflow_reject_time,
+  // TCP or UDP with both ports 0.
+  netflow_reject_ports,
+  // More octets or packets per second than the limits.
+  netflow_reject_rate,
+  // Source or destination in 0.0.0.0/8.
+  netflow_reject_address,
+  netflow_reject_reasons,
+} netflow_reject_reason_t;
+
+/**
+ * Sets the octets and packets per second above which a flow is rejected.
+ * 0 keeps the current limit. Call before parsing starts.
+ */
+void netflow_set_flow_limits(uint32_t max_octets_per_sec, uint32_t max_packets_per_sec);
+
+/**
+ * Runs once over the rows a flowset added to a batch, from `start` on: puts
+ * the private side of each IPv4 row in src (as swap_src_dst_v9_ipv4() does)
+ * and, if `rejected` is not NULL, drops the rows no sink should store,
+ * packing the rest after the rows before `start` and adding one to
+ * rejected[reason] for each row's first failed check. Each step is one
+ * branch-free loop over a few columns; the swaps vectorize.
+ *
+ * @return The rows now in the batch.
+ */
+uint32_t netflow_prepare_batch(struct flow_batch_s *flows, uint32_t start, uint32_t *rejected);
+/**
+ * Receives one stored template: the exporter/template id key of the template
+ * tables and the template record as it arrived, in network byte order.
+ */
+typedef void (*netflow_template_cb)(uint16_t version, uint64_t key, const void *record, size_t len, void *ctx);
 extern endianness_e endianness;
 #endif // NETFLOW_H
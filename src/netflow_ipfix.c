@@ -7,10 +7,14 @@
 #include <assert.h>
 #include <stdio.h>
 #include "db.h"
+#include "exporter.h"
+#include "flow_batch.h"
 #include "log.h"
 #include "metrics.h"
 #include "netflow.h"
+#include "netflow_template.h"
 #include "netflow_v5.h"
+#include "shard.h"
 #include <arpa/inet.h>
 #ifdef USE_REDIS
 #include "redis_handler.h"
@@ -21,6 +25,23 @@ uv_mutex_t ipfix_parse_mutex;
 extern arena_struct_t *arena_collector;
 extern arena_struct_t *arena_hashmap_ipfix;
 
+/**
+ * @return The length of an IPFIX template record: its id and field
+ *         count, then 4 bytes per field and 4 more for an enterprise number.
+ *         0 if the record would run past `max` bytes.
+ */
+static size_t ipfix_template_len(const uint8_t *record, size_t max) {
+  uint16_t field_count = (uint16_t) (record[2] << 8 | record[3]);
+  size_t len = 4;
+  for (uint16_t i = 0; i < field_count; i++) {
+    if (len + 4 > max) {
+      return 0;
+    }
+    len += record[len] & 0x80 ? 8 : 4;
+  }
+  return len <= max ? len : 0;
+}
+
 void init_ipfix(arena_struct_t *arena, const size_t cap) {
   LOG_ERROR("%s %d %s: Initializing IPFIX (Hashmap)...\n", __FILE__, __LINE__, __func__);
   templates_ipfix_hashmap = hashmap_create(arena, cap);
@@ -35,20 +56,29 @@ void init_ipfix(arena_struct_t *arena, const size_t cap) {
       size_t val_len = 0;
       void *val = redis_get_template(keys[i], strlen(keys[i]), &val_len);
       if (val) {
-        void *arena_val = arena_alloc(arena, val_len);
+        netflow_template_t *arena_val = NULL;
+        if (val_len >= 4 && ipfix_template_len((const uint8_t *) val, val_len) == val_len) {
+          arena_val = netflow_template_compile(arena, 10, (const uint8_t *) val, val_len);
+        }
         if (arena_val) {
-          memcpy(arena_val, val, val_len);
-          char ip_str[32] = {0};
+          char ip_str[INET6_ADDRSTRLEN] = {0};
+          uint32_t domain = 0;
           uint16_t tid = 0;
-          if (sscanf(keys[i], "%31[^-]-10-%hu", ip_str, &tid) == 2) {
-             struct in_addr in;
-             if (inet_pton(AF_INET, ip_str, &in) == 1) {
-                 uint64_t hkey = ((uint64_t)in.s_addr << 32) | tid;
-                 uv_mutex_lock(&ipfix_parse_mutex);
-                 hashmap_set(templates_ipfix_hashmap, arena, &hkey, sizeof(uint64_t), arena_val);
-                 uv_mutex_unlock(&ipfix_parse_mutex);
-                 LOG_INFO("Loaded IPFIX template %s from Redis\n", keys[i]);
-             }
+          // <exporter>-10-<observation domain>-<template id>; older keys carry no domain.
+          int fields = sscanf(keys[i], "%45[^-]-10-%u-%hu", ip_str, &domain, &tid);
+          if (fields == 2) {
+            tid = (uint16_t) domain;
+            domain = 0;
+          }
+          uint8_t addr[16];
+          uint32_t id = 0;
+          if (fields >= 2 && exporter_addr_from_string(ip_str, addr) == 0 &&
+              (id = exporter_intern(addr, domain)) != 0) {
+             uint64_t hkey = exporter_template_key(id, tid);
+             uv_mutex_lock(&ipfix_parse_mutex);
+             hashmap_set(templates_ipfix_hashmap, arena, &hkey, sizeof(uint64_t), arena_val);
+             uv_mutex_unlock(&ipfix_parse_mutex);
+             LOG_INFO("Loaded IPFIX template %s from Redis\n", keys[i]);
           }
         }
         free(val);
@@ -59,12 +89,61 @@ void init_ipfix(arena_struct_t *arena, const size_t cap) {
 #endif
 }
 
+typedef struct {
+  netflow_template_cb cb;
+  void *ctx;
+} ipfix_template_walk_t;
+
+static void ipfix_template_visit(const void *key, size_t key_len, void *value, void *ctx) {
+  ipfix_template_walk_t *walk = (ipfix_template_walk_t *) ctx;
+  uint64_t hkey;
+  if (key_len != sizeof(hkey)) {
+    return;
+  }
+  memcpy(&hkey, key, sizeof(hkey));
+  const netflow_template_t *tpl = (const netflow_template_t *) value;
+  walk->cb(10, hkey, tpl->raw, tpl->raw_len, walk->ctx);
+}
+
+size_t ipfix_templates_foreach(netflow_template_cb cb, void *ctx) {
+  ipfix_template_walk_t walk = {.cb = cb, .ctx = ctx};
+  size_t count = hashmap_foreach(templates_ipfix_hashmap, ipfix_template_visit, &walk);
+  // Templates learned by a shard thread only live in its own table.
+  for (unsigned int i = 0; i < SHARD_MAX; i++) {
+    shard_t *shard = shard_get(i);
+    if (shard != NULL) {
+      count += hashmap_foreach(shard->templates_ipfix, ipfix_template_visit, &walk);
+    }
+  }
+  return count;
+}
+
+int ipfix_template_restore(uint64_t key, const void *record, size_t len) {
+  if (len < 4 || ipfix_template_len((const uint8_t *) record, len) != len) {
+    return -1;
+  }
+  netflow_template_t *value = netflow_template_compile(arena_hashmap_ipfix, 10, (const uint8_t *) record, len);
+  if (value == NULL) {
+    return -1;
+  }
+  uv_mutex_lock(&ipfix_parse_mutex);
+  int ret = hashmap_set(templates_ipfix_hashmap, arena_hashmap_ipfix, &key, sizeof(key), value);
+  uv_mutex_unlock(&ipfix_parse_mutex);
+  return ret;
+}
+
 void *parse_ipfix(uv_work_t *req) {
 
-  uint16_t *template_hashmap = NULL;
+  netflow_template_t *template_hashmap = NULL;
   parse_args_t *args = (parse_args_t *) req->data;
   args->status = collector_data_status_processing;
   uint64_t total_flows_in_packet = 0;
+  // Every data set of the message adds its rows; the batch goes to the sink
+  // once the message is parsed.
+  flow_batch_t *flows = flow_batch_thread();
+  // A shard thread keeps its exporters' templates in its own table and arena.
+  shard_t *shard = shard_current();
+  arena_struct_t *template_arena = shard != NULL ? &shard->arena : arena_hashmap_ipfix;
 
   if (args->len < sizeof(netflow_ipfix_header_t)) {
     LOG_ERROR("%s %d %s: Packet too short for IPFIX header: %lu\n", __FILE__, __LINE__, __func__, args->len);
@@ -83,8 +162,15 @@ void *parse_ipfix(uv_work_t *req) {
   swap_endianness((void *) &(header->ExportTime), sizeof(header->ExportTime));
   swap_endianness((void *) &(header->SequenceNumber), sizeof(header->SequenceNumber));
   swap_endianness((void *) &(header->ObsDomainId), sizeof(header->ObsDomainId));
+  // Template ids are only unique per exporter address and observation domain.
+  uint32_t exporter_id = exporter_intern(args->exporter_addr, header->ObsDomainId);
+  if (unlikely(exporter_id == 0)) {
+    metrics_inc_exporter_rejected();
+    goto cleanup_ipfix_and_unlock;
+  }
   uint32_t now = args->now;
   uint32_t diff = now - (uint32_t) (header->ExportTime);
+  const uint32_t sampling_rate = args->sampling_rate ? args->sampling_rate : 1;
   LOG_DEBUG("%s %d %s: IPFIX packet length: %d ExportTime: %u Sequence: %u Domain: %u Now: %u Diff: %u\n", __FILE__,
             __LINE__, __func__, header->length, header->ExportTime, header->SequenceNumber, header->ObsDomainId, now,
             diff);
@@ -184,32 +270,42 @@ void *parse_ipfix(uv_work_t *req) {
 
         // Store template in Redis
         char redis_key[255];
-        snprintf(redis_key, 255, "%s-10-%u", ip_int_to_str(args->exporter), template_id);
-        uint64_t hkey = ((uint64_t)args->exporter << 32) | template_id;
+        char exporter_str[INET6_ADDRSTRLEN];
+        exporter_addr_to_string(args->exporter_addr, exporter_str, sizeof(exporter_str));
+        snprintf(redis_key, 255, "%s-10-%u-%u", exporter_str, header->ObsDomainId, template_id);
+        uint64_t hkey = exporter_template_key(exporter_id, template_id);
         LOG_ERROR("%s %d %s: Storing template key: %s\n", __FILE__, __LINE__, __func__, redis_key);
 
         uint8_t *template_record_start = args->data + flowset_base + pos;
 
-        // We use arena for temporary buffer if needed, but here we can just use the raw pointer if we were copying
-        // But redis_set_template takes a buffer.
-        // The original code allocated on arena then set to hashmap.
-        // We can just set to Redis directly from the packet buffer if it's contiguous?
-        // Wait, the template definition in packet might not be contiguous if we skipped enterprise fields?
-        // The original code copied to `temp` using `memcpy`.
-        // AND `template_size` was calculated.
-
-        // Let's allocate a clean buffer to store the standardized template format
-        uint16_t *temp = arena_alloc(arena_hashmap_ipfix, template_size);
-        if (temp) {
-          memcpy(temp, (void *) template_record_start, template_size);
-          // Store in Hashmap
+        netflow_template_t *temp;
+        if (shard != NULL) {
+          temp = (netflow_template_t *) shard_template_get(shard, shard->templates_ipfix, templates_ipfix_hashmap,
+                                                           &ipfix_parse_mutex, hkey);
+        } else {
           uv_mutex_lock(&ipfix_parse_mutex);
-          hashmap_set(templates_ipfix_hashmap, arena_hashmap_ipfix, &hkey, sizeof(uint64_t), temp);
+          temp = (netflow_template_t *) hashmap_get(templates_ipfix_hashmap, &hkey, sizeof(uint64_t));
           uv_mutex_unlock(&ipfix_parse_mutex);
-          LOG_ERROR("%s %d %s: IPFIX template saved to Hashmap [%s]\n", __FILE__, __LINE__, __func__, redis_key);
+        }
+        // Exporters resend unchanged templates every few seconds; those keep the compiled copy.
+        if (!netflow_template_same(temp, template_record_start, template_size)) {
+          temp = netflow_template_compile(template_arena, 10, template_record_start, template_size);
+          if (temp != NULL) {
+            // Store in Hashmap
+            if (shard != NULL) {
+              shard_template_set(shard, shard->templates_ipfix, hkey, temp);
+            } else {
+              uv_mutex_lock(&ipfix_parse_mutex);
+              hashmap_set(templates_ipfix_hashmap, arena_hashmap_ipfix, &hkey, sizeof(uint64_t), temp);
+              uv_mutex_unlock(&ipfix_parse_mutex);
+            }
+            LOG_ERROR("%s %d %s: IPFIX template saved to Hashmap [%s]\n", __FILE__, __LINE__, __func__, redis_key);
+          }
+        }
+        if (temp) {
 
 #ifdef USE_REDIS
-          if (redis_set_template(redis_key, strlen(redis_key), temp, template_size) != 0) {
+          if (redis_set_template(redis_key, strlen(redis_key), temp->raw, temp->raw_len) != 0) {
             LOG_ERROR("%s %d %s: Error saving IPFIX template to Redis [%s]\n", __FILE__, __LINE__, __func__, redis_key);
           } else {
             LOG_ERROR("%s %d %s: IPFIX template saved to Redis [%s]\n", __FILE__, __LINE__, __func__, redis_key);
@@ -240,11 +336,16 @@ void *parse_ipfix(uv_work_t *req) {
       LOG_ERROR("%s %d %s: Processing IPFIX data set\n", __FILE__, __LINE__, __func__);
 
       uint16_t template_id = flowset_id;
-      uint64_t hkey = ((uint64_t)args->exporter << 32) | template_id;
+      uint64_t hkey = exporter_template_key(exporter_id, template_id);
 
-      uv_mutex_lock(&ipfix_parse_mutex);
-      template_hashmap = (uint16_t *) hashmap_get(templates_ipfix_hashmap, &hkey, sizeof(uint64_t));
-      uv_mutex_unlock(&ipfix_parse_mutex);
+      if (shard != NULL) {
+        template_hashmap = (netflow_template_t *) shard_template_get(shard, shard->templates_ipfix,
+                                                                     templates_ipfix_hashmap, &ipfix_parse_mutex, hkey);
+      } else {
+        uv_mutex_lock(&ipfix_parse_mutex);
+        template_hashmap = (netflow_template_t *) hashmap_get(templates_ipfix_hashmap, &hkey, sizeof(uint64_t));
+        uv_mutex_unlock(&ipfix_parse_mutex);
+      }
 
       if (template_hashmap == NULL) {
         LOG_ERROR("%s %d %s: Template %d not found for exporter %s\n", __FILE__, __LINE__, __func__, template_id,
@@ -254,428 +355,53 @@ void *parse_ipfix(uv_work_t *req) {
           LOG_ERROR("%s %d %s: Exporter: %s [%u]\n", __FILE__, __LINE__, __func__, ip_int_to_str(args->exporter),
                     args->exporter);
         }
-        void *pointer = args->data + flowset_base + 4; // Skip set header
+        const uint8_t *pointer = args->data + flowset_base + 4; // Skip set header
         size_t pos = 4;
 
-        uint16_t stored_template_id = template_hashmap[0];
-        swap_endianness(&stored_template_id, sizeof(stored_template_id));
-        uint16_t field_count = template_hashmap[1];
-        swap_endianness(&field_count, sizeof(field_count));
-
-        netflow_v9_uint128_flowset_t flows_to_insert;
-        memset(&flows_to_insert, 0, sizeof(flows_to_insert));
-        int is_ipv6 = 0;
+        // The template writes the same fields into every record, so the
+        // fields it lacks stay 0 from here for the whole set.
+        netflow_v9_record_insert_uint128_t record;
+        memset(&record, 0, sizeof(record));
+        const uint32_t start = flows->count;
         uint64_t local_ipfix_records = 0;
 
-        size_t total_record_size = 0;
-        uint8_t *temp_ptr = (uint8_t *) template_hashmap + 4;
-        for (uint16_t i = 0; i < field_count; i++) {
-            uint16_t flen = (temp_ptr[2] << 8) | temp_ptr[3];
-            if (flen == 65535) { // Variable length field (not supported yet, skip size logic if needed)
-               total_record_size = 0;
-               break; 
-            }
-            total_record_size += flen;
-            temp_ptr += 4;
-        }
-
+        // Variable-length fields are not supported yet.
+        size_t total_record_size = template_hashmap->record_size;
         if (unlikely(total_record_size == 0)) {
             LOG_ERROR("%s %d %s: Template %d has 0 record size\n", __FILE__, __LINE__, __func__, template_id);
             goto unlock_mutex_parse_ipfix;
         }
+        if (unlikely(flow_batch_reserve(flows, (uint32_t) (flowset_length / total_record_size)) != 0)) {
+            goto skip_ipfix_record_pass;
+        }
 
+        // The set lies within the message, so every whole record in it does too.
         while (pos + total_record_size <= flowset_length) {
-          if (record_counter >= 60) {
-            LOG_ERROR("%s %d %s: Too many records in FlowSet (> 60), truncating\n", __FILE__, __LINE__, __func__);
-            break;
-          }
-#ifdef CNETFLOW_DEBUG_BUILD
-          fprintf(stdout, "exporter: %s template: %d record_no: %lu field_count: %u\n", ip_int_to_str(args->exporter),
-                  template_id, record_counter + 1, field_count);
-#endif
-
-          size_t reading_field = 0;
-
           // Track exporter and flowset per valid data loop entry
           metrics_track_exporter(args->exporter);
           metrics_inc_flowsets(1);
 
-          uint64_t sysUptimeMillis = 0;
-
-          uint8_t *stored_field_ptr = (uint8_t *) template_hashmap + 4;
+          netflow_template_decode(template_hashmap, pointer, &record, diff);
+          pointer += total_record_size;
+          pos += total_record_size;
 
-          for (uint16_t i = 0; i < field_count; i++) {
-            reading_field++;
-            uint16_t field_type = (stored_field_ptr[0] << 8) | stored_field_ptr[1];
-            uint16_t field_length = (stored_field_ptr[2] << 8) | stored_field_ptr[3];
-
-            size_t stored_field_def_size = (field_type & 0x8000) ? 8 : 4;
-
-            // Mask off enterprise bit for now
-            field_type = field_type & 0x7FFF;
-
-            if (unlikely(field_type >= (sizeof(ipfix_field_types) / sizeof(ipfix_field_type_t)))) {
-              LOG_ERROR("%s %d %s: Unknown IPFIX field type: %u\n", __FILE__, __LINE__, __func__, field_type);
-              goto cleanup_ipfix_and_unlock;
-            }
-
-#ifdef CNETFLOW_DEBUG_BUILD
-            fprintf(stdout, " field_%lu_%s[%d]_%d ", reading_field,
-                    ipfix_field_types[field_type].name ? ipfix_field_types[field_type].name : "unknown", field_type,
-                    field_length);
-#endif
-
-            uint16_t record_length = field_length;
-            uint8_t *tmp8 = NULL;
-            uint8_t val_tmp8 = 0;
-            uint16_t *tmp16 = NULL;
-            uint16_t val_tmp16 = 0;
-            uint32_t *tmp32 = NULL;
-            uint32_t val_tmp32 = 0;
-            uint64_t *tmp64 = NULL;
-            uint64_t val_tmp64 = 0;
-            uint128_t *tmp128 = NULL;
-            uint128_t val_tmp128 = 0;
-
-            if (unlikely((uint8_t *) pointer + record_length > (uint8_t *) args->data + args->len ||
-                         pos + record_length > flowset_length)) {
-              LOG_ERROR("%s %d %s: Data record OOB! field: %d type: %u len: %u\n", __FILE__, __LINE__, __func__, i,
-                        field_type, record_length);
-              goto cleanup_ipfix_and_unlock;
-            }
-
-            switch (record_length) {
-              case 1:
-                tmp8 = (uint8_t *) pointer;
-                val_tmp8 = *tmp8;
-                break;
-              case 2:
-                tmp16 = (uint16_t *) pointer;
-                val_tmp16 = *tmp16;
-                swap_endianness(&val_tmp16, sizeof(val_tmp16));
-                break;
-              case 4:
-                tmp32 = (uint32_t *) pointer;
-                val_tmp32 = *tmp32;
-                swap_endianness(&val_tmp32, sizeof(val_tmp32));
-                break;
-              case 6:
-                tmp64 = (uint64_t *) pointer;
-                val_tmp64 = *tmp64;
-                swap_endianness(&val_tmp64, sizeof(val_tmp64));
-                val_tmp64 &= 0x0000ffffffffffff;
-                break;
-              case 8:
-                tmp64 = (uint64_t *) pointer;
-                val_tmp64 = *tmp64;
-                swap_endianness(&val_tmp64, sizeof(val_tmp64));
-                break;
-              case 16:
-                tmp128 = (uint128_t *) pointer;
-                memcpy(&val_tmp128, tmp128, sizeof(uint128_t));
-                swap_endianness(&val_tmp128, sizeof(val_tmp128));
-                break;
-            }
-
-            // Process field based on IPFIX field type (same as NetFlow v9)
-            switch (field_type) {
-              case IPFIX_FT_SYSTEMINITTIMEMILLISECONDS:
-                if (record_length == 8) {
-                  // swap_endianness(tmp64, sizeof(*tmp64));
-                  sysUptimeMillis = val_tmp64;
-                }
-                break;
-              case IPFIX_FT_FLOWENDSYSUPTIME:
-                if (record_length == 4) {
-                  // swap_endianness(&val_tmp32, sizeof(val_tmp32));
-                  val_tmp32 = val_tmp32 / 1000 + diff;
-                  // swap_endianness(&val_tmp32, sizeof(val_tmp32));
-                  flows_to_insert.records[record_counter].Last = val_tmp32;
-                } else if (record_length == 8) {
-                  // val_tmp64 is already host-order from the switch above
-                  val_tmp64 = val_tmp64 / 1000 + diff;
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  flows_to_insert.records[record_counter].Last = val32;
-                } else {
-                  flows_to_insert.records[record_counter].Last = 0;
-                }
-                break;
-              case IPFIX_FT_FLOWSTARTSYSUPTIME:
-                if (record_length == 4) {
-                  // swap_endianness(&val_tmp32, sizeof(val_tmp32));
-                  val_tmp32 = val_tmp32 / 1000 + diff;
-                  // swap_endianness(&val_tmp32, sizeof(val_tmp32));
-                  flows_to_insert.records[record_counter].First = val_tmp32;
-                } else if (record_length == 8) {
-                  // val_tmp64 is already host-order
-                  val_tmp64 = val_tmp64 / 1000 + diff;
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  flows_to_insert.records[record_counter].First = val32;
-                } else {
-                  flows_to_insert.records[record_counter].First = 0;
-                }
-                break;
-              case IPFIX_FT_FLOWSTARTMILLISECONDS:
-                // swap_endianness(&val_tmp64, sizeof(val_tmp64));
-                val_tmp64 = val_tmp64 / 1000 + diff;
-                {
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  // swap_endianness(&val32, sizeof(val32));
-                  flows_to_insert.records[record_counter].First = val32;
-                }
-                break;
-              case IPFIX_FT_FLOWENDMILLISECONDS:
-                // swap_endianness(&val_tmp64, sizeof(val_tmp64));
-                val_tmp64 = val_tmp64 / 1000 + diff;
-                {
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  // swap_endianness(&val32, sizeof(val32));
-                  flows_to_insert.records[record_counter].Last = val32;
-                }
-                break;
-              case IPFIX_FT_IPVERSION:
-                switch (val_tmp8) {
-                  case 4:
-                    is_ipv6 = 0;
-                    flows_to_insert.records[record_counter].ip_version = 4;
-                    break;
-                  case 6:
-                    is_ipv6 = 1;
-                    flows_to_insert.records[record_counter].ip_version = 6;
-                    break;
-                  default:
-                    is_ipv6 = 0;
-                    flows_to_insert.records[record_counter].ip_version = 4;
-                    break;
-                }
-                break;
-              case IPFIX_FT_SOURCEIPV4ADDRESS:
-                flows_to_insert.records[record_counter].srcaddr = val_tmp32;
-                flows_to_insert.records[record_counter].ip_version = 4;
-                break;
-              case IPFIX_FT_DESTINATIONIPV4ADDRESS:
-                flows_to_insert.records[record_counter].dstaddr = val_tmp32;
-                break;
-              case IPFIX_FT_SOURCEIPV6ADDRESS:
-                flows_to_insert.records[record_counter].srcaddr = val_tmp128;
-                flows_to_insert.records[record_counter].ip_version = 6;
-                is_ipv6 = 1;
-                break;
-              case IPFIX_FT_DESTINATIONIPV6ADDRESS:
-                flows_to_insert.records[record_counter].dstaddr = val_tmp128;
-                is_ipv6 = 1;
-                break;
-              case IPFIX_FT_OCTETDELTACOUNT:
-                switch (record_length) {
-                  case 4:
-                    flows_to_insert.records[record_counter].dOctets = ((uint64_t) val_tmp32);
-                    break;
-                  case 8:
-                    flows_to_insert.records[record_counter].dOctets = (uint64_t) val_tmp64;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dOctets = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_PACKETDELTACOUNT:
-                switch (record_length) {
-                  case 4:
-                    flows_to_insert.records[record_counter].dPkts = ((uint64_t) val_tmp32);
-                    break;
-                  case 8:
-                    flows_to_insert.records[record_counter].dPkts = (uint64_t) val_tmp64;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dPkts = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_DESTINATIONTRANSPORTPORT:
-              case IPFIX_FT_TCPDESTINATIONPORT:
-              case IPFIX_FT_UDPDESTINATIONPORT:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].dstport = (uint16_t) val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].dstport = (uint16_t) ((val_tmp32) >> 16);
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dstport = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_SOURCETRANSPORTPORT:
-              case IPFIX_FT_TCPSOURCEPORT:
-              case IPFIX_FT_UDPSOURCEPORT:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].srcport = (uint16_t) val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].srcport = (uint16_t) ((val_tmp32) >> 16);
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].srcport = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_PROTOCOLIDENTIFIER:
-                flows_to_insert.records[record_counter].prot = val_tmp8;
-                break;
-              case IPFIX_FT_INGRESSINTERFACE:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].input = val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].input = (uint16_t) ((val_tmp32) >> 16);
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].input = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_EGRESSINTERFACE:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].output = val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].output = (uint16_t) ((val_tmp32) >> 16);
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].output = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_BGPSOURCEASNUMBER:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].src_as = ((uint32_t) val_tmp16) << 16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].src_as = val_tmp32;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].src_as = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_BGPDESTINATIONASNUMBER:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].dst_as = ((uint32_t) val_tmp16) << 16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].dst_as = val_tmp32;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dst_as = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_BGPNEXTHOPIPV4ADDRESS:
-                flows_to_insert.records[record_counter].nexthop = val_tmp32;
-                break;
-              case IPFIX_FT_BGPNEXTHOPIPV6ADDRESS:
-                flows_to_insert.records[record_counter].nexthop = val_tmp128;
-                is_ipv6 = 1;
-                break;
-              case IPFIX_FT_TCPCONTROLBITS:
-                flows_to_insert.records[record_counter].tcp_flags = val_tmp8;
-                break;
-              case IPFIX_FT_IPCLASSOFSERVICE:
-                flows_to_insert.records[record_counter].tos = val_tmp8;
-                break;
-              case IPFIX_FT_SOURCEIPV4PREFIXLENGTH:
-                flows_to_insert.records[record_counter].src_mask = val_tmp8;
-                break;
-              case IPFIX_FT_DESTINATIONIPV4PREFIXLENGTH:
-                flows_to_insert.records[record_counter].dst_mask = val_tmp8;
-                break;
-              case IPFIX_FT_SOURCEIPV6PREFIXLENGTH:
-                flows_to_insert.records[record_counter].src_mask = val_tmp8;
-                break;
-              case IPFIX_FT_DESTINATIONIPV6PREFIXLENGTH:
-                flows_to_insert.records[record_counter].dst_mask = val_tmp8;
-                break;
-              default:
-                break;
-            }
-
-            pointer += record_length;
-            pos += record_length;
-            stored_field_ptr += stored_field_def_size;
-          }
-
-#ifdef CNETFLOW_DEBUG_BUILD
-          fprintf(stdout, "\n");
-#endif
-          // if (flows_to_insert.records[record_counter].prot == 1 &&
-          // (flows_to_insert.records[record_counter].srcport > 0 ||
-          // flows_to_insert.records[record_counter].dstport > 0)) {
-          //   EXIT_WITH_MSG(-1, "%s %d %s this should not happen...\n", __FILE__, __LINE__, __func__);
-          // }
-          // if (sysUptimeMillis != 0 ) {
-
-          LOG_ERROR("%s %d %s: sysUptimeMillis = %lu\n", __FILE__, __LINE__, __func__, sysUptimeMillis);
-          LOG_ERROR("%s %d %s: Last = %u\n", __FILE__, __LINE__, __func__,
-                    flows_to_insert.records[record_counter].Last);
-          LOG_ERROR("%s %d %s: First = %u\n", __FILE__, __LINE__, __func__,
-                    flows_to_insert.records[record_counter].First);
-          // swap_endianness(&flows_to_insert.records[record_counter].Last,
-          //               sizeof(flows_to_insert.records[record_counter].Last));
-          // swap_endianness(&flows_to_insert.records[record_counter].First,
-          //               sizeof(flows_to_insert.records[record_counter].First));
-          uint32_t duration =
-              flows_to_insert.records[record_counter].Last - flows_to_insert.records[record_counter].First;
-          flows_to_insert.records[record_counter].Last = now;
-          flows_to_insert.records[record_counter].First = now - duration;
-          // flows_to_insert.records[record_counter].Last = (sysUptimeMillis/1000) +
-          // flows_to_insert.records[record_counter].Last; flows_to_insert.records[record_counter].Last =
-          // (sysUptimeMillis/1000) + flows_to_insert.records[record_counter].Last;
-          // flows_to_insert.records[record_counter].First = (sysUptimeMillis/1000) +
-          // flows_to_insert.records[record_counter].First;
-          // swap_endianness(&flows_to_insert.records[record_counter].Last,
-          // sizeof(flows_to_insert.records[record_counter].Last));
-          // swap_endianness(&flows_to_insert.records[record_counter].First,
-          //               sizeof(flows_to_insert.records[record_counter].First));
-          //}
-          if (!is_ipv6) {
-
-            // swap_endianness(&flows_to_insert.records[record_counter].srcport,
-            // sizeof(flows_to_insert.records[record_counter].srcport));
-            // swap_endianness(&flows_to_insert.records[record_counter].dstport,
-            // sizeof(flows_to_insert.records[record_counter].dstport));
-            // swap_endianness(&flows_to_insert.records[record_counter].srcaddr,
-            // sizeof(flows_to_insert.records[record_counter].srcaddr));
-            // swap_endianness(&flows_to_insert.records[record_counter].dstaddr,
-            // sizeof(flows_to_insert.records[record_counter].dstaddr));
-
-            swap_src_dst_ipfix_ipv4(&flows_to_insert.records[record_counter]);
-
-            // swap_endianness(&flows_to_insert.records[record_counter].srcport,
-            // sizeof(flows_to_insert.records[record_counter].srcport));
-            // swap_endianness(&flows_to_insert.records[record_counter].dstport,
-            // sizeof(flows_to_insert.records[record_counter].dstport));
-            // swap_endianness(&flows_to_insert.records[record_counter].srcaddr,
-            // sizeof(flows_to_insert.records[record_counter].srcaddr));
-            // swap_endianness(&flows_to_insert.records[record_counter].dstaddr,
-            // sizeof(flows_to_insert.records[record_counter].dstaddr));
-          }
+          LOG_ERROR("%s %d %s: Last = %u\n", __FILE__, __LINE__, __func__, record.Last);
+          LOG_ERROR("%s %d %s: First = %u\n", __FILE__, __LINE__, __func__, record.First);
+          uint32_t duration = record.Last - record.First;
+          record.Last = now;
+          record.First = now - duration;
+          flow_batch_add(flows, &record, exporter_id, sampling_rate);
 
 // #ifdef ENABLE_METRICS
 //           metrics_inc_ipfix_records_received();
 // #endif
           local_ipfix_records++;
 
-          if (flows_to_insert.records[record_counter].input != 0) {
-            metrics_track_interface(args->exporter, flows_to_insert.records[record_counter].input);
+          if (record.input != 0) {
+            metrics_track_interface(args->exporter, record.input);
           }
-          if (flows_to_insert.records[record_counter].output != 0) {
-            metrics_track_interface(args->exporter, flows_to_insert.records[record_counter].output);
+          if (record.output != 0) {
+            metrics_track_interface(args->exporter, record.output);
           }
 
           record_counter++;
@@ -685,33 +411,24 @@ void *parse_ipfix(uv_work_t *req) {
           }
         }
 
-        flows_to_insert.header.count = record_counter;
-
 #ifdef ENABLE_METRICS
         if (local_ipfix_records > 0) {
           metrics_inc_ipfix_records_received_batch(local_ipfix_records);
         }
 #endif
 
-        flows_to_insert.header.SysUptime = 0; // IPFIX doesn't use SysUptime the same way
-        flows_to_insert.header.unix_secs = header->ExportTime;
-        flows_to_insert.header.unix_nsecs = 0;
-        flows_to_insert.header.flow_sequence = header->SequenceNumber;
-        flows_to_insert.header.sampling_interval = header->ObsDomainId;
-
-        uint32_t exporter_host = args->exporter;
-        swap_endianness((void *) &exporter_host, sizeof(exporter_host));
-
         LOG_INFO("%s %d %s: Inserting %lu IPFIX flows (%s)\n", __FILE__, __LINE__, __func__, record_counter,
-                 is_ipv6 ? "IPv6" : "IPv4");
+                 template_hashmap->ipv6 ? "IPv6" : "IPv4");
         total_flows_in_packet += record_counter;
         collector_inc_received_flows(record_counter);
+        uint32_t rejected[netflow_reject_reasons] = {0};
+        netflow_prepare_batch(flows, start, args->flags & 2 ? NULL : rejected);
+        metrics_inc_flows_rejected(rejected);
         if (args->flags & 2) {
-            for (size_t i = 0; i < record_counter; i++) {
-                printf_v9(stdout, &flows_to_insert, i, args->frame_number, template_id, flowset_id);
+            for (uint32_t row = start; row < flows->count; row++) {
+                printf_v9(stdout, flows, row, row - start, args->frame_number, template_id, flowset_id);
             }
-        } else {
-            insert_flows(exporter_host, &flows_to_insert);
+            flow_batch_truncate(flows, start);
         }
       }
       skip_ipfix_record_pass:;
@@ -731,6 +448,10 @@ void *parse_ipfix(uv_work_t *req) {
 cleanup_ipfix_and_unlock:
 
 unlock_mutex_parse_ipfix:
+  if (flows->count > 0) {
+    flows->received = args->now;
+    insert_flows(flows);
+  }
   args->processed_flows = total_flows_in_packet;
   args->status = collector_data_status_done;
   return NULL;
@@ -130,5 +130,19 @@ typedef struct {
 
 void init_ipfix(arena_struct_t *arena, const size_t cap);
 void *parse_ipfix(uv_work_t *req);
+/**
+ * Calls `cb` with every IPFIX template the collector holds, in the shared table
+ * and in every shard's table.
+ *
+ * @return The number of templates visited.
+ */
+size_t ipfix_templates_foreach(netflow_template_cb cb, void *ctx);
+/**
+ * Stores a template record, as passed to a netflow_template_cb, under `key`
+ * in the shared table.
+ *
+ * @return 0 on success, -1 if `len` does not match the record or the table is full.
+ */
+int ipfix_template_restore(uint64_t key, const void *record, size_t len);
 void copy_ipfix_to_flow(const netflow_v9_flowset_t * restrict, netflow_v9_uint128_flowset_t * restrict, int);
 #endif // NETFLOW_IPFIX_H
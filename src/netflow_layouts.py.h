@@ -0,0 +1,110 @@
+//
+// Generated by scripts/gen_fields.h.py --layouts; do not edit.
+//
+// Unrolled decoders for the template layouts most exporters send. Each decodes
+// one record exactly as the compiled program of the same template would.
+//
+
+#ifndef CNETFLOW_NETFLOW_LAYOUTS_PY_H
+#define CNETFLOW_NETFLOW_LAYOUTS_PY_H
+
+// Cisco IOS v9 IPv4 template, the v5 record fields: 18 fields, 45 bytes.
+static const uint8_t netflow_layout_cisco_v4_spec[] = {
+    0x00, 0x01, 0x00, 0x04, 0x00, 0x02, 0x00, 0x04, 0x00, 0x04, 0x00, 0x01,
+    0x00, 0x05, 0x00, 0x01, 0x00, 0x06, 0x00, 0x01, 0x00, 0x07, 0x00, 0x02,
+    0x00, 0x08, 0x00, 0x04, 0x00, 0x09, 0x00, 0x01, 0x00, 0x0a, 0x00, 0x02,
+    0x00, 0x0b, 0x00, 0x02, 0x00, 0x0c, 0x00, 0x04, 0x00, 0x0d, 0x00, 0x01,
+    0x00, 0x0e, 0x00, 0x02, 0x00, 0x0f, 0x00, 0x04, 0x00, 0x10, 0x00, 0x02,
+    0x00, 0x11, 0x00, 0x02, 0x00, 0x15, 0x00, 0x04, 0x00, 0x16, 0x00, 0x04,
+};
+
+static int netflow_layout_cisco_v4(const uint8_t *src, netflow_v9_record_insert_uint128_t *out, uint32_t diff) {
+  int ipv6 = 0;
+  out->ip_version = 4;
+  out->dOctets = (uint64_t) (netflow_load32(src + 0));
+  out->dPkts = (uint64_t) (netflow_load32(src + 4));
+  out->prot = (uint8_t) (src[8]);
+  out->tos = (uint8_t) (src[9]);
+  out->tcp_flags = (uint8_t) (src[10]);
+  out->srcport = (uint16_t) (netflow_load16(src + 11));
+  out->srcaddr = (uint128_t) (netflow_load32(src + 13));
+  out->src_mask = (uint8_t) (src[17]);
+  out->input = (uint16_t) (netflow_load16(src + 18));
+  out->dstport = (uint16_t) (netflow_load16(src + 20));
+  out->dstaddr = (uint128_t) (netflow_load32(src + 22));
+  out->dst_mask = (uint8_t) (src[26]);
+  out->output = (uint16_t) (netflow_load16(src + 27));
+  out->src_as = (uint32_t) (netflow_load16(src + 33));
+  out->dst_as = (uint32_t) (netflow_load16(src + 35));
+  out->Last = (uint32_t) (netflow_load32(src + 37) / 1000 + diff);
+  out->First = (uint32_t) (netflow_load32(src + 41) / 1000 + diff);
+  return ipv6;
+}
+
+// softflowd -v 9 IPv4 template (docker-compose.yaml): 14 fields, 40 bytes.
+static const uint8_t netflow_layout_softflowd_v4_spec[] = {
+    0x00, 0x08, 0x00, 0x04, 0x00, 0x0c, 0x00, 0x04, 0x00, 0x15, 0x00, 0x04,
+    0x00, 0x16, 0x00, 0x04, 0x00, 0x01, 0x00, 0x04, 0x00, 0x02, 0x00, 0x04,
+    0x00, 0x0a, 0x00, 0x04, 0x00, 0x0e, 0x00, 0x04, 0x00, 0x07, 0x00, 0x02,
+    0x00, 0x0b, 0x00, 0x02, 0x00, 0x04, 0x00, 0x01, 0x00, 0x06, 0x00, 0x01,
+    0x00, 0x3c, 0x00, 0x01, 0x00, 0x05, 0x00, 0x01,
+};
+
+static int netflow_layout_softflowd_v4(const uint8_t *src, netflow_v9_record_insert_uint128_t *out, uint32_t diff) {
+  int ipv6 = 0;
+  out->ip_version = 4;
+  out->srcaddr = (uint128_t) (netflow_load32(src + 0));
+  out->dstaddr = (uint128_t) (netflow_load32(src + 4));
+  out->Last = (uint32_t) (netflow_load32(src + 8) / 1000 + diff);
+  out->First = (uint32_t) (netflow_load32(src + 12) / 1000 + diff);
+  out->dOctets = (uint64_t) (netflow_load32(src + 16));
+  out->dPkts = (uint64_t) (netflow_load32(src + 20));
+  out->input = (uint16_t) (netflow_load32(src + 24));
+  out->output = (uint16_t) (netflow_load32(src + 28));
+  out->srcport = (uint16_t) (netflow_load16(src + 32));
+  out->dstport = (uint16_t) (netflow_load16(src + 34));
+  out->prot = (uint8_t) (src[36]);
+  out->tcp_flags = (uint8_t) (src[37]);
+  ipv6 = src[38] == 6;
+  out->ip_version = ipv6 ? 6 : 4;
+  out->tos = (uint8_t) (src[39]);
+  return ipv6;
+}
+
+// softflowd -v 9 IPv6 template (docker-compose.yaml): 14 fields, 64 bytes.
+static const uint8_t netflow_layout_softflowd_v6_spec[] = {
+    0x00, 0x1b, 0x00, 0x10, 0x00, 0x1c, 0x00, 0x10, 0x00, 0x15, 0x00, 0x04,
+    0x00, 0x16, 0x00, 0x04, 0x00, 0x01, 0x00, 0x04, 0x00, 0x02, 0x00, 0x04,
+    0x00, 0x0a, 0x00, 0x04, 0x00, 0x0e, 0x00, 0x04, 0x00, 0x07, 0x00, 0x02,
+    0x00, 0x0b, 0x00, 0x02, 0x00, 0x04, 0x00, 0x01, 0x00, 0x06, 0x00, 0x01,
+    0x00, 0x3c, 0x00, 0x01, 0x00, 0x05, 0x00, 0x01,
+};
+
+static int netflow_layout_softflowd_v6(const uint8_t *src, netflow_v9_record_insert_uint128_t *out, uint32_t diff) {
+  int ipv6 = 1;
+  out->ip_version = 6;
+  out->srcaddr = (uint128_t) ((uint128_t) netflow_load64(src + 0) << 64 | netflow_load64(src + 0 + 8));
+  out->dstaddr = (uint128_t) ((uint128_t) netflow_load64(src + 16) << 64 | netflow_load64(src + 16 + 8));
+  out->Last = (uint32_t) (netflow_load32(src + 32) / 1000 + diff);
+  out->First = (uint32_t) (netflow_load32(src + 36) / 1000 + diff);
+  out->dOctets = (uint64_t) (netflow_load32(src + 40));
+  out->dPkts = (uint64_t) (netflow_load32(src + 44));
+  out->input = (uint16_t) (netflow_load32(src + 48));
+  out->output = (uint16_t) (netflow_load32(src + 52));
+  out->srcport = (uint16_t) (netflow_load16(src + 56));
+  out->dstport = (uint16_t) (netflow_load16(src + 58));
+  out->prot = (uint8_t) (src[60]);
+  out->tcp_flags = (uint8_t) (src[61]);
+  ipv6 = src[62] == 6;
+  out->ip_version = ipv6 ? 6 : 4;
+  out->tos = (uint8_t) (src[63]);
+  return ipv6;
+}
+
+static const netflow_layout_t netflow_layouts[] = {
+    {0xbc097c41u, 18, 45, netflow_layout_cisco_v4_spec, netflow_layout_cisco_v4},
+    {0x00b64288u, 14, 40, netflow_layout_softflowd_v4_spec, netflow_layout_softflowd_v4},
+    {0x58c74979u, 14, 64, netflow_layout_softflowd_v6_spec, netflow_layout_softflowd_v6},
+};
+
+#endif // CNETFLOW_NETFLOW_LAYOUTS_PY_H
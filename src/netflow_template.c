@@ -0,0 +1,337 @@
+//
+// Template compiler.
+//
+// A v9 or IPFIX data record is a run of fields whose types, widths and
+// offsets only change when the exporter sends a new template. Rather than
+// walking the template and switching on each field's type and width for every
+// record, the template is compiled when it arrives: each field a flow row
+// stores becomes one step naming its offset in the record, how to read it and
+// where in the row it goes. Everything else is dropped, so the data path only
+// touches the bytes it keeps, and the record size is known up front so bounds
+// are checked once per record instead of once per field.
+//
+// Templates laid out like one of the layouts in netflow_layouts.py.h, which
+// scripts/gen_fields.h.py generates, skip the program altogether: their
+// records go through an unrolled decoder with constant offsets.
+//
+
+#include "netflow_template.h"
+
+#include <stddef.h>
+#include <string.h>
+#include "fields.h"
+#include "log.h"
+
+#include "netflow_layouts.py.h"
+
+#define SLOT(field) ((uint16_t) offsetof(netflow_v9_record_insert_uint128_t, field))
+
+typedef enum {
+  netflow_dest_uint = 0,
+  netflow_dest_addr,
+  netflow_dest_seconds,
+  netflow_dest_ip_version,
+} netflow_dest_kind_t;
+
+typedef struct {
+  uint16_t slot;
+  // Bytes of the destination.
+  uint8_t size;
+  uint8_t kind;
+  // 4 or 6 if the field sets the record's ip_version, 0 otherwise.
+  uint8_t ip_version;
+  // The field is an IPv6 address.
+  uint8_t ipv6;
+} netflow_field_dest_t;
+
+/**
+ * @return 1 and the destination of IANA element `type` if a flow row stores
+ *         it, 0 otherwise.
+ */
+static int netflow_field_dest(uint16_t type, netflow_field_dest_t *dest) {
+  memset(dest, 0, sizeof(*dest));
+  switch (type) {
+    case IPFIX_FT_FLOWSTARTSYSUPTIME:
+    case IPFIX_FT_FLOWSTARTMILLISECONDS:
+      dest->slot = SLOT(First);
+      dest->size = 4;
+      dest->kind = netflow_dest_seconds;
+      return 1;
+    case IPFIX_FT_FLOWENDSYSUPTIME:
+    case IPFIX_FT_FLOWENDMILLISECONDS:
+      dest->slot = SLOT(Last);
+      dest->size = 4;
+      dest->kind = netflow_dest_seconds;
+      return 1;
+    case IPFIX_FT_IPVERSION:
+      dest->slot = SLOT(ip_version);
+      dest->size = 1;
+      dest->kind = netflow_dest_ip_version;
+      return 1;
+    case IPFIX_FT_SOURCEIPV4ADDRESS:
+      dest->slot = SLOT(srcaddr);
+      dest->size = 16;
+      dest->kind = netflow_dest_addr;
+      dest->ip_version = 4;
+      return 1;
+    case IPFIX_FT_DESTINATIONIPV4ADDRESS:
+      dest->slot = SLOT(dstaddr);
+      dest->size = 16;
+      dest->kind = netflow_dest_addr;
+      return 1;
+    case IPFIX_FT_SOURCEIPV6ADDRESS:
+      dest->slot = SLOT(srcaddr);
+      dest->size = 16;
+      dest->kind = netflow_dest_addr;
+      dest->ip_version = 6;
+      dest->ipv6 = 1;
+      return 1;
+    case IPFIX_FT_DESTINATIONIPV6ADDRESS:
+      dest->slot = SLOT(dstaddr);
+      dest->size = 16;
+      dest->kind = netflow_dest_addr;
+      dest->ipv6 = 1;
+      return 1;
+    case IPFIX_FT_BGPNEXTHOPIPV4ADDRESS:
+      dest->slot = SLOT(nexthop);
+      dest->size = 16;
+      dest->kind = netflow_dest_addr;
+      return 1;
+    case IPFIX_FT_BGPNEXTHOPIPV6ADDRESS:
+      dest->slot = SLOT(nexthop);
+      dest->size = 16;
+      dest->kind = netflow_dest_addr;
+      dest->ipv6 = 1;
+      return 1;
+    case IPFIX_FT_OCTETDELTACOUNT:
+      dest->slot = SLOT(dOctets);
+      dest->size = 8;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_PACKETDELTACOUNT:
+      dest->slot = SLOT(dPkts);
+      dest->size = 8;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_SOURCETRANSPORTPORT:
+    case IPFIX_FT_TCPSOURCEPORT:
+    case IPFIX_FT_UDPSOURCEPORT:
+      dest->slot = SLOT(srcport);
+      dest->size = 2;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_DESTINATIONTRANSPORTPORT:
+    case IPFIX_FT_TCPDESTINATIONPORT:
+    case IPFIX_FT_UDPDESTINATIONPORT:
+      dest->slot = SLOT(dstport);
+      dest->size = 2;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_PROTOCOLIDENTIFIER:
+      dest->slot = SLOT(prot);
+      dest->size = 1;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_INGRESSINTERFACE:
+      dest->slot = SLOT(input);
+      dest->size = 2;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_EGRESSINTERFACE:
+      dest->slot = SLOT(output);
+      dest->size = 2;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_BGPSOURCEASNUMBER:
+      dest->slot = SLOT(src_as);
+      dest->size = 4;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_BGPDESTINATIONASNUMBER:
+      dest->slot = SLOT(dst_as);
+      dest->size = 4;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_TCPCONTROLBITS:
+      dest->slot = SLOT(tcp_flags);
+      dest->size = 1;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_IPCLASSOFSERVICE:
+      dest->slot = SLOT(tos);
+      dest->size = 1;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_SOURCEIPV4PREFIXLENGTH:
+    case IPFIX_FT_SOURCEIPV6PREFIXLENGTH:
+      dest->slot = SLOT(src_mask);
+      dest->size = 1;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    case IPFIX_FT_DESTINATIONIPV4PREFIXLENGTH:
+    case IPFIX_FT_DESTINATIONIPV6PREFIXLENGTH:
+      dest->slot = SLOT(dst_mask);
+      dest->size = 1;
+      dest->kind = netflow_dest_uint;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @return The op converting a field of `width` bytes into `dest`, or -1 if the
+ *         field cannot be stored there.
+ */
+static int netflow_op_for(const netflow_field_dest_t *dest, uint16_t width) {
+  switch (dest->kind) {
+    case netflow_dest_seconds:
+      return width == 4 ? netflow_op_u32_to_seconds : width == 8 ? netflow_op_u64_to_seconds : -1;
+    case netflow_dest_ip_version:
+      return width == 1 ? netflow_op_ip_version : -1;
+    case netflow_dest_addr:
+      if (width == 16) {
+        return netflow_op_u128;
+      }
+      if (width == 4) {
+        return netflow_op_u32_to_u128;
+      }
+      break;
+    default:
+      if (width == dest->size) {
+        switch (width) {
+          case 1:
+            return netflow_op_u8;
+          case 2:
+            return netflow_op_u16;
+          case 4:
+            return netflow_op_u32;
+          case 8:
+            return netflow_op_u64;
+        }
+      }
+      if (width == 2 && dest->size == 4) {
+        return netflow_op_u16_to_u32;
+      }
+      if (width == 4 && dest->size == 2) {
+        return netflow_op_u32_to_u16;
+      }
+      if (width == 4 && dest->size == 8) {
+        return netflow_op_u32_to_u64;
+      }
+      break;
+  }
+  return width >= 1 && width <= 8 ? netflow_op_uint : -1;
+}
+
+/**
+ * @return FNV-1a of the field specifiers of a template record.
+ */
+static uint32_t netflow_layout_fingerprint(const uint8_t *spec, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ spec[i]) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @return The generated decoder for the layout of `tpl`, or NULL if it has none.
+ */
+static netflow_layout_fn netflow_layout_find(const netflow_template_t *tpl) {
+  uint16_t field_count = (uint16_t) (tpl->raw[2] << 8 | tpl->raw[3]);
+  const uint8_t *spec = tpl->raw + 4;
+  size_t spec_len = (size_t) tpl->raw_len - 4;
+  uint32_t fingerprint = netflow_layout_fingerprint(spec, spec_len);
+  for (size_t i = 0; i < sizeof(netflow_layouts) / sizeof(netflow_layouts[0]); i++) {
+    const netflow_layout_t *layout = &netflow_layouts[i];
+    if (layout->fingerprint == fingerprint && layout->field_count == field_count &&
+        (size_t) layout->field_count * 4 == spec_len && memcmp(layout->spec, spec, spec_len) == 0) {
+      return layout->decode;
+    }
+  }
+  return NULL;
+}
+
+netflow_template_t *netflow_template_compile(arena_struct_t *arena, uint16_t version, const uint8_t *record,
+                                             size_t len) {
+  if (len < 4 || len > UINT16_MAX) {
+    return NULL;
+  }
+  uint16_t field_count = (uint16_t) (record[2] << 8 | record[3]);
+
+  // Walk the field specifiers once to size the program.
+  size_t pos = 4;
+  uint16_t step_count = 0;
+  for (uint16_t i = 0; i < field_count; i++) {
+    if (pos + 4 > len) {
+      return NULL;
+    }
+    uint16_t type = (uint16_t) (record[pos] << 8 | record[pos + 1]);
+    int enterprise = version == 10 && (type & 0x8000);
+    netflow_field_dest_t dest;
+    if (!enterprise && netflow_field_dest(type, &dest)) {
+      step_count++;
+    }
+    pos += enterprise ? 8 : 4;
+  }
+  if (pos > len) {
+    return NULL;
+  }
+
+  size_t header_size = sizeof(netflow_template_t) + step_count * sizeof(netflow_decode_step_t);
+  // The raw record follows the program, 8-byte aligned like the arena hands out.
+  size_t raw_offset = (header_size + 7) & ~(size_t) 7;
+  netflow_template_t *tpl = arena_alloc(arena, raw_offset + pos);
+  if (tpl == NULL) {
+    return NULL;
+  }
+  memset(tpl, 0, header_size);
+  memcpy((uint8_t *) tpl + raw_offset, record, pos);
+  tpl->version = version;
+  tpl->template_id = (uint16_t) (record[0] << 8 | record[1]);
+  tpl->raw = (const uint8_t *) tpl + raw_offset;
+  tpl->raw_len = (uint16_t) pos;
+
+  size_t offset = 0;
+  int variable = 0;
+  pos = 4;
+  for (uint16_t i = 0; i < field_count; i++) {
+    uint16_t type = (uint16_t) (record[pos] << 8 | record[pos + 1]);
+    uint16_t width = (uint16_t) (record[pos + 2] << 8 | record[pos + 3]);
+    int enterprise = version == 10 && (type & 0x8000);
+    pos += enterprise ? 8 : 4;
+    if (width == 65535) {
+      // Variable length: the offsets of the fields after it differ per record.
+      variable = 1;
+      continue;
+    }
+    netflow_field_dest_t dest;
+    if (!enterprise && netflow_field_dest(type, &dest)) {
+      int op = netflow_op_for(&dest, width);
+      if (op >= 0 && offset + width <= UINT16_MAX) {
+        netflow_decode_step_t *step = &tpl->steps[tpl->step_count++];
+        step->offset = (uint16_t) offset;
+        step->slot = dest.slot;
+        step->op = (uint8_t) op;
+        step->width = (uint8_t) width;
+        step->size = dest.size;
+      }
+      if (dest.ip_version != 0) {
+        tpl->ip_version = dest.ip_version;
+      }
+      if (dest.ipv6) {
+        tpl->ipv6 = 1;
+      }
+    }
+    offset += width;
+  }
+  tpl->record_size = variable || offset > UINT16_MAX ? 0 : (uint16_t) offset;
+  if (tpl->record_size != 0) {
+    tpl->layout = netflow_layout_find(tpl);
+    if (tpl->layout != NULL) {
+      LOG_INFO("%s %d %s: template %u bound to a generated decoder\n", __FILE__, __LINE__, __func__, tpl->template_id);
+    }
+  }
+  return tpl;
+}
@@ -0,0 +1,234 @@
+//
+// Compiled v9 and IPFIX templates: a template is turned once, when it
+// arrives, into a short decode program that the data path runs per record.
+//
+
+#ifndef CNETFLOW_NETFLOW_TEMPLATE_H
+#define CNETFLOW_NETFLOW_TEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+#include "netflow.h"
+
+// How a step converts its field, named by source width and destination.
+typedef enum {
+  netflow_op_u8 = 0,
+  netflow_op_u16,
+  netflow_op_u32,
+  netflow_op_u64,
+  netflow_op_u16_to_u32,
+  netflow_op_u32_to_u16,
+  netflow_op_u32_to_u64,
+  // IPv4 address into a 128-bit address slot.
+  netflow_op_u32_to_u128,
+  netflow_op_u128,
+  // Exporter uptime or epoch milliseconds to seconds, rebased by the datagram's clock offset.
+  netflow_op_u32_to_seconds,
+  netflow_op_u64_to_seconds,
+  // ip_version, and whether the record is IPv6.
+  netflow_op_ip_version,
+  // Any other width up to 8 bytes, stored into `size` bytes.
+  netflow_op_uint,
+} netflow_op_t;
+
+typedef struct {
+  // Offset of the field in the record.
+  uint16_t offset;
+  // Offset of the destination in netflow_v9_record_insert_uint128_t.
+  uint16_t slot;
+  uint8_t op;
+  uint8_t width;
+  // Bytes of the destination.
+  uint8_t size;
+  uint8_t reserved;
+} netflow_decode_step_t;
+
+/**
+ * A decoder generated for one known template layout (see
+ * src/netflow_layouts.py.h). Same contract as netflow_template_decode().
+ */
+typedef int (*netflow_layout_fn)(const uint8_t *data, netflow_v9_record_insert_uint128_t *out, uint32_t diff);
+
+typedef struct {
+  // FNV-1a of `spec`.
+  uint32_t fingerprint;
+  uint16_t field_count;
+  uint16_t record_size;
+  // Field specifiers, as in the template record.
+  const uint8_t *spec;
+  netflow_layout_fn decode;
+} netflow_layout_t;
+
+typedef struct {
+  // 9 or 10.
+  uint16_t version;
+  uint16_t template_id;
+  // Bytes of one data record; 0 if the template has variable-length fields,
+  // whose records are not decoded.
+  uint16_t record_size;
+  uint16_t step_count;
+  // ip_version a record gets before its steps run, 0 if none.
+  uint8_t ip_version;
+  // Records carry IPv6 addresses.
+  uint8_t ipv6;
+  // The template record as received, in network order.
+  uint16_t raw_len;
+  const uint8_t *raw;
+  // Generated decoder of the template's layout, NULL to run `steps`.
+  netflow_layout_fn layout;
+  // Only the fields a flow row stores, in record order.
+  netflow_decode_step_t steps[];
+} netflow_template_t;
+
+/**
+ * Compiles a template record (template id, field count, field specifiers) as
+ * it appears in a v9 template flowset (`version` 9) or an IPFIX template set
+ * (`version` 10). Fields no flow row stores, IPFIX enterprise-specific fields
+ * and fields of a width no step decodes (over 8 bytes, or an address neither
+ * 4 nor 16 bytes wide) are left out of the program. Other integer fields
+ * wider than their destination keep only their low-order bytes.
+ * The program and a copy of the record are allocated together from `arena`.
+ * A template whose fields match a known layout is bound to its generated
+ * decoder instead.
+ *
+ * @return The compiled template, or NULL if the record is truncated or the
+ *         allocation fails.
+ */
+netflow_template_t *netflow_template_compile(arena_struct_t *arena, uint16_t version, const uint8_t *record,
+                                             size_t len);
+
+/**
+ * @return 1 if `tpl` was compiled from the `len` bytes of the template
+ *         record at `record`, as a periodic resend repeats them, 0 otherwise
+ *         or if `tpl` is NULL.
+ */
+static inline int netflow_template_same(const netflow_template_t *tpl, const uint8_t *record, size_t len) {
+  return tpl != NULL && tpl->raw_len == len && memcmp(tpl->raw, record, len) == 0;
+}
+
+static inline uint16_t netflow_load16(const uint8_t *src) {
+  uint16_t v;
+  memcpy(&v, src, sizeof(v));
+#if CNETFLOW_BIG_ENDIAN_ARCH
+  return v;
+#else
+  return __builtin_bswap16(v);
+#endif
+}
+
+static inline uint32_t netflow_load32(const uint8_t *src) {
+  uint32_t v;
+  memcpy(&v, src, sizeof(v));
+#if CNETFLOW_BIG_ENDIAN_ARCH
+  return v;
+#else
+  return __builtin_bswap32(v);
+#endif
+}
+
+static inline uint64_t netflow_load64(const uint8_t *src) {
+  uint64_t v;
+  memcpy(&v, src, sizeof(v));
+#if CNETFLOW_BIG_ENDIAN_ARCH
+  return v;
+#else
+  return __builtin_bswap64(v);
+#endif
+}
+
+#define NETFLOW_STORE(dst, type, value)                                                                                \
+  do {                                                                                                                 \
+    type netflow_store_tmp = (type) (value);                                                                           \
+    memcpy((dst), &netflow_store_tmp, sizeof(type));                                                                   \
+  } while (0)
+
+/**
+ * Decodes one record at `data` with `tpl`, filling `out`. `data` must hold
+ * tpl->record_size bytes. `diff` is added to timestamps converted to seconds.
+ *
+ * @return 1 if the record is IPv6, 0 otherwise.
+ */
+static inline int netflow_template_decode(const netflow_template_t *tpl, const uint8_t *data,
+                                          netflow_v9_record_insert_uint128_t *out, uint32_t diff) {
+  if (tpl->layout != NULL) {
+    return tpl->layout(data, out, diff);
+  }
+  int ipv6 = tpl->ipv6;
+  if (tpl->ip_version != 0) {
+    out->ip_version = tpl->ip_version;
+  }
+  const netflow_decode_step_t *step = tpl->steps;
+  const netflow_decode_step_t *end = step + tpl->step_count;
+  for (; step < end; step++) {
+    const uint8_t *src = data + step->offset;
+    uint8_t *dst = (uint8_t *) out + step->slot;
+    switch (step->op) {
+      case netflow_op_u8:
+        *dst = *src;
+        break;
+      case netflow_op_u16:
+        NETFLOW_STORE(dst, uint16_t, netflow_load16(src));
+        break;
+      case netflow_op_u32:
+        NETFLOW_STORE(dst, uint32_t, netflow_load32(src));
+        break;
+      case netflow_op_u64:
+        NETFLOW_STORE(dst, uint64_t, netflow_load64(src));
+        break;
+      case netflow_op_u16_to_u32:
+        NETFLOW_STORE(dst, uint32_t, netflow_load16(src));
+        break;
+      case netflow_op_u32_to_u16:
+        NETFLOW_STORE(dst, uint16_t, netflow_load32(src));
+        break;
+      case netflow_op_u32_to_u64:
+        NETFLOW_STORE(dst, uint64_t, netflow_load32(src));
+        break;
+      case netflow_op_u32_to_u128:
+        NETFLOW_STORE(dst, uint128_t, netflow_load32(src));
+        break;
+      case netflow_op_u128:
+        NETFLOW_STORE(dst, uint128_t, (uint128_t) netflow_load64(src) << 64 | netflow_load64(src + 8));
+        break;
+      case netflow_op_u32_to_seconds:
+        NETFLOW_STORE(dst, uint32_t, netflow_load32(src) / 1000 + diff);
+        break;
+      case netflow_op_u64_to_seconds:
+        NETFLOW_STORE(dst, uint32_t, netflow_load64(src) / 1000 + diff);
+        break;
+      case netflow_op_ip_version:
+        ipv6 = *src == 6;
+        *dst = ipv6 ? 6 : 4;
+        break;
+      case netflow_op_uint: {
+        uint64_t value = 0;
+        for (uint8_t b = 0; b < step->width; b++) {
+          value = value << 8 | src[b];
+        }
+        switch (step->size) {
+          case 1:
+            *dst = (uint8_t) value;
+            break;
+          case 2:
+            NETFLOW_STORE(dst, uint16_t, value);
+            break;
+          case 4:
+            NETFLOW_STORE(dst, uint32_t, value);
+            break;
+          case 8:
+            NETFLOW_STORE(dst, uint64_t, value);
+            break;
+          default:
+            NETFLOW_STORE(dst, uint128_t, value);
+            break;
+        }
+        break;
+      }
+    }
+  }
+  return ipv6;
+}
+
+#endif // CNETFLOW_NETFLOW_TEMPLATE_H
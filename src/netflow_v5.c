@@ -4,15 +4,207 @@
 #include "netflow_v5.h"
 #include <stdlib.h>
 #include <string.h>
+#if NETFLOW_V5_SIMD
+#include <immintrin.h>
+#endif
 
 #include "arena.h"
 #include "collector.h"
 #include "db.h"
+#include "exporter.h"
+#include "flow_batch.h"
 #include "log.h"
 #include "metrics.h"
 
 extern arena_struct_t *arena_collector;
 
+// Bytes of a v5 record on the wire.
+#define NETFLOW_V5_RECORD_SIZE 48
+// x / 1000 == (x * NETFLOW_V5_DIV1000) >> 38 for every 32-bit x.
+#define NETFLOW_V5_DIV1000 0x10624DD3u
+
+static decode_v5_fn decode_v5_impl = decode_v5_records_scalar;
+static const char *decode_v5_name = "scalar";
+
+/**
+ * Widens one host-order v5 record, First and Last already in epoch seconds,
+ * into a row. Every field of the row is written.
+ */
+static inline void decode_v5_store(const netflow_v5_record_t *in, netflow_v9_record_insert_uint128_t *out) {
+  out->srcaddr = in->srcaddr;
+  out->dstaddr = in->dstaddr;
+  out->nexthop = in->nexthop;
+  out->input = in->input;
+  out->output = in->output;
+  out->dPkts = in->dPkts;
+  out->dOctets = in->dOctets;
+  out->First = in->First;
+  out->Last = in->Last;
+  out->srcport = in->srcport;
+  out->dstport = in->dstport;
+  out->tcp_flags = in->tcp_flags;
+  out->prot = in->prot;
+  out->tos = in->tos;
+  out->src_as = in->src_as;
+  out->dst_as = in->dst_as;
+  out->src_mask = in->src_mask;
+  out->dst_mask = in->dst_mask;
+  out->ip_version = 4;
+  out->template_id = 0;
+  out->flow_version = 0;
+}
+
+void decode_v5_records_scalar(const uint8_t *data, uint16_t count, uint32_t diff,
+                              netflow_v9_record_insert_uint128_t *out) {
+  for (uint16_t i = 0; i < count; i++, data += NETFLOW_V5_RECORD_SIZE) {
+    netflow_v5_record_t record;
+    memcpy(&record, data, sizeof(record));
+    record.srcaddr = netflow_load32(data + 0);
+    record.dstaddr = netflow_load32(data + 4);
+    record.nexthop = netflow_load32(data + 8);
+    record.input = netflow_load16(data + 12);
+    record.output = netflow_load16(data + 14);
+    record.dPkts = netflow_load32(data + 16);
+    record.dOctets = netflow_load32(data + 20);
+    record.First = netflow_load32(data + 24) / 1000 + diff;
+    record.Last = netflow_load32(data + 28) / 1000 + diff;
+    record.srcport = netflow_load16(data + 32);
+    record.dstport = netflow_load16(data + 34);
+    record.src_as = netflow_load16(data + 40);
+    record.dst_as = netflow_load16(data + 42);
+    decode_v5_store(&record, &out[i]);
+  }
+}
+
+#if NETFLOW_V5_SIMD
+// Host order of the three 16-byte thirds of a record.
+#define NETFLOW_V5_SHUFFLE_0 _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 13, 12, 15, 14)
+#define NETFLOW_V5_SHUFFLE_1 _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+#define NETFLOW_V5_SHUFFLE_2 _mm_setr_epi8(1, 0, 3, 2, 4, 5, 6, 7, 9, 8, 11, 10, 12, 13, 15, 14)
+
+/**
+ * Replaces First and Last, the upper two lanes of a record's middle third
+ * (dPkts, dOctets, First, Last), with First / 1000 + diff and Last / 1000 + diff.
+ */
+__attribute__((target("ssse3"))) static inline __m128i decode_v5_times_ssse3(__m128i middle, __m128i magic,
+                                                                            __m128i diff) {
+  __m128i times = _mm_shuffle_epi32(middle, _MM_SHUFFLE(3, 3, 2, 2));
+  times = _mm_srli_epi64(_mm_mul_epu32(times, magic), 38);
+  times = _mm_add_epi32(times, diff);
+  times = _mm_shuffle_epi32(times, _MM_SHUFFLE(2, 0, 2, 0));
+  return _mm_unpacklo_epi64(middle, times);
+}
+
+// The row is written as seven 16-byte blocks, shuffled out of the record.
+_Static_assert(sizeof(netflow_v9_record_insert_uint128_t) == 112, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, input) == 48, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, dPkts) == 56, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, dOctets) == 64, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, First) == 72, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, srcport) == 80, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, tcp_flags) == 84, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, src_as) == 88, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, src_mask) == 96, "v5 row blocks");
+_Static_assert(offsetof(netflow_v9_record_insert_uint128_t, flow_version) == 100, "v5 row blocks");
+
+/**
+ * Writes the row of one host-order record, given as its three thirds with the
+ * timestamps already converted. Padding is zeroed.
+ */
+__attribute__((target("ssse3"))) static inline void decode_v5_row_ssse3(__m128i first, __m128i middle, __m128i last,
+                                                                       netflow_v9_record_insert_uint128_t *out) {
+  __m128i *row = (__m128i *) out;
+  _mm_store_si128(row + 0, _mm_shuffle_epi8(first, _mm_setr_epi8(0, 1, 2, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                   -1, -1, -1)));
+  _mm_store_si128(row + 1, _mm_shuffle_epi8(first, _mm_setr_epi8(4, 5, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                   -1, -1, -1)));
+  _mm_store_si128(row + 2, _mm_shuffle_epi8(first, _mm_setr_epi8(8, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                   -1, -1, -1)));
+  // input, output, dPkts
+  _mm_store_si128(row + 3, _mm_shuffle_epi8(_mm_alignr_epi8(middle, first, 12),
+                                            _mm_setr_epi8(0, 1, 2, 3, -1, -1, -1, -1, 4, 5, 6, 7, -1, -1, -1, -1)));
+  // dOctets, First, Last
+  _mm_store_si128(row + 4, _mm_shuffle_epi8(middle, _mm_setr_epi8(4, 5, 6, 7, -1, -1, -1, -1, 8, 9, 10, 11, 12, 13,
+                                                                    14, 15)));
+  // srcport, dstport, tcp_flags, prot, tos, src_as, dst_as
+  _mm_store_si128(row + 5, _mm_shuffle_epi8(last, _mm_setr_epi8(0, 1, 2, 3, 5, 6, 7, -1, 8, 9, -1, -1, 10, 11, -1,
+                                                                  -1)));
+  // src_mask, dst_mask, ip_version
+  _mm_store_si128(row + 6, _mm_or_si128(_mm_shuffle_epi8(last, _mm_setr_epi8(12, 13, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                               -1, -1, -1, -1, -1, -1)),
+                                        _mm_setr_epi8(0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)));
+}
+
+__attribute__((target("ssse3"))) void decode_v5_records_ssse3(const uint8_t *data, uint16_t count, uint32_t diff,
+                                                             netflow_v9_record_insert_uint128_t *out) {
+  const __m128i shuffle0 = NETFLOW_V5_SHUFFLE_0;
+  const __m128i shuffle1 = NETFLOW_V5_SHUFFLE_1;
+  const __m128i shuffle2 = NETFLOW_V5_SHUFFLE_2;
+  const __m128i magic = _mm_set1_epi32((int) NETFLOW_V5_DIV1000);
+  const __m128i diffv = _mm_set1_epi32((int) diff);
+  for (uint16_t i = 0; i < count; i++, data += NETFLOW_V5_RECORD_SIZE) {
+    __m128i first = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), shuffle0);
+    __m128i middle = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), shuffle1);
+    __m128i last = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), shuffle2);
+    decode_v5_row_ssse3(first, decode_v5_times_ssse3(middle, magic, diffv), last, &out[i]);
+  }
+}
+
+__attribute__((target("avx2"))) void decode_v5_records_avx2(const uint8_t *data, uint16_t count, uint32_t diff,
+                                                           netflow_v9_record_insert_uint128_t *out) {
+  // Two records are six thirds, loaded as three pairs: (0, 1), (2, 0), (1, 2).
+  const __m256i shuffle01 = _mm256_setr_m128i(NETFLOW_V5_SHUFFLE_0, NETFLOW_V5_SHUFFLE_1);
+  const __m256i shuffle20 = _mm256_setr_m128i(NETFLOW_V5_SHUFFLE_2, NETFLOW_V5_SHUFFLE_0);
+  const __m256i shuffle12 = _mm256_setr_m128i(NETFLOW_V5_SHUFFLE_1, NETFLOW_V5_SHUFFLE_2);
+  const __m256i magic = _mm256_set1_epi32((int) NETFLOW_V5_DIV1000);
+  const __m256i diffv = _mm256_set1_epi32((int) diff);
+  uint16_t i = 0;
+  for (; i + 2 <= count; i += 2, data += 2 * NETFLOW_V5_RECORD_SIZE) {
+    __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) data), shuffle01);
+    __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (data + 32)), shuffle20);
+    __m256i c = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (data + 64)), shuffle12);
+    // Both middle thirds, whose timestamps convert together.
+    __m256i middle = _mm256_permute2x128_si256(a, c, 0x21);
+    __m256i times = _mm256_shuffle_epi32(middle, _MM_SHUFFLE(3, 3, 2, 2));
+    times = _mm256_srli_epi64(_mm256_mul_epu32(times, magic), 38);
+    times = _mm256_add_epi32(times, diffv);
+    times = _mm256_shuffle_epi32(times, _MM_SHUFFLE(2, 0, 2, 0));
+    middle = _mm256_unpacklo_epi64(middle, times);
+    decode_v5_row_ssse3(_mm256_castsi256_si128(a), _mm256_castsi256_si128(middle), _mm256_castsi256_si128(b),
+                        &out[i]);
+    decode_v5_row_ssse3(_mm256_extracti128_si256(b, 1), _mm256_extracti128_si256(middle, 1),
+                        _mm256_extracti128_si256(c, 1), &out[i + 1]);
+  }
+  if (i < count) {
+    decode_v5_records_ssse3(data, (uint16_t) (count - i), diff, out + i);
+  }
+}
+#endif
+
+void init_v5(const char *decoder) {
+  decode_v5_impl = decode_v5_records_scalar;
+  decode_v5_name = "scalar";
+#if NETFLOW_V5_SIMD
+  __builtin_cpu_init();
+  int avx2 = decoder == NULL || strcmp(decoder, "avx2") == 0;
+  int ssse3 = avx2 || strcmp(decoder, "ssse3") == 0;
+  if (avx2 && __builtin_cpu_supports("avx2")) {
+    decode_v5_impl = decode_v5_records_avx2;
+    decode_v5_name = "avx2";
+  } else if (ssse3 && __builtin_cpu_supports("ssse3")) {
+    decode_v5_impl = decode_v5_records_ssse3;
+    decode_v5_name = "ssse3";
+  }
+#endif
+  if (decoder != NULL && strcmp(decoder, decode_v5_name) != 0) {
+    LOG_ERROR("v5 decoder %s is not available, using %s\n", decoder, decode_v5_name);
+  }
+  LOG_INFO("v5 decoder: %s\n", decode_v5_name);
+}
+
+void decode_v5_records(const uint8_t *data, uint16_t count, uint32_t diff, netflow_v9_record_insert_uint128_t *out) {
+  decode_v5_impl(data, count, diff, out);
+}
 
 /**
  * Parses and processes NetFlow v5 data from the provided arguments structure,
@@ -63,96 +255,58 @@ void *parse_v5(uv_work_t *req) {
   swap_endianness((void *) &(netflow_packet_ptr->header.sampling_interval),
                   sizeof(netflow_packet_ptr->header.sampling_interval));
 
+  // v5 has no source id; rows name the exporter by its address alone.
+  const uint32_t exporter_id = exporter_intern(args->exporter_addr, 0);
+  if (unlikely(exporter_id == 0)) {
+    metrics_inc_exporter_rejected();
+    goto unlock_mutex_parse_v5;
+  }
+
   uint32_t now = args->now;
   uint32_t diff = now - (uint32_t) (netflow_packet_ptr->header.SysUptime / 1000);
 
-  // memcpy(records, args->data + sizeof(netflow_v5_header_t), args->len - (sizeof(netflow_v5_header_t)));
-  // memcpy(&netflow_packet_ptr, args->data, args->len);
+  // Records stay in network order; the decoder swaps and widens them straight
+  // into staging rows, which then go into the batch column by column.
+  netflow_v9_record_insert_uint128_t records[30];
+  decode_v5_records((const uint8_t *) netflow_packet_ptr->records, netflow_packet_ptr->header.count, diff, records);
+
+  const uint32_t sampling_rate = args->sampling_rate ? args->sampling_rate : 1;
+  flow_batch_t *flows = flow_batch_thread();
+  if (unlikely(flow_batch_reserve(flows, netflow_packet_ptr->header.count) != 0)) {
+    goto unlock_mutex_parse_v5;
+  }
+
   for (int record_counter = 0; record_counter < netflow_packet_ptr->header.count; record_counter++) {
+    netflow_v9_record_insert_uint128_t *record = &records[record_counter];
 
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].srcaddr),
-                    sizeof((netflow_packet_ptr->records[record_counter].srcaddr)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].dstaddr),
-                    sizeof((netflow_packet_ptr->records[record_counter].dstaddr)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].nexthop),
-                    sizeof((netflow_packet_ptr->records[record_counter].nexthop)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].input),
-                    sizeof((netflow_packet_ptr->records[record_counter].input)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].output),
-                    sizeof((netflow_packet_ptr->records[record_counter].output)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].dPkts),
-                    sizeof((netflow_packet_ptr->records[record_counter].dPkts)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].dOctets),
-                    sizeof((netflow_packet_ptr->records[record_counter].dOctets)));
-
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].First),
-                    sizeof((netflow_packet_ptr->records[record_counter].First)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].Last),
-                    sizeof((netflow_packet_ptr->records[record_counter].Last)));
-    netflow_packet_ptr->records[record_counter].First = netflow_packet_ptr->records[record_counter].First / 1000 + diff;
-    netflow_packet_ptr->records[record_counter].Last = netflow_packet_ptr->records[record_counter].Last / 1000 + diff;
-
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].srcport),
-                    sizeof((netflow_packet_ptr->records[record_counter].srcport)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].dstport),
-                    sizeof((netflow_packet_ptr->records[record_counter].dstport)));
-    // pad1
-    // tcp_flags
-    // prot
-    // tos
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].src_as),
-                    sizeof((netflow_packet_ptr->records[record_counter].src_as)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].dst_as),
-                    sizeof((netflow_packet_ptr->records[record_counter].dst_as)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].src_mask),
-                    sizeof((netflow_packet_ptr->records[record_counter].src_mask)));
-    swap_endianness((void *) &(netflow_packet_ptr->records[record_counter].dst_mask),
-                    sizeof((netflow_packet_ptr->records[record_counter].dst_mask)));
-
-
-    // Note: We do NOT swap First/Last back to network order here.
-    // We also do not swap other fields in place here; copy_v5_to_flow handles that non-destructively.
-
-    swap_src_dst_v5_ipv4(&netflow_packet_ptr->records[record_counter]);
-
-    if (netflow_packet_ptr->records[record_counter].Last != 0 &&
-        netflow_packet_ptr->records[record_counter].First != 0) {
-      // swap_endianness(&netflow_packet_ptr->records[record_counter].Last,
-      //                 sizeof(netflow_packet_ptr->records[record_counter].Last));
-      // swap_endianness(&netflow_packet_ptr->records[record_counter].First,
-      //                 sizeof(netflow_packet_ptr->records[record_counter].First));
-      uint32_t duration =
-          netflow_packet_ptr->records[record_counter].Last - netflow_packet_ptr->records[record_counter].First;
-      netflow_packet_ptr->records[record_counter].Last = now;
-      netflow_packet_ptr->records[record_counter].First = now - duration;
-      // Do not swap back
+    if (record->Last != 0 && record->First != 0) {
+      uint32_t duration = record->Last - record->First;
+      record->Last = now;
+      record->First = now - duration;
     }
-    if (netflow_packet_ptr->records[record_counter].input != 0) {
-      metrics_track_interface(args->exporter, netflow_packet_ptr->records[record_counter].input);
+    if (record->input != 0) {
+      metrics_track_interface(args->exporter, record->input);
     }
-    if (netflow_packet_ptr->records[record_counter].output != 0) {
-      metrics_track_interface(args->exporter, netflow_packet_ptr->records[record_counter].output);
+    if (record->output != 0) {
+      metrics_track_interface(args->exporter, record->output);
     }
+    flow_batch_add(flows, record, exporter_id, sampling_rate);
 
 #ifdef CNETFLOW_DEBUG_BUILD
-    printf_v5(stdout, netflow_packet_ptr, record_counter);
+    printf_v9(stdout, flows, (uint32_t) record_counter, record_counter, args->frame_number, 0, 0);
 #endif
   }
-  // swap_endianness((void *) &args->exporter, sizeof(args->exporter));
-  // insert_v5(args->exporter, netflow_packet_ptr);
-
-  netflow_v9_uint128_flowset_t flows_to_insert = {0};
-  memset(&flows_to_insert, 0, sizeof(flows_to_insert));
-  copy_v5_to_flow(netflow_packet_ptr, &flows_to_insert);
-  uint32_t exporter_host = args->exporter;
-  swap_endianness((void *) &exporter_host, sizeof(exporter_host));
 
+  uint32_t rejected[netflow_reject_reasons] = {0};
+  netflow_prepare_batch(flows, 0, args->flags & 2 ? NULL : rejected);
+  metrics_inc_flows_rejected(rejected);
   if (args->flags & 2) {
-    for (size_t i = 0; i < netflow_packet_ptr->header.count; i++) {
-        printf_v9(stdout, &flows_to_insert, i, args->frame_number, 0, 0);
+    for (uint32_t row = 0; row < flows->count; row++) {
+        printf_v9(stdout, flows, row, row, args->frame_number, 0, 0);
     }
-  } else {
-    insert_flows(exporter_host, &flows_to_insert);
+  } else if (flows->count > 0) {
+    flows->received = args->now;
+    insert_flows(flows);
   }
 
 #ifdef ENABLE_METRICS
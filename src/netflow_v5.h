@@ -9,9 +9,42 @@
 #include <time.h>
 #include "collector.h"
 #include "netflow.h"
+#include "netflow_template.h"
+
+// The SSSE3 and AVX2 decoders, picked at run time by init_v5().
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !CNETFLOW_BIG_ENDIAN_ARCH
+#define NETFLOW_V5_SIMD 1
+#else
+#define NETFLOW_V5_SIMD 0
+#endif
+
+typedef void (*decode_v5_fn)(const uint8_t *data, uint16_t count, uint32_t diff,
+                             netflow_v9_record_insert_uint128_t *out);
 
 void *parse_v5(uv_work_t *);
 
+/**
+ * Picks the v5 decoder: `decoder` ("avx2", "ssse3" or "scalar") if the CPU
+ * supports it, the fastest one it supports if `decoder` is NULL, and the
+ * next best otherwise.
+ */
+void init_v5(const char *decoder);
+
+/**
+ * Decodes `count` v5 records at `data`, in network order, into `out`. First
+ * and Last become epoch seconds, uptime milliseconds / 1000 + `diff`. The
+ * records are not modified.
+ */
+void decode_v5_records(const uint8_t *data, uint16_t count, uint32_t diff, netflow_v9_record_insert_uint128_t *out);
+void decode_v5_records_scalar(const uint8_t *data, uint16_t count, uint32_t diff,
+                              netflow_v9_record_insert_uint128_t *out);
+#if NETFLOW_V5_SIMD
+void decode_v5_records_ssse3(const uint8_t *data, uint16_t count, uint32_t diff,
+                             netflow_v9_record_insert_uint128_t *out);
+void decode_v5_records_avx2(const uint8_t *data, uint16_t count, uint32_t diff,
+                            netflow_v9_record_insert_uint128_t *out);
+#endif
+
 void copy_v5_to_flow(const netflow_v5_flowset_t * restrict, netflow_v9_uint128_flowset_t * restrict);
 
 #endif // NETFLOW_V5_H
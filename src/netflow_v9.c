@@ -7,9 +7,13 @@
 #include <assert.h>
 #include <stdio.h>
 #include "db.h"
+#include "exporter.h"
+#include "flow_batch.h"
 #include "log.h"
 #include "metrics.h"
+#include "netflow_template.h"
 #include "netflow_v5.h"
+#include "shard.h"
 #include <arpa/inet.h>
 #ifdef USE_REDIS
 #include "redis_handler.h"
@@ -22,6 +26,12 @@ uv_mutex_t v9_parse_mutex;
 extern arena_struct_t *arena_collector;
 extern arena_struct_t *arena_hashmap_nf9;
 
+/**
+ * @return The length of a v9 template record: its id and field count,
+ *         then a type and a length per field.
+ */
+static size_t v9_template_len(const uint8_t *record) { return 4 + 4 * (size_t) (record[2] << 8 | record[3]); }
+
 void init_v9(arena_struct_t *arena, const size_t cap) {
   LOG_ERROR("%s %d %s: Initializing v9 (Hashmap)...\n", __FILE__, __LINE__, __func__);
   templates_nfv9_hashmap = hashmap_create(arena, cap);
@@ -36,18 +46,27 @@ void init_v9(arena_struct_t *arena, const size_t cap) {
       size_t val_len = 0;
       void *val = redis_get_template(keys[i], strlen(keys[i]), &val_len);
       if (val) {
-        void *arena_val = arena_alloc(arena, val_len);
+        netflow_template_t *arena_val = NULL;
+        if (val_len >= 4 && v9_template_len((const uint8_t *) val) == val_len) {
+          arena_val = netflow_template_compile(arena, 9, (const uint8_t *) val, val_len);
+        }
         if (arena_val) {
-          memcpy(arena_val, val, val_len);
-          char ip_str[32] = {0};
+          char ip_str[INET6_ADDRSTRLEN] = {0};
+          uint32_t source_id = 0;
           uint16_t tid = 0;
-          if (sscanf(keys[i], "%31[^-]-9-%hu", ip_str, &tid) == 2) {
-             struct in_addr in;
-             if (inet_pton(AF_INET, ip_str, &in) == 1) {
-                 uint64_t hkey = ((uint64_t)in.s_addr << 32) | tid;
-                 hashmap_set(templates_nfv9_hashmap, arena, &hkey, sizeof(uint64_t), arena_val);
-                 LOG_INFO("Loaded template %s from Redis\n", keys[i]);
-             }
+          // <exporter>-9-<source id>-<template id>; older keys carry no source id.
+          int fields = sscanf(keys[i], "%45[^-]-9-%u-%hu", ip_str, &source_id, &tid);
+          if (fields == 2) {
+            tid = (uint16_t) source_id;
+            source_id = 0;
+          }
+          uint8_t addr[16];
+          uint32_t id = 0;
+          if (fields >= 2 && exporter_addr_from_string(ip_str, addr) == 0 &&
+              (id = exporter_intern(addr, source_id)) != 0) {
+             uint64_t hkey = exporter_template_key(id, tid);
+             hashmap_set(templates_nfv9_hashmap, arena, &hkey, sizeof(uint64_t), arena_val);
+             LOG_INFO("Loaded template %s from Redis\n", keys[i]);
           }
         }
         free(val);
@@ -60,10 +79,59 @@ void init_v9(arena_struct_t *arena, const size_t cap) {
 
 
 
+typedef struct {
+  netflow_template_cb cb;
+  void *ctx;
+} v9_template_walk_t;
+
+static void v9_template_visit(const void *key, size_t key_len, void *value, void *ctx) {
+  v9_template_walk_t *walk = (v9_template_walk_t *) ctx;
+  uint64_t hkey;
+  if (key_len != sizeof(hkey)) {
+    return;
+  }
+  memcpy(&hkey, key, sizeof(hkey));
+  const netflow_template_t *tpl = (const netflow_template_t *) value;
+  walk->cb(9, hkey, tpl->raw, tpl->raw_len, walk->ctx);
+}
+
+size_t v9_templates_foreach(netflow_template_cb cb, void *ctx) {
+  v9_template_walk_t walk = {.cb = cb, .ctx = ctx};
+  size_t count = hashmap_foreach(templates_nfv9_hashmap, v9_template_visit, &walk);
+  // Templates learned by a shard thread only live in its own table.
+  for (unsigned int i = 0; i < SHARD_MAX; i++) {
+    shard_t *shard = shard_get(i);
+    if (shard != NULL) {
+      count += hashmap_foreach(shard->templates_v9, v9_template_visit, &walk);
+    }
+  }
+  return count;
+}
+
+int v9_template_restore(uint64_t key, const void *record, size_t len) {
+  if (len < 4 || v9_template_len((const uint8_t *) record) != len) {
+    return -1;
+  }
+  netflow_template_t *value = netflow_template_compile(arena_hashmap_nf9, 9, (const uint8_t *) record, len);
+  if (value == NULL) {
+    return -1;
+  }
+  uv_mutex_lock(&v9_parse_mutex);
+  int ret = hashmap_set(templates_nfv9_hashmap, arena_hashmap_nf9, &key, sizeof(key), value);
+  uv_mutex_unlock(&v9_parse_mutex);
+  return ret;
+}
+
 void *parse_v9(uv_work_t *req) {
-  uint16_t *template_hashmap = NULL;
+  netflow_template_t *template_hashmap = NULL;
   parse_args_t *args = (parse_args_t *) req->data;
   uint64_t total_flows_in_packet = 0;
+  // Every data flowset of the datagram adds its rows; the batch goes to the
+  // sink once the datagram is parsed.
+  flow_batch_t *flows = flow_batch_thread();
+  // A shard thread keeps its exporters' templates in its own table and arena.
+  shard_t *shard = shard_current();
+  arena_struct_t *template_arena = shard != NULL ? &shard->arena : arena_hashmap_nf9;
   if (unlikely(templates_nfv9_hashmap == NULL)) {
     goto cleanup_template_and_unlock;
   }
@@ -88,9 +156,16 @@ void *parse_v9(uv_work_t *req) {
   swap_endianness((void *) &(header->unix_secs), sizeof(header->unix_secs));
   swap_endianness((void *) &(header->package_sequence), sizeof(header->package_sequence));
   swap_endianness((void *) &(header->source_id), sizeof(header->source_id));
+  // Template ids are only unique per exporter address and source id.
+  uint32_t exporter_id = exporter_intern(args->exporter_addr, header->source_id);
+  if (unlikely(exporter_id == 0)) {
+    metrics_inc_exporter_rejected();
+    goto cleanup_template_and_unlock;
+  }
 
   uint32_t now = args->now;
   uint32_t diff = now - (uint32_t) (header->SysUptime / 1000);
+  const uint32_t sampling_rate = args->sampling_rate ? args->sampling_rate : 1;
 
   flowset_union_t *flowset;
 
@@ -100,7 +175,6 @@ void *parse_v9(uv_work_t *req) {
   uint16_t len = 0;
   size_t total_packet_length = args->len;
   LOG_ERROR("%s %d %s: args->len: %lu\n", __FILE__, __LINE__, __func__, total_packet_length);
-  int8_t has_padding = 0;
   flowset_base = sizeof(netflow_v9_header_t);
   while (flowset_base + 4 <= total_packet_length) {
       flowset = (flowset_union_t *) (args->data + flowset_base);
@@ -113,11 +187,6 @@ void *parse_v9(uv_work_t *req) {
       }
       
       flowset_end = flowset_base + len;
-      if (flowset_end % 32 != 0) {
-        has_padding = 1;
-      } else {
-        has_padding = 0;
-      }
 
     swap_endianness(&flowset->template.flowset_id, sizeof(flowset->template.flowset_id));
     swap_endianness(&flowset->template.length, sizeof(flowset->template.length));
@@ -164,34 +233,46 @@ void *parse_v9(uv_work_t *req) {
         }
         
         char redis_key[255];
-        snprintf(redis_key, 255, "%s-9-%u", ip_int_to_str(args->exporter), template_id);
-        uint64_t hkey = ((uint64_t)args->exporter << 32) | template_id;
+        char exporter_str[INET6_ADDRSTRLEN];
+        exporter_addr_to_string(args->exporter_addr, exporter_str, sizeof(exporter_str));
+        snprintf(redis_key, 255, "%s-9-%u-%u", exporter_str, header->source_id, template_id);
+        uint64_t hkey = exporter_template_key(exporter_id, template_id);
         LOG_ERROR("%s %d %s: key: %s\n", __FILE__, __LINE__, __func__, redis_key);
 
-        // Prepare template data (Network Byte Order for hashmap)
-        size_t alloc_size = sizeof(uint16_t) * (field_count + 1) * 2;
-
-        // We use arena_hashmap_nf9 as temporary storage for construction
-        uint16_t *temp = arena_alloc(arena_hashmap_nf9, alloc_size);
-        if (temp == NULL) {
-          LOG_ERROR("%s %d %s Failed to allocate %lu bytes for template\n", __FILE__, __LINE__, __func__, alloc_size);
-          goto cleanup_template_and_unlock;
+        size_t alloc_size = 4 + 4 * (size_t) field_count;
+        netflow_template_t *temp;
+        if (shard != NULL) {
+          temp = (netflow_template_t *) shard_template_get(shard, shard->templates_v9, templates_nfv9_hashmap,
+                                                           &v9_parse_mutex, hkey);
+        } else {
+          uv_mutex_lock(&v9_parse_mutex);
+          temp = (netflow_template_t *) hashmap_get(templates_nfv9_hashmap, &hkey, sizeof(uint64_t));
+          uv_mutex_unlock(&v9_parse_mutex);
         }
+        // Exporters resend unchanged templates every few seconds; those keep the compiled copy.
+        if (!netflow_template_same(temp, template_ptr, alloc_size)) {
+          temp = netflow_template_compile(template_arena, 9, template_ptr, alloc_size);
+          if (temp == NULL) {
+            LOG_ERROR("%s %d %s Failed to allocate %lu bytes for template\n", __FILE__, __LINE__, __func__, alloc_size);
+            goto cleanup_template_and_unlock;
+          }
 
-        // Copy template data to buffer: exactly template_id, field_count, and then fields
-        memcpy(temp, template_ptr, alloc_size);
-
-        // Store in Hashmap
-        uv_mutex_lock(&v9_parse_mutex);
-        hashmap_set(templates_nfv9_hashmap, arena_hashmap_nf9, &hkey, sizeof(uint64_t), temp);
-        uv_mutex_unlock(&v9_parse_mutex);
-        LOG_ERROR("%s %d %s Template saved in Hashmap [%s]...\n", __FILE__, __LINE__, __func__, redis_key);
+          // Store in Hashmap
+          if (shard != NULL) {
+            shard_template_set(shard, shard->templates_v9, hkey, temp);
+          } else {
+            uv_mutex_lock(&v9_parse_mutex);
+            hashmap_set(templates_nfv9_hashmap, arena_hashmap_nf9, &hkey, sizeof(uint64_t), temp);
+            uv_mutex_unlock(&v9_parse_mutex);
+          }
+          LOG_ERROR("%s %d %s Template saved in Hashmap [%s]...\n", __FILE__, __LINE__, __func__, redis_key);
+        }
 
 
 
 
 #ifdef USE_REDIS
-        if (redis_set_template(redis_key, strlen(redis_key), temp, alloc_size) != 0) {
+        if (redis_set_template(redis_key, strlen(redis_key), temp->raw, temp->raw_len) != 0) {
           LOG_ERROR("%s %d %s Error saving template in Redis [%s]...\n", __FILE__, __LINE__, __func__, redis_key);
         } else {
           LOG_ERROR("%s %d %s Template saved in Redis [%s]...\n", __FILE__, __LINE__, __func__, redis_key);
@@ -234,23 +315,29 @@ void *parse_v9(uv_work_t *req) {
       }
 
       uint16_t template_id = flowset_id;
-      uint64_t hkey = ((uint64_t)args->exporter << 32) | template_id;
-      uv_mutex_lock(&v9_parse_mutex);
-      template_hashmap = (uint16_t *) hashmap_get(templates_nfv9_hashmap, &hkey, sizeof(uint64_t));
-      uv_mutex_unlock(&v9_parse_mutex);
+      uint64_t hkey = exporter_template_key(exporter_id, template_id);
+      if (shard != NULL) {
+        template_hashmap = (netflow_template_t *) shard_template_get(shard, shard->templates_v9, templates_nfv9_hashmap,
+                                                                     &v9_parse_mutex, hkey);
+      } else {
+        uv_mutex_lock(&v9_parse_mutex);
+        template_hashmap = (netflow_template_t *) hashmap_get(templates_nfv9_hashmap, &hkey, sizeof(uint64_t));
+        uv_mutex_unlock(&v9_parse_mutex);
+      }
 
       if (template_hashmap == NULL) {
         LOG_ERROR("%s %d %s template %d not found for exporter %s — discarding flowset\n", __FILE__, __LINE__, __func__, template_id,
                   ip_int_to_str(args->exporter));
         goto skip_v9_record_pass;
       } else {
-        void *pointer = args->data + flowset_base + 4;
-        uint16_t field_count = template_hashmap[1];
-        swap_endianness(&field_count, sizeof(field_count));
+        const uint8_t *pointer = args->data + flowset_base + 4;
         // SKIP FLOWSET HEADER
         pos = 4;
-        netflow_v9_uint128_flowset_t flows_to_insert;
-        memset(&flows_to_insert, 0, sizeof(flows_to_insert));
+        // The template writes the same fields into every record, so the
+        // fields it lacks stay 0 from here for the whole flowset.
+        netflow_v9_record_insert_uint128_t record;
+        memset(&record, 0, sizeof(record));
+        const uint32_t start = flows->count;
         int is_ipv6 = 0;
         uint64_t local_v9_records = 0;
 
@@ -258,14 +345,7 @@ void *parse_v9(uv_work_t *req) {
         metrics_track_exporter(args->exporter);
         metrics_inc_flowsets(1);
 
-        // Compute total size of one record based on template fields
-        size_t total_record_size = 0;
-        for (size_t count = 2; count < field_count * 2 + 2; count += 2) {
-            uint16_t flen = template_hashmap[count + 1];
-            swap_endianness(&flen, sizeof(flen));
-            total_record_size += flen;
-        }
-
+        size_t total_record_size = template_hashmap->record_size;
         if (unlikely(total_record_size == 0)) {
             LOG_ERROR("%s %d %s: Template %d has 0 record size\n", __FILE__, __LINE__, __func__, template_id);
             goto cleanup_template_and_unlock;
@@ -280,317 +360,25 @@ void *parse_v9(uv_work_t *req) {
                       __FILE__, __LINE__, __func__, template_id, flowset_data_len, total_record_size);
             goto skip_v9_record_pass;
         }
+        if (unlikely(flow_batch_reserve(flows, (uint32_t) (flowset_data_len / total_record_size)) != 0)) {
+            goto skip_v9_record_pass;
+        }
 
+        // The flowset lies within the datagram, so every whole record in it does too.
         while (pos + total_record_size <= flowset_length) {
-          if (record_counter >= 60) {
-            LOG_ERROR("%s %d %s: Too many records in FlowSet (> 60), truncating\n", __FILE__, __LINE__, __func__);
-            break;
-          }
-#ifdef CNETFLOW_DEBUG_BUILD
-          fprintf(stdout, "exporter: %s template: %d record_no: %d field_count: %d",
-                  ip_int_to_str(args->exporter), template_id, record_counter + 1, field_count);
-#endif
-          for (size_t count = 2; count < field_count * 2 + 2; count = count + 2) {
-
-            // CRITICAL FIX: Validate pointer is within packet bounds before accessing
-            size_t pointer_offset = (size_t) pointer - (size_t) args->data;
-            if (unlikely(pointer_offset >= total_packet_length)) {
-              LOG_ERROR("%s %d %s: pointer offset %lu exceeds packet length %lu\n", __FILE__, __LINE__, __func__,
-                        pointer_offset, total_packet_length);
-              goto cleanup_template_and_unlock;
-            }
-
-            uint16_t field_type = template_hashmap[count];
-            swap_endianness(&field_type, sizeof(field_type));
-            if (unlikely(field_type >= (sizeof(ipfix_field_types) / sizeof(ipfix_field_type_t)))) {
-              goto cleanup_template_and_unlock;
-            }
-            uint16_t field_length = template_hashmap[count + 1];
-            swap_endianness(&field_length, sizeof(field_length));
-
-            // Validate we have enough space for this field
-            if (unlikely(pointer_offset + field_length > total_packet_length)) {
-              LOG_ERROR("%s %d %s: field at offset %lu length %u exceeds packet bounds\n", __FILE__, __LINE__, __func__,
-                        pointer_offset, field_length);
-              if (has_padding) {
-                pos = flowset_length; // Force outer while loop to terminate
-                break;
-              }
-              goto cleanup_template_and_unlock;
-            }
-
-            uint16_t record_length = field_length;
-            uint8_t *tmp8 = NULL;
-            uint8_t val_tmp8 = 0;
-            uint16_t *tmp16 = NULL;
-            uint16_t val_tmp16 = 0;
-            uint32_t *tmp32 = NULL;
-            uint32_t val_tmp32 = 0;
-            uint64_t *tmp64 = NULL;
-            uint64_t val_tmp64 = 0;
-            uint128_t *tmp128 = NULL;
-            uint128_t val_tmp128 = 0;
-
-            switch (record_length) {
-              case 1:
-                tmp8 = (uint8_t *) pointer;
-                val_tmp8 = *tmp8;
-                break;
-              case 2:
-                tmp16 = (uint16_t *) pointer;
-                val_tmp16 = *tmp16;
-                swap_endianness(&val_tmp16, sizeof(val_tmp16));
-                break;
-              case 4:
-                tmp32 = (uint32_t *) pointer;
-                val_tmp32 = *tmp32;
-                swap_endianness(&val_tmp32, sizeof(val_tmp32));
-                break;
-              case 6:
-                tmp64 = (uint64_t *) pointer;
-                val_tmp64 = *tmp64;
-                swap_endianness(&val_tmp64, sizeof(val_tmp64));
-                val_tmp64 &= 0x0000ffffffffffff;
-                break;
-              case 8:
-                tmp64 = (uint64_t *) pointer;
-                val_tmp64 = *tmp64;
-                swap_endianness(&val_tmp64, sizeof(val_tmp64));
-                break;
-              case 16:
-                tmp128 = (uint128_t *) pointer;
-                memcpy(&val_tmp128, pointer, sizeof(uint128_t));
-                swap_endianness(&val_tmp128, sizeof(val_tmp128));
-                break;
-            }
-
-            // Process field based on IPFIX field type (same as NetFlow v9)
-            switch (field_type) {
-              case IPFIX_FT_FLOWENDSYSUPTIME:
-                if (record_length == 4) {
-                  val_tmp32 = val_tmp32 / 1000 + diff;
-                  flows_to_insert.records[record_counter].Last = val_tmp32;
-                } else if (record_length == 8) {
-                  val_tmp64 = val_tmp64 / 1000 + diff;
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  flows_to_insert.records[record_counter].Last = val32;
-                } else {
-                  flows_to_insert.records[record_counter].Last = 0;
-                }
-                break;
-              case IPFIX_FT_FLOWSTARTSYSUPTIME:
-                if (record_length == 4) {
-                  val_tmp32 = val_tmp32 / 1000 + diff;
-                  flows_to_insert.records[record_counter].First = val_tmp32;
-                } else if (record_length == 8) {
-                  val_tmp64 = val_tmp64 / 1000 + diff;
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  flows_to_insert.records[record_counter].First = val32;
-                } else {
-                  flows_to_insert.records[record_counter].First = 0;
-                }
-                break;
-              case IPFIX_FT_FLOWSTARTMILLISECONDS:
-                val_tmp64 = val_tmp64 / 1000 + diff;
-                {
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  flows_to_insert.records[record_counter].First = val32;
-                }
-                break;
-              case IPFIX_FT_FLOWENDMILLISECONDS:
-                val_tmp64 = val_tmp64 / 1000 + diff;
-                {
-                  uint32_t val32 = (uint32_t) val_tmp64;
-                  flows_to_insert.records[record_counter].Last = val32;
-                }
-                break;
-              case IPFIX_FT_IPVERSION:
-                switch (val_tmp8) {
-                  case 4:
-                    is_ipv6 = 0;
-                    flows_to_insert.records[record_counter].ip_version = 4;
-                    break;
-                  case 6:
-                    is_ipv6 = 1;
-                    flows_to_insert.records[record_counter].ip_version = 6;
-                    break;
-                  default:
-                    is_ipv6 = 0;
-                    flows_to_insert.records[record_counter].ip_version = 4;
-                    break;
-                }
-                break;
-              case IPFIX_FT_SOURCEIPV4ADDRESS:
-                flows_to_insert.records[record_counter].srcaddr = val_tmp32;
-                flows_to_insert.records[record_counter].ip_version = 4;
-                break;
-              case IPFIX_FT_DESTINATIONIPV4ADDRESS:
-                flows_to_insert.records[record_counter].dstaddr = val_tmp32;
-                break;
-              case IPFIX_FT_SOURCEIPV6ADDRESS:
-                flows_to_insert.records[record_counter].srcaddr = val_tmp128;
-                flows_to_insert.records[record_counter].ip_version = 6;
-                is_ipv6 = 1;
-                break;
-              case IPFIX_FT_DESTINATIONIPV6ADDRESS:
-                flows_to_insert.records[record_counter].dstaddr = val_tmp128;
-                is_ipv6 = 1;
-                break;
-              case IPFIX_FT_OCTETDELTACOUNT:
-                switch (record_length) {
-                  case 4:
-                    flows_to_insert.records[record_counter].dOctets = ((uint64_t) val_tmp32);
-                    break;
-                  case 8:
-                    flows_to_insert.records[record_counter].dOctets = (uint64_t) val_tmp64;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dOctets = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_PACKETDELTACOUNT:
-                switch (record_length) {
-                  case 4:
-                    flows_to_insert.records[record_counter].dPkts = ((uint64_t) val_tmp32);
-                    break;
-                  case 8:
-                    flows_to_insert.records[record_counter].dPkts = (uint64_t) val_tmp64;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dPkts = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_DESTINATIONTRANSPORTPORT:
-              case IPFIX_FT_TCPDESTINATIONPORT:
-              case IPFIX_FT_UDPDESTINATIONPORT:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].dstport = (uint16_t) val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].dstport = (uint16_t) ((val_tmp32));
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dstport = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_SOURCETRANSPORTPORT:
-              case IPFIX_FT_TCPSOURCEPORT:
-              case IPFIX_FT_UDPSOURCEPORT:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].srcport = (uint16_t) val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].srcport = (uint16_t) ((val_tmp32));
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].srcport = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_PROTOCOLIDENTIFIER:
-                flows_to_insert.records[record_counter].prot = val_tmp8;
-                break;
-              case IPFIX_FT_INGRESSINTERFACE:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].input = val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].input = (uint16_t) ((val_tmp32));
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].input = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_EGRESSINTERFACE:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].output = val_tmp16;
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].output = (uint16_t) ((val_tmp32));
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].output = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_BGPSOURCEASNUMBER:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].src_as = ((uint32_t) val_tmp16);
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].src_as = val_tmp32;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].src_as = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_BGPDESTINATIONASNUMBER:
-                switch (record_length) {
-                  case 2:
-                    flows_to_insert.records[record_counter].dst_as = ((uint32_t) val_tmp16);
-                    break;
-                  case 4:
-                    flows_to_insert.records[record_counter].dst_as = val_tmp32;
-                    break;
-                  default:
-                    flows_to_insert.records[record_counter].dst_as = 0;
-                    break;
-                }
-                break;
-              case IPFIX_FT_BGPNEXTHOPIPV4ADDRESS:
-                flows_to_insert.records[record_counter].nexthop = val_tmp32;
-                break;
-              case IPFIX_FT_BGPNEXTHOPIPV6ADDRESS:
-                flows_to_insert.records[record_counter].nexthop = val_tmp128;
-                is_ipv6 = 1;
-                break;
-              case IPFIX_FT_TCPCONTROLBITS:
-                flows_to_insert.records[record_counter].tcp_flags = val_tmp8;
-                break;
-              case IPFIX_FT_IPCLASSOFSERVICE:
-                flows_to_insert.records[record_counter].tos = val_tmp8;
-                break;
-              case IPFIX_FT_SOURCEIPV4PREFIXLENGTH:
-                flows_to_insert.records[record_counter].src_mask = val_tmp8;
-                break;
-              case IPFIX_FT_DESTINATIONIPV4PREFIXLENGTH:
-                flows_to_insert.records[record_counter].dst_mask = val_tmp8;
-                break;
-              case IPFIX_FT_SOURCEIPV6PREFIXLENGTH:
-                flows_to_insert.records[record_counter].src_mask = val_tmp8;
-                break;
-              case IPFIX_FT_DESTINATIONIPV6PREFIXLENGTH:
-                flows_to_insert.records[record_counter].dst_mask = val_tmp8;
-                break;
-              default:
-                break;
-            }
-
-            pointer += record_length;
-            pos += record_length;
-          }
-
-          if (flows_to_insert.records[record_counter].Last != 0 &&
-              flows_to_insert.records[record_counter].First != 0) {
-            uint32_t duration =
-                flows_to_insert.records[record_counter].Last - flows_to_insert.records[record_counter].First;
-            flows_to_insert.records[record_counter].Last = now;
-            flows_to_insert.records[record_counter].First = now - duration;
+          is_ipv6 = netflow_template_decode(template_hashmap, pointer, &record, diff);
+          pointer += total_record_size;
+          pos += total_record_size;
+
+          if (record.Last != 0 && record.First != 0) {
+            uint32_t duration = record.Last - record.First;
+            record.Last = now;
+            record.First = now - duration;
           }
+          flow_batch_add(flows, &record, exporter_id, sampling_rate);
           if (!is_ipv6) {
-            swap_src_dst_v9_ipv4(&flows_to_insert.records[record_counter]);
 #ifdef CNETFLOW_DEBUG_BUILD
-            printf_v9(stderr, &flows_to_insert, record_counter, args->frame_number, template_id, flowset_id);
+            printf_v9(stderr, flows, flows->count - 1, record_counter, args->frame_number, template_id, flowset_id);
 #endif
           } else {
             LOG_ERROR("ipv6 not supported at the moment...\n");
@@ -598,11 +386,11 @@ void *parse_v9(uv_work_t *req) {
 
           local_v9_records++;
 
-          if (flows_to_insert.records[record_counter].input != 0) {
-            metrics_track_interface(args->exporter, flows_to_insert.records[record_counter].input);
+          if (record.input != 0) {
+            metrics_track_interface(args->exporter, record.input);
           }
-          if (flows_to_insert.records[record_counter].output != 0) {
-            metrics_track_interface(args->exporter, flows_to_insert.records[record_counter].output);
+          if (record.output != 0) {
+            metrics_track_interface(args->exporter, record.output);
           }
 
           record_counter++;
@@ -614,34 +402,25 @@ void *parse_v9(uv_work_t *req) {
         }
 #endif
 
-        flows_to_insert.header.count = record_counter;
-
-        flows_to_insert.header.SysUptime = header->SysUptime;
-        flows_to_insert.header.unix_secs = header->unix_secs;
-        flows_to_insert.header.unix_nsecs = 0;
-        flows_to_insert.header.flow_sequence = header->package_sequence;
-        flows_to_insert.header.sampling_interval = header->source_id;
-
-        uint32_t exporter_host = args->exporter;
-        swap_endianness((void *) &exporter_host, sizeof(exporter_host));
-
         LOG_INFO("%s %d %s Inserting %lu v9 flows\n", __FILE__, __LINE__, __func__, record_counter);
         total_flows_in_packet += record_counter;
         collector_inc_received_flows(record_counter);
+        uint32_t rejected[netflow_reject_reasons] = {0};
+        netflow_prepare_batch(flows, start, args->flags & 2 ? NULL : rejected);
+        metrics_inc_flows_rejected(rejected);
         if (args->flags & 2) {
-            for (size_t i = 0; i < record_counter; i++) {
-                uint32_t saddr = flows_to_insert.records[i].srcaddr;
-                uint32_t daddr = flows_to_insert.records[i].dstaddr;
+            for (uint32_t row = start; row < flows->count; row++) {
+                uint32_t saddr = flows->srcaddr[row];
+                uint32_t daddr = flows->dstaddr[row];
                 if (saddr == 0 || daddr == 0) {
                     continue;
                 }
                 if ((saddr >> 24) == 0 || (daddr >> 24) == 0) {
                     continue;
                 }
-                printf_v9(stdout, &flows_to_insert, i, args->frame_number, template_id, flowset_id);
+                printf_v9(stdout, flows, row, row - start, args->frame_number, template_id, flowset_id);
             }
-        } else {
-            insert_flows(exporter_host, &flows_to_insert);
+            flow_batch_truncate(flows, start);
         }
       }
       skip_v9_record_pass:;
@@ -657,6 +436,10 @@ void *parse_v9(uv_work_t *req) {
   }
 
 cleanup_template_and_unlock:
+  if (flows->count > 0) {
+    flows->received = args->now;
+    insert_flows(flows);
+  }
 
   args->processed_flows = total_flows_in_packet;
   args->status = collector_data_status_done;
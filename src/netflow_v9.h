@@ -135,6 +135,20 @@ typedef struct {
 
 void init_v9(arena_struct_t *arena, const size_t cap);
 void *parse_v9(uv_work_t *req);
+/**
+ * Calls `cb` with every v9 template the collector holds, in the shared table
+ * and in every shard's table.
+ *
+ * @return The number of templates visited.
+ */
+size_t v9_templates_foreach(netflow_template_cb cb, void *ctx);
+/**
+ * Stores a template record, as passed to a netflow_template_cb, under `key`
+ * in the shared table.
+ *
+ * @return 0 on success, -1 if `len` does not match the record or the table is full.
+ */
+int v9_template_restore(uint64_t key, const void *record, size_t len);
 void copy_v9_to_flow(const netflow_v9_flowset_t * restrict, netflow_v9_uint128_flowset_t * restrict, int, uint8_t*);
 
 #endif // NETFLOW_V9_H
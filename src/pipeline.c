@@ -0,0 +1,722 @@
+//
+// Parser threads fed by single-producer/single-consumer rings.
+//
+// Every producer (a receive loop) owns one lane per parser thread: an `in`
+// ring the producer pushes contexts into and an `out` ring the parser hands
+// parsed contexts back through. A lane never holds more than `ring_size`
+// contexts in total, so neither ring can overflow and the parser never waits
+// on its producer.
+//
+// Wakeups are only paid on idle edges: a parser that finds every ring empty
+// spins for a while and then sleeps on its condition variable with
+// `sleeping` set, and producers only signal it when they see that flag. The
+// return path goes through one uv_async_t per producer, which coalesces
+// sends while the loop has not run its callback yet.
+//
+// With work stealing, a parser claims its `in` ring in small batches with a
+// compare-and-swap on `head`, and an idle parser may claim the head of
+// another parser's ring the same way, one datagram at a time. Only datagrams
+// without templates are taken, and only once every template datagram the
+// same exporter sent before them has been applied: each lane keeps, per
+// exporter hash, the number of template datagrams submitted (producer side)
+// and applied (owner side), and a data datagram records the former as its
+// sequencing token. The owner also waits for datagrams stolen under a token
+// to be parsed before it applies a template datagram with that token, so a
+// redefinition queued behind a stolen datagram cannot change or free the
+// template it is decoded with. Stealing is off with sharding, where a datagram may only
+// be parsed by the thread running its shard, so a stolen datagram is always
+// parsed against the shared template tables. Parsed contexts always go back
+// through their own lane, whose `out` ring therefore takes several writers:
+// each reserves a slot by bumping `tail` and fills it, and the producer
+// drains filled slots in order.
+//
+// With an adaptive parser count, producers still spread exporters over one
+// lane per parser thread, but lane i is served by parser i modulo the active
+// count, and the parsers beyond it sleep. A parser hands a lane over only
+// between two batches, by clearing its owner, and the next one claims it with
+// a compare-and-swap, so a lane is never served by two parsers at once and
+// its exporters stay in order. The lane keeps its shard, which the parser
+// serving it switches to while parsing the lane's datagrams.
+//
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "affinity.h"
+#include "ingest_queue.h"
+#include "log.h"
+#include "metrics.h"
+#include "shard.h"
+
+// Empty rounds a parser spins through before going to sleep.
+#define PIPELINE_SPIN_ROUNDS 2048
+// Datagrams a shard parses between two pushes of its counters.
+#define PIPELINE_SHARD_FLUSH 256
+// With work stealing: datagrams a parser claims from its own ring at once,
+// and how far behind a parser must be before others take its datagrams.
+#define PIPELINE_CLAIM_BATCH 16
+#define PIPELINE_STEAL_MIN 4
+// Sequencing tokens per lane; exporters sharing one only wait on each other's templates.
+#define PIPELINE_TOKENS 64
+
+typedef struct {
+  // Written by the consumer only.
+  volatile uint32_t head;
+  char pad_head[60];
+  // Written by the producer only.
+  volatile uint32_t tail;
+  char pad_tail[60];
+  pkt_ctx_t **slots;
+} pipeline_ring_t;
+
+typedef struct {
+  pipeline_ring_t in;
+  pipeline_ring_t out;
+  // Contexts submitted and not drained yet; producer thread only.
+  uint32_t outstanding;
+  // Template datagrams per exporter token: submitted (producer thread only)
+  // and applied (owning parser only).
+  uint32_t templates_submitted[PIPELINE_TOKENS];
+  char pad_tokens[64];
+  uint32_t templates_applied[PIPELINE_TOKENS];
+  // Stolen datagrams per exporter token still being parsed; any parser.
+  uint32_t steals_running[PIPELINE_TOKENS];
+} pipeline_lane_t;
+
+struct pipeline_producer_s {
+  uv_loop_t *loop;
+  uv_async_t returned;
+  pipeline_lane_t *lanes;
+  // Producer thread only.
+  uint32_t outstanding;
+  int closing;
+  // Set once the return handle is being closed; parsers stop sending to it.
+  volatile int closed;
+  // Parsers inside uv_async_send(&returned).
+  volatile int notifying;
+  // Set by the close callback, after which the producer can be freed.
+  volatile int released;
+};
+
+typedef struct {
+  uv_thread_t thread;
+  unsigned int index;
+  volatile int sleeping;
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  // Bit i set while this parser serves lane i.
+  volatile uint64_t lanes;
+  // Datagrams parsed and the time spent on them, for the adaptive parser count.
+  volatile uint64_t parsed;
+  volatile uint64_t busy_ns;
+  char pad[64];
+} pipeline_parser_t;
+
+static pipeline_parser_t parsers[PIPELINE_MAX_THREADS];
+static unsigned int parser_count = 0;
+static pipeline_producer_t *producers[PIPELINE_MAX_PRODUCERS];
+static unsigned int producer_count = 0;
+static uv_mutex_t producers_mutex;
+static uint32_t ring_mask = 0;
+static volatile int stopping = 0;
+static int stealing = 0;
+// Parsers that attached their shard. pipeline_start() waits for all of them,
+// as another parser may serve a parser's lane, and shard, from the start.
+static volatile unsigned int parsers_ready = 0;
+// Adaptive parser count: lane i is served by parser i % active, through lane_owner.
+static unsigned int min_threads = 0;
+static int adaptive = 0;
+static volatile unsigned int active = 0;
+static volatile int lane_owner[PIPELINE_MAX_THREADS];
+static pipeline_scale_t scale;
+static uv_mutex_t scale_mutex;
+static uint64_t scale_parsed = 0;
+static uint64_t scale_busy_ns = 0;
+
+static inline void pipeline_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static int pipeline_ring_init(pipeline_ring_t *ring) {
+  memset(ring, 0, sizeof(*ring));
+  ring->slots = calloc((size_t) ring_mask + 1, sizeof(pkt_ctx_t *));
+  return ring->slots == NULL ? UV_ENOMEM : 0;
+}
+
+static inline unsigned int pipeline_lane_target(unsigned int lane) {
+  return lane % __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @return Non-zero if `p` should release one of its lanes or can claim one.
+ */
+static int pipeline_parser_unbalanced(const pipeline_parser_t *p) {
+  for (unsigned int i = 0; i < parser_count; i++) {
+    int target = pipeline_lane_target(i) == p->index;
+    if ((p->lanes >> i) & 1) {
+      if (!target) {
+        return 1;
+      }
+    } else if (target && __atomic_load_n(&lane_owner[i], __ATOMIC_ACQUIRE) < 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int pipeline_parser_pending(const pipeline_parser_t *p) {
+  if (adaptive && pipeline_parser_unbalanced(p)) {
+    return 1;
+  }
+  unsigned int count = __atomic_load_n(&producer_count, __ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < count; i++) {
+    for (uint64_t lanes = p->lanes; lanes != 0; lanes &= lanes - 1) {
+      const pipeline_ring_t *in = &producers[i]->lanes[__builtin_ctzll(lanes)].in;
+      if (in->head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void pipeline_notify(pipeline_producer_t *producer) {
+  // Paired with the closed/notifying check in pipeline_producer_finish().
+  __atomic_add_fetch(&producer->notifying, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&producer->closed, __ATOMIC_SEQ_CST)) {
+    uv_async_send(&producer->returned);
+  }
+  __atomic_sub_fetch(&producer->notifying, 1, __ATOMIC_SEQ_CST);
+}
+
+static void pipeline_wake(pipeline_parser_t *p) {
+  uv_mutex_lock(&p->mutex);
+  uv_cond_signal(&p->cond);
+  uv_mutex_unlock(&p->mutex);
+}
+
+static void pipeline_parser_sleep(pipeline_parser_t *p) {
+  uv_mutex_lock(&p->mutex);
+  __atomic_store_n(&p->sleeping, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!pipeline_parser_pending(p) && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    uv_cond_wait(&p->cond, &p->mutex);
+  }
+  __atomic_store_n(&p->sleeping, 0, __ATOMIC_RELAXED);
+  uv_mutex_unlock(&p->mutex);
+}
+
+/**
+ * Releases the lanes `p` should no longer serve, waking the parser that takes
+ * each over, and claims the free lanes it should serve. Only called between
+ * batches, so a released lane has nothing of its exporters in flight.
+ */
+static void pipeline_parser_rebalance(pipeline_parser_t *p) {
+  uint64_t lanes = p->lanes;
+  for (unsigned int i = 0; i < parser_count; i++) {
+    unsigned int target = pipeline_lane_target(i);
+    if ((lanes >> i) & 1) {
+      if (target != p->index) {
+        lanes &= ~(1ULL << i);
+        __atomic_store_n(&lane_owner[i], -1, __ATOMIC_RELEASE);
+        pipeline_wake(&parsers[target]);
+      }
+    } else if (target == p->index) {
+      int free_lane = -1;
+      if (__atomic_compare_exchange_n(&lane_owner[i], &free_lane, (int) p->index, 0, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_RELAXED)) {
+        lanes |= 1ULL << i;
+      }
+    }
+  }
+  __atomic_store_n(&p->lanes, lanes, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int pipeline_token(uint32_t key) {
+  uint32_t h = (key ^ (key >> 16)) * 0x45d9f3bu;
+  return (h ^ (h >> 16)) & (PIPELINE_TOKENS - 1);
+}
+
+/**
+ * Parses `ctx`, taken from `lane`, and hands it back through the lane.
+ */
+static void pipeline_run(pipeline_parser_t *p, pipeline_lane_t *lane, pkt_ctx_t *ctx) {
+  unsigned int token = pipeline_token(ctx->args.exporter);
+  int is_template = stealing && !ctx->stealable;
+  if (is_template) {
+    // A datagram stolen from before this one may still be decoding with the
+    // template this one redefines.
+    while (__atomic_load_n(&lane->steals_running[token], __ATOMIC_ACQUIRE) != 0) {
+      pipeline_relax();
+    }
+  }
+  if (adaptive) {
+    uint64_t start = uv_hrtime();
+    ctx->work.work_cb(&ctx->work);
+    // Single writer; the controller only reads.
+    __atomic_store_n(&p->busy_ns, p->busy_ns + (uv_hrtime() - start), __ATOMIC_RELAXED);
+    __atomic_store_n(&p->parsed, p->parsed + 1, __ATOMIC_RELAXED);
+  } else {
+    ctx->work.work_cb(&ctx->work);
+  }
+  if (is_template) {
+    // Data sent after this template may now be parsed by any parser.
+    __atomic_store_n(&lane->templates_applied[token], lane->templates_applied[token] + 1, __ATOMIC_RELEASE);
+  }
+  uint32_t slot = __atomic_fetch_add(&lane->out.tail, 1, __ATOMIC_RELAXED);
+  // Publish each one, so the producer can recycle while we keep parsing.
+  __atomic_store_n(&lane->out.slots[slot & ring_mask], ctx, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes one datagram from the head of another parser's ring, if one is far
+ * enough behind and the datagram may be parsed out of its owner's order.
+ *
+ * @return 1 if a datagram was parsed, 0 otherwise.
+ */
+static int pipeline_steal(pipeline_parser_t *p) {
+  unsigned int count = __atomic_load_n(&producer_count, __ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < count; i++) {
+    pipeline_producer_t *producer = producers[i];
+    for (unsigned int k = 0; k < parser_count; k++) {
+      unsigned int victim = (p->index + k) % parser_count;
+      if ((p->lanes >> victim) & 1) {
+        continue;
+      }
+      pipeline_lane_t *lane = &producer->lanes[victim];
+      uint32_t head = __atomic_load_n(&lane->in.head, __ATOMIC_ACQUIRE);
+      uint32_t tail = __atomic_load_n(&lane->in.tail, __ATOMIC_ACQUIRE);
+      if ((uint32_t) (tail - head) < PIPELINE_STEAL_MIN) {
+        continue;
+      }
+      // The slot may be recycled under us; the exchange below fails if it was.
+      pkt_ctx_t *ctx = lane->in.slots[head & ring_mask];
+      if (!ctx->stealable) {
+        continue;
+      }
+      uint32_t applied =
+          __atomic_load_n(&lane->templates_applied[pipeline_token(ctx->args.exporter)], __ATOMIC_ACQUIRE);
+      if ((int32_t) (applied - ctx->seq) < 0) {
+        continue;
+      }
+      // Announced before the claim: the owner claims what follows only after
+      // it, so it sees the count before it reaches a later template.
+      unsigned int token = pipeline_token(ctx->args.exporter);
+      __atomic_add_fetch(&lane->steals_running[token], 1, __ATOMIC_SEQ_CST);
+      if (!__atomic_compare_exchange_n(&lane->in.head, &head, head + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        __atomic_sub_fetch(&lane->steals_running[token], 1, __ATOMIC_RELEASE);
+        continue;
+      }
+      pipeline_run(p, lane, ctx);
+      __atomic_sub_fetch(&lane->steals_running[token], 1, __ATOMIC_RELEASE);
+      pipeline_notify(producer);
+      metrics_inc_pipeline_steal();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void pipeline_parser_run(void *arg) {
+  pipeline_parser_t *p = (pipeline_parser_t *) arg;
+  char name[24];
+  snprintf(name, sizeof(name), "parser-%u", p->index);
+  affinity_apply(affinity_role_parse, name);
+  // With sharding, this thread owns the shard of the exporters steered to it.
+  shard_t *shard = shard_attach(p->index);
+  if (shard != NULL) {
+    metrics_local_begin();
+  }
+  __atomic_add_fetch(&parsers_ready, 1, __ATOMIC_RELEASE);
+  unsigned int unflushed = 0;
+  unsigned int idle = 0;
+  for (;;) {
+    if (adaptive) {
+      pipeline_parser_rebalance(p);
+    }
+    unsigned int done = 0;
+    unsigned int count = __atomic_load_n(&producer_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < count; i++) {
+      pipeline_producer_t *producer = producers[i];
+      int parsed = 0;
+      for (uint64_t lanes = p->lanes; lanes != 0; lanes &= lanes - 1) {
+        unsigned int index = (unsigned int) __builtin_ctzll(lanes);
+        pipeline_lane_t *lane = &producer->lanes[index];
+        uint32_t head = __atomic_load_n(&lane->in.head, __ATOMIC_ACQUIRE);
+        uint32_t tail = __atomic_load_n(&lane->in.tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+          continue;
+        }
+        uint32_t first = head;
+        if (stealing) {
+          // Claim a bounded batch so idle parsers can take what follows.
+          if (tail - head > PIPELINE_CLAIM_BATCH) {
+            tail = head + PIPELINE_CLAIM_BATCH;
+          }
+          if (!__atomic_compare_exchange_n(&lane->in.head, &first, tail, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            // Another parser took the head; try again next round.
+            continue;
+          }
+        }
+        // A lane taken over from a parked parser keeps that parser's shard.
+        shard_t *lane_shard = index == p->index ? shard : shard_get(index);
+        shard_t *own = lane_shard != shard ? shard_switch(lane_shard) : shard;
+        for (; head != tail; head++) {
+          pipeline_run(p, lane, lane->in.slots[head & ring_mask]);
+          if (lane_shard != NULL) {
+            shard_count_datagram(lane_shard);
+          }
+          done++;
+        }
+        if (lane_shard != shard) {
+          shard_switch(own);
+        }
+        if (!stealing) {
+          __atomic_store_n(&lane->in.head, head, __ATOMIC_RELEASE);
+        }
+        parsed = 1;
+      }
+      if (parsed) {
+        pipeline_notify(producer);
+      }
+    }
+    unflushed += done;
+    if (unflushed >= PIPELINE_SHARD_FLUSH || (done == 0 && unflushed > 0)) {
+      metrics_local_flush();
+      unflushed = 0;
+    }
+    // A parked parser serves no lane and takes no work from others either.
+    if (done == 0 && stealing && p->lanes != 0 && pipeline_steal(p)) {
+      unflushed++;
+      done = 1;
+    }
+    if (done > 0) {
+      idle = 0;
+      continue;
+    }
+    // Producers are closed before stopping is set, so empty rings stay empty.
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    if (++idle < PIPELINE_SPIN_ROUNDS && p->lanes != 0) {
+      pipeline_relax();
+      continue;
+    }
+    pipeline_parser_sleep(p);
+    idle = 0;
+  }
+}
+
+static void pipeline_drain(pipeline_producer_t *producer, pipeline_lane_t *lane) {
+  // after_work_cb may submit again and drain this lane from inside the loop,
+  // so the head is re-read and published before every callback. A slot
+  // reserved by a parser that has not filled it yet ends the drain; its
+  // parser notifies again once it has.
+  for (;;) {
+    uint32_t head = lane->out.head;
+    pkt_ctx_t *ctx = __atomic_load_n(&lane->out.slots[head & ring_mask], __ATOMIC_ACQUIRE);
+    if (ctx == NULL) {
+      break;
+    }
+    lane->out.slots[head & ring_mask] = NULL;
+    __atomic_store_n(&lane->out.head, head + 1, __ATOMIC_RELEASE);
+    lane->outstanding--;
+    producer->outstanding--;
+    ctx->work.after_work_cb(&ctx->work, 0);
+  }
+}
+
+static void pipeline_on_close(uv_handle_t *handle) {
+  pipeline_producer_t *producer = (pipeline_producer_t *) handle->data;
+  __atomic_store_n(&producer->released, 1, __ATOMIC_RELEASE);
+}
+
+static void pipeline_producer_finish(pipeline_producer_t *producer) {
+  if (producer->closed || producer->outstanding > 0) {
+    return;
+  }
+  __atomic_store_n(&producer->closed, 1, __ATOMIC_SEQ_CST);
+  // A parser that saw closed == 0 may still be inside uv_async_send().
+  while (__atomic_load_n(&producer->notifying, __ATOMIC_SEQ_CST) > 0) {
+    pipeline_relax();
+  }
+  uv_close((uv_handle_t *) &producer->returned, pipeline_on_close);
+}
+
+static void pipeline_on_returned(uv_async_t *handle) {
+  pipeline_producer_t *producer = (pipeline_producer_t *) handle->data;
+  for (unsigned int i = 0; i < parser_count; i++) {
+    pipeline_drain(producer, &producer->lanes[i]);
+  }
+  if (producer->closing) {
+    pipeline_producer_finish(producer);
+  }
+}
+
+int pipeline_enabled(void) { return parser_count > 0; }
+
+void pipeline_set_stealing(int enabled) { stealing = enabled != 0; }
+
+void pipeline_set_min_threads(unsigned int threads) { min_threads = threads; }
+
+void pipeline_adapt(uint64_t now_ms, uint64_t backlog) {
+  if (!adaptive) {
+    return;
+  }
+  uint64_t parsed = 0;
+  uint64_t busy_ns = 0;
+  for (unsigned int i = 0; i < parser_count; i++) {
+    parsed += __atomic_load_n(&parsers[i].parsed, __ATOMIC_RELAXED);
+    busy_ns += __atomic_load_n(&parsers[i].busy_ns, __ATOMIC_RELAXED);
+  }
+  uv_mutex_lock(&scale_mutex);
+  unsigned int from = scale.active;
+  unsigned int to = pipeline_scale_update(&scale, now_ms, backlog, parsed - scale_parsed, busy_ns - scale_busy_ns);
+  scale_parsed = parsed;
+  scale_busy_ns = busy_ns;
+  uv_mutex_unlock(&scale_mutex);
+  if (to == from) {
+    return;
+  }
+  LOG_INFO("%s %d %s %u -> %u active parsers, backlog %lu\n", __FILE__, __LINE__, __func__, from, to,
+           (unsigned long) backlog);
+  __atomic_store_n(&active, to, __ATOMIC_RELEASE);
+  // Current owners release their lanes between batches, new ones claim them.
+  for (unsigned int i = 0; i < parser_count; i++) {
+    pipeline_wake(&parsers[i]);
+  }
+}
+
+size_t pipeline_append_json(char *buf, size_t size, size_t len) {
+  if (!adaptive) {
+    return len;
+  }
+  uv_mutex_lock(&scale_mutex);
+  len = pipeline_scale_append_json(&scale, buf, size, len);
+  uv_mutex_unlock(&scale_mutex);
+  return len;
+}
+
+int pipeline_start(unsigned int threads, unsigned int ring_size) {
+  if (threads == 0 || threads > PIPELINE_MAX_THREADS || ring_size < 2 || ring_size > PIPELINE_MAX_RING ||
+      (ring_size & (ring_size - 1)) != 0) {
+    return UV_EINVAL;
+  }
+  if (parser_count > 0) {
+    return UV_EALREADY;
+  }
+  int err = uv_mutex_init(&producers_mutex);
+  if (err != 0) {
+    return err;
+  }
+  if (stealing && shard_count() > 0) {
+    // A shard's arena and template tables are written by its own thread only.
+    LOG_ERROR("%s %d %s work stealing is not available with sharding, disabling it\n", __FILE__, __LINE__, __func__);
+    stealing = 0;
+  }
+  ring_mask = ring_size - 1;
+  stopping = 0;
+  producer_count = 0;
+  parsers_ready = 0;
+  adaptive = min_threads > 0 && min_threads < threads;
+  active = adaptive ? min_threads : threads;
+  if (adaptive) {
+    pipeline_scale_init(&scale, min_threads, threads, uv_hrtime() / 1000000);
+    scale_parsed = 0;
+    scale_busy_ns = 0;
+    if ((err = uv_mutex_init(&scale_mutex)) != 0) {
+      uv_mutex_destroy(&producers_mutex);
+      return err;
+    }
+  }
+  for (unsigned int i = 0; i < threads; i++) {
+    memset(&parsers[i], 0, sizeof(parsers[i]));
+  }
+  for (unsigned int i = 0; i < threads; i++) {
+    lane_owner[i] = (int) (i % active);
+    parsers[i % active].lanes |= 1ULL << i;
+  }
+  for (unsigned int i = 0; i < threads; i++) {
+    pipeline_parser_t *p = &parsers[i];
+    p->index = i;
+    if ((err = uv_mutex_init(&p->mutex)) != 0) {
+      break;
+    }
+    if ((err = uv_cond_init(&p->cond)) != 0) {
+      uv_mutex_destroy(&p->mutex);
+      break;
+    }
+    if ((err = uv_thread_create(&p->thread, pipeline_parser_run, p)) != 0) {
+      uv_cond_destroy(&p->cond);
+      uv_mutex_destroy(&p->mutex);
+      break;
+    }
+    parser_count = i + 1;
+  }
+  if (err != 0) {
+    LOG_ERROR("%s %d %s failed to start parser thread %u: %s\n", __FILE__, __LINE__, __func__, parser_count,
+              uv_strerror(err));
+    pipeline_stop();
+    return err;
+  }
+  while (__atomic_load_n(&parsers_ready, __ATOMIC_ACQUIRE) < threads) {
+    uv_sleep(1);
+  }
+  if (adaptive) {
+    LOG_INFO("%s %d %s started %u parser threads, %u to %u active, %u slots per ring\n", __FILE__, __LINE__,
+             __func__, threads, min_threads, threads, ring_size);
+  } else {
+    LOG_INFO("%s %d %s started %u parser threads, %u slots per ring\n", __FILE__, __LINE__, __func__, threads,
+             ring_size);
+  }
+  return 0;
+}
+
+void pipeline_stop(void) {
+  if (parser_count == 0) {
+    return;
+  }
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  for (unsigned int i = 0; i < parser_count; i++) {
+    uv_mutex_lock(&parsers[i].mutex);
+    uv_cond_signal(&parsers[i].cond);
+    uv_mutex_unlock(&parsers[i].mutex);
+  }
+  for (unsigned int i = 0; i < parser_count; i++) {
+    uv_thread_join(&parsers[i].thread);
+    uv_cond_destroy(&parsers[i].cond);
+    uv_mutex_destroy(&parsers[i].mutex);
+  }
+  for (unsigned int i = 0; i < producer_count; i++) {
+    pipeline_producer_t *producer = producers[i];
+    producers[i] = NULL;
+    if (!producer->released) {
+      // Still waiting for contexts at shutdown; its loop may touch it again.
+      LOG_ERROR("%s %d %s producer %u still has %u contexts, not releasing it\n", __FILE__, __LINE__, __func__, i,
+                producer->outstanding);
+      continue;
+    }
+    for (unsigned int k = 0; k < parser_count; k++) {
+      free(producer->lanes[k].in.slots);
+      free(producer->lanes[k].out.slots);
+    }
+    free(producer->lanes);
+    free(producer);
+  }
+  producer_count = 0;
+  parser_count = 0;
+  if (adaptive) {
+    uv_mutex_destroy(&scale_mutex);
+    adaptive = 0;
+  }
+  uv_mutex_destroy(&producers_mutex);
+}
+
+pipeline_producer_t *pipeline_producer_open(uv_loop_t *loop) {
+  if (parser_count == 0) {
+    return NULL;
+  }
+  pipeline_producer_t *producer = calloc(1, sizeof(*producer));
+  if (producer == NULL) {
+    return NULL;
+  }
+  producer->loop = loop;
+  producer->lanes = calloc(parser_count, sizeof(pipeline_lane_t));
+  int err = producer->lanes == NULL ? UV_ENOMEM : 0;
+  for (unsigned int i = 0; err == 0 && i < parser_count; i++) {
+    if ((err = pipeline_ring_init(&producer->lanes[i].in)) == 0) {
+      err = pipeline_ring_init(&producer->lanes[i].out);
+    }
+  }
+  if (err == 0) {
+    uv_mutex_lock(&producers_mutex);
+    err = producer_count < PIPELINE_MAX_PRODUCERS ? uv_async_init(loop, &producer->returned, pipeline_on_returned)
+                                                  : UV_ENOSPC;
+    if (err == 0) {
+      producer->returned.data = producer;
+      producers[producer_count] = producer;
+      // Parsers only look at producers below the published count.
+      __atomic_store_n(&producer_count, producer_count + 1, __ATOMIC_RELEASE);
+    }
+    uv_mutex_unlock(&producers_mutex);
+    if (err == 0) {
+      return producer;
+    }
+  }
+  LOG_ERROR("%s %d %s could not register a producer: %s\n", __FILE__, __LINE__, __func__, uv_strerror(err));
+  if (producer->lanes != NULL) {
+    for (unsigned int i = 0; i < parser_count; i++) {
+      free(producer->lanes[i].in.slots);
+      free(producer->lanes[i].out.slots);
+    }
+    free(producer->lanes);
+  }
+  free(producer);
+  return NULL;
+}
+
+void pipeline_producer_close(pipeline_producer_t *producer) {
+  if (producer == NULL || producer->closing) {
+    return;
+  }
+  producer->closing = 1;
+  pipeline_on_returned(&producer->returned);
+}
+
+int pipeline_submit(pipeline_producer_t *producer, pkt_ctx_t *ctx, uint32_t key) {
+  // Same key, same parser: templates are always parsed before the data they describe.
+  unsigned int index = (unsigned int) (((uint64_t) (key * 2654435761u) * parser_count) >> 32);
+  pipeline_lane_t *lane = &producer->lanes[index];
+  if (lane->outstanding > ring_mask) {
+    // Recycle what the parser already handed back before giving up.
+    pipeline_drain(producer, lane);
+    if (lane->outstanding > ring_mask) {
+      return UV_ENOBUFS;
+    }
+  }
+  if (stealing) {
+    // Template datagrams stay with this parser and in order; data may be
+    // stolen once the templates submitted before it are applied.
+    unsigned int token = pipeline_token(key);
+    ctx->stealable = !ingest_queue_has_templates((const uint8_t *) ctx->args.data, (size_t) ctx->args.len);
+    if (!ctx->stealable) {
+      lane->templates_submitted[token]++;
+    }
+    ctx->seq = lane->templates_submitted[token];
+  } else {
+    ctx->stealable = 0;
+  }
+  uint32_t tail = lane->in.tail;
+  lane->in.slots[tail & ring_mask] = ctx;
+  __atomic_store_n(&lane->in.tail, tail + 1, __ATOMIC_RELEASE);
+  lane->outstanding++;
+  producer->outstanding++;
+  // Paired with the fence in pipeline_parser_sleep(): either the parser sees
+  // the new tail, or we see it asleep.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  // A lane between two parsers has no owner; the one taking it over is woken
+  // by the one releasing it, and sees the new tail when it claims the lane.
+  int owner = __atomic_load_n(&lane_owner[index], __ATOMIC_ACQUIRE);
+  pipeline_parser_t *p = &parsers[owner < 0 ? pipeline_lane_target(index) : (unsigned int) owner];
+  if (__atomic_load_n(&p->sleeping, __ATOMIC_RELAXED)) {
+    pipeline_wake(p);
+  } else if (stealing && ctx->stealable && tail + 1 - __atomic_load_n(&lane->in.head, __ATOMIC_RELAXED) >= PIPELINE_STEAL_MIN) {
+    // The parser is falling behind: wake an idle one to help. Parked parsers
+    // are not woken, they are beyond the active count.
+    unsigned int helpers = __atomic_load_n(&active, __ATOMIC_RELAXED);
+    for (unsigned int k = 1; k < helpers; k++) {
+      pipeline_parser_t *helper = &parsers[(p->index + k) % helpers];
+      if (__atomic_load_n(&helper->sleeping, __ATOMIC_RELAXED)) {
+        pipeline_wake(helper);
+        break;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,150 @@
+//
+// Parser threads fed by single-producer/single-consumer rings.
+//
+
+#ifndef CNETFLOW_PIPELINE_H
+#define CNETFLOW_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+#include "pkt_slab.h"
+
+#define PIPELINE_MAX_THREADS 64
+// Receive threads that may submit: the collector loop plus one per reuseport socket.
+#define PIPELINE_MAX_PRODUCERS 64
+#define PIPELINE_DEFAULT_RING 1024
+#define PIPELINE_MAX_RING 65536
+// How often the parser count is reconsidered when it is adaptive.
+#define PIPELINE_SCALE_INTERVAL_MS 100
+// Changes of the parser count kept for the metrics.
+#define PIPELINE_SCALE_EVENTS 16
+
+typedef struct pipeline_producer_s pipeline_producer_t;
+
+// One change of the active parser count and what it was based on.
+typedef struct {
+  // Seconds since the epoch
+  uint64_t time;
+  unsigned int from;
+  unsigned int to;
+  // Datagrams waiting to be parsed
+  uint64_t backlog;
+  // Average parse time of one datagram
+  uint64_t parse_ns;
+  // Share of the interval the active parsers were busy, in percent
+  unsigned int busy_pct;
+} pipeline_scale_event_t;
+
+// Controller state of an adaptive parser count.
+typedef struct {
+  unsigned int min;
+  unsigned int max;
+  unsigned int active;
+  uint64_t last_ms;
+  // Start of the current stretch in which fewer parsers would have done
+  uint64_t calm_since_ms;
+  uint64_t parse_ns;
+  unsigned int busy_pct;
+  uint64_t delay_ns;
+  uint64_t ups;
+  uint64_t downs;
+  uint64_t changes;
+  pipeline_scale_event_t events[PIPELINE_SCALE_EVENTS];
+} pipeline_scale_t;
+
+/**
+ * Starts `threads` parser threads. Every producer/parser pair gets a ring of
+ * `ring_size` slots (a power of two) towards the parser and one of the same
+ * size back, so a context is recycled by the thread that received it.
+ *
+ * @return 0 on success, a negative libuv error code otherwise.
+ */
+int pipeline_start(unsigned int threads, unsigned int ring_size);
+
+/**
+ * Lets the parser threads finish what is queued and joins them. Producers
+ * must be closed first.
+ */
+void pipeline_stop(void);
+
+/**
+ * @return Non-zero once pipeline_start() succeeded.
+ */
+int pipeline_enabled(void);
+
+/**
+ * Lets idle parsers take datagrams without templates from parsers that are
+ * behind, once the templates their exporter sent before them are applied.
+ * Must be called before pipeline_start(), which turns it off again when
+ * sharding is enabled.
+ */
+void pipeline_set_stealing(int enabled);
+
+/**
+ * Makes the number of active parsers adaptive between `min_threads` and the
+ * count given to pipeline_start(), starting at `min_threads`. Parsers beyond
+ * the active count sleep, and their exporters are parsed by the active ones.
+ * A minimum of 0 or at least the maximum keeps every parser active. Must be
+ * called before pipeline_start().
+ */
+void pipeline_set_min_threads(unsigned int min_threads);
+
+/**
+ * Reconsiders the active parser count from `backlog`, the datagrams received
+ * and not parsed yet, and the parse times measured since the last call. Meant
+ * to run every PIPELINE_SCALE_INTERVAL_MS from a timer.
+ */
+void pipeline_adapt(uint64_t now_ms, uint64_t backlog);
+
+/**
+ * Appends the adaptive parser count and its last changes as "parser_scaling"
+ * to the metrics JSON in `buf`, if it is enabled.
+ *
+ * @return The new length of the JSON in `buf`.
+ */
+size_t pipeline_append_json(char *buf, size_t size, size_t len);
+
+void pipeline_scale_init(pipeline_scale_t *s, unsigned int min, unsigned int max, uint64_t now_ms);
+
+/**
+ * Feeds one interval to the controller: `parsed` datagrams finished since the
+ * last update, taking `busy_ns` of parser time in total, with `backlog`
+ * datagrams still waiting. Every change is recorded in `s->events`.
+ *
+ * @return The number of parsers that should be active.
+ */
+unsigned int pipeline_scale_update(pipeline_scale_t *s, uint64_t now_ms, uint64_t backlog, uint64_t parsed,
+                                   uint64_t busy_ns);
+
+/**
+ * Appends `s` as "parser_scaling" to the metrics JSON in `buf`.
+ *
+ * @return The new length of the JSON in `buf`.
+ */
+size_t pipeline_scale_append_json(const pipeline_scale_t *s, char *buf, size_t size, size_t len);
+
+/**
+ * Registers the calling thread as a producer whose returned contexts complete
+ * on `loop`. Must be called from the thread that runs `loop`.
+ *
+ * @return The producer, or NULL if the pipeline is disabled or full.
+ */
+pipeline_producer_t *pipeline_producer_open(uv_loop_t *loop);
+
+/**
+ * Stops accepting contexts from `producer`. Its return handle is closed on
+ * `loop` once every context it submitted has come back.
+ */
+void pipeline_producer_close(pipeline_producer_t *producer);
+
+/**
+ * Queues `ctx` to the parser selected by `key`, so contexts with the same key
+ * are parsed in order by one thread. The parser runs ctx->work.work_cb and
+ * the producer's loop runs ctx->work.after_work_cb with status 0.
+ *
+ * @return 0 on success, UV_ENOBUFS if the parser is `ring_size` contexts behind.
+ */
+int pipeline_submit(pipeline_producer_t *producer, pkt_ctx_t *ctx, uint32_t key);
+
+#endif // CNETFLOW_PIPELINE_H
@@ -0,0 +1,119 @@
+//
+// Sizing of the active parser set from the ingest backlog and parse latency.
+//
+// Every interval the controller gets the datagrams waiting to be parsed, and
+// how many datagrams the parsers finished and how long they spent on them.
+// From those it derives the average time to parse one datagram, how busy the
+// active parsers were, and how long the backlog would take them to drain.
+//
+// One parser is added as soon as the active ones are nearly saturated or the
+// backlog would take too long to drain. One is parked once the others could
+// have carried the load comfortably for a few seconds in a row, so a short
+// lull does not undo growth that a burst will need again.
+//
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Grow when the active parsers were busy this share of the interval (percent),
+#define PIPELINE_SCALE_GROW_BUSY 80
+// or when the backlog would take them this long to parse.
+#define PIPELINE_SCALE_GROW_DELAY_NS 2000000ULL
+// Shrink when one parser less would have been busy below this share,
+#define PIPELINE_SCALE_SHRINK_BUSY 50
+// with the backlog below a quarter of the growth delay, for this long.
+#define PIPELINE_SCALE_CALM_MS 3000
+
+void pipeline_scale_init(pipeline_scale_t *s, unsigned int min, unsigned int max, uint64_t now_ms) {
+  memset(s, 0, sizeof(*s));
+  s->min = min;
+  s->max = max;
+  s->active = min;
+  s->last_ms = now_ms;
+  s->calm_since_ms = now_ms;
+}
+
+static void pipeline_scale_record(pipeline_scale_t *s, unsigned int to, uint64_t backlog, unsigned int busy_pct) {
+  pipeline_scale_event_t *event = &s->events[s->changes % PIPELINE_SCALE_EVENTS];
+  event->time = (uint64_t) time(NULL);
+  event->from = s->active;
+  event->to = to;
+  event->backlog = backlog;
+  event->parse_ns = s->parse_ns;
+  event->busy_pct = busy_pct;
+  s->changes++;
+  if (to > s->active) {
+    s->ups++;
+  } else {
+    s->downs++;
+  }
+  s->active = to;
+}
+
+unsigned int pipeline_scale_update(pipeline_scale_t *s, uint64_t now_ms, uint64_t backlog, uint64_t parsed,
+                                   uint64_t busy_ns) {
+  if (now_ms <= s->last_ms) {
+    return s->active;
+  }
+  uint64_t interval_ns = (now_ms - s->last_ms) * 1000000ULL;
+  s->last_ms = now_ms;
+  if (parsed > 0) {
+    // Moving average over a few intervals, so one slow datagram does not add a parser.
+    uint64_t sample = busy_ns / parsed;
+    s->parse_ns = s->parse_ns == 0 ? sample : (s->parse_ns * 3 + sample) / 4;
+  }
+  unsigned int busy_pct = (unsigned int) (busy_ns * 100 / (interval_ns * s->active));
+  uint64_t delay_ns = backlog * s->parse_ns / s->active;
+  s->busy_pct = busy_pct;
+  s->delay_ns = delay_ns;
+
+  if (busy_pct >= PIPELINE_SCALE_GROW_BUSY || delay_ns >= PIPELINE_SCALE_GROW_DELAY_NS) {
+    s->calm_since_ms = now_ms;
+    if (s->active < s->max) {
+      pipeline_scale_record(s, s->active + 1, backlog, busy_pct);
+    }
+    return s->active;
+  }
+  if (s->active <= s->min || busy_ns * 100 >= PIPELINE_SCALE_SHRINK_BUSY * interval_ns * (s->active - 1) ||
+      delay_ns >= PIPELINE_SCALE_GROW_DELAY_NS / 4) {
+    s->calm_since_ms = now_ms;
+    return s->active;
+  }
+  if (now_ms - s->calm_since_ms >= PIPELINE_SCALE_CALM_MS) {
+    s->calm_since_ms = now_ms;
+    pipeline_scale_record(s, s->active - 1, backlog, busy_pct);
+  }
+  return s->active;
+}
+
+size_t pipeline_scale_append_json(const pipeline_scale_t *s, char *buf, size_t size, size_t len) {
+  if (len >= size) {
+    return len;
+  }
+  int n = snprintf(buf + len, size - len,
+                   ",\n  \"parser_scaling\": {\"min\": %u, \"max\": %u, \"active\": %u, \"parse_ns\": %lu, "
+                   "\"busy_pct\": %u, \"backlog_delay_ns\": %lu, \"scale_ups\": %lu, \"scale_downs\": %lu, "
+                   "\"events\": [",
+                   s->min, s->max, s->active, (unsigned long) s->parse_ns, s->busy_pct, (unsigned long) s->delay_ns,
+                   (unsigned long) s->ups, (unsigned long) s->downs);
+  len = n < 0 ? len : len + (size_t) n;
+  // Oldest first; only the last PIPELINE_SCALE_EVENTS changes are kept.
+  uint64_t first = s->changes > PIPELINE_SCALE_EVENTS ? s->changes - PIPELINE_SCALE_EVENTS : 0;
+  for (uint64_t i = first; i < s->changes && len + 160 < size; i++) {
+    const pipeline_scale_event_t *event = &s->events[i % PIPELINE_SCALE_EVENTS];
+    n = snprintf(buf + len, size - len,
+                 "%s\n    {\"time\": %lu, \"from\": %u, \"to\": %u, \"backlog\": %lu, \"parse_ns\": %lu, "
+                 "\"busy_pct\": %u}",
+                 i > first ? "," : "", (unsigned long) event->time, event->from, event->to,
+                 (unsigned long) event->backlog, (unsigned long) event->parse_ns, event->busy_pct);
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  if (len < size) {
+    n = snprintf(buf + len, size - len, "%s]}", s->changes > 0 ? "\n  " : "");
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  return len < size ? len : size - 1;
+}
@@ -0,0 +1,141 @@
+//
+// Lock-free slab of packet contexts.
+//
+// Each size class is one contiguous, cache-aligned array of contexts with a
+// Treiber stack of free ones. The stack head packs a generation tag next to
+// the index of the top context so a pop that races with a pop/push pair on
+// another thread fails its compare-and-swap instead of corrupting the list.
+//
+
+#include "pkt_slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+typedef struct {
+  char *base;
+  size_t stride;
+  uint32_t capacity;
+  uint32_t count;
+  // (generation << 32) | (index + 1) of the top free context, index 0 = empty
+  uint64_t head;
+  uint32_t in_use;
+} pkt_slab_class_t;
+
+static pkt_slab_class_t slab[PKT_SLAB_CLASSES];
+
+static const uint32_t class_sizes[PKT_SLAB_CLASSES] = {0, PKT_SLAB_SMALL_SIZE, PKT_SLAB_JUMBO_SIZE,
+                                                       PKT_SLAB_MAX_SIZE};
+
+static inline pkt_ctx_t *slab_ctx(const pkt_slab_class_t *c, uint32_t index) {
+  return (pkt_ctx_t *) (c->base + (size_t) index * c->stride);
+}
+
+static void *slab_aligned_alloc(size_t bytes) {
+#ifdef _WIN32
+  return _aligned_malloc(bytes, 64);
+#else
+  void *ptr = NULL;
+  return posix_memalign(&ptr, 64, bytes) == 0 ? ptr : NULL;
+#endif
+}
+
+static void slab_aligned_free(void *ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+int pkt_slab_init(uint32_t contexts) {
+  if (contexts == 0) {
+    contexts = PKT_SLAB_DEFAULT_CONTEXTS;
+  }
+  const uint32_t counts[PKT_SLAB_CLASSES] = {contexts * 2, contexts / 2 ? contexts / 2 : 1, contexts, 256};
+  for (unsigned int k = 0; k < PKT_SLAB_CLASSES; k++) {
+    pkt_slab_class_t *c = &slab[k];
+    c->capacity = class_sizes[k];
+    c->count = counts[k];
+    c->stride = (PKT_CTX_HEADER + c->capacity + 63) & ~(size_t) 63;
+    c->base = slab_aligned_alloc(c->stride * c->count);
+    if (c->base == NULL) {
+      LOG_ERROR("%s %d %s failed to allocate %u contexts of %u bytes\n", __FILE__, __LINE__, __func__, c->count,
+                c->capacity);
+      pkt_slab_destroy();
+      return -1;
+    }
+    for (uint32_t i = 0; i < c->count; i++) {
+      pkt_ctx_t *ctx = slab_ctx(c, i);
+      memset(ctx, 0, sizeof(*ctx));
+      ctx->size_class = k;
+      ctx->capacity = c->capacity;
+      ctx->next_free = i + 1 < c->count ? i + 2 : 0;
+    }
+    c->head = 1;
+    c->in_use = 0;
+  }
+  return 0;
+}
+
+void pkt_slab_destroy(void) {
+  for (unsigned int k = 0; k < PKT_SLAB_CLASSES; k++) {
+    if (slab[k].in_use != 0) {
+      // A parser timed out at shutdown and still holds a context.
+      LOG_ERROR("%s %d %s %u contexts of class %u still in use, not releasing it\n", __FILE__, __LINE__, __func__,
+                slab[k].in_use, k);
+      continue;
+    }
+    slab_aligned_free(slab[k].base);
+    memset(&slab[k], 0, sizeof(slab[k]));
+  }
+}
+
+pkt_ctx_t *pkt_slab_alloc(size_t bytes) {
+  unsigned int k = 0;
+  while (k < PKT_SLAB_CLASSES && class_sizes[k] < bytes) {
+    k++;
+  }
+  if (k == PKT_SLAB_CLASSES) {
+    return NULL;
+  }
+  pkt_slab_class_t *c = &slab[k];
+  uint64_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+  pkt_ctx_t *ctx;
+  uint64_t next;
+  do {
+    uint32_t top = (uint32_t) head;
+    if (top == 0 || c->base == NULL) {
+      return NULL;
+    }
+    ctx = slab_ctx(c, top - 1);
+    // May read a stale link if another thread wins the race; the tag makes
+    // the CAS below fail in that case.
+    next = ((head >> 32) + 1) << 32 | __atomic_load_n(&ctx->next_free, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&c->head, &head, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  __atomic_fetch_add(&c->in_use, 1, __ATOMIC_RELAXED);
+  return ctx;
+}
+
+void pkt_slab_free(pkt_ctx_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+  pkt_slab_class_t *c = &slab[ctx->size_class];
+  uint32_t index = (uint32_t) (((char *) ctx - c->base) / c->stride);
+  uint64_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+  uint64_t next;
+  do {
+    __atomic_store_n(&ctx->next_free, (uint32_t) head, __ATOMIC_RELAXED);
+    next = ((head >> 32) + 1) << 32 | (index + 1);
+  } while (!__atomic_compare_exchange_n(&c->head, &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  __atomic_fetch_sub(&c->in_use, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t pkt_slab_in_use(unsigned int size_class) {
+  if (size_class >= PKT_SLAB_CLASSES) {
+    return 0;
+  }
+  return __atomic_load_n(&slab[size_class].in_use, __ATOMIC_RELAXED);
+}
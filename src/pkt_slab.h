@@ -0,0 +1,88 @@
+//
+// Preallocated packet contexts for the receive path.
+//
+
+#ifndef CNETFLOW_PKT_SLAB_H
+#define CNETFLOW_PKT_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+#include "collector.h"
+
+// Buffer sizes of the context classes. Class 0 has no buffer and only carries
+// the work request for datagrams that live in a receive ring (tpacket, xdp,
+// io_uring, GRO segments).
+#define PKT_SLAB_CLASSES 4
+#define PKT_SLAB_SMALL_SIZE 2048
+#define PKT_SLAB_JUMBO_SIZE 9216
+#define PKT_SLAB_MAX_SIZE 65536
+// Receive buffer size for sockets: a full jumbo frame.
+#define PKT_SLAB_RECV_SIZE PKT_SLAB_JUMBO_SIZE
+#define PKT_SLAB_DEFAULT_CONTEXTS 8192
+#define PKT_SLAB_MAX_CONTEXTS (1 << 20)
+
+/**
+ * One datagram in flight: the work request, its parse arguments and the
+ * datagram buffer in a single cache-aligned object.
+ */
+typedef struct {
+  // First member, so after_work_cb can recover the context from its request.
+  uv_work_t work;
+  parse_args_t args;
+  // Index + 1 of the next free context of the class, 0 ends the list.
+  uint32_t next_free;
+  uint32_t size_class;
+  uint32_t capacity;
+  // Datagrams still parsing out of this buffer (UDP_GRO segments).
+  volatile int refs;
+  // Pipeline work stealing: whether a parser other than the exporter's own may
+  // take this datagram, and the exporter's template count it must wait for.
+  uint32_t stealable;
+  uint32_t seq;
+} pkt_ctx_t;
+
+// Offset of the buffer from the start of its context.
+#define PKT_CTX_HEADER ((sizeof(pkt_ctx_t) + 63) & ~(size_t) 63)
+
+/**
+ * Allocates every class up front: `contexts` buffered receive contexts, half
+ * as many small ones, twice as many buffer-less ones and a fixed handful of
+ * 64 KiB ones.
+ *
+ * @return 0 on success, -1 if the memory could not be allocated.
+ */
+int pkt_slab_init(uint32_t contexts);
+
+/**
+ * Releases the slab. Classes that still have contexts handed out are left
+ * allocated.
+ */
+void pkt_slab_destroy(void);
+
+/**
+ * Takes a context whose buffer holds at least `bytes` bytes from the smallest
+ * class that fits. Lock-free; safe from any thread.
+ *
+ * @return The context, or NULL when the class is exhausted or `bytes` exceeds
+ *         PKT_SLAB_MAX_SIZE. The caller counts the drop.
+ */
+pkt_ctx_t *pkt_slab_alloc(size_t bytes);
+
+/**
+ * Returns a context to its class. Lock-free; safe from any thread.
+ */
+void pkt_slab_free(pkt_ctx_t *ctx);
+
+/**
+ * Number of contexts of `size_class` currently handed out.
+ */
+uint32_t pkt_slab_in_use(unsigned int size_class);
+
+static inline char *pkt_ctx_data(pkt_ctx_t *ctx) { return (char *) ctx + PKT_CTX_HEADER; }
+
+static inline pkt_ctx_t *pkt_ctx_from_data(void *data) { return (pkt_ctx_t *) ((char *) data - PKT_CTX_HEADER); }
+
+static inline pkt_ctx_t *pkt_ctx_from_work(uv_work_t *req) { return (pkt_ctx_t *) req; }
+
+#endif // CNETFLOW_PKT_SLAB_H
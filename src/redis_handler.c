@@ -199,7 +199,7 @@ void *redis_get_template(const char *key, size_t key_len, size_t *out_len) {
   return result;
 }
 
-int redis_set_template(const char *key, size_t key_len, void *data, size_t len) {
+int redis_set_template(const char *key, size_t key_len, const void *data, size_t len) {
   if (!redis_conn) {
     if (connect_thread_local_redis() != 0) {
       return -1;
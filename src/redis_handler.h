@@ -42,7 +42,7 @@ void *redis_get_template(const char *key, size_t key_len, size_t *out_len);
  * @param len Length of data
  * @return 0 on success, -1 on failure
  */
-int redis_set_template(const char *key, size_t key_len, void *data, size_t len);
+int redis_set_template(const char *key, size_t key_len, const void *data, size_t len);
 
 /**
  * Get all keys matching a pattern
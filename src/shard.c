@@ -0,0 +1,164 @@
+//
+// Shared-nothing parse shards.
+//
+// With sharding enabled, exporters are steered to a fixed parser thread (see
+// pipeline_submit()) and that thread runs one shard: its own arena and
+// template tables, its own ClickHouse buffers and connection (thread-local in
+// db_clickhouse.c) and counters it adds up locally before handing them to the
+// metrics thread in batches. Nothing a shard writes on the parse path is
+// written by another thread, so shards never contend on a lock or a cache
+// line. The shared template tables are only read, on a shard's first lookup
+// of a template it has not seen yet.
+//
+
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+static unsigned int count = 0;
+static shard_t *shards[SHARD_MAX];
+static THREAD_LOCAL shard_t *current = NULL;
+
+int shard_configure(unsigned int shards_count) {
+  if (shards_count > SHARD_MAX) {
+    return UV_EINVAL;
+  }
+  count = shards_count;
+  return 0;
+}
+
+unsigned int shard_count(void) { return count; }
+
+/**
+ * @return Bytes of a shard's arena: both template tables and SHARD_TEMPLATES
+ *         templates with their keys.
+ */
+static size_t shard_arena_size(void) {
+#ifdef USE_ARENA_ALLOCATOR
+  size_t chunk = sizeof(arena_chunk_t) + 8;
+#else
+  size_t chunk = 8;
+#endif
+  size_t table = sizeof(hashmap_t) + sizeof(uv_rwlock_t) + sizeof(bucket_t) * SHARD_TEMPLATE_BUCKETS + 3 * chunk;
+  size_t key = sizeof(uint64_t) + 1 + chunk;
+  return 2 * table + (size_t) SHARD_TEMPLATES * (SHARD_TEMPLATE_BYTES + key + chunk);
+}
+
+shard_t *shard_attach(unsigned int index) {
+  if (index >= count) {
+    return NULL;
+  }
+  shard_t *shard = calloc(1, sizeof(*shard));
+  if (shard == NULL) {
+    return NULL;
+  }
+  shard->index = index;
+  if (arena_create(&shard->arena, shard_arena_size()) != ok) {
+    LOG_ERROR("%s %d %s shard %u: arena_create failed\n", __FILE__, __LINE__, __func__, index);
+    free(shard);
+    return NULL;
+  }
+  shard->templates_v9 = hashmap_create(&shard->arena, SHARD_TEMPLATE_BUCKETS);
+  shard->templates_ipfix = hashmap_create(&shard->arena, SHARD_TEMPLATE_BUCKETS);
+  if (shard->templates_v9 == NULL || shard->templates_ipfix == NULL) {
+    LOG_ERROR("%s %d %s shard %u: cannot create template tables\n", __FILE__, __LINE__, __func__, index);
+    arena_destroy(&shard->arena);
+    free(shard);
+    return NULL;
+  }
+  __atomic_store_n(&shards[index], shard, __ATOMIC_RELEASE);
+  current = shard;
+  return shard;
+}
+
+shard_t *shard_current(void) { return current; }
+
+shard_t *shard_get(unsigned int index) {
+  return index < SHARD_MAX ? __atomic_load_n(&shards[index], __ATOMIC_ACQUIRE) : NULL;
+}
+
+shard_t *shard_switch(shard_t *shard) {
+  shard_t *previous = current;
+  current = shard;
+  return previous;
+}
+
+void *shard_template_get(shard_t *shard, hashmap_t *local, hashmap_t *shared, uv_mutex_t *shared_mutex,
+                         uint64_t key) {
+  void *value = hashmap_get(local, &key, sizeof(key));
+  if (value != NULL || shared == NULL) {
+    return value;
+  }
+  uv_mutex_lock(shared_mutex);
+  value = hashmap_get(shared, &key, sizeof(key));
+  uv_mutex_unlock(shared_mutex);
+#ifdef USE_ARENA_ALLOCATOR
+  if (value != NULL) {
+    // The shared arena is never reset while the collector runs, so the pointer stays valid.
+    hashmap_set(local, &shard->arena, &key, sizeof(key), value);
+  }
+#else
+  // Without the arena, replacing a value frees it, so a shared template must not be referenced twice.
+  (void) shard;
+#endif
+  return value;
+}
+
+void shard_template_set(shard_t *shard, hashmap_t *local, uint64_t key, void *value) {
+  void *replaced = hashmap_get(local, &key, sizeof(key));
+  if (hashmap_set(local, &shard->arena, &key, sizeof(key), value) != 0) {
+    return;
+  }
+  if (replaced == NULL) {
+    __atomic_store_n(&shard->templates, shard->templates + 1, __ATOMIC_RELAXED);
+  }
+#ifdef USE_ARENA_ALLOCATOR
+  // Only this thread reads the table, so a redefined template can be reused
+  // right away. One copied from the shared table is not the shard's to free.
+  if (replaced != NULL && replaced != value && (size_t) replaced >= (size_t) shard->arena.base_address &&
+      (size_t) replaced < shard->arena.end) {
+    arena_free(&shard->arena, replaced);
+  }
+#endif
+}
+
+void shard_count_datagram(shard_t *shard) {
+  __atomic_store_n(&shard->datagrams, shard->datagrams + 1, __ATOMIC_RELAXED);
+}
+
+void shard_destroy(void) {
+  for (unsigned int i = 0; i < SHARD_MAX; i++) {
+    shard_t *shard = shards[i];
+    if (shard == NULL) {
+      continue;
+    }
+    shards[i] = NULL;
+    arena_destroy(&shard->arena);
+    free(shard);
+  }
+  count = 0;
+}
+
+size_t shard_append_json(char *buf, size_t size, size_t len) {
+  if (count == 0 || len >= size) {
+    return len;
+  }
+  int n = snprintf(buf + len, size - len, ",\n  \"shards\": [");
+  len = n < 0 ? len : len + (size_t) n;
+  for (unsigned int i = 0; i < count && len + 96 < size; i++) {
+    shard_t *shard = __atomic_load_n(&shards[i], __ATOMIC_ACQUIRE);
+    uint64_t datagrams = shard ? __atomic_load_n(&shard->datagrams, __ATOMIC_RELAXED) : 0;
+    uint64_t templates = shard ? __atomic_load_n(&shard->templates, __ATOMIC_RELAXED) : 0;
+    n = snprintf(buf + len, size - len, "%s\n    {\"shard\": %u, \"datagrams\": %lu, \"templates\": %lu}", i ? "," : "",
+                 i, (unsigned long) datagrams, (unsigned long) templates);
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  if (len < size) {
+    n = snprintf(buf + len, size - len, "\n  ]");
+    len = n < 0 ? len : len + (size_t) n;
+  }
+  return len < size ? len : size - 1;
+}
@@ -0,0 +1,107 @@
+//
+// Shared-nothing parse shards: one parser thread per shard, each owning the
+// templates of the exporters steered to it.
+//
+
+#ifndef CNETFLOW_SHARD_H
+#define CNETFLOW_SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+#include "arena.h"
+#include "hashmap.h"
+
+#define SHARD_MAX 64
+#define SHARD_TEMPLATE_BUCKETS 65536
+// Templates a shard's arena is sized for, and the bytes a typical one takes
+// once compiled. A redefined template reuses the space of the one it replaces.
+#define SHARD_TEMPLATES 8192
+#define SHARD_TEMPLATE_BYTES 1024
+
+typedef struct {
+  unsigned int index;
+  arena_struct_t arena;
+  hashmap_t *templates_v9;
+  hashmap_t *templates_ipfix;
+  // Written by the shard's thread only, read by the metrics endpoint.
+  uint64_t datagrams;
+  uint64_t templates;
+  // Keeps the next allocation off the counters' cache line.
+  char pad[64];
+} shard_t;
+
+/**
+ * Enables `count` shards. Must be called before the parser threads start.
+ *
+ * @return 0 on success, UV_EINVAL if `count` exceeds SHARD_MAX.
+ */
+int shard_configure(unsigned int count);
+
+/**
+ * @return The number of shards, 0 when sharding is disabled.
+ */
+unsigned int shard_count(void);
+
+/**
+ * Creates shard `index` on the calling thread, which then runs it alone. The
+ * shard's memory is first touched here, on its own thread.
+ *
+ * @return The shard, or NULL if sharding is disabled or it cannot be allocated.
+ */
+shard_t *shard_attach(unsigned int index);
+
+/**
+ * @return The shard run by the calling thread, or NULL.
+ */
+shard_t *shard_current(void);
+
+/**
+ * @return Shard `index` once its thread has attached it, or NULL.
+ */
+shard_t *shard_get(unsigned int index);
+
+/**
+ * Makes the calling thread parse against `shard` until switched back, e.g.
+ * for a datagram taken from another shard's queue.
+ *
+ * @return The shard the thread used before.
+ */
+shard_t *shard_switch(shard_t *shard);
+
+/**
+ * Looks a template up in the shard's own table. A template missing there is
+ * copied from `shared` (filled at startup, e.g. from Redis, and read-only
+ * while sharding is enabled) under `shared_mutex`, so later lookups take no
+ * shared lock.
+ *
+ * @return The template, or NULL.
+ */
+void *shard_template_get(shard_t *shard, hashmap_t *local, hashmap_t *shared, uv_mutex_t *shared_mutex,
+                         uint64_t key);
+
+/**
+ * Stores a template allocated from the shard's arena in its own table. The
+ * template it replaces, if the shard allocated it, is freed.
+ */
+void shard_template_set(shard_t *shard, hashmap_t *local, uint64_t key, void *value);
+
+/**
+ * Counts a datagram parsed by the shard.
+ */
+void shard_count_datagram(shard_t *shard);
+
+/**
+ * Frees every shard. The parser threads must have stopped.
+ */
+void shard_destroy(void);
+
+/**
+ * Appends the datagrams and templates of every shard as a JSON member
+ * starting with a comma.
+ *
+ * @return The new length of the string in `buf`.
+ */
+size_t shard_append_json(char *buf, size_t size, size_t len);
+
+#endif // CNETFLOW_SHARD_H
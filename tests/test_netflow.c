@@ -5,7 +5,11 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "../src/arena.h"
+#include "../src/flow_batch.h"
 #include "../src/netflow.h"
+#include "../src/netflow_template.h"
+#include "../src/netflow_layouts.py.h"
 #include "../src/netflow_v5.h"
 #include "../src/netflow_v9.h"
 
@@ -170,3 +174,352 @@ Test(netflow, fix_endianness_values) {
 }
 
 
+
+Test(netflow, compiled_template_decodes_stored_fields) {
+  arena_struct_t arena;
+  arena_create(&arena, 64 * 1024);
+
+  // v9 template 256: srcaddr(4), an unstored 3-byte field, dstport(2), octets(8), last(4).
+  const uint8_t v9[] = {0x01, 0x00, 0x00, 0x05, 0x00, 0x08, 0x00, 0x04, 0x03, 0xe7, 0x00, 0x03,
+                        0x00, 0x0b, 0x00, 0x02, 0x00, 0x01, 0x00, 0x08, 0x00, 0x15, 0x00, 0x04};
+  netflow_template_t *tpl = netflow_template_compile(&arena, 9, v9, sizeof(v9));
+  cr_assert_not_null(tpl);
+  cr_expect_eq(tpl->template_id, 256);
+  cr_expect_eq(tpl->record_size, 21);
+  cr_expect_eq(tpl->step_count, 4);
+  cr_expect_eq(tpl->raw_len, sizeof(v9));
+  cr_expect_eq(memcmp(tpl->raw, v9, sizeof(v9)), 0);
+  // A resend is recognised by its bytes; a redefinition of the same id is not.
+  uint8_t redefined[sizeof(v9)];
+  memcpy(redefined, v9, sizeof(v9));
+  redefined[sizeof(v9) - 1] = 0x08;
+  cr_expect(netflow_template_same(tpl, v9, sizeof(v9)));
+  cr_expect_not(netflow_template_same(tpl, redefined, sizeof(redefined)));
+  cr_expect_not(netflow_template_same(tpl, v9, sizeof(v9) - 4));
+  cr_expect_not(netflow_template_same(NULL, v9, sizeof(v9)));
+
+  const uint8_t record[] = {10, 0, 0, 1, 0xaa, 0xbb, 0xcc, 0x01, 0xbb, 0, 0, 0, 0, 0, 0, 0x12, 0x34, 0, 0, 0x27, 0x10};
+  netflow_v9_record_insert_uint128_t out = {0};
+  cr_expect_eq(netflow_template_decode(tpl, record, &out, 100), 0);
+  cr_expect_eq((uint32_t) out.srcaddr, ipv4("10.0.0.1"));
+  cr_expect_eq(out.dstport, 443);
+  cr_expect_eq(out.dOctets, (uint64_t) 0x1234);
+  cr_expect_eq(out.Last, (uint32_t) 110);
+  cr_expect_eq(out.ip_version, 4);
+
+  // IPFIX: an enterprise field is skipped along with its enterprise number.
+  const uint8_t ipfix[] = {0x01, 0x01, 0x00, 0x02, 0x80, 0x08, 0x00, 0x04, 0x00,
+                           0x00, 0x00, 0x7b, 0x00, 0x1b, 0x00, 0x10};
+  tpl = netflow_template_compile(&arena, 10, ipfix, sizeof(ipfix));
+  cr_assert_not_null(tpl);
+  cr_expect_eq(tpl->record_size, 20);
+  cr_expect_eq(tpl->step_count, 1);
+  cr_expect_eq(tpl->ipv6, 1);
+  cr_expect_eq(tpl->ip_version, 6);
+
+  // A variable-length field leaves the records undecodable; a truncated record does not compile.
+  const uint8_t variable[] = {0x01, 0x02, 0x00, 0x01, 0x00, 0x52, 0xff, 0xff};
+  tpl = netflow_template_compile(&arena, 10, variable, sizeof(variable));
+  cr_assert_not_null(tpl);
+  cr_expect_eq(tpl->record_size, 0);
+  cr_expect_null(netflow_template_compile(&arena, 9, v9, sizeof(v9) - 2));
+
+  arena_destroy(&arena);
+}
+
+Test(netflow, generated_layouts_match_compiled_program) {
+  arena_struct_t arena;
+  arena_create(&arena, 64 * 1024);
+  srand(7);
+
+  for (size_t i = 0; i < sizeof(netflow_layouts) / sizeof(netflow_layouts[0]); i++) {
+    const netflow_layout_t *layout = &netflow_layouts[i];
+    uint8_t record[4 + 4 * 32];
+    size_t len = 4 + 4 * (size_t) layout->field_count;
+    cr_assert_leq(len, sizeof(record));
+    record[0] = 0x01;
+    record[1] = 0x00;
+    record[2] = (uint8_t) (layout->field_count >> 8);
+    record[3] = (uint8_t) layout->field_count;
+    memcpy(record + 4, layout->spec, len - 4);
+
+    netflow_template_t *tpl = netflow_template_compile(&arena, 9, record, len);
+    cr_assert_not_null(tpl);
+    // Each translation unit has its own copy of the generated decoders.
+    cr_expect_not_null(tpl->layout);
+    cr_expect_eq(tpl->record_size, layout->record_size);
+
+    // Whatever the bytes, the generated decoder and the program agree.
+    for (int round = 0; round < 64; round++) {
+      uint8_t data[256];
+      for (size_t b = 0; b < sizeof(data); b++) {
+        data[b] = (uint8_t) rand();
+      }
+      netflow_v9_record_insert_uint128_t generated, program;
+      memset(&generated, 0, sizeof(generated));
+      memset(&program, 0, sizeof(program));
+      int generated_ipv6 = netflow_template_decode(tpl, data, &generated, 1000);
+      netflow_layout_fn bound = tpl->layout;
+      tpl->layout = NULL;
+      int program_ipv6 = netflow_template_decode(tpl, data, &program, 1000);
+      tpl->layout = bound;
+      cr_expect_eq(generated_ipv6, program_ipv6);
+      cr_expect_eq(memcmp(&generated, &program, sizeof(generated)), 0);
+    }
+  }
+
+  arena_destroy(&arena);
+}
+
+Test(netflow, v5_decoders_agree) {
+  // One record as on the wire: 10.0.0.1:1234 -> 10.0.0.2:80, First 5000 ms, Last 9999 ms.
+  uint8_t data[31 * 48] = {10, 0, 0, 1, 10, 0, 0, 2, 10, 0, 0, 254, 0, 3, 0, 4, 0, 0, 0, 7, 0, 0, 0x01, 0x2c,
+                           0, 0, 0x13, 0x88, 0, 0, 0x27, 0x0f, 0x04, 0xd2, 0, 80, 0, 0x1b, 6, 0x10, 0xfd, 0xe8,
+                           0, 0x0f, 24, 16, 0, 0};
+  srand(5);
+  for (size_t b = 48; b < sizeof(data); b++) {
+    data[b] = (uint8_t) rand();
+  }
+
+  netflow_v9_record_insert_uint128_t expected[31];
+  memset(expected, 0, sizeof(expected));
+  decode_v5_records_scalar(data, 31, 1000, expected);
+  cr_expect_eq((uint32_t) expected[0].srcaddr, 0x0a000001u);
+  cr_expect_eq((uint32_t) expected[0].dstaddr, 0x0a000002u);
+  cr_expect_eq((uint32_t) expected[0].nexthop, 0x0a0000feu);
+  cr_expect_eq(expected[0].input, 3);
+  cr_expect_eq(expected[0].output, 4);
+  cr_expect_eq(expected[0].dPkts, 7);
+  cr_expect_eq(expected[0].dOctets, 300);
+  cr_expect_eq(expected[0].First, 1005);
+  cr_expect_eq(expected[0].Last, 1009);
+  cr_expect_eq(expected[0].srcport, 1234);
+  cr_expect_eq(expected[0].dstport, 80);
+  cr_expect_eq(expected[0].tcp_flags, 0x1b);
+  cr_expect_eq(expected[0].prot, 6);
+  cr_expect_eq(expected[0].tos, 0x10);
+  cr_expect_eq(expected[0].src_as, 65000);
+  cr_expect_eq(expected[0].dst_as, 15);
+  cr_expect_eq(expected[0].src_mask, 24);
+  cr_expect_eq(expected[0].dst_mask, 16);
+  cr_expect_eq(expected[0].ip_version, 4);
+
+#if NETFLOW_V5_SIMD
+  // An odd count, so the AVX2 decoder also finishes a lone record.
+  netflow_v9_record_insert_uint128_t decoded[31];
+  if (__builtin_cpu_supports("ssse3")) {
+    memset(decoded, 0, sizeof(decoded));
+    decode_v5_records_ssse3(data, 31, 1000, decoded);
+    cr_expect_eq(memcmp(decoded, expected, sizeof(expected)), 0);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    memset(decoded, 0, sizeof(decoded));
+    decode_v5_records_avx2(data, 31, 1000, decoded);
+    cr_expect_eq(memcmp(decoded, expected, sizeof(expected)), 0);
+  }
+#endif
+}
+
+// The filter ch_insert_flows() applied before netflow_prepare_batch().
+static int prepare_reference_rejects(const netflow_v9_record_insert_uint128_t *r) {
+  if (r->dOctets == 0 || r->dPkts == 0 || r->First > r->Last || r->First == 0 || r->Last == 0 ||
+      ((r->prot == 6 || r->prot == 17) && r->srcport == 0 && r->dstport == 0)) {
+    return 1;
+  }
+  uint32_t dur = r->Last - r->First;
+  if (dur > 0 && (r->dOctets / dur > NETFLOW_MAX_OCTETS_PER_SEC || r->dPkts / dur > NETFLOW_MAX_PACKETS_PER_SEC)) {
+    return 1;
+  }
+  if (dur == 0 && (r->dOctets > NETFLOW_MAX_OCTETS_PER_SEC || r->dPkts > NETFLOW_MAX_PACKETS_PER_SEC)) {
+    return 1;
+  }
+  return r->srcaddr < 16777216 || r->dstaddr < 16777216;
+}
+
+// Whether the batch's row holds the record; `v6` walks the side column.
+static int batch_row_equals(const flow_batch_t *flows, uint32_t row, uint32_t *v6,
+                            const netflow_v9_record_insert_uint128_t *r) {
+  uint128_t srcaddr, dstaddr;
+  flow_batch_addrs(flows, row, v6, &srcaddr, &dstaddr);
+  return srcaddr == r->srcaddr && dstaddr == r->dstaddr && flows->srcport[row] == r->srcport &&
+         flows->dstport[row] == r->dstport && flows->input[row] == r->input && flows->output[row] == r->output &&
+         flows->src_mask[row] == r->src_mask && flows->dst_mask[row] == r->dst_mask &&
+         flows->src_as[row] == r->src_as && flows->dst_as[row] == r->dst_as && flows->prot[row] == r->prot &&
+         flows->First[row] == r->First && flows->Last[row] == r->Last && flows->dOctets[row] == r->dOctets &&
+         flows->dPkts[row] == r->dPkts && flows->ip_version[row] == r->ip_version;
+}
+
+Test(netflow, prepare_batch_matches_per_row_filter) {
+  static const uint32_t addrs[] = {0x0a000001u, 0xac100005u, 0xac200005u, 0xc0a80101u, 0x08080808u, 0x00000001u};
+  netflow_v9_record_insert_uint128_t records[302], expected[302];
+  flow_batch_t flows;
+  memset(&flows, 0, sizeof(flows));
+  srand(11);
+  for (int round = 0; round < 200; round++) {
+    // Rows already in the batch, failing every check, must be left alone.
+    const uint32_t start = (uint32_t) (rand() % 3);
+    const uint32_t count = (uint32_t) (1 + rand() % 300);
+    memset(records, 0, sizeof(records));
+    for (uint32_t i = 0; i < start + count; i++) {
+      netflow_v9_record_insert_uint128_t *r = &records[i];
+      if (i < start) {
+        r->ip_version = 4;
+        continue;
+      }
+      r->srcaddr = addrs[rand() % 6];
+      r->dstaddr = addrs[rand() % 6];
+      r->srcport = (uint16_t) (rand() % 4 == 0 ? 0 : rand());
+      r->dstport = (uint16_t) (rand() % 4 == 0 ? 0 : rand());
+      r->input = (uint16_t) rand();
+      r->output = (uint16_t) rand();
+      r->src_mask = (uint8_t) rand();
+      r->dst_mask = (uint8_t) rand();
+      r->src_as = (uint32_t) rand();
+      r->dst_as = (uint32_t) rand();
+      r->prot = (uint8_t) (rand() % 3 == 0 ? 1 : rand() % 2 ? 6 : 17);
+      r->First = (uint32_t) (rand() % 8 == 0 ? 0 : 1000 + rand() % 100);
+      r->Last = (uint32_t) (rand() % 8 == 0 ? 0 : 1000 + rand() % 100);
+      r->dOctets = rand() % 8 == 0 ? 0 : (uint64_t) rand() * (rand() % 2 ? 1 : 2000);
+      r->dPkts = rand() % 8 == 0 ? 0 : (uint64_t) rand() % 20000000;
+      r->ip_version = rand() % 4 == 0 ? 6 : 4;
+      if (r->ip_version == 6) {
+        r->srcaddr |= (uint128_t) 0x20010db8u << 96;
+        r->dstaddr |= (uint128_t) 0x20010db8u << 96;
+      }
+    }
+
+    flow_batch_truncate(&flows, 0);
+    uint32_t expected_count = 0, expected_rejected = 0;
+    for (uint32_t i = 0; i < start + count; i++) {
+      cr_assert_eq(flow_batch_add(&flows, &records[i], 1, 1), 0);
+      netflow_v9_record_insert_uint128_t r = records[i];
+      if (i >= start && r.ip_version == 4) {
+        swap_src_dst_v9_ipv4(&r);
+      }
+      if (i >= start && prepare_reference_rejects(&r)) {
+        expected_rejected++;
+      } else {
+        expected[expected_count++] = r;
+      }
+    }
+
+    uint32_t rejected[netflow_reject_reasons] = {0};
+    uint32_t kept = netflow_prepare_batch(&flows, start, rejected);
+    cr_assert_eq(kept, expected_count);
+    cr_expect_eq(flows.count, kept);
+    uint32_t total = 0;
+    for (int reason = 0; reason < netflow_reject_reasons; reason++) {
+      total += rejected[reason];
+    }
+    cr_expect_eq(total, expected_rejected);
+    uint32_t v6 = 0;
+    for (uint32_t i = 0; i < kept; i++) {
+      cr_expect(batch_row_equals(&flows, i, &v6, &expected[i]));
+    }
+    cr_expect_eq(v6, flows.v6_count);
+  }
+  flow_batch_free(&flows);
+}
+
+Test(netflow, prepare_batch_counts_first_failed_check) {
+  netflow_v9_record_insert_uint128_t r;
+  memset(&r, 0, sizeof(r));
+  r.srcaddr = ipv4("10.0.0.1");
+  r.dstaddr = ipv4("8.8.8.8");
+  r.srcport = 40000;
+  r.dstport = 53;
+  r.prot = 17;
+  r.First = 100;
+  r.Last = 110;
+  r.dOctets = 1000;
+  r.dPkts = 10;
+  r.ip_version = 4;
+  flow_batch_t flows;
+  memset(&flows, 0, sizeof(flows));
+  for (int i = 0; i < 6; i++) {
+    flow_batch_add(&flows, &r, 1, 1);
+  }
+  flows.dPkts[1] = 0;
+  flows.First[2] = 120;
+  flows.srcport[3] = flows.dstport[3] = 0;
+  flows.dPkts[4] = 1000;
+  flows.dstaddr[5] = ipv4("0.0.0.9");
+  // A lower packet limit makes row 4's 100 packets/s too many.
+  netflow_set_flow_limits(0, 99);
+
+  uint32_t rejected[netflow_reject_reasons] = {0};
+  cr_expect_eq(netflow_prepare_batch(&flows, 0, rejected), 1);
+  netflow_set_flow_limits(0, NETFLOW_MAX_PACKETS_PER_SEC);
+  cr_expect_eq(rejected[netflow_reject_counters], 1);
+  cr_expect_eq(rejected[netflow_reject_time], 1);
+  cr_expect_eq(rejected[netflow_reject_ports], 1);
+  cr_expect_eq(rejected[netflow_reject_rate], 1);
+  cr_expect_eq(rejected[netflow_reject_address], 1);
+  cr_expect_eq(flows.dstport[0], 53);
+
+  // Without `rejected` nothing is dropped.
+  flow_batch_truncate(&flows, 0);
+  for (int i = 0; i < 6; i++) {
+    flow_batch_add(&flows, &r, 1, 1);
+  }
+  flows.dPkts[1] = 0;
+  cr_expect_eq(netflow_prepare_batch(&flows, 0, NULL), 6);
+  flow_batch_free(&flows);
+}
+
+Test(netflow, flow_batch_grows_and_keeps_v6_rows) {
+  netflow_v9_record_insert_uint128_t r;
+  memset(&r, 0, sizeof(r));
+  flow_batch_t a, b;
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  // More rows than a v9 flowset used to be cut at, and than the batch starts with.
+  for (uint32_t i = 0; i < 300; i++) {
+    r.ip_version = i % 3 == 0 ? 6 : 4;
+    r.srcaddr = r.ip_version == 6 ? ((uint128_t) 0x20010db8u << 96) | i : 0x0a000000u | i;
+    r.dstaddr = r.srcaddr + 1;
+    r.dPkts = i;
+    cr_assert_eq(flow_batch_add(&a, &r, 0x0a000001u, 1), 0);
+  }
+  cr_expect_eq(a.count, 300);
+  cr_expect(a.capacity >= 300);
+  cr_expect_eq(a.v6_count, 100);
+  cr_expect_eq(a.srcaddr[3], 0);
+
+  cr_assert_eq(flow_batch_add(&b, &r, 0x0a000002u, 1), 0);
+  cr_assert_eq(flow_batch_append(&b, &a), 0);
+  cr_expect_eq(b.count, 301);
+  cr_expect_eq(b.exporter[0], 0x0a000002u);
+  cr_expect_eq(b.exporter[1], 0x0a000001u);
+  cr_expect_eq(b.dPkts[300], 299);
+
+  // Keep the even rows after the first.
+  uint32_t keep[301];
+  for (uint32_t i = 0; i < 301; i++) {
+    keep[i] = i % 2 == 0;
+  }
+  cr_expect_eq(flow_batch_compact(&b, 1, keep), 151);
+  uint32_t v6 = 0, v6_rows = 0;
+  for (uint32_t row = 0; row < b.count; row++) {
+    uint128_t src, dst;
+    flow_batch_addrs(&b, row, &v6, &src, &dst);
+    cr_expect_eq(dst, src + 1);
+    if (row > 0) {
+      // Row `row` is a's row 2 * row - 1.
+      uint32_t i = 2 * row - 1;
+      cr_expect_eq(b.dPkts[row], i);
+      cr_expect_eq((uint32_t) src, i % 3 == 0 ? i : 0x0a000000u | i);
+      v6_rows += i % 3 == 0;
+    }
+  }
+  cr_expect_eq(v6, b.v6_count);
+  cr_expect_eq(b.v6_count, v6_rows);
+
+  flow_batch_truncate(&b, 10);
+  cr_expect_eq(b.count, 10);
+  for (uint32_t i = 0; i < b.v6_count; i++) {
+    cr_expect(b.v6_row[i] < 10);
+  }
+  flow_batch_free(&a);
+  flow_batch_free(&b);
+}
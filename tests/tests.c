@@ -8,15 +8,28 @@
 #include <criterion/new/assert.h>
 #include <string.h>
 #include <stdint.h>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include "../src/affinity.h"
 #include "../src/arena.h"
 #include "../src/hashmap.h"
 #include "../src/dyn_array.h"
+#include "../src/exporter.h"
+#include "../src/flow_batch.h"
+#include "../src/ingest.h"
+#include "../src/ingest_queue.h"
+#include "../src/ingest_validate.h"
+#include "../src/pipeline.h"
+#include "../src/pkt_slab.h"
+#include "../src/shard.h"
 
 #include "../src/netflow_v9.h"
 
 // Stubs for database backend to avoid real connections in tests
-int ch_insert_flows(uint32_t exporter, netflow_v9_uint128_flowset_t *flows) {
-  (void) exporter;
+int ch_insert_flows(flow_batch_t *flows) {
   (void) flows;
   return 0;
 }
@@ -110,6 +123,610 @@ Test(arena, realloc_grows) {
   free(arena_test);
 }
 
+Test(pkt_slab, size_classes_and_reuse) {
+  cr_assert_eq(pkt_slab_init(64), 0);
+
+  // smallest class that fits; the buffer follows the context, cache-aligned
+  pkt_ctx_t *none = pkt_slab_alloc(0);
+  pkt_ctx_t *small = pkt_slab_alloc(1500);
+  pkt_ctx_t *jumbo = pkt_slab_alloc(9000);
+  pkt_ctx_t *max = pkt_slab_alloc(PKT_SLAB_MAX_SIZE);
+  cr_assert_neq(none, NULL);
+  cr_assert_neq(small, NULL);
+  cr_assert_neq(jumbo, NULL);
+  cr_assert_neq(max, NULL);
+  cr_expect_eq(none->capacity, 0);
+  cr_expect_eq(small->capacity, PKT_SLAB_SMALL_SIZE);
+  cr_expect_eq(jumbo->capacity, PKT_SLAB_JUMBO_SIZE);
+  cr_expect_eq(max->capacity, PKT_SLAB_MAX_SIZE);
+  cr_expect_eq(pkt_slab_alloc(PKT_SLAB_MAX_SIZE + 1), NULL);
+  cr_expect_eq((uintptr_t) pkt_ctx_data(jumbo) % 64, 0);
+  cr_expect_eq(pkt_ctx_from_data(pkt_ctx_data(jumbo)), jumbo);
+  cr_expect_eq(pkt_ctx_from_work(&jumbo->work), jumbo);
+  cr_expect_eq(pkt_slab_in_use(2), 1);
+
+  // a freed context is handed out again
+  pkt_slab_free(small);
+  cr_expect_eq(pkt_slab_alloc(100), small);
+
+  pkt_slab_free(none);
+  pkt_slab_free(small);
+  pkt_slab_free(jumbo);
+  pkt_slab_free(max);
+  pkt_slab_destroy();
+}
+
+Test(pkt_slab, exhaustion_returns_null) {
+  cr_assert_eq(pkt_slab_init(64), 0);
+  pkt_ctx_t *ctxs[64];
+  for (int i = 0; i < 64; i++) {
+    ctxs[i] = pkt_slab_alloc(PKT_SLAB_RECV_SIZE);
+    cr_assert_neq(ctxs[i], NULL);
+  }
+  cr_expect_eq(pkt_slab_alloc(PKT_SLAB_RECV_SIZE), NULL);
+  for (int i = 0; i < 64; i++) {
+    pkt_slab_free(ctxs[i]);
+  }
+  cr_expect_eq(pkt_slab_in_use(2), 0);
+  pkt_ctx_t *again = pkt_slab_alloc(PKT_SLAB_RECV_SIZE);
+  cr_expect_neq(again, NULL);
+  pkt_slab_free(again);
+  pkt_slab_destroy();
+}
+
+// v9 header plus one flowset with the given id
+static void ingest_queue_v9(uint8_t *buf, uint16_t flowset_id) {
+  memset(buf, 0, 24);
+  buf[1] = 9;
+  buf[20] = (uint8_t) (flowset_id >> 8);
+  buf[21] = (uint8_t) flowset_id;
+  buf[23] = 4;
+}
+
+static void ingest_queue_ctx(pkt_ctx_t *ctx, uint8_t *buf, uint32_t exporter) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->args.data = buf;
+  ctx->args.len = 24;
+  ctx->args.exporter = exporter;
+  // IPv4-mapped, as the receive path fills it in
+  ctx->args.exporter_addr[10] = 0xff;
+  ctx->args.exporter_addr[11] = 0xff;
+  memcpy(&ctx->args.exporter_addr[12], &exporter, sizeof(exporter));
+}
+
+// Weight the queue gave `exporter` on its first datagram.
+static uint32_t ingest_queue_weight_of(const ingest_queue_t *q, uint32_t exporter) {
+  for (uint32_t i = 0; i < INGEST_QUEUE_EXPORTERS; i++) {
+    if (q->exporters[i].used && q->exporters[i].exporter == exporter) {
+      return q->exporters[i].weight;
+    }
+  }
+  return 0;
+}
+
+Test(ingest_queue, template_detection) {
+  uint8_t buf[24];
+  ingest_queue_v9(buf, 0);
+  cr_expect(ingest_queue_has_templates(buf, sizeof(buf)));
+  ingest_queue_v9(buf, 256);
+  cr_expect_not(ingest_queue_has_templates(buf, sizeof(buf)));
+  // IPFIX: 16-byte header, template set id 2
+  uint8_t ipfix[20] = {0, 10, 0, 20};
+  ipfix[17] = 2;
+  ipfix[19] = 4;
+  cr_expect(ingest_queue_has_templates(ipfix, sizeof(ipfix)));
+  ipfix[17] = 0;
+  ipfix[16] = 1;
+  cr_expect_not(ingest_queue_has_templates(ipfix, sizeof(ipfix)));
+  cr_expect_eq(ingest_queue_parse_policy("keep_templates"), ingest_overload_keep_templates);
+  cr_expect_eq(ingest_queue_parse_policy("bogus"), -1);
+}
+
+Test(ingest_queue, drop_newest_and_oldest) {
+  uint8_t buf[24];
+  ingest_queue_v9(buf, 256);
+  pkt_ctx_t ctxs[3];
+  metrics_drop_reason_t reason;
+  for (int i = 0; i < 3; i++) {
+    ingest_queue_ctx(&ctxs[i], buf, 1);
+  }
+
+  ingest_queue_t *q = ingest_queue_create(2, ingest_overload_drop_newest);
+  cr_assert_neq(q, NULL);
+  cr_expect_eq(ingest_queue_offer(q, &ctxs[0], &reason), NULL);
+  cr_expect_eq(ingest_queue_offer(q, &ctxs[1], &reason), NULL);
+  cr_expect_eq(ingest_queue_offer(q, &ctxs[2], &reason), &ctxs[2]);
+  cr_expect_eq(reason, metrics_drop_queue_full);
+  cr_expect_eq(ingest_queue_pop(q), &ctxs[0]);
+  cr_expect_eq(ingest_queue_pop(q), &ctxs[1]);
+  cr_expect_eq(ingest_queue_pop(q), NULL);
+  ingest_queue_destroy(q);
+
+  q = ingest_queue_create(2, ingest_overload_drop_oldest);
+  cr_assert_neq(q, NULL);
+  ingest_queue_offer(q, &ctxs[0], &reason);
+  ingest_queue_offer(q, &ctxs[1], &reason);
+  cr_expect_eq(ingest_queue_offer(q, &ctxs[2], &reason), &ctxs[0]);
+  cr_expect_eq(reason, metrics_drop_evicted);
+  cr_expect_eq(ingest_queue_pop(q), &ctxs[1]);
+  cr_expect_eq(ingest_queue_pop(q), &ctxs[2]);
+  ingest_queue_destroy(q);
+}
+
+Test(ingest_queue, keep_templates_evicts_data) {
+  uint8_t data[24];
+  uint8_t tmpl[24];
+  ingest_queue_v9(data, 256);
+  ingest_queue_v9(tmpl, 0);
+  pkt_ctx_t t0, d0, t1, d1;
+  ingest_queue_ctx(&t0, tmpl, 1);
+  ingest_queue_ctx(&d0, data, 1);
+  ingest_queue_ctx(&t1, tmpl, 2);
+  ingest_queue_ctx(&d1, data, 1);
+  metrics_drop_reason_t reason;
+
+  ingest_queue_t *q = ingest_queue_create(2, ingest_overload_keep_templates);
+  cr_assert_neq(q, NULL);
+  cr_expect_eq(ingest_queue_offer(q, &t0, &reason), NULL);
+  cr_expect_eq(ingest_queue_offer(q, &d0, &reason), NULL);
+  // data arriving at a full queue from the exporter filling it is dropped
+  cr_expect_eq(ingest_queue_offer(q, &d1, &reason), &d1);
+  cr_expect_eq(reason, metrics_drop_queue_full);
+  // a template evicts the oldest data datagram, the order of the rest is kept
+  cr_expect_eq(ingest_queue_offer(q, &t1, &reason), &d0);
+  cr_expect_eq(reason, metrics_drop_evicted);
+  cr_expect_eq(ingest_queue_pop(q), &t0);
+  cr_expect_eq(ingest_queue_pop(q), &t1);
+  ingest_queue_destroy(q);
+}
+
+Test(ingest_queue, weighted_round_robin) {
+  char path[] = "/tmp/cnetflow_weights_XXXXXX";
+  int fd = mkstemp(path);
+  cr_assert_geq(fd, 0);
+  const char *rules = "10.0.0.0/8 3\n10.0.0.2 1 # more specific\n\nbogus 2\n192.0.2.0/24 0\n";
+  cr_assert_eq(write(fd, rules, strlen(rules)), (ssize_t) strlen(rules));
+  close(fd);
+  ingest_weights_t *weights = ingest_weights_load(path);
+  unlink(path);
+  cr_assert_neq(weights, NULL);
+  cr_expect_eq(weights->count, 2);
+  uint32_t a = htonl(0x0a000001);
+  uint32_t b = htonl(0x0a000002);
+  cr_expect_eq(ingest_weights_lookup(weights, a), 3);
+  cr_expect_eq(ingest_weights_lookup(weights, b), 1);
+  cr_expect_eq(ingest_weights_lookup(weights, htonl(0xc0000201)), 1);
+
+  // 1000-byte data datagrams: one quantum pays for 1.5 of them
+  static uint8_t data[1000];
+  ingest_queue_v9(data, 256);
+  data[22] = (uint8_t) (980 >> 8);
+  data[23] = (uint8_t) 980;
+  static pkt_ctx_t ctxs[12];
+  metrics_drop_reason_t reason;
+  ingest_queue_t *q = ingest_queue_create(12, ingest_overload_drop_newest);
+  cr_assert_neq(q, NULL);
+  ingest_queue_set_weights(q, weights);
+  for (int i = 0; i < 12; i++) {
+    ingest_queue_ctx(&ctxs[i], data, i < 8 ? a : b);
+    ctxs[i].args.len = sizeof(data);
+    cr_expect_eq(ingest_queue_offer(q, &ctxs[i], &reason), NULL);
+  }
+  // the flood from a waits its turn; b is served after a's quantum, not after all of a
+  for (int i = 0; i < 4; i++) {
+    cr_expect_eq(ingest_queue_pop(q), &ctxs[i]);
+  }
+  pkt_ctx_t *next = ingest_queue_pop(q);
+  cr_expect_eq(next, &ctxs[8]);
+  // a pop undone is the next one again
+  ingest_queue_unpop(q, next);
+  cr_expect_eq(ingest_queue_pop(q), &ctxs[8]);
+  for (int i = 4; i < 8; i++) {
+    cr_expect_eq(ingest_queue_pop(q), &ctxs[i]);
+  }
+  for (int i = 9; i < 12; i++) {
+    cr_expect_eq(ingest_queue_pop(q), &ctxs[i]);
+  }
+  cr_expect_eq(ingest_queue_pop(q), NULL);
+
+  // a full queue: the exporter over its weighted share loses its own oldest datagram
+  for (int i = 0; i < 12; i++) {
+    ingest_queue_ctx(&ctxs[i], data, a);
+    ctxs[i].args.len = sizeof(data);
+    cr_expect_eq(ingest_queue_offer(q, &ctxs[i], &reason), NULL);
+  }
+  pkt_ctx_t other;
+  ingest_queue_ctx(&other, data, b);
+  cr_expect_eq(ingest_queue_offer(q, &other, &reason), &ctxs[0]);
+  cr_expect_eq(reason, metrics_drop_evicted);
+  // while its own arrivals meet the policy
+  pkt_ctx_t more;
+  ingest_queue_ctx(&more, data, a);
+  cr_expect_eq(ingest_queue_offer(q, &more, &reason), &more);
+  cr_expect_eq(reason, metrics_drop_queue_full);
+  while (ingest_queue_pop(q) != NULL) {
+  }
+  ingest_queue_destroy(q);
+
+  // an IPv6 exporter whose folded address reads as 10.0.0.1 is not in 10.0.0.0/8
+  q = ingest_queue_create(12, ingest_overload_drop_newest);
+  cr_assert_neq(q, NULL);
+  ingest_queue_set_weights(q, weights);
+  ingest_queue_ctx(&other, data, a);
+  cr_assert_eq(exporter_addr_from_string("a00:1::", other.args.exporter_addr), 0);
+  cr_expect_eq(exporter_addr_fold(other.args.exporter_addr), a);
+  cr_expect_eq(ingest_queue_offer(q, &other, &reason), NULL);
+  cr_expect_eq(ingest_queue_weight_of(q, a), 1);
+  cr_expect_eq(ingest_queue_pop(q), &other);
+  ingest_queue_destroy(q);
+  q = ingest_queue_create(12, ingest_overload_drop_newest);
+  cr_assert_neq(q, NULL);
+  ingest_queue_set_weights(q, weights);
+  ingest_queue_ctx(&other, data, a);
+  cr_expect_eq(ingest_queue_offer(q, &other, &reason), NULL);
+  cr_expect_eq(ingest_queue_weight_of(q, a), 3);
+  cr_expect_eq(ingest_queue_pop(q), &other);
+  ingest_queue_destroy(q);
+  ingest_weights_destroy(weights);
+}
+
+Test(ingest_queue, sample_records_rate) {
+  uint8_t data[24];
+  uint8_t tmpl[24];
+  ingest_queue_v9(data, 256);
+  ingest_queue_v9(tmpl, 0);
+  static pkt_ctx_t ctxs[64];
+  metrics_drop_reason_t reason;
+  ingest_queue_t *q = ingest_queue_create(64, ingest_overload_sample);
+  cr_assert_neq(q, NULL);
+
+  // below half full nothing is sampled
+  for (int i = 0; i < 32; i++) {
+    ingest_queue_ctx(&ctxs[i], data, 1);
+    cr_expect_eq(ingest_queue_offer(q, &ctxs[i], &reason), NULL);
+    cr_expect_eq(ctxs[i].args.sampling_rate, 1);
+  }
+  // past half full the heavy exporter is sampled 1-in-N and the rate is recorded
+  int sampled = 0;
+  for (int i = 32; i < 64; i++) {
+    ingest_queue_ctx(&ctxs[i], data, 1);
+    pkt_ctx_t *dropped = ingest_queue_offer(q, &ctxs[i], &reason);
+    if (dropped != NULL) {
+      cr_expect_eq(dropped, &ctxs[i]);
+      cr_expect_eq(reason, metrics_drop_sampled);
+      sampled++;
+    } else {
+      cr_expect_geq(ctxs[i].args.sampling_rate, 2);
+    }
+  }
+  cr_expect_gt(sampled, 0);
+  // templates are never sampled
+  pkt_ctx_t t;
+  ingest_queue_ctx(&t, tmpl, 1);
+  cr_expect_eq(ingest_queue_offer(q, &t, &reason), NULL);
+  cr_expect_eq(t.args.sampling_rate, 1);
+  while (ingest_queue_pop(q) != NULL) {
+  }
+  ingest_queue_destroy(q);
+}
+
+static size_t validate_put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t) (v >> 8);
+  p[1] = (uint8_t) v;
+  return 2;
+}
+
+Test(ingest_validate, v5_count_and_length) {
+  uint8_t pkt[INGEST_V5_HEADER_SIZE + 2 * INGEST_V5_RECORD_SIZE];
+  memset(pkt, 0, sizeof(pkt));
+  validate_put16(pkt, 5);
+  validate_put16(pkt + 2, 2);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_valid);
+  // records past the end
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt) - 1), ingest_invalid_count);
+  validate_put16(pkt + 2, 0);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_count);
+  validate_put16(pkt + 2, INGEST_V5_MAX_RECORDS + 1);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_count);
+  cr_expect_eq(ingest_validate_header(pkt, 10), ingest_invalid_length);
+  validate_put16(pkt, 7);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_version);
+}
+
+Test(ingest_validate, v9_flowsets) {
+  uint8_t pkt[INGEST_V9_HEADER_SIZE + 8 + 12 + 2];
+  memset(pkt, 0, sizeof(pkt));
+  validate_put16(pkt, 9);
+  size_t off = INGEST_V9_HEADER_SIZE;
+  validate_put16(pkt + off, 0);
+  validate_put16(pkt + off + 2, 8);
+  off += 8;
+  validate_put16(pkt + off, 256);
+  validate_put16(pkt + off + 2, 12);
+  // two bytes of trailing padding are accepted
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_valid);
+  // a flowset running past the end
+  validate_put16(pkt + off + 2, 16);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_set);
+  validate_put16(pkt + off + 2, 12);
+  // reserved flowset id
+  validate_put16(pkt + off, 42);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_set);
+  // zero-length flowset
+  validate_put16(pkt + off, 256);
+  validate_put16(pkt + off + 2, 0);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_set);
+  cr_expect_eq(ingest_validate_header(pkt, INGEST_V9_HEADER_SIZE), ingest_invalid_length);
+}
+
+Test(ingest_validate, ipfix_message_length) {
+  uint8_t pkt[INGEST_IPFIX_HEADER_SIZE + 8];
+  memset(pkt, 0, sizeof(pkt));
+  validate_put16(pkt, 10);
+  validate_put16(pkt + 2, sizeof(pkt));
+  validate_put16(pkt + INGEST_IPFIX_HEADER_SIZE, 2);
+  validate_put16(pkt + INGEST_IPFIX_HEADER_SIZE + 2, 8);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_valid);
+  // the header length must match the datagram
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt) - 1), ingest_invalid_length);
+  // set ids 0, 1 and 4-255 are reserved
+  validate_put16(pkt + INGEST_IPFIX_HEADER_SIZE, 1);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_set);
+  validate_put16(pkt + INGEST_IPFIX_HEADER_SIZE, 300);
+  // sets must fill the message exactly
+  validate_put16(pkt + INGEST_IPFIX_HEADER_SIZE + 2, 6);
+  cr_expect_eq(ingest_validate_header(pkt, sizeof(pkt)), ingest_invalid_set);
+}
+
+#ifdef __linux__
+Test(ingest_validate, allowlist_lookup) {
+  char path[] = "/tmp/cnetflow_allowlist_XXXXXX";
+  int fd = mkstemp(path);
+  cr_assert_geq(fd, 0);
+  const char *contents = "# exporters\n192.0.2.1\n  198.51.100.7   # core router\n\nnot-an-address\n2001:db8::1\n";
+  cr_assert_eq(write(fd, contents, strlen(contents)), (ssize_t) strlen(contents));
+  close(fd);
+  ingest_allowlist_t *list = ingest_allowlist_load(path);
+  unlink(path);
+  cr_assert_neq(list, NULL);
+  cr_expect_eq(list->count, 3);
+
+  struct sockaddr_in v4;
+  memset(&v4, 0, sizeof(v4));
+  v4.sin_family = AF_INET;
+  uv_inet_pton(AF_INET, "198.51.100.7", &v4.sin_addr);
+  cr_expect(ingest_allowlist_contains(list, (struct sockaddr *) &v4));
+  uv_inet_pton(AF_INET, "198.51.100.8", &v4.sin_addr);
+  cr_expect_not(ingest_allowlist_contains(list, (struct sockaddr *) &v4));
+
+  struct sockaddr_in6 v6;
+  memset(&v6, 0, sizeof(v6));
+  v6.sin6_family = AF_INET6;
+  uv_inet_pton(AF_INET6, "2001:db8::1", &v6.sin6_addr);
+  cr_expect(ingest_allowlist_contains(list, (struct sockaddr *) &v6));
+  // an IPv4-mapped source matches its IPv4 entry
+  uv_inet_pton(AF_INET6, "::ffff:192.0.2.1", &v6.sin6_addr);
+  cr_expect(ingest_allowlist_contains(list, (struct sockaddr *) &v6));
+  ingest_allowlist_destroy(list);
+}
+
+Test(ingest_tcp, frames_by_message_length) {
+  uint8_t stream[40 + 16];
+  memset(stream, 0, sizeof(stream));
+  validate_put16(stream, 10);
+  validate_put16(stream + 2, 40);
+  validate_put16(stream + 40, 10);
+  validate_put16(stream + 42, 16);
+  // not enough bytes for the length field, then for the whole message
+  cr_expect_eq(ingest_tcp_frame(stream, 3), 0);
+  cr_expect_eq(ingest_tcp_frame(stream, 39), 0);
+  cr_expect_eq(ingest_tcp_frame(stream, sizeof(stream)), 40);
+  cr_expect_eq(ingest_tcp_frame(stream + 40, 16), 16);
+  // a length shorter than the header cannot be skipped over
+  validate_put16(stream + 42, 15);
+  cr_expect_eq(ingest_tcp_frame(stream + 40, 16), -1);
+  validate_put16(stream, 9);
+  cr_expect_eq(ingest_tcp_frame(stream, sizeof(stream)), -1);
+}
+
+Test(ingest_rcvbuf, grows_on_kernel_drops) {
+  // kernel drops are reported to the metrics thread
+  metrics_init();
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  cr_assert_geq(fd, 0);
+  ingest_config_t config = {.rcvbuf = 65536, .rcvbuf_max = 262144};
+  ingest_rcvbuf_t b;
+  ingest_rcvbuf_init(&b, fd, &config);
+  cr_expect_eq(b.requested, 65536);
+
+  // unchanged counter: nothing happens
+  ingest_rcvbuf_update(&b, 0, 10000);
+  cr_expect_eq(b.requested, 65536);
+  // new drops double the buffer
+  ingest_rcvbuf_update(&b, 5, 10000);
+  cr_expect_eq(b.drops, 5);
+  cr_expect_eq(b.requested, 131072);
+  // at most once a second
+  ingest_rcvbuf_update(&b, 9, 10500);
+  cr_expect_eq(b.drops, 9);
+  cr_expect_eq(b.requested, 131072);
+  // a stale value from earlier in a batch is ignored
+  ingest_rcvbuf_update(&b, 7, 11000);
+  cr_expect_eq(b.drops, 9);
+  cr_expect_eq(b.requested, 131072);
+  // never past the cap
+  ingest_rcvbuf_update(&b, 20, 11000);
+  cr_expect_eq(b.requested, 262144);
+  ingest_rcvbuf_update(&b, 40, 12000);
+  cr_expect_eq(b.requested, 262144);
+  // the counter wraps at 2^32
+  b.drops = UINT32_MAX - 1;
+  ingest_rcvbuf_update(&b, 3, 13000);
+  cr_expect_eq(b.drops, 3);
+  close(fd);
+  metrics_cleanup();
+}
+
+Test(affinity, cpu_lists_and_placement) {
+  cr_expect_eq(affinity_configure(affinity_role_parse, ""), UV_EINVAL);
+  cr_expect_eq(affinity_configure(affinity_role_parse, "3-1"), UV_EINVAL);
+  cr_expect_eq(affinity_configure(affinity_role_parse, "0,x"), UV_EINVAL);
+  cr_expect_eq(affinity_configure(affinity_role_parse, "-1"), UV_EINVAL);
+  // CPU 0 always exists
+  cr_assert_eq(affinity_configure(affinity_role_parse, "0"), 0);
+  affinity_apply(affinity_role_parse, "test");
+
+  char buf[4096];
+  size_t len = affinity_append_json(buf, sizeof(buf), 0);
+  cr_expect_eq(len, strlen(buf));
+  cr_expect(strstr(buf, "\"role\": \"parse\", \"thread\": \"test\"") != NULL);
+  cr_expect(strstr(buf, "\"cpus\": \"0\", \"cpu\": 0") != NULL);
+  cr_expect(strstr(buf, "\"placement_memory_nodes\": {\"recv\": -1") != NULL);
+  // a full buffer is left terminated
+  len = affinity_append_json(buf, 16, 0);
+  cr_expect_lt(len, 16);
+  cr_expect_eq(len, strlen(buf));
+}
+#endif
+
+Test(shard, templates_stay_in_their_shard) {
+  cr_assert_eq(shard_configure(SHARD_MAX + 1), UV_EINVAL);
+  cr_assert_eq(shard_configure(2), 0);
+  cr_expect_eq(shard_current(), NULL);
+  cr_expect_eq(shard_attach(2), NULL);
+  shard_t *shard = shard_attach(1);
+  cr_assert_neq(shard, NULL);
+  cr_expect_eq(shard_current(), shard);
+
+  // templates loaded at startup sit in the shared table
+  arena_struct_t shared_arena;
+#ifdef USE_ARENA_ALLOCATOR
+  cr_assert_eq(arena_create(&shared_arena, 1024 * 1024), ok);
+#else
+  arena_create(&shared_arena, 0);
+#endif
+  hashmap_t *shared = hashmap_create(&shared_arena, 64);
+  uv_mutex_t shared_mutex;
+  uv_mutex_init(&shared_mutex);
+  uint64_t preloaded = ((uint64_t) 0x0a000001 << 32) | 256;
+  uint16_t *preloaded_template = arena_alloc(&shared_arena, 8);
+  cr_assert_eq(hashmap_set(shared, &shared_arena, &preloaded, sizeof(preloaded), preloaded_template), 0);
+  cr_expect_eq(shard_template_get(shard, shard->templates_v9, shared, &shared_mutex, preloaded), preloaded_template);
+#ifdef USE_ARENA_ALLOCATOR
+  // and are then found without the shared table
+  cr_expect_eq(hashmap_get(shard->templates_v9, &preloaded, sizeof(preloaded)), preloaded_template);
+#endif
+
+  // new templates only go to the shard
+  uint64_t learned = ((uint64_t) 0x0a000001 << 32) | 257;
+  uint16_t *learned_template = arena_alloc(&shard->arena, 8);
+  shard_template_set(shard, shard->templates_v9, learned, learned_template);
+  cr_expect_eq(shard_template_get(shard, shard->templates_v9, shared, &shared_mutex, learned), learned_template);
+  cr_expect_eq(hashmap_get(shared, &learned, sizeof(learned)), NULL);
+  cr_expect_eq(shard_template_get(shard, shard->templates_ipfix, shared, &shared_mutex, learned), NULL);
+  // a redefinition replaces the template without counting another one
+  uint16_t *redefined_template = arena_alloc(&shard->arena, 8);
+  shard_template_set(shard, shard->templates_v9, learned, redefined_template);
+  cr_expect_eq(shard_template_get(shard, shard->templates_v9, shared, &shared_mutex, learned), redefined_template);
+#ifdef USE_ARENA_ALLOCATOR
+  // and its space is reused
+  cr_expect_eq(arena_alloc(&shard->arena, 8), learned_template);
+#endif
+
+  shard_count_datagram(shard);
+  char buf[512];
+  shard_append_json(buf, sizeof(buf), 0);
+  cr_expect(strstr(buf, "{\"shard\": 0, \"datagrams\": 0, \"templates\": 0}") != NULL);
+  cr_expect(strstr(buf, "{\"shard\": 1, \"datagrams\": 1, \"templates\": 1}") != NULL);
+  shard_destroy();
+  cr_expect_eq(shard_count(), 0);
+  uv_mutex_destroy(&shared_mutex);
+  arena_destroy(&shared_arena);
+}
+
+Test(exporter, full_address_and_domain_identify_templates) {
+  // two IPv6 exporters sharing their first 32 bits
+  uint8_t a[16], b[16], v4[16], mapped[16];
+  cr_assert_eq(exporter_addr_from_string("2001:db8::1", a), 0);
+  cr_assert_eq(exporter_addr_from_string("2001:db8::2", b), 0);
+  uint32_t id_a = exporter_intern(a, 0);
+  uint32_t id_b = exporter_intern(b, 0);
+  cr_assert_neq(id_a, 0);
+  cr_assert_neq(id_b, 0);
+  cr_expect_neq(id_a, id_b);
+  cr_expect_eq(exporter_intern(a, 0), id_a);
+  cr_expect_neq(exporter_intern(a, 1), id_a);
+  cr_expect_neq(exporter_template_key(id_a, 256), exporter_template_key(id_b, 256));
+
+  // an IPv4 exporter keeps its identity on a dual-stack socket
+  struct sockaddr_in addr4;
+  struct sockaddr_in6 addr6;
+  uv_ip4_addr("192.0.2.7", 2055, &addr4);
+  uv_ip6_addr("::ffff:192.0.2.7", 2055, &addr6);
+  cr_assert_eq(exporter_addr_from_sockaddr((const struct sockaddr *) &addr4, v4), 0);
+  cr_assert_eq(exporter_addr_from_sockaddr((const struct sockaddr *) &addr6, mapped), 0);
+  cr_expect_eq(exporter_intern(v4, 7), exporter_intern(mapped, 7));
+  cr_expect_eq(exporter_addr_fold(mapped), addr4.sin_addr.s_addr);
+
+  uint8_t back[16];
+  uint32_t domain = 0;
+  cr_assert_eq(exporter_lookup(exporter_intern(a, 1), back, &domain), 0);
+  cr_expect_eq(memcmp(back, a, 16), 0);
+  cr_expect_eq(domain, 1);
+  cr_expect_eq(exporter_lookup(0, back, &domain), -1);
+  char str[INET6_ADDRSTRLEN];
+  exporter_addr_to_string(mapped, str, sizeof(str));
+  cr_expect_str_eq(str, "192.0.2.7");
+}
+
+Test(exporter, domains_per_address_are_capped) {
+  // a source making up domains only uses up its own share of the ids
+  uint8_t spoofed[16], other[16];
+  cr_assert_eq(exporter_addr_from_string("198.51.100.1", spoofed), 0);
+  cr_assert_eq(exporter_addr_from_string("198.51.100.2", other), 0);
+  for (uint32_t domain = 0; domain < EXPORTER_MAX_DOMAINS_PER_ADDR; domain++) {
+    cr_assert_neq(exporter_intern(spoofed, domain), 0);
+  }
+  cr_expect_eq(exporter_intern(spoofed, EXPORTER_MAX_DOMAINS_PER_ADDR), 0);
+  cr_expect_eq(exporter_count(), EXPORTER_MAX_DOMAINS_PER_ADDR);
+  // its known domains and other exporters still get theirs
+  cr_expect_neq(exporter_intern(spoofed, 0), 0);
+  cr_expect_eq(exporter_intern(other, EXPORTER_MAX_DOMAINS_PER_ADDR), EXPORTER_MAX_DOMAINS_PER_ADDR + 1);
+}
+
+Test(pipeline, scale_grows_and_parks) {
+  pipeline_scale_t s;
+  pipeline_scale_init(&s, 1, 3, 1000);
+  cr_expect_eq(s.active, 1);
+
+  // 90 ms of parsing in 100 ms: nearly saturated, one more parser
+  cr_expect_eq(pipeline_scale_update(&s, 1100, 0, 900, 90000000), 2);
+  cr_expect_eq(s.parse_ns, 100000);
+  // a backlog that takes too long to drain also grows the set
+  cr_expect_eq(pipeline_scale_update(&s, 1200, 100, 100, 10000000), 3);
+  // never past the maximum
+  cr_expect_eq(pipeline_scale_update(&s, 1300, 0, 2800, 280000000), 3);
+  cr_expect_eq(s.ups, 2);
+
+  // one parser less only after a calm stretch
+  cr_expect_eq(pipeline_scale_update(&s, 1400, 0, 10, 1000000), 3);
+  cr_expect_eq(pipeline_scale_update(&s, 3000, 0, 10, 1000000), 3);
+  cr_expect_eq(pipeline_scale_update(&s, 4400, 0, 10, 1000000), 2);
+  // a busy interval restarts the stretch
+  cr_expect_eq(pipeline_scale_update(&s, 4500, 0, 1000, 120000000), 2);
+  cr_expect_eq(pipeline_scale_update(&s, 7400, 0, 0, 0), 2);
+  cr_expect_eq(pipeline_scale_update(&s, 7600, 0, 0, 0), 1);
+  // never below the minimum
+  cr_expect_eq(pipeline_scale_update(&s, 20000, 0, 0, 0), 1);
+  cr_expect_eq(s.downs, 2);
+
+  char buf[2048];
+  pipeline_scale_append_json(&s, buf, sizeof(buf), 0);
+  cr_expect(strstr(buf, "\"min\": 1, \"max\": 3, \"active\": 1") != NULL);
+  cr_expect(strstr(buf, "\"from\": 1, \"to\": 2, \"backlog\": 0, \"parse_ns\": 100000, \"busy_pct\": 90}") != NULL);
+  cr_expect(strstr(buf, "\"from\": 2, \"to\": 1") != NULL);
+}
+
 Test(hashmap, set_get_delete) {
   arena_struct_t *arena_hashmap = malloc(sizeof(arena_struct_t));
 #ifdef USE_ARENA_ALLOCATOR
@@ -141,6 +758,35 @@ Test(hashmap, set_get_delete) {
 #endif
 }
 
+static void count_foreach_pair(const void *key, size_t key_len, void *value, void *ctx) {
+  cr_assert_eq(key_len, sizeof(uint64_t));
+  cr_assert_eq(*(const uint64_t *) value, *(const uint64_t *) key * 10);
+  (*(int *) ctx)++;
+}
+
+Test(hashmap, foreach_visits_live_pairs) {
+  arena_struct_t *arena_hashmap = malloc(sizeof(arena_struct_t));
+#ifdef USE_ARENA_ALLOCATOR
+  cr_assert_eq(arena_create(arena_hashmap, 1024*1024), ok);
+#endif
+  hashmap_t *hashmap = hashmap_create(arena_hashmap, 64);
+  cr_assert_neq(hashmap, NULL);
+
+  static uint64_t values[8];
+  for (uint64_t key = 0; key < 8; key++) {
+    values[key] = key * 10;
+    cr_assert_eq(hashmap_set(hashmap, arena_hashmap, &key, sizeof(key), &values[key]), 0);
+  }
+  uint64_t deleted = 3;
+  cr_assert_eq(hashmap_delete(hashmap, &deleted, sizeof(deleted)), 0);
+
+  int visited = 0;
+  cr_assert_eq(hashmap_foreach(hashmap, count_foreach_pair, &visited), 7);
+  cr_assert_eq(visited, 7);
+  arena_destroy(arena_hashmap);
+  free(arena_hashmap);
+}
+
 Test(dyn_array, create_returns_null_on_zero_elem) {
   arena_struct_t *arena_test = malloc(sizeof(arena_struct_t));
 #ifdef USE_ARENA_ALLOCATOR
@@ -162,3 +808,161 @@ Test(dyn_array, create_nonnull_on_valid) {
   arena_destroy(arena_test);
   free(arena_test);
 }
+
+// Work stealing: each ctx holds its parser at gate `frame_number - 1` until opened.
+static int pipeline_gates[3];
+static int pipeline_gates_entered[3];
+static int pipeline_data_runs;
+static int pipeline_template_runs;
+static int pipeline_returned;
+
+static void pipeline_test_work(uv_work_t *req) {
+  pkt_ctx_t *ctx = (pkt_ctx_t *) req;
+  if (ctx->args.frame_number > 0) {
+    int gate = (int) ctx->args.frame_number - 1;
+    __atomic_store_n(&pipeline_gates_entered[gate], 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&pipeline_gates[gate], __ATOMIC_ACQUIRE)) {
+      usleep(100);
+    }
+  }
+  if (ctx->args.exporter != 2) {
+    return;
+  }
+  if (ingest_queue_has_templates((const uint8_t *) ctx->args.data, (size_t) ctx->args.len)) {
+    __atomic_add_fetch(&pipeline_template_runs, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&pipeline_data_runs, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void pipeline_test_after_work(uv_work_t *req, int status) {
+  (void) req;
+  (void) status;
+  pipeline_returned++;
+}
+
+static void pipeline_test_submit(pipeline_producer_t *producer, pkt_ctx_t *ctx, uint8_t *buf, uint16_t flowset_id,
+                                 uint32_t exporter, int gate) {
+  ingest_queue_v9(buf, flowset_id);
+  ingest_queue_ctx(ctx, buf, exporter);
+  ctx->args.frame_number = (uint32_t) (gate + 1);
+  ctx->work.work_cb = pipeline_test_work;
+  ctx->work.after_work_cb = pipeline_test_after_work;
+  cr_assert_eq(pipeline_submit(producer, ctx, exporter), 0);
+}
+
+// Runs `loop` until `*value` reaches `target`, for two seconds at most.
+static int pipeline_test_wait(uv_loop_t *loop, int *value, int target) {
+  for (int i = 0; i < 2000; i++) {
+    uv_run(loop, UV_RUN_NOWAIT);
+    if (__atomic_load_n(value, __ATOMIC_ACQUIRE) >= target) {
+      return 1;
+    }
+    usleep(1000);
+  }
+  return 0;
+}
+
+Test(pipeline, steal_waits_for_templates) {
+  static pkt_ctx_t ctxs[32];
+  static uint8_t bufs[32][24];
+  unsigned int n = 0;
+  uv_loop_t loop;
+  uv_loop_init(&loop);
+  // Steals are counted.
+  metrics_init();
+  pipeline_set_stealing(1);
+  cr_assert_eq(pipeline_start(2, 64), 0);
+  pipeline_producer_t *producer = pipeline_producer_open(&loop);
+  cr_assert(producer != NULL);
+
+  // Exporters 2 and 4 share parser 0 but not a sequencing token. While the
+  // template of exporter 2 is being parsed, its data stays queued even
+  // though the lane is backed up.
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 0, 2, 0);
+  n++;
+  cr_assert(pipeline_test_wait(&loop, &pipeline_gates_entered[0], 1));
+  for (int i = 0; i < 5; i++, n++) {
+    pipeline_test_submit(producer, &ctxs[n], bufs[n], 256, 2, -1);
+  }
+  usleep(50000);
+  cr_expect_eq(__atomic_load_n(&pipeline_data_runs, __ATOMIC_ACQUIRE), 0);
+  __atomic_store_n(&pipeline_gates[0], 1, __ATOMIC_RELEASE);
+  cr_assert(pipeline_test_wait(&loop, &pipeline_returned, (int) n));
+  cr_expect_eq(pipeline_data_runs, 5);
+
+  // Once its new template is applied, data of exporter 2 is stolen while the
+  // owner is held up by exporter 4.
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 0, 4, 1);
+  n++;
+  cr_assert(pipeline_test_wait(&loop, &pipeline_gates_entered[1], 1));
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 0, 2, -1);
+  n++;
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 0, 4, 2);
+  n++;
+  for (int i = 0; i < 14; i++, n++) {
+    pipeline_test_submit(producer, &ctxs[n], bufs[n], 256, 4, -1);
+  }
+  for (int i = 0; i < 5; i++, n++) {
+    pipeline_test_submit(producer, &ctxs[n], bufs[n], 256, 2, -1);
+  }
+  __atomic_store_n(&pipeline_gates[1], 1, __ATOMIC_RELEASE);
+  cr_assert(pipeline_test_wait(&loop, &pipeline_gates_entered[2], 1));
+  // Wakes the idle parser, now that the owner is stuck.
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 256, 2, -1);
+  n++;
+  cr_expect(pipeline_test_wait(&loop, &pipeline_data_runs, 6));
+  __atomic_store_n(&pipeline_gates[2], 1, __ATOMIC_RELEASE);
+  cr_assert(pipeline_test_wait(&loop, &pipeline_returned, (int) n));
+  cr_expect_eq(pipeline_data_runs, 11);
+
+  pipeline_producer_close(producer);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  pipeline_stop();
+  pipeline_set_stealing(0);
+  uv_loop_close(&loop);
+}
+
+Test(pipeline, template_waits_for_stolen_data) {
+  static pkt_ctx_t ctxs[8];
+  static uint8_t bufs[8][24];
+  unsigned int n = 0;
+  uv_loop_t loop;
+  uv_loop_init(&loop);
+  // Steals are counted.
+  metrics_init();
+  pipeline_set_stealing(1);
+  cr_assert_eq(pipeline_start(2, 64), 0);
+  pipeline_producer_t *producer = pipeline_producer_open(&loop);
+  cr_assert(producer != NULL);
+
+  // The owner is held up by exporter 4 while data of exporter 2, followed by
+  // a redefinition of its template, is queued; the idle parser steals the
+  // data and is held up decoding it.
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 0, 4, 0);
+  n++;
+  cr_assert(pipeline_test_wait(&loop, &pipeline_gates_entered[0], 1));
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 256, 2, 1);
+  n++;
+  pipeline_test_submit(producer, &ctxs[n], bufs[n], 0, 2, -1);
+  n++;
+  for (int i = 0; i < 3; i++, n++) {
+    pipeline_test_submit(producer, &ctxs[n], bufs[n], 256, 4, -1);
+  }
+  cr_assert(pipeline_test_wait(&loop, &pipeline_gates_entered[1], 1));
+
+  // The owner reaches the redefinition but does not apply it under the thief.
+  __atomic_store_n(&pipeline_gates[0], 1, __ATOMIC_RELEASE);
+  usleep(50000);
+  cr_expect_eq(__atomic_load_n(&pipeline_template_runs, __ATOMIC_ACQUIRE), 0);
+  __atomic_store_n(&pipeline_gates[1], 1, __ATOMIC_RELEASE);
+  cr_assert(pipeline_test_wait(&loop, &pipeline_returned, (int) n));
+  cr_expect_eq(pipeline_template_runs, 1);
+  cr_expect_eq(pipeline_data_runs, 1);
+
+  pipeline_producer_close(producer);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  pipeline_stop();
+  pipeline_set_stealing(0);
+  uv_loop_close(&loop);
+}